@@ -12,6 +12,8 @@
 
 #include "chip_gpio_pin_defs.h" //read this as well
 
+#define CHIP_GPIO_VERSION "1.2.0" //keep in sync with CHANGELOG
+
 #define GPIO_DIR_OUT 1
 #define GPIO_DIR_IN 0
 #define DIR_GPIO_OUT GPIO_DIR_OUT
@@ -35,8 +37,23 @@
 #define XIO_U14_FIRST_PIN_ALL XIO_U14_FIRST_PIN+U14_OFFSET
 #define XIO_U14_LAST_PIN_ALL XIO_U14_LAST_PIN+U14_OFFSET
 
+#define GPIO_SETUP_TIMEOUT_MS 1000 //how long setup_gpio_pins waits for sysfs nodes
+#define GPIO_SETUP_RECHECK_MS 10 //how often nodes are checked without an inotify event
+
+//one pin for setup_gpio_pins
+typedef struct
+{
+    int pin;
+    int dir; //GPIO_DIR_IN or GPIO_DIR_OUT
+    int val; //value an output starts with; ignored for inputs
+} pin_cfg_t;
+
 extern int initialize_gpio_interface();
 
+// Optional; prefix every sysfs path with root (e.g. to run against a fake sysfs tree).
+// Must be called before initialize_gpio_interface.
+extern int set_gpio_sysfs_root(char* root);
+
 //  _u functions have been removed, as they are not conducive to having the GPIO pins 
 //  be extendable in the future. Pins should not be accessed directly by their pin
 //  number.
@@ -53,6 +70,19 @@ extern int get_gpio_dir_n(char* name);
 extern int setup_gpio_pin(int pin, int out);
 extern int setup_gpio_pin_n(char* pin_name, int out);
 
+// Set up n pins as one transaction: every pin is exported, then the library waits once
+// (with inotify) for their sysfs nodes to become usable, then every direction is set.
+// Outputs are switched to "high" or "low" directly, so they never drive the wrong value
+// first. Pins that are already open are only given their direction. If anything fails,
+// the pins this exported are closed again, the ones that were open get back the
+// direction and value they had, and GPIO_ERR is returned.
+extern int setup_gpio_pins(const pin_cfg_t* cfgs, int n);
+
+// Close n pins (autoclose_gpio_pins and terminate_gpio_interface use this). Every pin's
+// value fd is dropped before the first one is unexported. Returns GPIO_ERR if any of
+// them couldn't be closed; the others are still closed.
+extern int close_gpio_pins(const int* pins, int n);
+
 extern int set_gpio_val(int pin, int val);
 extern int set_gpio_val_n(char* pin_name, int val);
 
@@ -62,6 +92,19 @@ extern int read_gpio_val_n(char* pin_name);
 extern int toggle_gpio_val(int pin);
 extern int toggle_gpio_val_n(char* pin_name);
 
+// The last value written to each output is kept in memory (its shadow). By default,
+// reads and toggles of an output are served from the shadow, and writing the value an
+// output already has is skipped, so a toggle is one write. With GPIO_SHADOW_VERIFY,
+// outputs are always read from (and written to) the hardware, and a read that differs
+// from the shadow is reported as GPIO_E_SHADOW_MISMATCH. GPIO_SHADOW_OFF ignores the
+// shadows, for pins that something else (another process, a kernel driver) also drives.
+// A shadow is forgotten when its pin is opened, closed or has its direction set.
+#define GPIO_SHADOW_OFF 0
+#define GPIO_SHADOW_ON 1
+#define GPIO_SHADOW_VERIFY 2
+extern int set_gpio_shadow_mode(int mode);
+extern int get_gpio_shadow_mode();
+
 extern int close_gpio_pin(int pin);
 extern int close_gpio_pin_n(char* pin_name);
 
@@ -73,6 +116,12 @@ extern int get_gpio_num(char* pin_name);
 
 extern int get_gpio_xio_base();
 
+// For bindings that keep a pin's value file open (such as chip_gpio.hpp): the pin's
+// kernel number, and the full path of its value file. The path belongs to the library
+// and stays valid until terminate_gpio_interface.
+extern int get_gpio_kern_num(int pin);
+extern const char* get_gpio_value_path(int pin);
+
 extern int autoclose_gpio_pins();
 
 extern int terminate_gpio_interface();
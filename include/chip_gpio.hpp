@@ -0,0 +1,514 @@
+/*
+ * Copyright (c) 2017, Bryan Haley
+ * This code is dual licensed (GPLv2 and Simplified BSD). Use the license that works
+ * best for you. Check LICENSE.GPL and LICENSE.BSD for more details.
+ *
+ * chip_gpio.hpp
+ * Header-only C++17 layer over the libchipgpio interface. Pins, pin groups and the
+ * callback manager are move-only RAII handles, so a pin opened in a scope is closed when
+ * the scope is left (errors included), and failures are thrown as chipgpio::Error.
+ *
+ * Pins keep their value file open, so read() is one pread. write() and toggle() go
+ * through set_gpio_val and toggle_gpio_val, so they take the pin's lock, keep its output
+ * shadow right for C calls on the same pin and use the PIO registers when enabled.
+ * The built-in pins are also available as constexpr descriptors (chipgpio::pins, made
+ * from CHIP_GPIO_BUILTIN_PINS in chip_gpio_pin_defs.h); StaticPin<pins::X> works out
+ * the pin's backend, bit and (for R8 pins) kernel number at compile time and keeps its
+ * fd in a slot of its own, so there is no lookup of any kind left in read().
+ *
+ *   chipgpio::Interface gpio;
+ *   chipgpio::StaticPin<chipgpio::pins::XIO_P7> led(chipgpio::Direction::Out);
+ *   led.write(true);
+ */
+
+#ifndef CHIP_GPIO_HPP
+#define CHIP_GPIO_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+extern "C"
+{
+#include "chip_gpio.h"
+#include "chip_gpio_callback_manager.h"
+#include "chip_gpio_error.h"
+}
+
+namespace chipgpio
+{
+
+enum class Direction { In = GPIO_DIR_IN, Out = GPIO_DIR_OUT };
+
+//How a pin is reached, which decides how expensive it is to access
+enum class Backend { R8, Expander };
+
+using Clock = std::chrono::steady_clock; //CLOCK_MONOTONIC, like the rest of the library
+
+class Error : public std::runtime_error
+{
+public:
+    Error(int code, int pin, int sys_errno, const std::string& what)
+        : std::runtime_error(what), code_(code), pin_(pin), sys_errno_(sys_errno) {}
+
+    int code() const noexcept { return code_; } //GPIO_E_* from chip_gpio_error.h
+    int pin() const noexcept { return pin_; }
+    int sys_errno() const noexcept { return sys_errno_; }
+
+private:
+    int code_;
+    int pin_;
+    int sys_errno_;
+};
+
+namespace detail
+{
+
+[[noreturn]] inline void throw_error(int code, int pin, int sys_errno, const char* what)
+{
+    std::string msg = std::string(what) + " (pin " + std::to_string(pin) + "): " +
+                      gpio_strerror(code);
+    if (sys_errno) { msg += std::string(": ") + std::strerror(sys_errno); }
+    throw Error(code, pin, sys_errno, msg);
+}
+
+//Throw whatever the library recorded for the failed call on this thread
+[[noreturn]] inline void throw_last_error(int pin, const char* what)
+{
+    gpio_error_t err;
+    get_gpio_last_error(&err);
+    throw_error(err.code, pin, err.sys_errno, what);
+}
+
+inline int check(int rc, int pin, const char* what)
+{
+    if (rc < GPIO_OK) { throw_last_error(pin, what); }
+    return rc;
+}
+
+// Open and set up the pin, then open its value file for pread. The pin is closed again
+// if any step fails.
+inline int open_pin(int pin, int dir)
+{
+    const char* path = nullptr;
+    int fd = GPIO_ERR;
+    int err = 0;
+
+    check(open_gpio_pin(pin), pin, "open");
+
+    if (set_gpio_dir(pin, dir) < GPIO_OK || (path = get_gpio_value_path(pin)) == nullptr)
+    {
+        gpio_error_t last;
+        get_gpio_last_error(&last);
+        close_gpio_pin(pin);
+        throw_error(last.code, pin, last.sys_errno, "setup");
+    }
+
+    fd = ::open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+    {
+        err = errno;
+        close_gpio_pin(pin);
+        throw_error(GPIO_E_OPEN, pin, err, "open value file");
+    }
+
+    return fd;
+}
+
+inline void write_value(int pin, bool value)
+{ check(set_gpio_val(pin, value ? GPIO_PIN_HIGH : GPIO_PIN_LOW), pin, "write"); }
+
+inline void toggle_value(int pin) { check(toggle_gpio_val(pin), pin, "toggle"); }
+
+inline bool read_value(int fd, int pin)
+{
+    char ch = '\0';
+    if (::pread(fd, &ch, 1, 0) != 1) { throw_error(GPIO_E_READ, pin, errno, "read"); }
+    if (ch != '0' && ch != '1') { throw_error(GPIO_E_BAD_DATA, pin, 0, "read"); }
+    return ch == '1';
+}
+
+} // namespace detail
+
+//A pin as described by chip_gpio_pin_defs.h
+struct PinDesc
+{
+    int pin;
+    const char* name;
+    char port; //R8 port letter, or GPIO_UNUSED for expander pins
+    int offset; //pin within the port, or line on the expander
+
+    constexpr Backend backend() const { return port == GPIO_UNUSED ? Backend::Expander
+                                                                   : Backend::R8; }
+    // Kernel number of an R8 pin (see decode_r8_pin). Expander pins depend on a base
+    // number the kernel picks at boot, so they have none at compile time.
+    constexpr int r8_kern_num() const { return 32*(port-'A')+offset; }
+};
+
+namespace pins
+{
+#define CHIP_GPIO_PIN_DESC(pin, pin_name, pin_port, pin_offset) \
+    inline constexpr PinDesc pin { GPIO_##pin, pin_name, pin_port, pin_offset };
+CHIP_GPIO_BUILTIN_PINS(CHIP_GPIO_PIN_DESC)
+#undef CHIP_GPIO_PIN_DESC
+} // namespace pins
+
+// initialize_gpio_interface for the lifetime of the object. Pins opened through the
+// C API are closed by terminate_gpio_interface as usual.
+class Interface
+{
+public:
+    explicit Interface(const char* sysfs_root = nullptr)
+    {
+        if (sysfs_root) { set_gpio_sysfs_root(const_cast<char*>(sysfs_root)); }
+        if (initialize_gpio_interface() < GPIO_OK)
+        { throw Error(GPIO_E_OPEN, 0, errno, "could not initialize libchipgpio"); }
+    }
+
+    ~Interface() { if (active_) { terminate_gpio_interface(); } }
+
+    Interface(Interface&& other) noexcept
+        : active_(std::exchange(other.active_, false)) {}
+    Interface& operator=(Interface&&) = delete;
+    Interface(const Interface&) = delete;
+    Interface& operator=(const Interface&) = delete;
+
+private:
+    bool active_ = true;
+};
+
+//An open pin. It's closed (unexported) when the handle is destroyed.
+class Pin
+{
+public:
+    Pin(int pin, Direction dir)
+        : pin_(pin), fd_(detail::open_pin(pin, static_cast<int>(dir))) {}
+
+    Pin(const char* name, Direction dir) : Pin(lookup(name), dir) {}
+
+    ~Pin() { release(); }
+
+    Pin(Pin&& other) noexcept
+        : pin_(std::exchange(other.pin_, GPIO_ERR)), fd_(std::exchange(other.fd_, -1)) {}
+
+    Pin& operator=(Pin&& other) noexcept
+    {
+        if (this != &other)
+        {
+            release();
+            pin_ = std::exchange(other.pin_, GPIO_ERR);
+            fd_ = std::exchange(other.fd_, -1);
+        }
+        return *this;
+    }
+
+    Pin(const Pin&) = delete;
+    Pin& operator=(const Pin&) = delete;
+
+    void write(bool value) { detail::write_value(pin_, value); }
+    bool read() const { return detail::read_value(fd_, pin_); }
+    void toggle() { detail::toggle_value(pin_); }
+
+    void set_direction(Direction dir)
+    { detail::check(set_gpio_dir(pin_, static_cast<int>(dir)), pin_, "set direction"); }
+
+    Direction direction() const
+    {
+        return static_cast<Direction>(detail::check(get_gpio_dir(pin_), pin_,
+                                                    "get direction"));
+    }
+
+    int number() const noexcept { return pin_; }
+    explicit operator bool() const noexcept { return fd_ >= 0; }
+
+private:
+    static int lookup(const char* name)
+    {
+        int pin = get_gpio_num(const_cast<char*>(name));
+        if (pin < GPIO_OK)
+        {
+            throw Error(GPIO_E_NO_PIN, GPIO_ERR, 0,
+                        std::string("no pin named ") + name);
+        }
+        return pin;
+    }
+
+    void release() noexcept
+    {
+        if (fd_ >= 0) { ::close(fd_); }
+        if (pin_ >= GPIO_OK) { close_gpio_pin(pin_); }
+        fd_ = -1;
+        pin_ = GPIO_ERR;
+    }
+
+    int pin_ = GPIO_ERR;
+    int fd_ = -1;
+};
+
+// A built-in pin whose descriptor is known at compile time. Each descriptor has one fd
+// slot, so only one StaticPin<D> can be open at a time (like the pin itself). On open,
+// the descriptor is checked against the loaded pin map, in case a different map (see
+// chip_gpio_pin_map.h) moved the pin.
+template <const PinDesc& D>
+class StaticPin
+{
+public:
+    static constexpr const PinDesc& desc = D;
+    static constexpr Backend backend = D.backend();
+    static constexpr int bit = D.offset; //bit within the R8 port or expander register
+
+    explicit StaticPin(Direction dir)
+    {
+        if (fd_ >= 0)
+        {
+            throw Error(GPIO_E_OPEN, D.pin, EBUSY,
+                        std::string(D.name) + " is already open");
+        }
+
+        if (get_gpio_num(const_cast<char*>(D.name)) != D.pin ||
+            (backend == Backend::R8 && get_gpio_kern_num(D.pin) != D.r8_kern_num()))
+        {
+            throw Error(GPIO_E_NO_KERN_NUM, D.pin, 0,
+                        std::string(D.name) + " is not where chip_gpio_pin_defs.h says");
+        }
+
+        fd_ = detail::open_pin(D.pin, static_cast<int>(dir));
+        owned_ = true;
+    }
+
+    ~StaticPin() { release(); }
+
+    StaticPin(StaticPin&& other) noexcept : owned_(std::exchange(other.owned_, false)) {}
+
+    StaticPin& operator=(StaticPin&& other) noexcept
+    {
+        if (this != &other)
+        {
+            release();
+            owned_ = std::exchange(other.owned_, false);
+        }
+        return *this;
+    }
+
+    StaticPin(const StaticPin&) = delete;
+    StaticPin& operator=(const StaticPin&) = delete;
+
+    void write(bool value) { detail::write_value(D.pin, value); }
+    bool read() const { return detail::read_value(fd_, D.pin); }
+    void toggle() { detail::toggle_value(D.pin); }
+
+    void set_direction(Direction dir)
+    { detail::check(set_gpio_dir(D.pin, static_cast<int>(dir)), D.pin, "set direction"); }
+
+    static constexpr int number() noexcept { return D.pin; }
+    explicit operator bool() const noexcept { return owned_; }
+
+private:
+    void release() noexcept
+    {
+        if (!owned_) { return; }
+        ::close(fd_);
+        close_gpio_pin(D.pin);
+        fd_ = -1;
+        owned_ = false;
+    }
+
+    static inline int fd_ = -1;
+    bool owned_ = false;
+};
+
+// Several pins written and read as one word; pins[0] is bit 0. Only pins whose bit
+// changed since the last write are touched. A group holds at most max_pins pins.
+class PinGroup
+{
+public:
+    static constexpr size_t max_pins = 32; //bits in the word
+
+    PinGroup(std::initializer_list<int> pins, Direction dir)
+    {
+        check_size(pins.size());
+        for (int pin : pins) { pins_.emplace_back(pin, dir); }
+    }
+
+    PinGroup(std::initializer_list<const char*> names, Direction dir)
+    {
+        check_size(names.size());
+        for (const char* name : names) { pins_.emplace_back(name, dir); }
+    }
+
+    PinGroup(PinGroup&&) noexcept = default;
+    PinGroup& operator=(PinGroup&&) noexcept = default;
+    PinGroup(const PinGroup&) = delete;
+    PinGroup& operator=(const PinGroup&) = delete;
+
+    void write(uint32_t word)
+    {
+        uint32_t changed = shadow_valid_ ? word ^ shadow_ : ~0u;
+
+        for (size_t i = 0; i < pins_.size(); i++)
+        { if (changed & (1u << i)) { pins_[i].write(word & (1u << i)); } }
+
+        shadow_ = word;
+        shadow_valid_ = true;
+    }
+
+    uint32_t read() const
+    {
+        uint32_t word = 0;
+        for (size_t i = 0; i < pins_.size(); i++)
+        { word |= static_cast<uint32_t>(pins_[i].read()) << i; }
+        return word;
+    }
+
+    void set_direction(Direction dir)
+    {
+        for (Pin& pin : pins_) { pin.set_direction(dir); }
+        shadow_valid_ = false;
+    }
+
+    size_t size() const noexcept { return pins_.size(); }
+    Pin& operator[](size_t i) { return pins_[i]; }
+
+private:
+    static void check_size(size_t size)
+    {
+        if (size > max_pins)
+        {
+            throw Error(GPIO_E_BAD_VALUE, GPIO_ERR, 0, "a pin group holds at most " +
+                        std::to_string(max_pins) + " pins");
+        }
+    }
+
+    std::vector<Pin> pins_;
+    uint32_t shadow_ = 0;
+    bool shadow_valid_ = false;
+};
+
+// The callback manager for the lifetime of the object. Handlers are called on the
+// manager's thread, with the time the change was dispatched. An exception thrown by a
+// handler can't be passed on from there; it's reported on stderr and dropped.
+class CallbackManager
+{
+public:
+    struct Change
+    {
+        int pin;
+        bool value;
+        Clock::time_point time;
+    };
+
+    using Handler = std::function<void(const Change&)>;
+
+    CallbackManager()
+    { detail::check(setup_callback_manager(), 0, "start callback manager"); }
+
+    ~CallbackManager()
+    {
+        //stop the thread before the handlers it might be calling go away
+        if (active_) { terminate_callback_manager(); }
+    }
+
+    CallbackManager(CallbackManager&& other) noexcept
+        : active_(std::exchange(other.active_, false)),
+          handlers_(std::move(other.handlers_)) {}
+    CallbackManager& operator=(CallbackManager&&) = delete;
+    CallbackManager(const CallbackManager&) = delete;
+    CallbackManager& operator=(const CallbackManager&) = delete;
+
+    // Call handler whenever the pin changes (or, with on_flip, only when it changes to
+    // flip_value; see register_callback_flip_func)
+    void on_change(int pin, Handler handler)
+    { install(pin, std::move(handler), false, false); }
+
+    void on_flip(int pin, bool flip_value, Handler handler)
+    { install(pin, std::move(handler), true, flip_value); }
+
+    template <typename P> void on_change(const P& pin, Handler handler)
+    { on_change(pin.number(), std::move(handler)); }
+
+    void remove(int pin)
+    {
+        pause_callback_manager();
+        remove_callback_func(pin);
+        handlers_.erase(pin);
+        unpause_callback_manager();
+    }
+
+    void pause() { pause_callback_manager(); }
+    void unpause() { unpause_callback_manager(); }
+
+    void set_polling_delay(std::chrono::microseconds delay)
+    { set_callback_polling_delay(static_cast<int>(delay.count())); }
+
+    void set_adaptive_polling(std::chrono::microseconds min,
+                              std::chrono::microseconds max,
+                              std::chrono::microseconds quiet)
+    {
+        detail::check(set_callback_adaptive_polling(static_cast<int>(min.count()),
+                                                    static_cast<int>(max.count()),
+                                                    static_cast<int>(quiet.count())),
+                      0, "set adaptive polling");
+    }
+
+private:
+    void install(int pin, Handler handler, bool flip, bool flip_value)
+    {
+        auto h = std::make_unique<Handler>(std::move(handler));
+        void* func = reinterpret_cast<void*>(&dispatch);
+        //the thread may be calling the handler being replaced
+        bool replacing = handlers_.count(pin) != 0;
+        int rc = GPIO_OK;
+
+        if (replacing) { pause_callback_manager(); }
+
+        rc = flip ? register_callback_flip_func(pin, func, h.get())
+                  : register_callback_func(pin, func, h.get());
+        if (rc >= GPIO_OK && flip) { rc = set_callback_flip_value(pin, flip_value); }
+        if (rc >= GPIO_OK) { handlers_[pin] = std::move(h); }
+
+        if (replacing) { unpause_callback_manager(); }
+
+        detail::check(rc, pin, "register callback");
+    }
+
+    static int dispatch(pin_change_t change, void* arg) noexcept
+    {
+        //letting it unwind into the C polling thread would call std::terminate
+        try
+        {
+            (*static_cast<Handler*>(arg))(Change { change.pin, change.new_val != 0,
+                                                   Clock::now() });
+        }
+        catch (const std::exception& e)
+        {
+            std::fprintf(stderr, "Callback handler for pin %d threw: %s\n", change.pin,
+                         e.what());
+            return GPIO_ERR;
+        }
+        catch (...)
+        {
+            std::fprintf(stderr, "Callback handler for pin %d threw\n", change.pin);
+            return GPIO_ERR;
+        }
+
+        return GPIO_OK;
+    }
+
+    bool active_ = true;
+    std::unordered_map<int, std::unique_ptr<Handler>> handlers_;
+};
+
+} // namespace chipgpio
+
+#endif
@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2017, Bryan Haley
+ * This code is dual licensed (GPLv2 and Simplified BSD). Use the license that works
+ * best for you. Check LICENSE.GPL and LICENSE.BSD for more details.
+ *
+ * chip_gpio_batch.h
+ * Interface for reading or writing several pins in one go. The callback manager reads
+ * each poll pass this way, and buses write and read their words this way.
+ *
+ * Batches use value files that are kept open, and by default each pin is one
+ * pread/pwrite. Optionally, a batch can be handed to io_uring instead: every read or
+ * write is queued against the fds (registered with the ring), then submitted and reaped
+ * in one io_uring_enter call rather than one syscall per pin. Where io_uring isn't
+ * available (older kernels, or disabled by a sysctl or seccomp), batches fall back to
+ * the fds.
+ *
+ * Fewer syscalls aren't always faster: sysfs files can't be accessed without blocking,
+ * so the kernel may hand ring entries to worker threads. Measure both (make bench
+ * reports time and syscalls per batch for each backend).
+ *
+ * While the PIO registers are mapped (chip_gpio_pio.h), the pins on them skip all of
+ * this: a batch loads, or sets and clears in one store, each port's data register once.
+ */
+
+#ifndef CHIP_GPIO_BATCH_H
+#define CHIP_GPIO_BATCH_H
+
+#define GPIO_BATCH_AUTO 0 //io_uring if it's available, otherwise fds
+#define GPIO_BATCH_FDS 1 //one pread/pwrite per pin (the default)
+#define GPIO_BATCH_URING 2 //one io_uring_enter per batch (of up to GPIO_URING_ENTRIES)
+#define GPIO_URING_ENTRIES 64
+
+// Choose how batches are done. Returns the backend now in use (GPIO_BATCH_FDS or
+// GPIO_BATCH_URING), or GPIO_ERR if GPIO_BATCH_URING was asked for and io_uring can't be
+// set up (batches then use the fds). The choice holds across initialize/terminate.
+extern int set_gpio_batch_backend(int backend);
+extern int get_gpio_batch_backend();
+
+// Read n pins into vals. Pins that failed are set to GPIO_ERR (the reason is recorded
+// as usual, see chip_gpio_error.h) and GPIO_ERR is returned; the others are still read.
+extern int read_gpio_vals(int* pins, int* vals, int n);
+
+// Write vals[i] to pins[i]. Returns GPIO_ERR if any pin couldn't be written.
+extern int set_gpio_vals(int* pins, int* vals, int n);
+
+#endif
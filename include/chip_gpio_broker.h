@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2017, Bryan Haley
+ * This code is dual licensed (GPLv2 and Simplified BSD). Use the license that works
+ * best for you. Check LICENSE.GPL and LICENSE.BSD for more details.
+ *
+ * chip_gpio_broker.h
+ * Interface for sharing the GPIO pins between several processes through a broker
+ * (gpio_brokerd). The broker is the only process that opens, closes and polls pins;
+ * programs connect to it as clients, and the chip_gpio.h functions they already use are
+ * passed on to it.
+ *
+ * Control requests (open, close, direction, writes) go over a Unix socket. Pin values
+ * are published in shared memory as a seqlock protected snapshot, so read_gpio_val is a
+ * few memory loads and never waits on the broker, and changes on pins a client
+ * subscribed to are pushed to a lock-free ring of its own.
+ *
+ * A pin stays exported as long as any client has it open, and only clients that opened
+ * a pin may write to it or change its direction. The pins of a client that exits (or
+ * crashes) are released for it. Clients can only map the snapshot to read; the one
+ * word of shared memory they may write is the read position of their own ring.
+ *
+ * Anyone who can connect to the socket can use the pins, so the broker makes it
+ * readable and writable by its own user and group only (GPIO_BROKER_SOCKET_MODE).
+ */
+
+#ifndef CHIP_GPIO_BROKER_H
+#define CHIP_GPIO_BROKER_H
+
+#include <stdint.h>
+
+#define GPIO_BROKER_ENV "CHIP_GPIO_BROKER" //socket path; initialize_gpio_interface
+                                           //connects to it instead of using sysfs
+#define GPIO_BROKER_DEFAULT_SOCKET "/run/chipgpio.sock"
+#define GPIO_BROKER_SOCKET_MODE 0660 //run gpio_brokerd with the group of its users
+#define MAX_BROKER_CLIENTS 64 //one bit each in the per-pin owner masks
+#define BROKER_RING_SIZE 256 //events each client can have waiting (power of two)
+
+typedef struct
+{
+    int pin;
+    int new_val;
+    int64_t time_ns; //CLOCK_MONOTONIC timestamp of the read that saw the change
+} gpio_broker_event_t;
+
+// Client side. Connecting replaces initialize_gpio_interface (or is done by it, when
+// CHIP_GPIO_BROKER is set); disconnecting closes the pins this process opened. A child
+// made by fork shares its parent's connection, so it should disconnect and connect
+// again. The pin handles in chip_gpio.hpp keep sysfs files open themselves and can't be
+// used through the broker.
+extern int connect_gpio_broker(char* socket_path);
+extern int disconnect_gpio_broker();
+extern int is_gpio_broker_connected();
+
+// Have changes on a pin this process opened pushed to it
+extern int subscribe_gpio_broker(int pin);
+extern int subscribe_gpio_broker_n(char* pin_name);
+extern int unsubscribe_gpio_broker(int pin);
+
+// Take up to max waiting events without blocking. Returns how many were taken.
+extern int read_gpio_broker_events(gpio_broker_event_t* events, int max);
+
+// A file descriptor that becomes readable (poll/select/epoll) when events are waiting.
+// read_gpio_broker_events clears it.
+extern int get_gpio_broker_event_fd();
+
+// Events thrown away because this process's ring was full
+extern uint64_t get_gpio_broker_dropped();
+
+// Broker side, used by gpio_brokerd. initialize_gpio_interface must have been called.
+// Serves clients on socket_path until stop_gpio_broker is called (it's safe to call
+// from a signal handler, and a stop that comes while the broker is still starting up
+// isn't lost). socket_path only appears once the broker is accepting connections.
+extern int run_gpio_broker(char* socket_path);
+extern int stop_gpio_broker();
+
+#endif
@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2017, Bryan Haley
+ * This code is dual licensed (GPLv2 and Simplified BSD). Use the license that works
+ * best for you. Check LICENSE.GPL and LICENSE.BSD for more details.
+ *
+ * chip_gpio_bus.h
+ * Interface for treating an ordered group of GPIO pins (e.g. LCD-D0..LCD-D7) as a
+ * parallel bus that words can be written to and read from.
+ */
+
+#ifndef CHIP_GPIO_BUS_H
+#define CHIP_GPIO_BUS_H
+
+#include <stdint.h>
+
+#define MAX_BUS_WIDTH 32
+#define BUS_NO_STROBE -1
+
+typedef struct
+{
+    int width;
+    int pins[MAX_BUS_WIDTH]; //pins[i] carries bit i of a word
+    uint32_t mask; //bits of a word that map to a pin
+    uint32_t shadow; //last word written to the bus
+    int shadow_valid; //bool; false until the first write (or after changing direction)
+    int dir;
+    int strobe_pin; //BUS_NO_STROBE if the bus has no strobe
+    int strobe_active; //level the strobe is pulsed to
+    int strobe_width_us;
+} gpio_bus_t;
+
+// Create a bus out of width pins. pins[0] is the least significant bit.
+// Free it with destroy_gpio_bus when done.
+extern gpio_bus_t* create_gpio_bus(int* pins, int width);
+extern gpio_bus_t* create_gpio_bus_n(char** pin_names, int width);
+
+// Open every pin on the bus (and its strobe, if any) and set their direction
+extern int setup_gpio_bus(gpio_bus_t* bus, int out);
+extern int set_gpio_bus_dir(gpio_bus_t* bus, int out);
+
+// Use pin as a strobe (e.g. an LCD's E pin or an ADC's RD pin). It is pulsed to
+// active_level for width_us microseconds by bus_strobe.
+extern int set_gpio_bus_strobe(gpio_bus_t* bus, int pin, int active_level, int width_us);
+
+// Write a word to the bus. Only pins whose bit differs from the last word written
+// are touched.
+extern int bus_write(gpio_bus_t* bus, uint32_t word);
+
+// Read a word from the bus. Returns the word, or -1 on error.
+extern int64_t bus_read(gpio_bus_t* bus);
+
+extern int bus_strobe(gpio_bus_t* bus);
+
+// Convenience functions for the common write-then-latch and assert-read-release cycles
+extern int bus_write_strobe(gpio_bus_t* bus, uint32_t word);
+extern int64_t bus_strobe_read(gpio_bus_t* bus);
+
+// Does not close the bus's pins; use close_gpio_pin or autoclose_gpio_pins for that
+extern int destroy_gpio_bus(gpio_bus_t* bus);
+
+#endif
@@ -5,6 +5,17 @@
  *
  * chip_gpio_callback_manager.h
  * Interface for registering callbacks and starting the callback manager.
+ *
+ * The functions without a manager argument use the default manager. More can be made
+ * with create_callback_manager, each with its own polling thread, workers, callbacks and
+ * histograms, and used with the _m form of those functions, which takes the manager
+ * first. Managers can watch the same pins; each reads them on its own thread, and
+ * samples the encoders registered with it (chip_gpio_encoder.h).
+ *
+ * Managers are not independent GPIO contexts: there is no gpio_ctx_t. The pin map, pin
+ * cache and output shadows, the sysfs root, the shadow mode, the batch backend and the
+ * PIO mapping are shared by the whole process, so two managers can't use different
+ * sysfs roots or pin maps.
  */
 
 #ifndef CHIP_GPIO_CALLBACK_MANAGER_H
@@ -15,12 +26,89 @@
 #define CALLBACK_ON_PRESS_PULLDOWN 0
 #define CALLBACK_ON_RELEASE_PULLDOWN 1
 
+#include <stdint.h>
+
+//latency histograms kept by the callback manager (see get_callback_histogram)
+#define CALLBACK_HIST_DISPATCH 0 //change detected -> callback invoked
+#define CALLBACK_HIST_DETECT 1 //previous read -> read that saw the change
+#define CALLBACK_HIST_POLL_PASS 2 //time spent polling a group's pins in one pass
+#define CALLBACK_NUM_HISTS 3
+
+//pins are grouped by how they are reached, since their read costs differ widely
+#define PIN_GROUP_R8 0 //the R8's own pins (LCD, CSI, PWM...)
+#define PIN_GROUP_XIO 1 //pins behind the i2c expander
+#define NUM_PIN_GROUPS 2
+
+//callbacks can be run on a pool of worker threads (see set_callback_workers)
+#define MAX_CALLBACK_WORKERS 16
+#define CALLBACK_QUEUE_SIZE 64 //changes each pin can have waiting for a worker
+#define CALLBACK_PRIORITY_HIGH 0
+#define CALLBACK_PRIORITY_NORMAL 1 //the default
+#define CALLBACK_PRIORITY_LOW 2
+#define CALLBACK_NUM_PRIORITIES 3
+
+//how a batch callback's changes are gathered (see set_callback_batch_mode)
+#define CALLBACK_BATCH_EVERY 0 //every change, in the order they were seen (the default)
+#define CALLBACK_BATCH_LATEST 1 //one change per pin, holding its latest value
+#define CALLBACK_BATCH_SIZE 256 //changes held before a batch is delivered early
+
+// Histograms are log-bucketed (HDR-style): values below 2^HIST_SUB_BITS ns have a bucket
+// each, and every power of two above that is split into 2^HIST_SUB_BITS buckets, so
+// any value is within ~6% of its bucket. Values past 2^HIST_MAX_EXP ns are clamped.
+#define HIST_SUB_BITS 4
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_MAX_EXP 47 //~39 hours
+#define HIST_NUM_BUCKETS ((HIST_MAX_EXP-HIST_SUB_BITS+2)*HIST_SUB_BUCKETS)
+
 typedef struct
 {
     int pin;
     int new_val;
 } pin_change_t;
 
+//one change in a batch (see register_callback_batch_func)
+typedef struct
+{
+    int pin;
+    int new_val;
+    int64_t time_ns; //CLOCK_MONOTONIC timestamp of the read that saw the change
+} pin_event_t;
+
+//snapshot of a pin's measurement channel (see enable_gpio_measurement)
+typedef struct
+{
+    int pin;
+    uint64_t edges; //rising and falling edges seen since enabled/reset
+    uint64_t rising_edges;
+    uint64_t errors; //failed reads
+    int64_t period_ns; //time between the last two rising edges
+    int64_t high_ns; //time spent high during the last complete pulse
+    double duty_cycle; //high_ns/period_ns of the last complete pulse
+    double frequency; //rising edges per second over the last complete gate window
+    int64_t last_edge_ns; //CLOCK_MONOTONIC timestamp of the last edge
+} pin_measurement_t;
+
+//time spent in a pin's callback function (see get_callback_stats)
+typedef struct
+{
+    int pin;
+    uint64_t calls;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t dropped; //changes thrown away because the pin's queue was full
+} callback_stats_t;
+
+typedef struct
+{
+    uint64_t count;
+    uint64_t min_ns;
+    uint64_t max_ns;
+    uint64_t sum_ns;
+    uint64_t buckets[HIST_NUM_BUCKETS]; //see get_histogram_bucket_ns
+} latency_histogram_t;
+
+typedef struct gpio_cb_manager gpio_cb_manager_t;
+
 extern int initialize_callback_manager();
 extern int init_callback_manager();
 
@@ -28,6 +116,16 @@ extern int start_callback_manager();
 
 extern int setup_callback_manager();
 
+// A new manager, initialized (but not started); NULL if it couldn't be made. Free it
+// with free_callback_manager, which also terminates it.
+extern gpio_cb_manager_t* create_callback_manager();
+extern int free_callback_manager(gpio_cb_manager_t* manager);
+extern gpio_cb_manager_t* get_default_callback_manager();
+
+// Keep a manager's polling thread on one CPU (GPIO_ERR lets it run on any, the default),
+// e.g. to give each of several managers a core of its own
+extern int set_callback_manager_cpu(gpio_cb_manager_t* manager, int cpu);
+
 // Signature of a callback function: int foo(pin_change_t, void*)
 
 extern int register_callback_func(int pin, void* func, void* arg);
@@ -39,9 +137,72 @@ extern int register_callback_flip_func_n(char* pin_name, void* func, void* arg);
 extern int set_callback_flip_value(int pin, int val);
 extern int set_callback_flip_value_n(char* pin_name, int val);
 
+// Once these return, no worker is still running the pin's old function (see
+// set_callback_workers), so its arg can be freed. Registering a new function does the same.
 extern int remove_callback_func(int pin);
 extern int remove_callback_func_n(char* pin_name);
 
+// A batch callback gets every change on its pins from a poll pass in one call, for
+// consumers that log or forward changes and would rather not be called once per pin.
+// Signature: int foo(const pin_event_t* events, int n, void* arg)
+// There is one batch callback; registering another replaces it and its pins. It runs on
+// the polling thread (never on the workers), after the pass's other callbacks, and its
+// pins may also have callbacks of their own.
+extern int register_callback_batch_func(int* pins, int n, void* func, void* arg);
+extern int register_callback_batch_func_n(char** pin_names, int n, void* func, void* arg);
+extern int remove_callback_batch_func();
+
+// By default a batch is delivered after every pass that saw a change. With interval_us,
+// changes are gathered for at least that long first; CALLBACK_BATCH_LATEST then keeps
+// only each pin's latest value (a pin that changed and changed back is still delivered),
+// while CALLBACK_BATCH_EVERY keeps every change. A batch is delivered early if it fills
+// up (CALLBACK_BATCH_SIZE changes), and whatever is held is delivered when the manager
+// is paused or stopped.
+extern int set_callback_batch_mode(int mode, int interval_us);
+
+// Measurement channels count edges and time pulses on the polling thread without
+// invoking a callback. gate_us sets the window frequency is measured over (0 disables).
+extern int enable_gpio_measurement(int pin, int gate_us);
+extern int enable_gpio_measurement_n(char* pin_name, int gate_us);
+
+extern int disable_gpio_measurement(int pin);
+extern int disable_gpio_measurement_n(char* pin_name);
+
+extern int get_gpio_measurement(int pin, pin_measurement_t* out);
+extern int get_gpio_measurement_n(char* pin_name, pin_measurement_t* out);
+
+extern int reset_gpio_measurement(int pin);
+extern int reset_gpio_measurement_n(char* pin_name);
+
+// Copy out one of the histograms (CALLBACK_HIST_*) for a pin group (PIN_GROUP_*).
+// Recording never blocks the polling thread; each bucket is read atomically.
+extern int get_callback_histogram(int group, int hist, latency_histogram_t* out);
+extern int reset_callback_histograms();
+
+// Value (in ns) below which percentile (0.0-1.0) of the recorded values fall, to the
+// histogram's precision. Returns 0 for an empty histogram.
+extern int64_t get_histogram_percentile(const latency_histogram_t* hist, double percentile);
+// Smallest value (in ns) counted in a bucket
+extern int64_t get_histogram_bucket_ns(int bucket);
+
+// By default, callbacks run one after another on the polling thread. With workers > 0,
+// they run on that many threads instead, so a slow callback only holds up its own pin.
+// A pin's changes are still delivered in order, and only one worker runs a pin's
+// callback at a time. Idle workers take whichever pin has changes waiting, higher
+// priority (CALLBACK_PRIORITY_*) pins first. Changing the count while the manager is
+// running lets the current workers finish what's queued first.
+extern int set_callback_workers(int workers);
+extern int get_callback_workers();
+
+extern int set_callback_priority(int pin, int priority);
+extern int set_callback_priority_n(char* pin_name, int priority);
+
+// How often a pin's callback ran and for how long, to find the ones that hog the
+// workers (or the polling thread)
+extern int get_callback_stats(int pin, callback_stats_t* out);
+extern int get_callback_stats_n(char* pin_name, callback_stats_t* out);
+extern int reset_callback_stats();
+
 extern int pause_callback_manager();
 extern int unpause_callback_manager();
 
@@ -50,4 +211,55 @@ extern int term_callback_manager();
 
 extern int set_callback_polling_delay(int new_delay);
 
+// Adaptive polling: poll every min_us (0 = no delay) as soon as a pin (or encoder)
+// changes, and once nothing has changed for quiet_us, double the delay every pass up to
+// max_us. This saves CPU on idle boards without a long delay missing bursts, though a
+// pulse shorter than the current delay can still be missed, including the one that
+// starts a burst. max_us = 0 turns it off, and set_callback_polling_delay applies again.
+extern int set_callback_adaptive_polling(int min_us, int max_us, int quiet_us);
+
+// Delay (in us) the polling thread currently waits between passes
+extern int get_callback_polling_interval();
+
+// The same functions for a given manager
+extern int start_callback_manager_m(gpio_cb_manager_t* manager);
+extern int pause_callback_manager_m(gpio_cb_manager_t* manager);
+extern int unpause_callback_manager_m(gpio_cb_manager_t* manager);
+extern int terminate_callback_manager_m(gpio_cb_manager_t* manager);
+
+extern int register_callback_func_m(gpio_cb_manager_t* manager, int pin, void* func,
+                                    void* arg);
+extern int register_callback_flip_func_m(gpio_cb_manager_t* manager, int pin, void* func,
+                                         void* arg);
+extern int set_callback_flip_value_m(gpio_cb_manager_t* manager, int pin, int val);
+extern int remove_callback_func_m(gpio_cb_manager_t* manager, int pin);
+
+extern int register_callback_batch_func_m(gpio_cb_manager_t* manager, int* pins, int n,
+                                          void* func, void* arg);
+extern int remove_callback_batch_func_m(gpio_cb_manager_t* manager);
+extern int set_callback_batch_mode_m(gpio_cb_manager_t* manager, int mode,
+                                     int interval_us);
+
+extern int enable_gpio_measurement_m(gpio_cb_manager_t* manager, int pin, int gate_us);
+extern int disable_gpio_measurement_m(gpio_cb_manager_t* manager, int pin);
+extern int get_gpio_measurement_m(gpio_cb_manager_t* manager, int pin,
+                                  pin_measurement_t* out);
+extern int reset_gpio_measurement_m(gpio_cb_manager_t* manager, int pin);
+
+extern int get_callback_histogram_m(gpio_cb_manager_t* manager, int group, int hist,
+                                    latency_histogram_t* out);
+extern int reset_callback_histograms_m(gpio_cb_manager_t* manager);
+
+extern int set_callback_workers_m(gpio_cb_manager_t* manager, int workers);
+extern int get_callback_workers_m(gpio_cb_manager_t* manager);
+extern int set_callback_priority_m(gpio_cb_manager_t* manager, int pin, int priority);
+extern int get_callback_stats_m(gpio_cb_manager_t* manager, int pin,
+                                callback_stats_t* out);
+extern int reset_callback_stats_m(gpio_cb_manager_t* manager);
+
+extern int set_callback_polling_delay_m(gpio_cb_manager_t* manager, int new_delay);
+extern int set_callback_adaptive_polling_m(gpio_cb_manager_t* manager, int min_us,
+                                           int max_us, int quiet_us);
+extern int get_callback_polling_interval_m(gpio_cb_manager_t* manager);
+
 #endif
@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2017, Bryan Haley
+ * This code is dual licensed (GPLv2 and Simplified BSD). Use the license that works
+ * best for you. Check LICENSE.GPL and LICENSE.BSD for more details.
+ *
+ * chip_gpio_encoder.h
+ * Interface for decoding quadrature rotary encoders connected to a pair of GPIO pins.
+ * Encoders are sampled by a callback manager's polling thread (the default manager's,
+ * unless one is given), so that manager must be initialized and started for positions
+ * to update.
+ */
+
+#ifndef CHIP_GPIO_ENCODER_H
+#define CHIP_GPIO_ENCODER_H
+
+#include <stdint.h>
+#include "chip_gpio_callback_manager.h"
+
+#define MAX_ENCODERS 8
+
+typedef struct
+{
+    int encoder;
+    int64_t position;
+    int64_t delta; //counts since the last notification
+} encoder_change_t;
+
+// Returns an encoder handle (0 or higher) to pass to the functions below.
+// Both pins must already be set up in the input direction.
+extern int register_encoder(int pin_a, int pin_b);
+extern int register_encoder_m(gpio_cb_manager_t* manager, int pin_a, int pin_b);
+extern int register_encoder_n(char* pin_a_name, char* pin_b_name);
+
+extern int remove_encoder(int encoder);
+
+extern int64_t get_encoder_position(int encoder);
+extern int set_encoder_position(int encoder, int64_t position);
+
+// Velocity is given in counts per second and is recalculated once every window.
+// A window of 0 or less disables velocity estimation (the default).
+extern int set_encoder_velocity_window(int encoder, int window_us);
+extern double get_encoder_velocity(int encoder);
+
+// Signature of a notification function: int foo(encoder_change_t, void*)
+// func is invoked once the position has moved at least threshold counts since the last
+// time it was invoked. A threshold of 0 or less disables notifications.
+extern int set_encoder_threshold(int encoder, int64_t threshold, void* func, void* arg);
+
+// Number of impossible transitions seen (both pins changed between two samples).
+// A rising count means the encoder is turning faster than the pins are being polled.
+extern uint64_t get_encoder_errors(int encoder);
+
+#endif
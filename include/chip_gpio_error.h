@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2017, Bryan Haley
+ * This code is dual licensed (GPLv2 and Simplified BSD). Use the license that works
+ * best for you. Check LICENSE.GPL and LICENSE.BSD for more details.
+ *
+ * chip_gpio_error.h
+ * Interface for finding out why a libchipgpio call failed. Errors on the pin access
+ * paths are recorded as codes (per thread and per pin) instead of being printed, and
+ * passed on to a log function that is rate limited and drops repeats, so a failing pin
+ * can't flood stderr or slow down the callback manager.
+ */
+
+#ifndef CHIP_GPIO_ERROR_H
+#define CHIP_GPIO_ERROR_H
+
+#include <stdint.h>
+
+#define GPIO_E_NONE 0
+#define GPIO_E_NO_PIN 1 //the pin number does not exist
+#define GPIO_E_NO_KERN_NUM 2 //no kernel number could be found for the pin
+#define GPIO_E_BAD_VALUE 3 //a value other than 0 or 1 was passed in
+#define GPIO_E_OPEN 4 //a sysfs file could not be opened
+#define GPIO_E_READ 5
+#define GPIO_E_WRITE 6
+#define GPIO_E_CLOSE 7
+#define GPIO_E_BAD_DATA 8 //a sysfs file held something other than what was expected
+#define GPIO_E_CALLBACK_REMOVED 9 //the callback manager gave up on a pin that failed
+#define GPIO_E_BROKER 10 //the broker (chip_gpio_broker.h) could not be reached
+#define GPIO_E_NOT_OWNER 11 //the broker refused: the pin wasn't opened by this process
+#define GPIO_E_SHADOW_MISMATCH 12 //an output didn't hold the value last written to it
+#define GPIO_NUM_ERRORS 13
+
+#define GPIO_LOG_DEFAULT_RATE 10 //messages per second
+#define GPIO_LOG_DEFAULT_DEDUP_MS 1000
+
+typedef struct
+{
+    int code; //GPIO_E_*
+    int pin;
+    int pin_kern; //kernel number, or GPIO_ERR if unknown
+    int sys_errno; //errno at the time, or 0
+    int64_t time_ns; //CLOCK_MONOTONIC timestamp
+    uint64_t count; //errors on this pin since it was last cleared (get_gpio_pin_error)
+} gpio_error_t;
+
+// The last error on the calling thread. Returns GPIO_E_NONE if there hasn't been one
+// since clear_gpio_last_error.
+extern int get_gpio_last_error(gpio_error_t* out);
+extern int clear_gpio_last_error();
+
+// The last error on a pin, from any thread, and how many errors the pin has had.
+extern int get_gpio_pin_error(int pin, gpio_error_t* out);
+extern int get_gpio_pin_error_n(char* pin_name, gpio_error_t* out);
+extern int clear_gpio_pin_error(int pin);
+
+extern const char* gpio_strerror(int code);
+
+// Every error is passed to a log function, which writes to stderr by default. Signature:
+// int foo(gpio_error_t err, char* message, void* arg)
+// A NULL func turns logging off. The function may be called from any thread, including
+// the callback manager's.
+extern int set_gpio_log_func(void* func, void* arg);
+
+// At most max_per_sec messages are logged per second (bursts of up to max_per_sec are
+// allowed), and an error repeating on the same pin is only logged once every dedup_ms.
+// Messages that are held back are counted and mentioned in the next one for that pin.
+// 0 for either disables that limit.
+extern int set_gpio_log_limits(int max_per_sec, int dedup_ms);
+
+#endif
@@ -4,10 +4,10 @@
  * best for you. Check LICENSE.GPL and LICENSE.BSD for more details.
  *
  * chip_gpio_pin_defs.h
- * Header file used to define pins in a way we can easily interpret. This file can be
- * edited to add, remove, or modify pins recognized by the library with relative ease.
- * Doing so should not break programs compiled against older versions of the library,
- * unless you remove a pin it relied upon.
+ * Header file used to define pins in a way we can easily interpret. The pins below are
+ * the library's built-in map of the CHIP. Other boards (or revisions) don't need a
+ * rebuilt library: describe their pins in a pin map file instead (see
+ * chip_gpio_pin_map.h and pinmaps/chip.ini).
  */
 
 #ifndef CHIP_GPIO_PIN_DEFS_H
@@ -20,7 +20,9 @@
 //Some definitions that detail what the CHIP pinout is like in a way we can interpret
 
 #define FIRST_PIN          1 // First pin is 1 since that's how it's labeled. 0 is
-#define NUM_PINS          80 // unused. Keep that in mind when using NUM_PINS.
+#define NUM_PINS gpio_num_pins // unused. Keep that in mind when using NUM_PINS.
+#define BUILTIN_NUM_PINS  80 // NUM_PINS comes from the loaded pin map; this is the
+                             // built-in map's
 #define U13_END           40
 #define U14_OFFSET        40 //These are the same now, but may not always be.
 
@@ -35,8 +37,11 @@
 #define LCD_U14_FIRST_PIN 27
 #define LCD_U14_LAST_PIN  38 //39, 40 is GND
 
+#define GPIO_CLASS_PATH "/sys/class/gpio"
 #define GPIO_SYSFS_PATH "/sys/class/gpio/gpio"
 #define GPIOCHIP_SYSFS_PATH "/sys/class/gpio/gpiochip"
+#define GPIO_EXPORT_PATH "/sys/class/gpio/export"
+#define GPIO_UNEXPORT_PATH "/sys/class/gpio/unexport"
 
 //If the multiplier of a pin is this, that means it's definitely not an R8 pin
 #define GPIO_UNUSED '\0'
@@ -98,8 +103,59 @@
 #define	    GPIO_CSID6	    37 + U14_OFFSET
 #define	    GPIO_CSID7	    38 + U14_OFFSET
 
-char* PIN_UNUSED;
-char* XIO_CHIP_LABEL;
+// The built-in map of the CHIP, as X(pin, name, R8 port, offset). The pin number is
+// GPIO_##pin (defined above). Pins with no R8 port (GPIO_UNUSED) are lines on the XIO
+// expander, the gpiochip labeled XIO_CHIP_LABEL.
+#define CHIP_GPIO_BUILTIN_PINS(X) \
+    X(LCD_D2,    "LCD-D2",    'D',          2) \
+    X(PWM0,      "PWM0",      'B',          2) \
+    X(LCD_D4,    "LCD-D4",    'D',          4) \
+    X(LCD_D3,    "LCD-D3",    'D',          3) \
+    X(LCD_D6,    "LCD-D6",    'D',          6) \
+    X(LCD_D5,    "LCD-D5",    'D',          5) \
+    X(LCD_D10,   "LCD-D10",   'D',         10) \
+    X(LCD_D7,    "LCD-D7",    'D',          7) \
+    X(LCD_D12,   "LCD-D12",   'D',         12) \
+    X(LCD_D11,   "LCD-D11",   'D',         11) \
+    X(LCD_D14,   "LCD-D14",   'D',         14) \
+    X(LCD_D13,   "LCD-D13",   'D',         13) \
+    X(LCD_D18,   "LCD-D18",   'D',         18) \
+    X(LCD_D15,   "LCD-D15",   'D',         15) \
+    X(LCD_D20,   "LCD-D20",   'D',         20) \
+    X(LCD_D19,   "LCD-D19",   'D',         19) \
+    X(LCD_D22,   "LCD-D22",   'D',         22) \
+    X(LCD_D21,   "LCD-D21",   'D',         21) \
+    X(LCD_CLK,   "LCD-CLK",   'D',         24) \
+    X(LCD_D23,   "LCD-D23",   'D',         23) \
+    X(LCD_VSYNC, "LCD-VSYNC", 'D',         27) \
+    X(LCD_HSYNC, "LCD-HSYNC", 'D',         26) \
+    X(LCD_DE,    "LCD-DE",    'D',         25) \
+    X(XIO_P0,    "XIO-P0",    GPIO_UNUSED,  0) \
+    X(XIO_P1,    "XIO-P1",    GPIO_UNUSED,  1) \
+    X(XIO_P2,    "XIO-P2",    GPIO_UNUSED,  2) \
+    X(XIO_P3,    "XIO-P3",    GPIO_UNUSED,  3) \
+    X(XIO_P4,    "XIO-P4",    GPIO_UNUSED,  4) \
+    X(XIO_P5,    "XIO-P5",    GPIO_UNUSED,  5) \
+    X(XIO_P6,    "XIO-P6",    GPIO_UNUSED,  6) \
+    X(XIO_P7,    "XIO-P7",    GPIO_UNUSED,  7) \
+    X(CSIPCK,    "CSIPCK",    'E',          0) \
+    X(CSICK,     "CSICK",     'E',          1) \
+    X(CSIHSYNC,  "CSIHSYNC",  'E',          2) \
+    X(CSIVSYNC,  "CSIVSYNC",  'E',          3) \
+    X(CSID0,     "CSID0",     'E',          4) \
+    X(CSID1,     "CSID1",     'E',          5) \
+    X(CSID2,     "CSID2",     'E',          6) \
+    X(CSID3,     "CSID3",     'E',          7) \
+    X(CSID4,     "CSID4",     'E',          8) \
+    X(CSID5,     "CSID5",     'E',          9) \
+    X(CSID6,     "CSID6",     'E',         10) \
+    X(CSID7,     "CSID7",     'E',         11)
+
+extern char* PIN_UNUSED;
+extern char* XIO_CHIP_LABEL;
+
+//Number of pins in the loaded pin map, not counting pin 0 (see NUM_PINS)
+extern int gpio_num_pins;
 
 //struct containing information to identify a gpio pin
 //see: goo.gl/vQLRuW (pages 18 to 20), goo.gl/1cGAZw
@@ -112,6 +168,10 @@ typedef struct
     void* func;
     void* arg;
     int hard_coded_kern_pin; //DEPRACATED; use function pointer instead
+    //Pins on another gpiochip (e.g. the XIO pins on the i2c expander) name the chip by
+    //its label; off is then the line on that chip. chip_base is found at init.
+    char* chip_label;
+    int chip_base;
 } pin_identifier_t;
 
 // There is a chance the kernel identifier for a pin may be calculated by an algorithm
@@ -124,118 +184,10 @@ typedef struct
 // number as #defined above. The argument arg is a void pointer you can set yourself.
 // Set p_ident[bar].func to the address of your function, and arg to a pointer leading to
 // any data you may need. Use a struct if you need arg to contain multiple variables.
+// The kernel number is looked up once and cached, so set func before opening the pin.
 
-pin_identifier_t p_ident[NUM_PINS+FIRST_PIN];
-
-//This is called in initialize_gpio_interface() before anything else
-static int initialize_gpio_pin_names()
-{
-    PIN_UNUSED = "DO NOT USE";
-    // this is the i2c chip handling the XIO pins
-    XIO_CHIP_LABEL = "pcf8574a"; // Currently, the CHIP uses this label to identify
-                                 // the correct directory containing the xio base
-                                 // number, so we just need to know this beforehand.
-
-    for (int i = 0; i < NUM_PINS+FIRST_PIN; i++)
-    {
-	//Unused pins will all have this info
-        p_ident[i].name = PIN_UNUSED;
-        p_ident[i].mult =  GPIO_UNUSED;
-        p_ident[i].off  = GPIO_ERR;
-        p_ident[i].func = NULL;
-        p_ident[i].arg = NULL;
-        p_ident[i].hard_coded_kern_pin = GPIO_ERR;
-    }
-	
-    // Here, we define the name (by which users of this library should access
-    // the pins by) and other identifying information. XIO pins should only
-    // need the name.
-    
-    //U13
-    p_ident[GPIO_LCD_D2].name        = "LCD-D2";
-        p_ident[GPIO_LCD_D2].mult    = 'D'; p_ident[GPIO_LCD_D2].off    =  2;
-    p_ident[GPIO_PWM0].name          = "PWM0";
-        p_ident[GPIO_PWM0].mult      = 'B'; p_ident[GPIO_PWM0].off      =  2;
-    p_ident[GPIO_LCD_D4].name        = "LCD-D4";
-        p_ident[GPIO_LCD_D4].mult    = 'D'; p_ident[GPIO_LCD_D4].off    =  4;
-    p_ident[GPIO_LCD_D3].name        = "LCD-D3";
-        p_ident[GPIO_LCD_D3].mult    = 'D'; p_ident[GPIO_LCD_D3].off    =  3;
-    p_ident[GPIO_LCD_D6].name        = "LCD-D6";
-        p_ident[GPIO_LCD_D6].mult    = 'D'; p_ident[GPIO_LCD_D6].off    =  6;
-    p_ident[GPIO_LCD_D5].name        = "LCD-D5";
-        p_ident[GPIO_LCD_D5].mult    = 'D'; p_ident[GPIO_LCD_D5].off    =  5;
-    p_ident[GPIO_LCD_D10].name       = "LCD-D10";
-        p_ident[GPIO_LCD_D10].mult   = 'D'; p_ident[GPIO_LCD_D10].off   = 10;
-    p_ident[GPIO_LCD_D7].name        = "LCD-D7";
-        p_ident[GPIO_LCD_D7].mult    = 'D'; p_ident[GPIO_LCD_D7].off    =  7;
-    p_ident[GPIO_LCD_D12].name       = "LCD-D12";
-        p_ident[GPIO_LCD_D12].mult   = 'D'; p_ident[GPIO_LCD_D12].off   = 12;
-    p_ident[GPIO_LCD_D11].name       = "LCD-D11";
-        p_ident[GPIO_LCD_D11].mult   = 'D'; p_ident[GPIO_LCD_D11].off   = 11;
-    p_ident[GPIO_LCD_D14].name       = "LCD-D14";
-        p_ident[GPIO_LCD_D14].mult   = 'D'; p_ident[GPIO_LCD_D14].off   = 14;
-    p_ident[GPIO_LCD_D13].name       = "LCD-D13";
-        p_ident[GPIO_LCD_D13].mult   = 'D'; p_ident[GPIO_LCD_D13].off   = 13;
-    p_ident[GPIO_LCD_D18].name       = "LCD-D18";
-        p_ident[GPIO_LCD_D18].mult   = 'D'; p_ident[GPIO_LCD_D18].off   = 18;
-    p_ident[GPIO_LCD_D15].name       = "LCD-D15";
-        p_ident[GPIO_LCD_D15].mult   = 'D'; p_ident[GPIO_LCD_D15].off   = 15;
-    p_ident[GPIO_LCD_D20].name       = "LCD-D20";
-        p_ident[GPIO_LCD_D20].mult   = 'D'; p_ident[GPIO_LCD_D20].off   = 20;
-    p_ident[GPIO_LCD_D19].name       = "LCD-D19";
-        p_ident[GPIO_LCD_D19].mult   = 'D'; p_ident[GPIO_LCD_D19].off   = 19;
-    p_ident[GPIO_LCD_D22].name       = "LCD-D22";
-        p_ident[GPIO_LCD_D22].mult   = 'D'; p_ident[GPIO_LCD_D22].off   = 22;
-    p_ident[GPIO_LCD_D21].name       = "LCD-D21";
-        p_ident[GPIO_LCD_D21].mult   = 'D'; p_ident[GPIO_LCD_D21].off   = 21;
-    p_ident[GPIO_LCD_CLK].name       = "LCD-CLK";
-        p_ident[GPIO_LCD_CLK].mult   = 'D'; p_ident[GPIO_LCD_CLK].off   = 24;
-    p_ident[GPIO_LCD_D23].name       = "LCD-D23";
-        p_ident[GPIO_LCD_D23].mult   = 'D'; p_ident[GPIO_LCD_D23].off   = 23;
-    p_ident[GPIO_LCD_VSYNC].name     = "LCD-VSYNC";
-        p_ident[GPIO_LCD_VSYNC].mult = 'D'; p_ident[GPIO_LCD_VSYNC].off = 27;
-    p_ident[GPIO_LCD_HSYNC].name     = "LCD-HSYNC";
-        p_ident[GPIO_LCD_HSYNC].mult = 'D'; p_ident[GPIO_LCD_HSYNC].off = 26;
-    p_ident[GPIO_LCD_DE].name        = "LCD-DE";
-        p_ident[GPIO_LCD_DE].mult    = 'D'; p_ident[GPIO_LCD_DE].off    = 25;
-
-    //U14
-    p_ident[GPIO_XIO_P0].name = "XIO-P0";
-    p_ident[GPIO_XIO_P1].name = "XIO-P1";
-    p_ident[GPIO_XIO_P2].name = "XIO-P2";
-    p_ident[GPIO_XIO_P3].name = "XIO-P3";
-    p_ident[GPIO_XIO_P4].name = "XIO-P4";
-    p_ident[GPIO_XIO_P5].name = "XIO-P5";
-    p_ident[GPIO_XIO_P6].name = "XIO-P6";
-    p_ident[GPIO_XIO_P7].name = "XIO-P7";
-	
-
-    p_ident[GPIO_CSIPCK].name       = "CSIPCK";
-        p_ident[GPIO_CSIPCK].mult   = 'E'; p_ident[GPIO_CSIPCK].off   =  0;
-    p_ident[GPIO_CSICK].name        = "CSICK";
-        p_ident[GPIO_CSICK].mult    = 'E'; p_ident[GPIO_CSICK].off    =  1;
-    p_ident[GPIO_CSIHSYNC].name     = "CSIHSYNC";
-        p_ident[GPIO_CSIHSYNC].mult = 'E'; p_ident[GPIO_CSIHSYNC].off =  2;
-    p_ident[GPIO_CSIVSYNC].name     = "CSIVSYNC";
-        p_ident[GPIO_CSIVSYNC].mult = 'E'; p_ident[GPIO_CSIVSYNC].off =  3;
-    p_ident[GPIO_CSID0].name        = "CSID0";
-        p_ident[GPIO_CSID0].mult    = 'E'; p_ident[GPIO_CSID0].off    =  4;
-    p_ident[GPIO_CSID1].name        = "CSID1";
-        p_ident[GPIO_CSID1].mult    = 'E'; p_ident[GPIO_CSID1].off    =  5;
-    p_ident[GPIO_CSID2].name        = "CSID2";
-        p_ident[GPIO_CSID2].mult    = 'E'; p_ident[GPIO_CSID2].off    =  6;
-    p_ident[GPIO_CSID3].name        = "CSID3";
-        p_ident[GPIO_CSID3].mult    = 'E'; p_ident[GPIO_CSID3].off    =  7;
-    p_ident[GPIO_CSID4].name        = "CSID4";
-        p_ident[GPIO_CSID4].mult    = 'E'; p_ident[GPIO_CSID4].off    =  8;
-    p_ident[GPIO_CSID5].name        = "CSID5";
-        p_ident[GPIO_CSID5].mult    = 'E'; p_ident[GPIO_CSID5].off    =  9;
-    p_ident[GPIO_CSID6].name        = "CSID6";
-        p_ident[GPIO_CSID6].mult    = 'E'; p_ident[GPIO_CSID6].off    = 10;
-    p_ident[GPIO_CSID7].name        = "CSID7";
-        p_ident[GPIO_CSID7].mult    = 'E'; p_ident[GPIO_CSID7].off    = 11;
-    
-    return 0;
-}
+// p_ident holds NUM_PINS+FIRST_PIN entries once initialize_gpio_interface() has loaded
+// the pin map.
+extern pin_identifier_t* p_ident;
 
 #endif
@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2017, Bryan Haley
+ * This code is dual licensed (GPLv2 and Simplified BSD). Use the license that works
+ * best for you. Check LICENSE.GPL and LICENSE.BSD for more details.
+ *
+ * chip_gpio_pin_map.h
+ * Interface for loading the pin map (pin numbers, names and how to find their kernel
+ * numbers) from a file at init instead of using the built-in map of the CHIP, so one
+ * library binary can serve every board revision.
+ *
+ * Pin maps are written as INI text (see pinmaps/chip.ini):
+ *
+ *   [pins]
+ *   ; name = pin number, where to find it
+ *   LCD-D2 = 17, PD2            ; R8/Allwinner port label (kernel number 32*3+2)
+ *   XIO-P0 = 53, chip:pcf8574a:0  ; line 0 of the gpiochip labelled pcf8574a
+ *   FAN    = 81, kern:1022      ; a fixed kernel number
+ *
+ * Text maps can be loaded directly, or compiled once (compile_gpio_pin_map, or the
+ * gpio_pinmap tool) into a binary index that is mmapped at load: names are looked up
+ * through a hash table stored in the file, so nothing is parsed on a warm start.
+ */
+
+#ifndef CHIP_GPIO_PIN_MAP_H
+#define CHIP_GPIO_PIN_MAP_H
+
+#define PIN_MAP_ENV "CHIP_GPIO_PIN_MAP" //used when load_gpio_pin_map wasn't called
+#define MAX_PIN_MAP_PINS 999 //pin numbers must stay below VIRTUAL_PIN_BASE
+
+// Load a pin map (text or compiled; the format is detected) to be used by the next
+// initialize_gpio_interface(). Passing NULL goes back to the built-in map.
+extern int load_gpio_pin_map(char* path);
+
+// Compile a text pin map into the binary index format.
+extern int compile_gpio_pin_map(char* ini_path, char* bin_path);
+
+// Number of pins in the loaded map (NUM_PINS), not counting pin 0.
+extern int get_gpio_num_pins();
+
+#endif
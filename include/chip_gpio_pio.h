@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2017, Bryan Haley
+ * This code is dual licensed (GPLv2 and Simplified BSD). Use the license that works
+ * best for you. Check LICENSE.GPL and LICENSE.BSD for more details.
+ *
+ * chip_gpio_pio.h
+ * Interface for reading and writing the R8's pins through its PIO registers instead of
+ * sysfs. The PIO block is mapped into the program (from /dev/mem, which needs root), so
+ * a read or write is a load or store rather than open/write/close on a value file.
+ *
+ * Only R8 pins are done this way; XIO pins, pins with a custom kernel number and pins
+ * whose port isn't muxed as a GPIO (their config field isn't input or output) keep
+ * using sysfs, and so do writes to pins whose config field isn't output (sysfs rejects
+ * those). Pins are still opened and have their direction set through sysfs, so the
+ * kernel muxes them and knows they're taken.
+ *
+ * Each port (A to I) has a data register holding one bit per pin. Writes load the whole
+ * register and store it back with their pin's bit changed, holding a lock per port, so
+ * writes to other pins of the same port (from other threads, or batches) aren't undone;
+ * set_gpio_vals changes every pin of a port it writes in a single store. The locks are
+ * only known to this process: other processes, and the kernel, writing the same port at
+ * the same time aren't covered by this.
+ *
+ * Instead of the hardware, a register image can be mapped from a regular file laid out
+ * like the PIO block (starting at GPIO_PIO_BASE), so the register handling can be tried
+ * and benchmarked on any machine. Writes through the image don't show up in the value
+ * files of a fake sysfs tree, and vice versa.
+ */
+
+#ifndef CHIP_GPIO_PIO_H
+#define CHIP_GPIO_PIO_H
+
+#define GPIO_PIO_DEV "/dev/mem"
+#define GPIO_PIO_BASE 0x01C20800 //physical address of the R8's PIO block
+#define GPIO_PIO_SIZE 0x400 //bytes mapped (and the size of an image file)
+#define GPIO_PIO_PORTS 9 //A to I
+#define GPIO_PIO_PORT_SIZE 0x24 //bytes of registers per port
+#define GPIO_PIO_CFG 0x00 //four config registers per port; 4 bits per pin, 8 pins each
+#define GPIO_PIO_DAT 0x10 //data register; bit n is pin n of the port
+#define GPIO_PIO_CFG_IN 0 //config field values of a pin muxed as a GPIO
+#define GPIO_PIO_CFG_OUT 1
+
+// Map the PIO block: from GPIO_PIO_DEV if path is NULL (or a character device), or
+// else a register image from the file at path, which is created (zeroed, so every pin
+// is an input) or extended to GPIO_PIO_SIZE bytes if needed. R8 pins are read and
+// written through it from then on. Fails if the registers are already mapped; call
+// disable_gpio_pio first to map others.
+extern int enable_gpio_pio(char* path);
+
+// Go back to sysfs for every pin. No other thread may be using the pins.
+// terminate_gpio_interface does this too.
+extern int disable_gpio_pio();
+
+extern int is_gpio_pio_enabled();
+
+// TRUE if pin is read and written through the PIO registers right now
+extern int is_gpio_pio_pin(int pin);
+extern int is_gpio_pio_pin_n(char* pin_name);
+
+#endif
@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2017, Bryan Haley
+ * This code is dual licensed (GPLv2 and Simplified BSD). Use the license that works
+ * best for you. Check LICENSE.GPL and LICENSE.BSD for more details.
+ *
+ * chip_gpio_probes.h
+ * Static (USDT) tracepoints used internally by libchipgpio, so bpftrace/perf/systemtap
+ * can be attached to a running program. Probes are built in whenever sys/sdt.h is
+ * available (unless CHIP_GPIO_NO_PROBES is defined); otherwise they compile to nothing.
+ * An unattached probe is a single nop, and every probe has a semaphore the tracer sets
+ * while attached, so arguments that cost something to compute are only computed then.
+ */
+
+#ifndef CHIP_GPIO_PROBES_H
+#define CHIP_GPIO_PROBES_H
+
+#if !defined(CHIP_GPIO_NO_PROBES) && defined(__has_include)
+    #if __has_include(<sys/sdt.h>)
+        #define CHIP_GPIO_PROBES 1
+    #endif
+#endif
+
+//Every probe in the library (provider "libchipgpio"):
+//  read_entry(pin)                      read_exit(pin, kern, value, duration_ns)
+//  write_entry(pin, value)              write_exit(pin, kern, value, duration_ns)
+//  set_dir_entry(pin, out)              set_dir_exit(pin, kern, out, duration_ns)
+//  open_entry(pin)                      open_exit(pin, kern, rc, duration_ns)
+//  close_entry(pin)                     close_exit(pin, kern, rc, duration_ns)
+//  poll_pass(pass, duration_ns)         change(pin, kern, value, window_ns)
+//  dispatch(pin, kern, value, latency_ns)
+//Exit probes report GPIO_ERR as the value/rc on failure.
+#define GPIO_PROBE_LIST(X) \
+    X(read_entry) X(read_exit) X(write_entry) X(write_exit) \
+    X(set_dir_entry) X(set_dir_exit) X(open_entry) X(open_exit) \
+    X(close_entry) X(close_exit) X(poll_pass) X(change) X(dispatch)
+
+#define GPIO_PROBE_SEMAPHORE(name) libchipgpio_##name##_semaphore
+#define DECLARE_GPIO_PROBE(name) extern unsigned short GPIO_PROBE_SEMAPHORE(name);
+
+#ifdef CHIP_GPIO_PROBES
+    #define _SDT_HAS_SEMAPHORES 1
+    #include <sys/sdt.h>
+
+    //the semaphores are defined once, in chip_gpio_stats.c
+    #define DEFINE_GPIO_PROBE(name) \
+        unsigned short GPIO_PROBE_SEMAPHORE(name) __attribute__((section(".probes")));
+    #define GPIO_PROBE_ENABLED(name) __builtin_expect(GPIO_PROBE_SEMAPHORE(name), 0)
+
+    #define GPIO_PROBE1(name, a) DTRACE_PROBE1(libchipgpio, name, a)
+    #define GPIO_PROBE2(name, a, b) DTRACE_PROBE2(libchipgpio, name, a, b)
+    #define GPIO_PROBE4(name, a, b, c, d) DTRACE_PROBE4(libchipgpio, name, a, b, c, d)
+#else
+    #define DEFINE_GPIO_PROBE(name)
+    #define GPIO_PROBE_ENABLED(name) 0
+
+    //the arguments are still used (so nothing is left unused) but never evaluated
+    #define GPIO_PROBE1(name, a) do { if (0) { (void) (a); } } while (0)
+    #define GPIO_PROBE2(name, a, b) do { if (0) { (void) (a); (void) (b); } } while (0)
+    #define GPIO_PROBE4(name, a, b, c, d) \
+        do { if (0) { (void) (a); (void) (b); (void) (c); (void) (d); } } while (0)
+#endif
+
+GPIO_PROBE_LIST(DECLARE_GPIO_PROBE)
+
+#endif
@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2017, Bryan Haley
+ * This code is dual licensed (GPLv2 and Simplified BSD). Use the license that works
+ * best for you. Check LICENSE.GPL and LICENSE.BSD for more details.
+ *
+ * chip_gpio_shift_register.h
+ * Interface for driving daisy-chained shift registers: 74HC595 (or similar) to add
+ * outputs, and 74HC165 (or similar) to add inputs.
+ */
+
+#ifndef CHIP_GPIO_SHIFT_REGISTER_H
+#define CHIP_GPIO_SHIFT_REGISTER_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define MAX_SHIFT_BYTES 32
+#define MAX_SHIFT_REGISTERS 4
+#define SHIFT_OUT 1 //74HC595: serial in, parallel out
+#define SHIFT_IN 0 //74HC165: parallel in, serial out
+
+// Virtual pins exposed by shift registers start here, well clear of any real pin
+#define VIRTUAL_PIN_BASE 1000
+
+typedef struct
+{
+    int data_pin; //SER on a 595, QH on a 165
+    int clock_pin; //SRCLK on a 595, CLK on a 165
+    int latch_pin; //RCLK on a 595, SH/LD on a 165
+    int dir;
+    int num_bytes;
+    uint8_t buffer[MAX_SHIFT_BYTES]; //what the chain currently holds
+    int buffer_valid; //bool; false until the chain has been written or read once
+    int data_level; //level the data pin was last driven to (outputs only)
+
+    //background refresh and virtual pins
+    pthread_mutex_t lock;
+    pthread_t refresh_thread;
+    int refreshing; //bool indicating if the refresh thread is running (under lock)
+    int users; //virtual pin accesses in progress, which destroy waits for
+    int refresh_us;
+    uint8_t pending[MAX_SHIFT_BYTES]; //bits written to virtual pins, not yet shifted
+    int first_virtual_pin; //GPIO_ERR if the chain isn't mapped to virtual pins
+} shift_register_t;
+
+// buffer[0] is the register closest to the CHIP; bit 0 of a byte is its Q0/A pin.
+extern shift_register_t* create_shift_register(int data_pin, int clock_pin,
+                                               int latch_pin, int num_bytes, int dir);
+extern int setup_shift_register(shift_register_t* sr);
+
+// Shift a whole chain out (595) or in (165). Writing the same buffer twice in a row
+// doesn't shift anything.
+extern int shift_register_write(shift_register_t* sr, const uint8_t* buf);
+extern int shift_register_read(shift_register_t* sr, uint8_t* buf);
+
+// Map every bit of the chain to a pin number usable with set_gpio_val, read_gpio_val
+// and toggle_gpio_val. Returns the first pin number.
+extern int map_shift_register_pins(shift_register_t* sr);
+
+// Shift pending virtual pin writes out (or refresh inputs) every interval_us on a
+// background thread instead of on every virtual pin access.
+extern int start_shift_register_refresh(shift_register_t* sr, int interval_us);
+extern int stop_shift_register_refresh(shift_register_t* sr);
+
+// Virtual pin reads and writes in progress on other threads are waited for, and later
+// ones fail. The chain must not be used through sr by any other thread meanwhile.
+extern int destroy_shift_register(shift_register_t* sr);
+
+#endif
@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2017, Bryan Haley
+ * This code is dual licensed (GPLv2 and Simplified BSD). Use the license that works
+ * best for you. Check LICENSE.GPL and LICENSE.BSD for more details.
+ *
+ * chip_gpio_stats.h
+ * Interface for reading the counters libchipgpio keeps on every pin operation and on
+ * the callback manager's polling thread. Counters are always on; they are relaxed
+ * atomic adds and cost next to nothing compared to the sysfs accesses they count.
+ */
+
+#ifndef CHIP_GPIO_STATS_H
+#define CHIP_GPIO_STATS_H
+
+#include <stdint.h>
+
+//operation types counted for every pin
+#define GPIO_STAT_READ 0 //read_gpio_val
+#define GPIO_STAT_WRITE 1 //set_gpio_val
+#define GPIO_STAT_SET_DIR 2 //set_gpio_dir
+#define GPIO_STAT_GET_DIR 3 //get_gpio_dir
+#define GPIO_STAT_OPEN 4 //open_gpio_pin
+#define GPIO_STAT_CLOSE 5 //close_gpio_pin
+#define GPIO_STAT_NUM_OPS 6
+
+typedef struct
+{
+    uint64_t count; //calls, including failed ones
+    uint64_t errors; //calls that returned an error
+    uint64_t syscalls; //open/read/write/close calls made on behalf of this operation
+    uint64_t time_ns; //cumulative time spent in this operation
+} gpio_op_stats_t;
+
+typedef struct
+{
+    int pin;
+    gpio_op_stats_t op[GPIO_STAT_NUM_OPS]; //indexed by GPIO_STAT_*
+    uint64_t events; //value changes seen by the callback manager
+    uint64_t events_dropped; //polls that failed, so any change in between was lost
+} gpio_pin_stats_t;
+
+typedef struct
+{
+    gpio_op_stats_t op[GPIO_STAT_NUM_OPS]; //totals over every pin
+    uint64_t poll_passes; //passes the callback manager made over the watched pins
+    uint64_t poll_time_ns; //cumulative time spent in those passes (excluding the delay)
+    uint64_t events;
+    uint64_t events_dropped;
+} gpio_stats_t;
+
+// Copy out the library-wide totals. Each counter is read atomically, but counters may
+// be updated between reads of different counters.
+extern int get_gpio_stats(gpio_stats_t* out);
+
+extern int get_gpio_pin_stats(int pin, gpio_pin_stats_t* out);
+extern int get_gpio_pin_stats_n(char* pin_name, gpio_pin_stats_t* out);
+
+// Zero every counter. Operations running at the same time may or may not be counted.
+extern int reset_gpio_stats();
+
+#endif
@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2017, Bryan Haley
+ * This code is dual licensed (GPLv2 and Simplified BSD). Use the license that works
+ * best for you. Check LICENSE.GPL and LICENSE.BSD for more details.
+ *
+ * chip_gpio_stepper.h
+ * Interface for driving stepper motors through STEP/DIR drivers (A4988, DRV8825, etc).
+ * Moves are precomputed into a schedule of step times, then emitted on a dedicated
+ * thread against absolute deadlines so that several axes step in sync.
+ */
+
+#ifndef CHIP_GPIO_STEPPER_H
+#define CHIP_GPIO_STEPPER_H
+
+#include <stdint.h>
+
+#define MAX_STEPPER_AXES 8
+#define MAX_STEPPER_MOVE_STEPS 1048576 //steps one move can schedule, all axes together
+#define STEPPER_PROFILE_TRAPEZOID 0
+#define STEPPER_PROFILE_S_CURVE 1
+
+typedef struct
+{
+    int running; //bool indicating if a move is being emitted
+    int num_axes;
+    int64_t position[MAX_STEPPER_AXES]; //absolute position of each axis, in steps
+    uint64_t steps_done; //step events emitted so far in the current/last move
+    uint64_t steps_total; //step events scheduled for the current/last move
+    int failed; //bool indicating if the current/last move stopped on a pin write error
+} stepper_status_t;
+
+//how far behind their deadlines step events were emitted in the current/last move
+typedef struct
+{
+    uint64_t events;
+    int64_t max_late_ns;
+    int64_t mean_late_ns;
+} stepper_timing_t;
+
+// Add an axis driven by step_pin and dir_pin. Both pins are set up as outputs.
+// Returns the axis number (0 or higher).
+extern int add_stepper_axis(int step_pin, int dir_pin);
+extern int add_stepper_axis_n(char* step_pin_name, char* dir_pin_name);
+
+// Speed is in steps per second and acceleration in steps per second squared, and
+// apply to the axis travelling furthest in a move; the other axes are scaled to match.
+// accel is the most either profile accelerates by, so an S-curve ramps up over 1.5
+// times as long as a trapezoid does.
+extern int set_stepper_profile(int profile, double max_speed, double accel);
+extern int set_stepper_pulse_width(int pulse_width_us);
+
+// Run the emitting thread with SCHED_FIFO at rt_priority (1-99). 0 uses the normal
+// scheduler. Falls back to the normal scheduler if not permitted (e.g. not root).
+extern int set_stepper_priority(int rt_priority);
+
+// Start a move; steps holds a signed, relative step count for each axis. Returns as soon
+// as the move has been scheduled. Moves of more than MAX_STEPPER_MOVE_STEPS steps (summed
+// over the axes) are refused; split them up.
+extern int move_steppers(const int64_t* steps);
+extern int move_stepper(int axis, int64_t steps);
+
+// Returns GPIO_ERR if the move stopped because a STEP pin couldn't be written.
+extern int wait_for_steppers();
+extern int stop_steppers();
+
+// None of these take a lock; they are safe to call while a move is running.
+extern int get_stepper_status(stepper_status_t* out);
+extern int64_t get_stepper_position(int axis);
+extern int get_stepper_timing(stepper_timing_t* out);
+
+// Stops any move and forgets every axis. Does not close the pins.
+extern int terminate_steppers();
+
+#endif
@@ -13,18 +13,214 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <sched.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "chip_gpio_error.h"
 
 #define GPIO_OPEN_FD 0
 #define GPIO_CLOSE_FD 1
 #define BASE_NUM_MAX_DIGITS 5
+#define NS_PER_SEC 1000000000LL
+#define NS_PER_US 1000LL
+#define KERN_NUM_MAX_DIGITS 11 //including a minus sign
+#define CACHE_LINE_SIZE 64
+#define PIN_LOCK_SPINS 64 //tries before a thread waiting for a pin sleeps on a futex
 
-//XIO GPIO pins start at an unknown base number
-/* static */ int xiopin_base;
-//Store pointers for gpio export and unexport files here
-//  At one point, it was planned to store file descriptors for GPIO value files in this
-//  array for performance considerations; however I have since changed this.
-static int pin_fd[GPIO_CLOSE_FD+1];
-static unsigned char* is_pin_open;
+//XIO GPIO pins start at an unknown base number; found by initialize_gpio_interface
+//(the export/unexport fds and which pins are open are kept in chip_gpio_oc.c)
+extern int xiopin_base;
+//Prepended to every sysfs path; empty unless set_gpio_sysfs_root was called
+extern char gpio_sysfs_root[];
+
+// Everything needed to access a pin, worked out once by resolve_pin_cache (when the pin
+// is opened, or the first time it's used) so the rw functions don't have to find the
+// kernel number or build paths on every call. One pin per cache line, so threads using
+// different pins don't share any.
+//  Paths that are replaced (when a pin's kernel number changes) are kept until the pin
+//  cache is freed, so a path read by one thread stays valid while another re-resolves.
+typedef struct
+{
+    unsigned seq; //sequence (see lock_pin_cache); odd while the pin is being changed
+    int kern; //kernel number, or GPIO_ERR until resolved
+    int kern_str_len;
+    char kern_str[KERN_NUM_MAX_DIGITS+1]; //what gets written to export/unexport
+    char* value_path;
+    char* direction_path;
+    int shadow; //last value written to the pin as an output, or GPIO_ERR if unknown
+    int value_fd; //kept open for batches (chip_gpio_batch.c), or GPIO_ERR
+    int fd_readers; //batch reads using value_fd, which isn't closed until they're done
+    unsigned char open; //bool; exported by this program (for autoclose)
+    unsigned next_ticket; //lock_pin_cache hands the pin out in turn
+    unsigned now_serving; //also the futex waiters sleep on
+} __attribute__((aligned(CACHE_LINE_SIZE))) pin_cache_t;
+
+//NUM_PINS+FIRST_PIN entries, allocated by initialize_gpio_interface
+extern pin_cache_t* pin_cache;
+extern int resolve_pin_cache(int pin);
+
+//Output shadows (see set_gpio_shadow_mode); the mode lives in chip_gpio_rw.c
+extern int gpio_shadow_mode;
+
+static inline int get_gpio_shadow(pin_cache_t* c)
+{ return __atomic_load_n(&c->shadow, __ATOMIC_RELAXED); }
+
+static inline void set_gpio_shadow(pin_cache_t* c, int val)
+{ __atomic_store_n(&c->shadow, val, __ATOMIC_RELAXED); }
+
+// Per-pin sequence lock. Whatever changes a pin (writing its value, setting its
+// direction, opening, closing or re-resolving it) holds its lock, so changes to one pin
+// happen one at a time, in the order they asked for it, while other pins never wait.
+// Readers don't take it or wait for it: they note the sequence before reading and
+// check it afterwards if they need to know the pin didn't change in between.
+//  A waiter spins briefly (a shadow hit or a register store is over in nanoseconds),
+//  then sleeps on now_serving, as the holder is most likely in a sysfs syscall.
+static inline void lock_pin_cache(pin_cache_t* c)
+{
+    unsigned ticket = __atomic_fetch_add(&c->next_ticket, 1, __ATOMIC_SEQ_CST);
+    unsigned serving = 0;
+
+    for (int spins = 0; (serving = __atomic_load_n(&c->now_serving, __ATOMIC_ACQUIRE))
+                        != ticket; spins++)
+    {
+        //returns straight away if now_serving has moved on since it was read
+        if (spins >= PIN_LOCK_SPINS)
+        {
+            syscall(SYS_futex, &c->now_serving, FUTEX_WAIT_PRIVATE, serving, NULL, NULL,
+                    0);
+        }
+    }
+
+    __atomic_store_n(&c->seq, c->seq+1, __ATOMIC_RELAXED);
+    //readers must see the sequence change before anything the holder writes
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void unlock_pin_cache(pin_cache_t* c)
+{
+    unsigned serving = 0;
+
+    __atomic_store_n(&c->seq, c->seq+1, __ATOMIC_RELEASE);
+    serving = __atomic_add_fetch(&c->now_serving, 1, __ATOMIC_SEQ_CST);
+
+    //only a pin somebody is queued for costs a syscall; the waiters all wake and check
+    //their tickets, as there's no telling which of them went to sleep
+    if (__atomic_load_n(&c->next_ticket, __ATOMIC_SEQ_CST) != serving)
+    { syscall(SYS_futex, &c->now_serving, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0); }
+}
+
+//Sequence to check a read against; odd if the pin is being changed right now
+static inline unsigned read_pin_cache_begin(pin_cache_t* c)
+{
+    return __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+}
+
+//TRUE if the pin was being changed, or changed, since read_pin_cache_begin returned seq
+static inline int read_pin_cache_changed(pin_cache_t* c, unsigned seq)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return (seq & 1) || __atomic_load_n(&c->seq, __ATOMIC_RELAXED) != seq;
+}
+
+//Paths and kernel number, which only change with the pin's lock held
+static inline char* get_pin_value_path(pin_cache_t* c)
+{ return __atomic_load_n(&c->value_path, __ATOMIC_ACQUIRE); }
+
+static inline char* get_pin_direction_path(pin_cache_t* c)
+{ return __atomic_load_n(&c->direction_path, __ATOMIC_ACQUIRE); }
+
+static inline int get_pin_kern(pin_cache_t* c)
+{ return __atomic_load_n(&c->kern, __ATOMIC_ACQUIRE); }
+
+//Open flag, set and cleared with the pin's lock held
+static inline int is_pin_cache_open(pin_cache_t* c)
+{ return __atomic_load_n(&c->open, __ATOMIC_ACQUIRE); }
+
+static inline void set_pin_cache_open(pin_cache_t* c, int open)
+{ __atomic_store_n(&c->open, (unsigned char) open, __ATOMIC_RELEASE); }
+
+//Pin map lookups, implemented in chip_gpio_pin_map.c
+extern int initialize_gpio_pin_names();
+extern int find_gpio_pin(char* name);
+
+//Hooks invoked by the callback manager's polling thread on every pass. poll_encoders
+//samples the encoders attached to the manager and returns how many moved, which counts
+//as activity for adaptive polling. detach_encoders removes a manager's encoders before
+//it's freed.
+struct gpio_cb_manager;
+extern int poll_encoders(struct gpio_cb_manager* m);
+extern void detach_encoders(struct gpio_cb_manager* m);
+
+//The callback worker pool (chip_gpio_callback_pool.c); every callback manager has one,
+//created by get_callback_pool. queue_callback returns GPIO_ERR if there are no workers,
+//in which case the polling thread runs the callback itself. invoke_callback (in the
+//callback manager) runs one and records it.
+typedef struct callback_pool callback_pool_t;
+extern callback_pool_t* get_callback_pool(struct gpio_cb_manager* m);
+extern callback_pool_t* create_callback_pool(struct gpio_cb_manager* manager);
+extern void destroy_callback_pool(callback_pool_t* pool);
+extern int init_callback_pool(callback_pool_t* pool, int num_pins);
+extern int start_callback_pool(callback_pool_t* pool);
+extern void free_callback_pool(callback_pool_t* pool);
+extern int queue_callback(callback_pool_t* pool, int pin, int new_val, void* func,
+                          void* arg, long long detected_ns);
+extern void discard_callbacks(callback_pool_t* pool, int pin, int wait);
+extern void record_callback_run(callback_pool_t* pool, int pin, long long ns);
+extern void invoke_callback(struct gpio_cb_manager* m, int pin, int new_val, void* func,
+                            void* arg, long long detected_ns);
+
+//Hooks invoked by the rw functions for pins at or above VIRTUAL_PIN_BASE
+extern int set_virtual_gpio_val(int pin, int val);
+extern int read_virtual_gpio_val(int pin);
+
+//Client mode (chip_gpio_broker.h): while gpio_broker_fd is a socket, the rw and oc
+//functions pass pins on to the broker instead of touching sysfs
+extern int gpio_broker_fd;
+extern int broker_open_gpio_pin(int pin);
+extern int broker_close_gpio_pin(int pin);
+extern int broker_is_gpio_pin_open(int pin);
+extern int broker_set_gpio_dir(int pin, int out);
+extern int broker_get_gpio_dir(int pin);
+extern int broker_set_gpio_val(int pin, int val);
+extern int broker_read_gpio_val(int pin);
+
+//PIO registers (chip_gpio_pio.h): while gpio_pio_regs is mapped, R8 pins muxed as GPIOs
+//are read and written through their port's data register. get_pio_data_reg returns the
+//register and sets the pin's bit, or returns NULL for pins that go through sysfs (for a
+//write, that's every pin whose config field doesn't say output).
+extern volatile uint32_t* gpio_pio_regs;
+extern volatile uint32_t* get_pio_data_reg(int pin, pin_cache_t* c, int write,
+                                           uint32_t* bit);
+
+//Set and clear bits of a port's data register with a plain load and store, under the
+//port's lock in this process, so other pins of the port written by other threads at the
+//same time keep their values. (Exclusive loads and stores, which an atomic
+//compare-and-swap needs, may never succeed on the Device memory of the mapping.)
+extern void write_pio_data(volatile uint32_t* reg, uint32_t set, uint32_t clear);
+
+static inline int read_pio_data(volatile uint32_t* reg, uint32_t bit)
+{ return (__atomic_load_n(reg, __ATOMIC_ACQUIRE) & bit) != 0; }
+
+//Hooks for the value fds kept open by batches (chip_gpio_batch.c), which must be let go
+//of when a pin is closed or reopened (with its lock held), and when the interface is
+//terminated
+extern void release_gpio_batch_fd(int pin);
+extern void free_gpio_batch();
+
+//Hooks used to record into the counters in chip_gpio_stats.h. record_gpio_op returns rc;
+//record_gpio_op_ns is the same for an op that has already been timed.
+extern int record_gpio_op(int pin, int op, long long start_ns, int syscalls, int rc);
+extern int record_gpio_op_ns(int pin, int op, long long ns, int syscalls, int rc);
+extern void record_gpio_poll_pass(long long start_ns);
+extern void record_gpio_event(int pin, int dropped);
+
+//Record an error (GPIO_E_* from chip_gpio_error.h) and pass it on to the log function.
+//Returns GPIO_ERR.
+extern int report_gpio_error(int code, int pin, int pin_kern, int sys_errno);
 
 /* Taken from http://stackoverflow.com/questions/1068849/how-do-i-determine-the-number-of-digits-of-an-integer-in-c */
 // Quick method to determine the number of digits in an int
@@ -42,6 +238,14 @@ static inline int num_places (int n)
     return 10;
 }
 
+//Monotonic timestamp in nanoseconds, used to time pin changes
+static inline long long get_time_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec*NS_PER_SEC + ts.tv_nsec;
+}
+
 //find chip-assigned number from Allwinner label
 static inline int decode_r8_pin(char multiple, int offset)
 {
@@ -59,11 +263,8 @@ static inline int get_kern_num(int pin) //U14 pins = label number + U14_OFFSET
     //if -1 gets returned, an error occured
     int pin_kern = GPIO_ERR;
 	
-    if (pin < FIRST_PIN || pin > NUM_PINS+FIRST_PIN)
-    {
-        fprintf(stderr, "Tried to access non-existant pin %d\n", pin);
-        return GPIO_ERR;
-    }
+    if (pin < FIRST_PIN || pin >= NUM_PINS+FIRST_PIN)
+    { return report_gpio_error(GPIO_E_NO_PIN, pin, GPIO_ERR, 0); }
     
     //  CHIP creates directories for GPIO files based on a number assigned to each
     //  GPIO pin. For XIO pins, the number is the offset from the first XIO pin
@@ -87,9 +288,13 @@ static inline int get_kern_num(int pin) //U14 pins = label number + U14_OFFSET
     }
 
     //Reference: https://docs.getchip.com/chip.html#gpio
-    if (pin >= XIO_U14_FIRST_PIN_ALL && pin <= XIO_U14_LAST_PIN_ALL)
+    //Pins on another gpiochip (the XIO pins) are offsets from that chip's base number
+    else if (p_ident[pin].chip_label)
     {
-        pin_kern = get_gpio_xio_base()+(pin-U14_OFFSET)-XIO_U14_FIRST_PIN;
+        if (p_ident[pin].chip_base >= GPIO_OK)
+        { pin_kern = p_ident[pin].chip_base+p_ident[pin].off; }
+        else
+        { report_gpio_error(GPIO_E_NO_KERN_NUM, pin, GPIO_ERR, 0); }
     }
     
     //Kernel pin number CAN be hard coded, but this is not recommended
@@ -106,26 +311,11 @@ static inline int get_kern_num(int pin) //U14 pins = label number + U14_OFFSET
     }
 
     else
-    {
-        fprintf(stderr, "Could not identify kernel-assigned identifier for pin %d\n", pin);
-    }
+    { report_gpio_error(GPIO_E_NO_KERN_NUM, pin, GPIO_ERR, 0); }
     
     return pin_kern;
 }
 
-//convert kernel pin number to a string
-static inline char* get_kern_num_str(int pin)
-{
-    int pin_kern = get_kern_num(pin);
-    int pin_kern_len = num_places(pin_kern)+1;
-    //create a buffer of the number of digits in pin_kern + a null terminator
-    char* pin_str = (char*) calloc(pin_kern_len, sizeof(char));
-    snprintf(pin_str, pin_kern_len, "%d", pin_kern);
-
-    //it's your responsibility to free this when it's returned to you
-    return pin_str;
-}
-
 //get the full path to a gpio file using its chip-assigned number
 static inline char* get_gpio_related_path(char* dir, int kern_pin, char* file)
 {
@@ -136,15 +326,27 @@ static inline char* get_gpio_related_path(char* dir, int kern_pin, char* file)
     snprintf(pin_str, pin_str_len, "%d", kern_pin);
 
     //concat a string that leads to the value file for the gpio pin
-    pin_path_full_len = strlen(dir)+strlen(pin_str)+strlen(file)+1;
+    pin_path_full_len = strlen(gpio_sysfs_root)+strlen(dir)+strlen(pin_str)+strlen(file)+1;
     char* pin_path_full = (char*) calloc(pin_path_full_len, sizeof(char));
     
     //this is way better than using strncpy
-    snprintf(pin_path_full, pin_path_full_len, "%s%s%s", dir, pin_str, file);
+    snprintf(pin_path_full, pin_path_full_len, "%s%s%s%s",
+             gpio_sysfs_root, dir, pin_str, file);
 
     return pin_path_full;
 }
 
+//Get the full path to a file in the gpio class directory (e.g. export)
+static inline char* get_sysfs_path(char* path)
+{
+    int path_full_len = strlen(gpio_sysfs_root)+strlen(path)+1;
+    char* path_full = (char*) calloc(path_full_len, sizeof(char));
+    snprintf(path_full, path_full_len, "%s%s", gpio_sysfs_root, path);
+
+    //it's your responsibility to free this when it's returned to you
+    return path_full;
+}
+
 //Convenience function for accessing files in GPIO pin directories
 static inline char* get_gpio_path(int kern_pin, char* file)
 {
@@ -157,23 +359,15 @@ static inline char* get_gpiochip_path(int kern_pin, char* file)
     return get_gpio_related_path(GPIOCHIP_SYSFS_PATH, kern_pin, file);
 }
 
+//Exact match against the names in the loaded pin map (see chip_gpio_pin_map.c)
 static inline int get_pin_from_name(char* name)
 {
-    //Compare name to list defined in xio_pin_defs.h
-    int pin = GPIO_ERR;
-
-    for (int i = FIRST_PIN; i < NUM_PINS+FIRST_PIN; i++)
-    {
-        if (strncmp(name, p_ident[i].name, strlen(name)) == GPIO_OK)
-        { pin = i; }
-    }
-
-    return pin;
+    return find_gpio_pin(name);
 }
 
 static inline int does_pin_exist(int pin)
 {
-    if (pin < FIRST_PIN || pin > NUM_PINS+FIRST_PIN)
+    if (pin < FIRST_PIN || pin >= NUM_PINS+FIRST_PIN)
     { return 0; } //pin does not exist
 
     return 1; //pin exists
@@ -184,10 +378,7 @@ static inline int does_pin_exist(int pin)
 static inline int check_if_pin_exists(int pin)
 {
     if (!does_pin_exist(pin))
-    {
-        fprintf(stderr, "Pin %d does not exist.", pin);
-        return GPIO_ERR; //pin does not exist
-    }
+    { return report_gpio_error(GPIO_E_NO_PIN, pin, GPIO_ERR, 0); } //pin does not exist
 
     return GPIO_OK; //pin exists
 }
@@ -196,12 +387,33 @@ static inline int check_if_pin_exists(int pin)
 static inline int is_valid_value(int val, int pin)
 {
     if (val < GPIO_PIN_LOW || val > GPIO_PIN_HIGH)
+    { return report_gpio_error(GPIO_E_BAD_VALUE, pin, GPIO_ERR, 0); }
+
+    return GPIO_OK;
+}
+
+// The pin's cache entry, resolved first if it hasn't been. Returns NULL (after reporting
+// why) if the pin doesn't exist or has no kernel number.
+static inline pin_cache_t* get_pin_cache(int pin)
+{
+    if (!does_pin_exist(pin) || pin_cache == NULL)
     {
-        fprintf(stderr, "Invalid pin (%d) value: %d", pin, val);
-        return GPIO_ERR;
+        report_gpio_error(GPIO_E_NO_PIN, pin, GPIO_ERR, 0);
+        return NULL;
     }
 
-    return GPIO_OK;
+    if (__atomic_load_n(&pin_cache[pin].kern, __ATOMIC_ACQUIRE) < GPIO_OK &&
+        resolve_pin_cache(pin) < GPIO_OK)
+    { return NULL; }
+
+    return &pin_cache[pin];
+}
+
+//Kernel number if the pin has been resolved, without resolving it (for the probes)
+static inline int get_cached_kern_num(int pin)
+{
+    if (!does_pin_exist(pin) || pin_cache == NULL) { return GPIO_ERR; }
+    return __atomic_load_n(&pin_cache[pin].kern, __ATOMIC_ACQUIRE);
 }
 
 #endif
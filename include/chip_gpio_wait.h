@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2017, Bryan Haley
+ * This code is dual licensed (GPLv2 and Simplified BSD). Use the license that works
+ * best for you. Check LICENSE.GPL and LICENSE.BSD for more details.
+ *
+ * chip_gpio_wait.h
+ * Interface for blocking until a pin changes, without the callback manager. A waiter
+ * sleeps in the kernel until one of its pins has an edge or the timeout passes, so it
+ * costs no CPU while blocked.
+ *
+ * How a pin is waited on depends on what it can do:
+ *  - Pins whose sysfs "edge" file can be set (the R8's interrupt capable pins) are
+ *    waited on with poll() on their value files.
+ *  - Value files that aren't in sysfs (a fake tree, see set_gpio_sysfs_root) are
+ *    watched with inotify.
+ *  - Anything else (pins that can't interrupt, virtual pins, broker clients) is read
+ *    every GPIO_WAIT_SAMPLE_NS while waited on.
+ * Edges are found by comparing each read with the last one, so a pulse shorter than
+ * the time it takes to wake up and read the pin may be missed.
+ *
+ * The edge file of a pin is left set to "both" after a wait; closing the pin resets it.
+ * Waits should be removed before their pins are closed.
+ */
+
+#ifndef CHIP_GPIO_WAIT_H
+#define CHIP_GPIO_WAIT_H
+
+#include <stdint.h>
+
+#define GPIO_EDGE_RISING 1
+#define GPIO_EDGE_FALLING 2
+#define GPIO_EDGE_BOTH (GPIO_EDGE_RISING | GPIO_EDGE_FALLING)
+#define GPIO_WAIT_FOREVER -1
+#define GPIO_WAIT_SAMPLE_NS 1000000LL //how often pins that can't be waited on are read
+#define MAX_GPIO_WAITS 64 //pins per waiter
+
+typedef struct
+{
+    int pin;
+    int new_val;
+    int64_t time_ns; //CLOCK_MONOTONIC timestamp of the read that saw the edge
+} gpio_edge_t;
+
+typedef struct gpio_waiter gpio_waiter_t;
+
+// Block until pin has one of edges (GPIO_EDGE_*) or timeout_ns passes (GPIO_WAIT_FOREVER
+// waits for good). Returns 1 and fills in edge (which may be NULL) if there was one, 0
+// on timeout.
+extern int wait_for_gpio_edge(int pin, int edges, int64_t timeout_ns, gpio_edge_t* edge);
+extern int wait_for_gpio_edge_n(char* pin_name, int edges, int64_t timeout_ns,
+                                gpio_edge_t* edge);
+
+// The same for any of n pins; edge->pin says which one it was.
+extern int wait_for_any_gpio_edge(int* pins, int* edges, int n, int64_t timeout_ns,
+                                  gpio_edge_t* edge);
+
+// Waiters keep their pins set up between waits, and can be driven by an event loop:
+// add pins, poll (or select/epoll) the waiter's fd for readability, and take the edges
+// with read_gpio_waiter_edges when it becomes readable. A waiter must only be used by
+// one thread at a time.
+extern gpio_waiter_t* create_gpio_waiter();
+extern int free_gpio_waiter(gpio_waiter_t* waiter);
+
+extern int add_gpio_wait(gpio_waiter_t* waiter, int pin, int edges);
+extern int add_gpio_wait_n(gpio_waiter_t* waiter, char* pin_name, int edges);
+
+extern int remove_gpio_wait(gpio_waiter_t* waiter, int pin);
+extern int remove_gpio_wait_n(gpio_waiter_t* waiter, char* pin_name);
+
+extern int get_gpio_waiter_fd(gpio_waiter_t* waiter);
+
+// Take up to max edges without blocking. Returns how many were taken; if that's max,
+// more may be ready, so call it again before waiting on the fd.
+extern int read_gpio_waiter_edges(gpio_waiter_t* waiter, gpio_edge_t* edges, int max);
+
+// Block until there's at least one edge or timeout_ns passes, then take up to max.
+// Returns how many were taken (0 on timeout).
+extern int wait_gpio_waiter(gpio_waiter_t* waiter, int64_t timeout_ns, gpio_edge_t* edges,
+                            int max);
+
+#endif
@@ -0,0 +1,1554 @@
+/*
+ * Copyright (c) 2017, Bryan Haley
+ * This code is dual licensed (GPLv2 and Simplified BSD). Use the license that works
+ * best for you. Check LICENSE.GPL and LICENSE.BSD for more details.
+ *
+ * bench.c
+ * Benchmarks every operation in the chip_gpio.h interface, plus callback latency, edge
+ * waits and the bus and shift register drivers. Everything runs against a fake sysfs
+ * tree built in a temporary directory (see set_gpio_sysfs_root), so no CHIP or root is
+ * needed; the numbers measure the library's own overhead rather than the GPIO hardware.
+ *
+ * Usage: bench_gpio [-n iterations] [-j results.json] [-t threads]
+ *   -j writes the results as JSON ("-" for stdout) so they can be compared across
+ *   library versions.
+ *
+ * Some results are checked as well as timed (the callback histograms against edges
+ * injected at known times, toggles of a shared pin from several threads, and the PIO
+ * register image). Exits with 1 if a check fails, after showing what the library
+ * reported on stderr during the run.
+ */
+
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "chip_gpio.h"
+#include "chip_gpio_callback_manager.h"
+#include "chip_gpio_bus.h"
+#include "chip_gpio_shift_register.h"
+#include "chip_gpio_stats.h"
+#include "chip_gpio_batch.h"
+#include "chip_gpio_wait.h"
+#include "chip_gpio_pio.h"
+
+#define FAKE_XIO_BASE 1013 //what the CHIP's 4.4 kernel uses
+#define FAKE_R8_PINS 192 //ports A to F
+#define DEFAULT_ITERATIONS 10000
+#define MAX_RESULTS 64
+#define CALLBACK_TIMEOUT_NS 1000000000LL
+#define NS_PER_SEC 1000000000LL
+#define BATCH_PINS 16
+#define SETUP_PINS 8
+#define BENCH_MANAGERS 2 //callback managers the fan-out pins are split between
+#define MANAGER_SHARED_DELAY_US 50 //their polling delay when they have to share a CPU
+#define WAIT_TIMEOUT_NS 20000000LL
+#define WAIT_TIMEOUTS 10
+#define HOG_CALLBACK_NS 500000LL //how long the hogging callback takes
+#define POLL_MODES 4 //busy, fixed delay, adaptive up to two slow intervals
+#define POLL_WORKLOADS 2 //idle, bursts
+#define POLL_IDLE_NS 500000000LL //how long the idle workload runs
+#define POLL_BURSTS 4
+#define POLL_BURST_GAP_NS 100000000LL //quiet time before each burst
+#define POLL_BURST_PULSES 20
+#define POLL_PULSE_NS 1000000LL //high for this long, then low for 1-2 times as long
+#define POLL_FIXED_DELAY_US 5000
+#define POLL_ADAPTIVE_MIN_US 100
+#define POLL_ADAPTIVE_MAX_US 5000 //the same as the fixed delay
+#define POLL_ADAPTIVE_SLOW_MAX_US 20000
+#define POLL_ADAPTIVE_QUIET_US 10000
+#define MAX_BENCH_THREADS 64
+#define MAX_THREAD_COUNTS 8 //1, 2, 4, ... 32 and the most threads (up to 64)
+#define THREAD_PINS 16 //threads beyond this share the pins
+#define PIO_THREADS 8
+#define THREAD_OPS 3 //own pin writes, own pin reads, toggles of one shared pin
+#define PIO_BATCH_PINS 14
+#define PIO_PATTERNS 64 //of the batch pins, written and read by the register checks
+#define PIO_HW_BIT (1u << 31) //set in every port by "the hardware"; must never change
+
+typedef struct
+{
+    char name[64];
+    long long iterations;
+    long long errors;
+    double ops_per_sec;
+    double mean_ns;
+    long long p50_ns;
+    long long p99_ns;
+    long long p999_ns;
+    long long max_ns;
+} bench_result_t;
+
+static bench_result_t results[MAX_RESULTS];
+static int num_results;
+static gpio_stats_t lib_stats; //the library's own counters over the whole run
+static char* stat_op_names[GPIO_STAT_NUM_OPS] = { "read", "write", "set_dir", "get_dir",
+                                                  "open", "close" };
+static char fake_root[] = "/tmp/chipgpio_bench.XXXXXX";
+static int saved_stderr = -1;
+static FILE* held_stderr; //what the library reported while stderr was silenced
+
+static char* batch_backend_names[] = { "auto", "fds", "uring" };
+
+//CPU used by the polling thread and pulses it missed, per polling mode and workload
+typedef struct
+{
+    double cpu_s_per_hour;
+    long long pulses;
+    long long missed;
+} poll_result_t;
+
+static char* poll_mode_names[POLL_MODES] = { "busy", "fixed_5ms", "adaptive_5ms",
+                                           "adaptive_20ms" };
+static char* poll_workload_names[POLL_WORKLOADS] = { "idle", "bursts" };
+static poll_result_t poll_results[POLL_MODES][POLL_WORKLOADS];
+//per read batch, bus write and poll pass
+static double batch_syscalls[GPIO_BATCH_URING+1][3];
+
+//Throughput of THREAD_OPS with each number of threads in thread_counts
+typedef struct
+{
+    double ops_per_sec;
+    long long errors;
+} thread_result_t;
+
+//1 and powers of 2 up to the number of threads asked for (or CPUs online), and that
+static int thread_counts[MAX_THREAD_COUNTS];
+static int num_thread_counts;
+static char* thread_op_names[THREAD_OPS] = { "set_gpio_val", "read_gpio_val",
+                                             "toggle_gpio_val_shared" };
+static thread_result_t thread_results[THREAD_OPS][MAX_THREAD_COUNTS];
+
+static int pio_checks; //of the register image, by bench_pio
+static int pio_failures;
+static int check_failures; //of the callback histograms and the shared pin's toggles
+
+static int xio_out; //pins used by the benchmarks
+static int xio_in;
+static int xio_cb;
+
+static atomic_llong callback_ns; //set by the benchmark callback when it fires
+static atomic_llong callback_count;
+
+static inline long long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec*NS_PER_SEC + ts.tv_nsec;
+}
+
+//Write a small file in the fake tree, creating it if needed
+static int write_fake_file(char* path, char* contents)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) { perror(path); return GPIO_ERR; }
+    if (write(fd, contents, strlen(contents)) < 0) { perror(path); }
+    close(fd);
+    return GPIO_OK;
+}
+
+//Create a gpioN directory with value and direction files
+static int make_fake_pin(int kern)
+{
+    char path[256];
+
+    snprintf(path, sizeof(path), "%s%s%d", fake_root, GPIO_SYSFS_PATH, kern);
+    if (mkdir(path, 0755) < 0) { perror(path); return GPIO_ERR; }
+
+    snprintf(path, sizeof(path), "%s%s%d/value", fake_root, GPIO_SYSFS_PATH, kern);
+    if (write_fake_file(path, "0\n") < 0) { return GPIO_ERR; }
+
+    snprintf(path, sizeof(path), "%s%s%d/direction", fake_root, GPIO_SYSFS_PATH, kern);
+    return write_fake_file(path, "in\n");
+}
+
+//Build just enough of /sys/class/gpio for the library to initialize and run
+static int make_fake_sysfs()
+{
+    char path[256];
+    char base[16];
+
+    if (mkdtemp(fake_root) == NULL) { perror("mkdtemp"); return GPIO_ERR; }
+
+    snprintf(path, sizeof(path), "%s/sys", fake_root);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/sys/class", fake_root);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/sys/class/gpio", fake_root);
+    mkdir(path, 0755);
+
+    snprintf(path, sizeof(path), "%s%s", fake_root, GPIO_EXPORT_PATH);
+    write_fake_file(path, "");
+    snprintf(path, sizeof(path), "%s%s", fake_root, GPIO_UNEXPORT_PATH);
+    write_fake_file(path, "");
+
+    //the XIO expander's gpiochip, which initialize_gpio_interface looks for
+    snprintf(path, sizeof(path), "%s%s%d", fake_root, GPIOCHIP_SYSFS_PATH, FAKE_XIO_BASE);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s%s%d/base", fake_root, GPIOCHIP_SYSFS_PATH,
+             FAKE_XIO_BASE);
+    snprintf(base, sizeof(base), "%d\n", FAKE_XIO_BASE);
+    write_fake_file(path, base);
+    snprintf(path, sizeof(path), "%s%s%d/label", fake_root, GPIOCHIP_SYSFS_PATH,
+             FAKE_XIO_BASE);
+    write_fake_file(path, "pcf8574a\n");
+
+    for (int i = 0; i < FAKE_R8_PINS; i++)
+    { if (make_fake_pin(i) < 0) { return GPIO_ERR; } }
+
+    for (int i = 0; i < NUM_XIO_PINS; i++)
+    { if (make_fake_pin(FAKE_XIO_BASE+i) < 0) { return GPIO_ERR; } }
+
+    return GPIO_OK;
+}
+
+static int remove_entry(const char* path, const struct stat* sb, int flag, struct FTW* ftw)
+{
+    return remove(path);
+}
+
+static void remove_fake_sysfs()
+{
+    nftw(fake_root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+//The library reports problems (such as pins that look already open) on stderr;
+//keep that out of the timed sections, in a file shown if a check fails
+static void silence_stderr()
+{
+    int fd = GPIO_ERR;
+
+    held_stderr = tmpfile();
+    fd = held_stderr != NULL ? fileno(held_stderr) : open("/dev/null", O_WRONLY);
+    fflush(stderr);
+    saved_stderr = dup(STDERR_FILENO);
+    dup2(fd, STDERR_FILENO);
+    if (held_stderr == NULL) { close(fd); }
+}
+
+static void restore_stderr(int show)
+{
+    char buf[4096];
+    size_t len = 0;
+
+    fflush(stderr);
+    dup2(saved_stderr, STDERR_FILENO);
+    close(saved_stderr);
+
+    if (held_stderr == NULL) { return; }
+
+    rewind(held_stderr);
+    if (show) { fprintf(stderr, "The library reported:\n"); }
+    while (show && (len = fread(buf, 1, sizeof(buf), held_stderr)) > 0)
+    { fwrite(buf, 1, len, stderr); }
+    fclose(held_stderr);
+    held_stderr = NULL;
+}
+
+static int compare_ll(const void* a, const void* b)
+{
+    long long x = *(const long long*) a;
+    long long y = *(const long long*) b;
+    return (x > y) - (x < y);
+}
+
+static inline long long percentile(long long* sorted, long long n, double p)
+{
+    long long i = (long long) (p*(n-1) + 0.5);
+    return sorted[i];
+}
+
+//Turn one of the callback manager's own histograms into a result
+static void record_histogram_result(char* name, int group, int hist)
+{
+    bench_result_t* r = &results[num_results++];
+    latency_histogram_t* h = (latency_histogram_t*) malloc(sizeof(latency_histogram_t));
+
+    get_callback_histogram(group, hist, h);
+
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->iterations = h->count;
+    r->errors = 0;
+    r->mean_ns = h->count ? (double) h->sum_ns/h->count : 0.0;
+    r->ops_per_sec = h->sum_ns ? (double) h->count*NS_PER_SEC/h->sum_ns : 0.0;
+    r->p50_ns = get_histogram_percentile(h, 0.50);
+    r->p99_ns = get_histogram_percentile(h, 0.99);
+    r->p999_ns = get_histogram_percentile(h, 0.999);
+    r->max_ns = h->max_ns;
+    free(h);
+}
+
+//Turn raw per-call timings into a result
+static void record_result(char* name, long long* samples, long long n, long long errors)
+{
+    bench_result_t* r = &results[num_results++];
+    long long total = 0;
+
+    qsort(samples, n, sizeof(long long), compare_ll);
+    for (long long i = 0; i < n; i++) { total += samples[i]; }
+
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->iterations = n;
+    r->errors = errors;
+    r->mean_ns = n ? (double) total/n : 0.0;
+    r->ops_per_sec = total ? (double) n*NS_PER_SEC/total : 0.0;
+    r->p50_ns = n ? percentile(samples, n, 0.50) : 0;
+    r->p99_ns = n ? percentile(samples, n, 0.99) : 0;
+    r->p999_ns = n ? percentile(samples, n, 0.999) : 0;
+    r->max_ns = n ? samples[n-1] : 0;
+}
+
+//Time op once per iteration; i is passed along so ops can vary their arguments
+static void bench_op(char* name, int (*op)(long long), long long n)
+{
+    long long* samples = (long long*) malloc(n*sizeof(long long));
+    long long errors = 0;
+    long long start = 0;
+
+    for (long long i = 0; i < n; i++)
+    {
+        start = now_ns();
+        if (op(i) < GPIO_OK) { errors++; }
+        samples[i] = now_ns() - start;
+    }
+
+    record_result(name, samples, n, errors);
+    free(samples);
+}
+
+static int op_get_gpio_num(long long i) { return get_gpio_num("XIO-P7"); }
+static int op_is_gpio_pin_open(long long i) { return is_gpio_pin_open(xio_out); }
+static int op_set_gpio_dir(long long i) { return set_gpio_dir(xio_in, GPIO_DIR_IN); }
+static int op_get_gpio_dir(long long i) { return get_gpio_dir(xio_in); }
+static int op_set_gpio_val(long long i) { return set_gpio_val(xio_out, i & 1); }
+static int op_read_gpio_val(long long i) { return read_gpio_val(xio_in); }
+static int op_read_gpio_val_n(long long i) { return read_gpio_val_n("XIO-P1"); }
+static int op_toggle_gpio_val(long long i) { return toggle_gpio_val(xio_out); }
+static int op_set_gpio_val_same(long long i) { return set_gpio_val(xio_out, 1); }
+static int op_read_gpio_val_out(long long i) { return read_gpio_val(xio_out); }
+
+static char* bus_names[8] = { "LCD-D3", "LCD-D4", "LCD-D5", "LCD-D6", "LCD-D7",
+                              "LCD-D10", "LCD-D11", "LCD-D12" };
+static char* thread_pin_names[THREAD_PINS] = { "LCD-D3", "LCD-D4", "LCD-D5", "LCD-D6",
+                                               "LCD-D7", "LCD-D10", "LCD-D11", "LCD-D12",
+                                               "LCD-D13", "LCD-D14", "LCD-D15", "LCD-D18",
+                                               "LCD-D19", "LCD-D20", "LCD-D21", "LCD-D22" };
+static gpio_bus_t* bench_bus;
+static int op_bus_write(long long i) { return bus_write(bench_bus, i & 1 ? 0x55 : 0xAA); }
+static int op_bus_read(long long i) { return (int) bus_read(bench_bus); }
+
+static shift_register_t* bench_chain;
+static int op_shift_register_write(long long i)
+{
+    uint8_t buf[2] = { i & 0xFF, (i >> 8) & 0xFF };
+    return shift_register_write(bench_chain, buf);
+}
+
+static int batch_pins[BATCH_PINS];
+static int batch_vals[BATCH_PINS];
+static int op_read_gpio_vals(long long i)
+{ return read_gpio_vals(batch_pins, batch_vals, BATCH_PINS); }
+
+static int batch_callback(pin_change_t change, void* arg) { return GPIO_OK; }
+
+//Syscalls made for reads and writes so far
+static unsigned long long count_rw_syscalls()
+{
+    gpio_stats_t stats;
+    get_gpio_stats(&stats);
+    return stats.op[GPIO_STAT_READ].syscalls + stats.op[GPIO_STAT_WRITE].syscalls;
+}
+
+// A batch read of BATCH_PINS R8 pins, an 8 bit bus write and callback manager passes over
+// BATCH_PINS pins, done with one backend (chip_gpio_batch.h)
+static void bench_batch_backend(int backend, long long n)
+{
+    char name[64];
+    char* backend_name = batch_backend_names[backend];
+    unsigned long long syscalls = 0;
+    gpio_stats_t stats;
+    uint64_t passes = 0;
+    long long start = 0;
+
+    if (set_gpio_batch_backend(backend) != backend) { return; } //no io_uring here
+
+    syscalls = count_rw_syscalls();
+    snprintf(name, sizeof(name), "read_gpio_vals_%d_%s", BATCH_PINS, backend_name);
+    bench_op(name, op_read_gpio_vals, n);
+    batch_syscalls[backend][0] = (double) (count_rw_syscalls()-syscalls)/n;
+
+    bench_bus = create_gpio_bus_n(bus_names, 8);
+    setup_gpio_bus(bench_bus, GPIO_DIR_OUT);
+    syscalls = count_rw_syscalls();
+    snprintf(name, sizeof(name), "bus_write_8bit_%s", backend_name);
+    bench_op(name, op_bus_write, n);
+    batch_syscalls[backend][1] = (double) (count_rw_syscalls()-syscalls)/n;
+    destroy_gpio_bus(bench_bus);
+
+    initialize_callback_manager();
+    reset_callback_histograms();
+    for (int i = 0; i < BATCH_PINS; i++)
+    { register_callback_func(batch_pins[i], batch_callback, NULL); }
+
+    get_gpio_stats(&stats);
+    passes = stats.poll_passes;
+    syscalls = count_rw_syscalls();
+    start = now_ns();
+    start_callback_manager();
+
+    do
+    {
+        nanosleep(&(struct timespec) { 0, 1000000 }, NULL);
+        get_gpio_stats(&stats);
+    } while (stats.poll_passes-passes < (uint64_t) n && now_ns()-start < NS_PER_SEC);
+
+    terminate_callback_manager();
+    get_gpio_stats(&stats);
+    batch_syscalls[backend][2] = (double) (count_rw_syscalls()-syscalls)/
+                                 (stats.poll_passes-passes);
+
+    snprintf(name, sizeof(name), "poll_pass_%d_%s", BATCH_PINS, backend_name);
+    record_histogram_result(name, PIN_GROUP_R8, CALLBACK_HIST_POLL_PASS);
+}
+
+static void bench_batch(long long n)
+{
+    char* names[BATCH_PINS] = { "LCD-D13", "LCD-D14", "LCD-D15", "LCD-D18", "LCD-D19",
+                                "LCD-D20", "LCD-D21", "LCD-D22", "LCD-D23", "LCD-CLK",
+                                "LCD-DE", "LCD-HSYNC", "LCD-VSYNC", "CSID3", "CSID4",
+                                "CSID5" };
+
+    for (int i = 0; i < BATCH_PINS; i++)
+    {
+        batch_pins[i] = get_gpio_num(names[i]);
+        setup_gpio_pin(batch_pins[i], GPIO_DIR_IN);
+    }
+
+    bench_batch_backend(GPIO_BATCH_FDS, n);
+    bench_batch_backend(GPIO_BATCH_URING, n);
+    set_gpio_batch_backend(GPIO_BATCH_FDS);
+}
+
+//open and close have to alternate, so they are timed together here
+static void bench_open_close(long long n)
+{
+    long long* open_samples = (long long*) malloc(n*sizeof(long long));
+    long long* close_samples = (long long*) malloc(n*sizeof(long long));
+    long long open_errors = 0;
+    long long close_errors = 0;
+    long long start = 0;
+    int pin = get_gpio_num("XIO-P6");
+
+    for (long long i = 0; i < n; i++)
+    {
+        start = now_ns();
+        if (open_gpio_pin(pin) < GPIO_OK) { open_errors++; }
+        open_samples[i] = now_ns() - start;
+
+        start = now_ns();
+        if (close_gpio_pin(pin) < GPIO_OK) { close_errors++; }
+        close_samples[i] = now_ns() - start;
+    }
+
+    record_result("open_gpio_pin", open_samples, n, open_errors);
+    record_result("close_gpio_pin", close_samples, n, close_errors);
+    free(open_samples);
+    free(close_samples);
+}
+
+// Bringing SETUP_PINS pins up (half of them outputs, given a value) and closing them,
+// one pin at a time and as one transaction
+static void bench_setup_pins(long long n)
+{
+    char* names[SETUP_PINS] = { "LCD-D10", "LCD-D11", "LCD-D12", "CSID6", "CSID7",
+                                "CSIPCK", "CSICK", "CSIHSYNC" };
+    long long* each_samples = (long long*) malloc(n*sizeof(long long));
+    long long* batch_samples = (long long*) malloc(n*sizeof(long long));
+    long long* close_samples = (long long*) malloc(n*sizeof(long long));
+    long long each_errors = 0;
+    long long batch_errors = 0;
+    long long close_errors = 0;
+    long long start = 0;
+    pin_cfg_t cfgs[SETUP_PINS];
+    int pins[SETUP_PINS];
+
+    for (int i = 0; i < SETUP_PINS; i++)
+    {
+        pins[i] = get_gpio_num(names[i]);
+        cfgs[i].pin = pins[i];
+        cfgs[i].dir = i & 1 ? GPIO_DIR_OUT : GPIO_DIR_IN;
+        cfgs[i].val = GPIO_PIN_HIGH;
+    }
+
+    for (long long i = 0; i < n; i++)
+    {
+        start = now_ns();
+        for (int k = 0; k < SETUP_PINS; k++)
+        {
+            if (setup_gpio_pin(pins[k], cfgs[k].dir) < GPIO_OK ||
+                (cfgs[k].dir == GPIO_DIR_OUT && set_gpio_val(pins[k], cfgs[k].val) < GPIO_OK))
+            { each_errors++; }
+        }
+        each_samples[i] = now_ns() - start;
+        for (int k = 0; k < SETUP_PINS; k++) { close_gpio_pin(pins[k]); }
+
+        start = now_ns();
+        if (setup_gpio_pins(cfgs, SETUP_PINS) < GPIO_OK) { batch_errors++; }
+        batch_samples[i] = now_ns() - start;
+
+        start = now_ns();
+        if (close_gpio_pins(pins, SETUP_PINS) < GPIO_OK) { close_errors++; }
+        close_samples[i] = now_ns() - start;
+    }
+
+    record_result("setup_gpio_pin_x8", each_samples, n, each_errors);
+    record_result("setup_gpio_pins_8", batch_samples, n, batch_errors);
+    record_result("close_gpio_pins_8", close_samples, n, close_errors);
+    free(each_samples);
+    free(batch_samples);
+    free(close_samples);
+}
+
+static int bench_callback(pin_change_t change, void* arg)
+{
+    atomic_store(&callback_ns, now_ns());
+    atomic_fetch_add(&callback_count, 1);
+    return GPIO_OK;
+}
+
+//Time from a value file changing to the callback manager invoking the callback
+static void bench_callback_latency(long long n)
+{
+    long long* samples = (long long*) malloc(n*sizeof(long long));
+    long long errors = 0;
+    long long done = 0;
+    long long count = 0;
+    long long start = 0;
+    char path[256];
+    char val = '0';
+    int fd = GPIO_ERR;
+    bench_result_t* end_to_end = NULL;
+    bench_result_t* dispatch = NULL;
+
+    snprintf(path, sizeof(path), "%s%s%d/value", fake_root, GPIO_SYSFS_PATH,
+             FAKE_XIO_BASE + xio_cb - (XIO_U14_FIRST_PIN_ALL));
+    fd = open(path, O_WRONLY);
+    pwrite(fd, &val, 1, 0);
+
+    initialize_callback_manager();
+    reset_callback_histograms();
+    register_callback_func(xio_cb, bench_callback, NULL);
+    start_callback_manager();
+
+    for (long long i = 0; i < n; i++)
+    {
+        count = atomic_load(&callback_count);
+        val = val == '0' ? '1' : '0';
+
+        start = now_ns();
+        pwrite(fd, &val, 1, 0);
+
+        while (atomic_load(&callback_count) == count && now_ns()-start < CALLBACK_TIMEOUT_NS)
+        { sched_yield(); } //leave the CPU to the poller on single-core boards
+
+        if (atomic_load(&callback_count) == count) { errors++; continue; }
+        samples[done++] = atomic_load(&callback_ns) - start;
+    }
+
+    terminate_callback_manager();
+    close(fd);
+
+    // Every edge is injected at a known time, so the end-to-end samples bound what the
+    // manager's histograms may report: one dispatch per edge, each no slower than the
+    // whole trip from the write to the callback.
+    record_result("callback_latency", samples, done, errors);
+    end_to_end = &results[num_results-1];
+    record_histogram_result("callback_detect_window", PIN_GROUP_XIO, CALLBACK_HIST_DETECT);
+    record_histogram_result("callback_dispatch", PIN_GROUP_XIO, CALLBACK_HIST_DISPATCH);
+    dispatch = &results[num_results-1];
+    record_histogram_result("poll_pass_xio", PIN_GROUP_XIO, CALLBACK_HIST_POLL_PASS);
+
+    //count it as an error if the histogram disagrees with what we saw
+    if (dispatch->iterations != done || dispatch->max_ns > end_to_end->max_ns)
+    {
+        dispatch->errors = 1;
+        check_failures++;
+    }
+
+    free(samples);
+}
+
+static int hog_callback(pin_change_t change, void* arg)
+{
+    nanosleep(&(struct timespec) { 0, HOG_CALLBACK_NS }, NULL);
+    return GPIO_OK;
+}
+
+static int open_fake_value(int pin)
+{
+    char path[256];
+
+    snprintf(path, sizeof(path), "%s%s%d/value", fake_root, GPIO_SYSFS_PATH,
+             get_gpio_kern_num(pin));
+    return open(path, O_RDWR);
+}
+
+// Callback latency on one pin while another pin's callback takes HOG_CALLBACK_NS every
+// time it changes, with callbacks run on the polling thread (workers = 0) or on workers
+// with the measured pin at high priority
+static void bench_callback_hogged(int workers, long long n)
+{
+    long long* samples = (long long*) malloc(n*sizeof(long long));
+    long long errors = 0;
+    long long done = 0;
+    long long count = 0;
+    long long start = 0;
+    callback_stats_t hog_stats;
+    int hog = get_gpio_num("XIO-P0"); //polled (and dispatched) before xio_cb
+    int hog_fd = open_fake_value(hog);
+    int fd = open_fake_value(xio_cb);
+    char val = '0';
+
+    pwrite(fd, &val, 1, 0);
+    pwrite(hog_fd, &val, 1, 0);
+    setup_gpio_pin(hog, GPIO_DIR_IN);
+
+    set_callback_workers(workers);
+    initialize_callback_manager();
+    register_callback_func(hog, hog_callback, NULL);
+    register_callback_func(xio_cb, bench_callback, NULL);
+    set_callback_priority(xio_cb, CALLBACK_PRIORITY_HIGH);
+    start_callback_manager();
+
+    for (long long i = 0; i < n; i++)
+    {
+        count = atomic_load(&callback_count);
+        val = val == '0' ? '1' : '0';
+
+        start = now_ns();
+        pwrite(hog_fd, &val, 1, 0);
+        pwrite(fd, &val, 1, 0);
+
+        while (atomic_load(&callback_count) == count && now_ns()-start < CALLBACK_TIMEOUT_NS)
+        { sched_yield(); }
+
+        if (atomic_load(&callback_count) == count) { errors++; continue; }
+        samples[done++] = atomic_load(&callback_ns) - start;
+    }
+
+    //the hog's callbacks must have been counted, and timed at no less than they sleep
+    get_callback_stats(hog, &hog_stats);
+    if (hog_stats.calls == 0 || hog_stats.max_ns < HOG_CALLBACK_NS) { errors++; }
+
+    terminate_callback_manager();
+    set_callback_workers(0);
+    close_gpio_pin(hog);
+    close(hog_fd);
+    close(fd);
+
+    record_result(workers ? "callback_hogged_workers" : "callback_hogged_serial", samples,
+                  done, errors);
+
+    free(samples);
+}
+
+static int fanout_batch_callback(const pin_event_t* events, int n, void* arg)
+{
+    atomic_store(&callback_ns, now_ns());
+    atomic_fetch_add(&callback_count, n);
+    return GPIO_OK;
+}
+
+// Time from BATCH_PINS value files changing together to the last of their changes
+// being delivered, with a callback per pin or one batch callback for them all
+static void bench_callback_fanout(int batched, long long n)
+{
+    long long* samples = (long long*) malloc(n*sizeof(long long));
+    long long errors = 0;
+    long long done = 0;
+    long long count = 0;
+    long long start = 0;
+    int fds[BATCH_PINS];
+    char val = '0';
+
+    for (int i = 0; i < BATCH_PINS; i++)
+    {
+        fds[i] = open_fake_value(batch_pins[i]);
+        pwrite(fds[i], &val, 1, 0);
+    }
+
+    initialize_callback_manager();
+    if (batched)
+    { register_callback_batch_func(batch_pins, BATCH_PINS, fanout_batch_callback, NULL); }
+    else
+    {
+        for (int i = 0; i < BATCH_PINS; i++)
+        { register_callback_func(batch_pins[i], bench_callback, NULL); }
+    }
+    start_callback_manager();
+
+    for (long long i = 0; i < n; i++)
+    {
+        count = atomic_load(&callback_count) + BATCH_PINS;
+        val = val == '0' ? '1' : '0';
+
+        start = now_ns();
+        for (int k = 0; k < BATCH_PINS; k++) { pwrite(fds[k], &val, 1, 0); }
+
+        while (atomic_load(&callback_count) < count && now_ns()-start < CALLBACK_TIMEOUT_NS)
+        { sched_yield(); }
+
+        //a straggler from a timed out round would be counted in the next one
+        if (atomic_load(&callback_count) != count)
+        {
+            errors++;
+            atomic_store(&callback_count, count);
+            continue;
+        }
+        samples[done++] = atomic_load(&callback_ns) - start;
+    }
+
+    terminate_callback_manager();
+    for (int i = 0; i < BATCH_PINS; i++) { close(fds[i]); }
+
+    record_result(batched ? "callback_fanout_batch" : "callback_fanout_each", samples,
+                  done, errors);
+
+    free(samples);
+}
+
+// The same fan-out with the pins split between BENCH_MANAGERS managers of their own,
+// each pinned to a CPU if there are enough (and otherwise polling with a short delay).
+// Each manager's dispatch histogram must count exactly its own pins' changes.
+static void bench_callback_managers(long long n)
+{
+    long long* samples = (long long*) malloc(n*sizeof(long long));
+    long long errors = 0;
+    long long done = 0;
+    long long count = 0;
+    long long start = 0;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    gpio_cb_manager_t* managers[BENCH_MANAGERS];
+    latency_histogram_t hist;
+    int fds[BATCH_PINS];
+    char val = '0';
+
+    for (int i = 0; i < BATCH_PINS; i++)
+    {
+        fds[i] = open_fake_value(batch_pins[i]);
+        pwrite(fds[i], &val, 1, 0);
+    }
+
+    for (int m = 0; m < BENCH_MANAGERS; m++)
+    {
+        managers[m] = create_callback_manager();
+        //busy pollers sharing a core only take turns when the scheduler says so
+        if (cpus >= BENCH_MANAGERS) { set_callback_manager_cpu(managers[m], m); }
+        else { set_callback_polling_delay_m(managers[m], MANAGER_SHARED_DELAY_US); }
+    }
+
+    for (int i = 0; i < BATCH_PINS; i++)
+    {
+        register_callback_func_m(managers[i % BENCH_MANAGERS], batch_pins[i],
+                                 bench_callback, NULL);
+    }
+
+    for (int m = 0; m < BENCH_MANAGERS; m++) { start_callback_manager_m(managers[m]); }
+
+    for (long long i = 0; i < n; i++)
+    {
+        count = atomic_load(&callback_count) + BATCH_PINS;
+        val = val == '0' ? '1' : '0';
+
+        start = now_ns();
+        for (int k = 0; k < BATCH_PINS; k++) { pwrite(fds[k], &val, 1, 0); }
+
+        while (atomic_load(&callback_count) < count && now_ns()-start < CALLBACK_TIMEOUT_NS)
+        { sched_yield(); }
+
+        if (atomic_load(&callback_count) != count)
+        {
+            errors++;
+            atomic_store(&callback_count, count);
+            continue;
+        }
+        samples[done++] = atomic_load(&callback_ns) - start;
+    }
+
+    for (int m = 0; m < BENCH_MANAGERS; m++)
+    {
+        pause_callback_manager_m(managers[m]);
+        get_callback_histogram_m(managers[m], PIN_GROUP_R8, CALLBACK_HIST_DISPATCH, &hist);
+        if (errors == 0 && hist.count != (uint64_t) done*BATCH_PINS/BENCH_MANAGERS)
+        { errors++; }
+        free_callback_manager(managers[m]);
+    }
+
+    for (int i = 0; i < BATCH_PINS; i++) { close(fds[i]); }
+
+    record_result("callback_fanout_managers", samples, done, errors);
+
+    free(samples);
+}
+
+typedef struct
+{
+    int pin;
+    int op; //index into thread_op_names
+    long long n;
+    long long errors;
+    pthread_barrier_t* start;
+} bench_thread_t;
+
+static void* bench_thread(void* arg)
+{
+    bench_thread_t* t = (bench_thread_t*) arg;
+    int rc = GPIO_OK;
+
+    pthread_barrier_wait(t->start);
+
+    for (long long i = 0; i < t->n; i++)
+    {
+        if (t->op == 0) { rc = set_gpio_val(t->pin, i & 1); } //never skipped (shadowed)
+        else if (t->op == 1) { rc = read_gpio_val(t->pin); }
+        else { rc = toggle_gpio_val(t->pin); }
+
+        if (rc < GPIO_OK) { t->errors++; }
+    }
+
+    return NULL;
+}
+
+//Fill thread_counts up to max threads (the number of CPUs online if max is under 1)
+static void set_thread_counts(int max)
+{
+    if (max < 1) { max = (int) sysconf(_SC_NPROCESSORS_ONLN); }
+    if (max < 1) { max = 1; }
+    if (max > MAX_BENCH_THREADS) { max = MAX_BENCH_THREADS; }
+
+    num_thread_counts = 0;
+    for (int t = 1; t < max; t *= 2) { thread_counts[num_thread_counts++] = t; }
+    thread_counts[num_thread_counts++] = max;
+}
+
+// Throughput of each of thread_counts threads writing and reading pins of their own
+// (which shouldn't wait on each other, up to THREAD_PINS threads), and toggling
+// xio_out together (which has to). No toggle of the shared pin may be lost, so its
+// value afterwards is checked too.
+static void bench_threads(long long n)
+{
+    pthread_t threads[MAX_BENCH_THREADS];
+    bench_thread_t args[MAX_BENCH_THREADS];
+    pin_cfg_t cfgs[THREAD_PINS];
+    int pins[THREAD_PINS];
+    int shared_fd = open_fake_value(xio_out);
+    pthread_barrier_t start;
+
+    for (int i = 0; i < THREAD_PINS; i++)
+    {
+        pins[i] = get_gpio_num(thread_pin_names[i]);
+        cfgs[i].pin = pins[i];
+        cfgs[i].dir = GPIO_DIR_OUT;
+        cfgs[i].val = GPIO_PIN_LOW;
+    }
+    setup_gpio_pins(cfgs, THREAD_PINS);
+
+    for (int op = 0; op < THREAD_OPS; op++)
+    {
+        //reads of outputs we wrote come from their shadows, so read inputs instead
+        for (int i = 0; op == 1 && i < THREAD_PINS; i++)
+        { set_gpio_dir(pins[i], GPIO_DIR_IN); }
+
+        for (int c = 0; c < num_thread_counts; c++)
+        {
+            thread_result_t* r = &thread_results[op][c];
+            int num_threads = thread_counts[c];
+            long long wall = 0;
+            char before = '0';
+            char after = '0';
+
+            pread(shared_fd, &before, 1, 0);
+            pthread_barrier_init(&start, NULL, num_threads+1);
+
+            for (int i = 0; i < num_threads; i++)
+            {
+                int pin = op == 2 ? xio_out : pins[i % THREAD_PINS];
+
+                args[i] = (bench_thread_t) { pin, op, n, 0, &start };
+                pthread_create(&threads[i], NULL, bench_thread, &args[i]);
+            }
+
+            //timed from before the threads are released: with few CPUs, this thread
+            //may not run again until they're done
+            wall = now_ns();
+            pthread_barrier_wait(&start);
+
+            r->errors = 0;
+            for (int i = 0; i < num_threads; i++)
+            {
+                pthread_join(threads[i], NULL);
+                r->errors += args[i].errors;
+            }
+
+            wall = now_ns() - wall;
+            pthread_barrier_destroy(&start);
+            r->ops_per_sec = (double) (num_threads*n) * NS_PER_SEC / (double) wall;
+
+            //an even number of toggles leaves the pin as it was
+            pread(shared_fd, &after, 1, 0);
+            if (op == 2 && (after != before) != ((num_threads*n) & 1))
+            {
+                r->errors++;
+                check_failures++;
+            }
+        }
+    }
+
+    close_gpio_pins(pins, THREAD_PINS);
+    close(shared_fd);
+}
+
+static volatile uint32_t* pio_image; //the register image, as the hardware would see it
+static int pio_out;
+static int pio_in;
+static int pio_pins[PIO_BATCH_PINS];
+static int pio_vals[PIO_BATCH_PINS];
+
+static int op_pio_set_gpio_val(long long i) { return set_gpio_val(pio_out, i & 1); }
+static int op_pio_toggle_gpio_val(long long i) { return toggle_gpio_val(pio_out); }
+static int op_pio_read_gpio_val(long long i) { return read_gpio_val(pio_in); }
+static int op_pio_set_gpio_vals(long long i)
+{
+    for (int j = 0; j < PIO_BATCH_PINS; j++) { pio_vals[j] = (i >> (j % 4)) & 1; }
+    return set_gpio_vals(pio_pins, pio_vals, PIO_BATCH_PINS);
+}
+static int op_pio_read_gpio_vals(long long i)
+{ return read_gpio_vals(pio_pins, pio_vals, PIO_BATCH_PINS); }
+
+//A pin's data register in the image, and its bit; R8 kernel numbers are 32*port+offset
+static volatile uint32_t* get_image_data(int pin, uint32_t* bit)
+{
+    int kern = get_gpio_kern_num(pin);
+
+    *bit = 1u << (kern % 32);
+    return pio_image + ((kern/32)*GPIO_PIO_PORT_SIZE + GPIO_PIO_DAT)/sizeof(uint32_t);
+}
+
+//Set a pin's config field in the image, as the kernel does when it changes the pin's
+//direction or function
+static void set_image_cfg(int pin, uint32_t cfg)
+{
+    int kern = get_gpio_kern_num(pin);
+    volatile uint32_t* reg = pio_image + ((kern/32)*GPIO_PIO_PORT_SIZE +
+                                          GPIO_PIO_CFG)/sizeof(uint32_t) + (kern % 32)/8;
+
+    *reg = (*reg & ~(0xFu << (kern % 8)*4)) | cfg << (kern % 8)*4;
+}
+
+static void check_pio(int ok)
+{
+    pio_checks++;
+    if (!ok) { pio_failures++; }
+}
+
+// Check the register image against what was written and read: which pins go through
+// it, each pin's bit, batches and threads changing only their own bits of each port,
+// and reads
+static void check_pio_image()
+{
+    pthread_t threads[PIO_THREADS];
+    bench_thread_t args[PIO_THREADS];
+    pthread_barrier_t start;
+    int muxed = get_gpio_num("LCD-D2");
+    int muxed_fd = GPIO_ERR;
+    int out_fd = GPIO_ERR;
+    int batch_pins[2] = { pio_out, pio_pins[0] };
+    int batch_vals[2] = { 0, 1 };
+    volatile uint32_t* reg = NULL;
+    volatile uint32_t* batch_reg = NULL;
+    uint32_t bit = 0;
+    uint32_t batch_bit = 0;
+    char val = '0';
+
+    //LCD-D2 is handed to the LCD (function 2), so it has to fall back to sysfs
+    setup_gpio_pin(muxed, GPIO_DIR_OUT);
+    set_image_cfg(muxed, 2);
+    check_pio(is_gpio_pio_pin(pio_out) && !is_gpio_pio_pin(xio_out) &&
+              !is_gpio_pio_pin(muxed));
+
+    set_gpio_val(muxed, 1);
+    muxed_fd = open_fake_value(muxed);
+    pread(muxed_fd, &val, 1, 0);
+    close(muxed_fd);
+    reg = get_image_data(muxed, &bit);
+    check_pio(val == '1' && !(*reg & bit));
+    close_gpio_pin(muxed);
+
+    reg = get_image_data(pio_out, &bit);
+    for (int v = 1; v >= 0; v--)
+    {
+        set_gpio_val(pio_out, v);
+        check_pio(((*reg & bit) != 0) == v);
+        check_pio(toggle_gpio_val(pio_out) == !v && ((*reg & bit) != 0) == !v);
+    }
+
+    //an output the registers say is an input (set so by another process, say) is
+    //written through sysfs, alone or in a batch, while its bit is left alone
+    set_gpio_shadow_mode(GPIO_SHADOW_OFF);
+    set_image_cfg(pio_out, GPIO_PIO_CFG_IN);
+    out_fd = open_fake_value(pio_out);
+    *reg &= ~bit;
+    set_gpio_val(pio_out, 1);
+    pread(out_fd, &val, 1, 0);
+    check_pio(val == '1' && !(*reg & bit));
+
+    *reg |= bit;
+    batch_reg = get_image_data(pio_pins[0], &batch_bit);
+    *batch_reg &= ~batch_bit;
+    set_gpio_vals(batch_pins, batch_vals, 2);
+    pread(out_fd, &val, 1, 0);
+    check_pio(val == '0' && (*reg & bit) && (*batch_reg & batch_bit));
+    close(out_fd);
+    set_image_cfg(pio_out, GPIO_PIO_CFG_OUT);
+    set_gpio_shadow_mode(GPIO_SHADOW_ON);
+
+    for (int i = 0; i < PIO_BATCH_PINS; i++)
+    {
+        reg = get_image_data(pio_pins[i], &bit);
+        *reg |= PIO_HW_BIT;
+    }
+
+    for (int k = 0; k < PIO_PATTERNS; k++)
+    {
+        for (int i = 0; i < PIO_BATCH_PINS; i++) { pio_vals[i] = (k*7 >> (i % 6)) & 1; }
+        set_gpio_vals(pio_pins, pio_vals, PIO_BATCH_PINS);
+
+        for (int i = 0; i < PIO_BATCH_PINS; i++)
+        {
+            reg = get_image_data(pio_pins[i], &bit);
+            check_pio(((*reg & bit) != 0) == pio_vals[i] && (*reg & PIO_HW_BIT));
+        }
+    }
+
+    //threads writing pins of the same port mustn't undo each other's writes
+    pthread_barrier_init(&start, NULL, PIO_THREADS+1);
+    for (int i = 0; i < PIO_THREADS; i++)
+    {
+        args[i] = (bench_thread_t) { pio_pins[i], 0, PIO_PATTERNS*16+1, 0, &start };
+        pthread_create(&threads[i], NULL, bench_thread, &args[i]);
+    }
+    pthread_barrier_wait(&start);
+    for (int i = 0; i < PIO_THREADS; i++) { pthread_join(threads[i], NULL); }
+    pthread_barrier_destroy(&start);
+
+    for (int i = 0; i < PIO_THREADS; i++)
+    {
+        reg = get_image_data(pio_pins[i], &bit);
+        check_pio(!args[i].errors && !(*reg & bit)); //the last write was a 0
+    }
+
+    //inputs change under the library, so shadows can't be used
+    set_gpio_shadow_mode(GPIO_SHADOW_OFF);
+    for (int k = 0; k < PIO_PATTERNS; k++)
+    {
+        for (int i = 0; i < PIO_BATCH_PINS; i++)
+        {
+            reg = get_image_data(pio_pins[i], &bit);
+            if ((k*5 >> (i % 5)) & 1) { *reg |= bit; }
+            else { *reg &= ~bit; }
+        }
+
+        read_gpio_vals(pio_pins, pio_vals, PIO_BATCH_PINS);
+        for (int i = 0; i < PIO_BATCH_PINS; i++)
+        {
+            int expected = (k*5 >> (i % 5)) & 1;
+            check_pio(pio_vals[i] == expected && read_gpio_val(pio_pins[i]) == expected);
+        }
+    }
+    set_gpio_shadow_mode(GPIO_SHADOW_ON);
+}
+
+// R8 pins through a register image of the PIO block (chip_gpio_pio.h) in the fake tree,
+// which is checked as well as timed
+static void bench_pio(long long n)
+{
+    char* names[PIO_BATCH_PINS] = { "LCD-D3", "LCD-D4", "LCD-D5", "LCD-D6", "LCD-D7",
+                                    "LCD-D10", "LCD-D11", "LCD-D12", "CSIPCK", "CSICK",
+                                    "CSIHSYNC", "CSIVSYNC", "CSID6", "PWM0" };
+    char path[256];
+    void* map = NULL;
+    int fd = GPIO_ERR;
+
+    snprintf(path, sizeof(path), "%s/pio", fake_root);
+    if (enable_gpio_pio(path) < GPIO_OK) { return; }
+
+    fd = open(path, O_RDWR);
+    map = mmap(NULL, GPIO_PIO_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) { disable_gpio_pio(); return; }
+    pio_image = (volatile uint32_t*) map;
+
+    pio_out = get_gpio_num("CSID7");
+    pio_in = get_gpio_num("LCD-D13");
+    setup_gpio_pin(pio_out, GPIO_DIR_OUT);
+    set_image_cfg(pio_out, GPIO_PIO_CFG_OUT);
+    for (int i = 0; i < PIO_BATCH_PINS; i++)
+    {
+        pio_pins[i] = get_gpio_num(names[i]);
+        setup_gpio_pin(pio_pins[i], GPIO_DIR_OUT);
+        set_image_cfg(pio_pins[i], GPIO_PIO_CFG_OUT);
+    }
+
+    check_pio_image();
+    check_pio(enable_gpio_pio(path) == GPIO_ERR && is_gpio_pio_pin(pio_out)); //in use
+
+    bench_op("pio_set_gpio_val", op_pio_set_gpio_val, n);
+    bench_op("pio_toggle_gpio_val", op_pio_toggle_gpio_val, n);
+    bench_op("pio_read_gpio_val", op_pio_read_gpio_val, n);
+    bench_op("pio_set_gpio_vals_14", op_pio_set_gpio_vals, n);
+    bench_op("pio_read_gpio_vals_14", op_pio_read_gpio_vals, n);
+
+    close_gpio_pins(pio_pins, PIO_BATCH_PINS);
+    close_gpio_pin(pio_out);
+    disable_gpio_pio();
+    munmap(map, GPIO_PIO_SIZE);
+}
+
+static long long thread_cpu_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec*NS_PER_SEC + ts.tv_nsec;
+}
+
+static void sleep_ns(long long ns)
+{
+    nanosleep(&(struct timespec) { ns / NS_PER_SEC, ns % NS_PER_SEC }, NULL);
+}
+
+// Run a workload against the callback manager polling one way, counting pulses with a
+// measurement channel. The polling thread's CPU time is the process's less this thread's.
+static void bench_polling(int mode, int workload)
+{
+    poll_result_t* r = &poll_results[mode][workload];
+    pin_measurement_t m;
+    int fd = open_fake_value(xio_cb);
+    long long wall = 0;
+    long long cpu = 0;
+    long long own_cpu = 0;
+    unsigned int seed = 1; //the same pulses for every mode
+    struct timespec ts;
+
+    pwrite(fd, "0", 1, 0);
+
+    if (mode == 1) { set_callback_polling_delay(POLL_FIXED_DELAY_US); }
+    if (mode >= 2)
+    {
+        set_callback_adaptive_polling(POLL_ADAPTIVE_MIN_US,
+                                      mode == 2 ? POLL_ADAPTIVE_MAX_US :
+                                                  POLL_ADAPTIVE_SLOW_MAX_US,
+                                      POLL_ADAPTIVE_QUIET_US);
+    }
+
+    initialize_callback_manager();
+    enable_gpio_measurement(xio_cb, 0);
+    start_callback_manager();
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    cpu = ts.tv_sec*NS_PER_SEC + ts.tv_nsec;
+    own_cpu = thread_cpu_ns();
+    wall = now_ns();
+
+    if (workload == 0) { sleep_ns(POLL_IDLE_NS); }
+    else
+    {
+        for (int b = 0; b < POLL_BURSTS; b++)
+        {
+            sleep_ns(POLL_BURST_GAP_NS);
+            for (int p = 0; p < POLL_BURST_PULSES; p++)
+            {
+                pwrite(fd, "1", 1, 0);
+                sleep_ns(POLL_PULSE_NS);
+                pwrite(fd, "0", 1, 0);
+
+                //uneven, so the pulses can't line up with the polling interval
+                sleep_ns(POLL_PULSE_NS + rand_r(&seed) % POLL_PULSE_NS);
+            }
+        }
+        r->pulses = POLL_BURSTS*POLL_BURST_PULSES;
+    }
+
+    sleep_ns(2*POLL_ADAPTIVE_SLOW_MAX_US*1000LL); //let the last pulse be seen
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    cpu = ts.tv_sec*NS_PER_SEC + ts.tv_nsec - cpu - (thread_cpu_ns() - own_cpu);
+    wall = now_ns() - wall;
+
+    get_gpio_measurement(xio_cb, &m);
+    terminate_callback_manager();
+    set_callback_polling_delay(0);
+    set_callback_adaptive_polling(0, 0, 0);
+    close(fd);
+
+    r->cpu_s_per_hour = (double) cpu / (double) wall * 3600.0;
+    r->missed = r->pulses > (long long) m.rising_edges ?
+                r->pulses - (long long) m.rising_edges : 0;
+}
+
+static gpio_waiter_t* bench_waiter;
+static atomic_llong wait_ns; //set by the waiting thread when it sees an edge
+static atomic_llong wait_count;
+static atomic_int wait_stop;
+
+static void* wait_thread(void* arg)
+{
+    gpio_edge_t edge;
+
+    while (!atomic_load(&wait_stop))
+    {
+        if (wait_gpio_waiter(bench_waiter, WAIT_TIMEOUT_NS, &edge, 1) > 0)
+        {
+            atomic_store(&wait_ns, now_ns());
+            atomic_fetch_add(&wait_count, 1);
+        }
+    }
+
+    return NULL;
+}
+
+// Time from a value file changing to a thread blocked on a waiter waking up with the
+// edge, and the CPU time a wait that times out costs (it should sleep throughout)
+static void bench_wait(long long n)
+{
+    long long* samples = (long long*) malloc(n*sizeof(long long));
+    long long cpu[WAIT_TIMEOUTS];
+    long long errors = 0;
+    long long done = 0;
+    long long count = 0;
+    long long start = 0;
+    pthread_t thread;
+    char path[256];
+    char val = '0';
+    int fd = GPIO_ERR;
+
+    snprintf(path, sizeof(path), "%s%s%d/value", fake_root, GPIO_SYSFS_PATH,
+             FAKE_XIO_BASE + xio_cb - (XIO_U14_FIRST_PIN_ALL));
+    fd = open(path, O_WRONLY);
+    pwrite(fd, &val, 1, 0);
+
+    bench_waiter = create_gpio_waiter();
+    add_gpio_wait(bench_waiter, xio_cb, GPIO_EDGE_BOTH);
+    atomic_store(&wait_stop, 0);
+    pthread_create(&thread, NULL, wait_thread, NULL);
+
+    for (long long i = 0; i < n; i++)
+    {
+        count = atomic_load(&wait_count);
+        val = val == '0' ? '1' : '0';
+
+        start = now_ns();
+        pwrite(fd, &val, 1, 0);
+
+        while (atomic_load(&wait_count) == count && now_ns()-start < CALLBACK_TIMEOUT_NS)
+        { sched_yield(); }
+
+        if (atomic_load(&wait_count) == count) { errors++; continue; }
+        samples[done++] = atomic_load(&wait_ns) - start;
+    }
+
+    atomic_store(&wait_stop, 1);
+    pthread_join(thread, NULL);
+    free_gpio_waiter(bench_waiter);
+    close(fd);
+
+    record_result("wait_edge_latency", samples, done, errors);
+
+    //the waiter is set up beforehand, so this is only the cost of sleeping and waking
+    bench_waiter = create_gpio_waiter();
+    add_gpio_wait(bench_waiter, xio_in, GPIO_EDGE_BOTH);
+    errors = 0;
+    for (int i = 0; i < WAIT_TIMEOUTS; i++)
+    {
+        gpio_edge_t edge;
+
+        start = thread_cpu_ns();
+        if (wait_gpio_waiter(bench_waiter, WAIT_TIMEOUT_NS, &edge, 1) != 0) { errors++; }
+        cpu[i] = thread_cpu_ns() - start;
+    }
+    free_gpio_waiter(bench_waiter);
+
+    record_result("wait_timeout_20ms_cpu", cpu, WAIT_TIMEOUTS, errors);
+
+    free(samples);
+}
+
+static void print_results(FILE* out)
+{
+    fprintf(out, "%-24s %10s %8s %12s %10s %10s %10s %10s\n", "operation", "iterations",
+            "errors", "ops/sec", "p50 ns", "p99 ns", "p999 ns", "max ns");
+
+    for (int i = 0; i < num_results; i++)
+    {
+        bench_result_t* r = &results[i];
+        fprintf(out, "%-24s %10lld %8lld %12.0f %10lld %10lld %10lld %10lld\n", r->name,
+                r->iterations, r->errors, r->ops_per_sec, r->p50_ns, r->p99_ns,
+                r->p999_ns, r->max_ns);
+    }
+
+    fprintf(out, "\n%-24s %10s %8s %12s %12s\n", "library counters", "calls", "errors",
+            "syscalls", "mean ns");
+
+    for (int op = 0; op < GPIO_STAT_NUM_OPS; op++)
+    {
+        gpio_op_stats_t* o = &lib_stats.op[op];
+        fprintf(out, "%-24s %10llu %8llu %12llu %12.0f\n", stat_op_names[op],
+                (unsigned long long) o->count, (unsigned long long) o->errors,
+                (unsigned long long) o->syscalls,
+                o->count ? (double) o->time_ns / (double) o->count : 0.0);
+    }
+
+    fprintf(out, "poll passes: %llu (mean %.0f ns), events: %llu, dropped: %llu\n",
+            (unsigned long long) lib_stats.poll_passes,
+            lib_stats.poll_passes ?
+            (double) lib_stats.poll_time_ns / (double) lib_stats.poll_passes : 0.0,
+            (unsigned long long) lib_stats.events,
+            (unsigned long long) lib_stats.events_dropped);
+
+    fprintf(out, "\n%-24s %12s %12s %12s\n", "syscalls per", "read batch", "bus write",
+            "poll pass");
+    for (int b = GPIO_BATCH_FDS; b <= GPIO_BATCH_URING; b++)
+    {
+        fprintf(out, "%-24s %12.2f %12.2f %12.2f\n", batch_backend_names[b],
+                batch_syscalls[b][0], batch_syscalls[b][1], batch_syscalls[b][2]);
+    }
+
+    fprintf(out, "\n%-24s %12s %12s %12s\n", "polling", "workload", "cpu s/hour",
+            "missed");
+    for (int mode = 0; mode < POLL_MODES; mode++)
+    {
+        for (int w = 0; w < POLL_WORKLOADS; w++)
+        {
+            poll_result_t* r = &poll_results[mode][w];
+            char missed[32];
+
+            snprintf(missed, sizeof(missed), "%lld/%lld", r->missed, r->pulses);
+            fprintf(out, "%-24s %12s %12.1f %12s\n", poll_mode_names[mode],
+                    poll_workload_names[w], r->cpu_s_per_hour, missed);
+        }
+    }
+
+    fprintf(out, "\nPIO register image: %d of %d check(s) failed\n", pio_failures,
+            pio_checks);
+
+    fprintf(out, "\n%-24s %12s %12s %12s %12s\n", "threaded", "threads", "ops/sec",
+            "scaling", "errors");
+    for (int op = 0; op < THREAD_OPS; op++)
+    {
+        for (int c = 0; c < num_thread_counts; c++)
+        {
+            thread_result_t* r = &thread_results[op][c];
+
+            fprintf(out, "%-24s %12d %12.0f %12.2f %12lld\n", thread_op_names[op],
+                    thread_counts[c], r->ops_per_sec,
+                    r->ops_per_sec / thread_results[op][0].ops_per_sec, r->errors);
+        }
+    }
+
+    fprintf(out, "\nCallback histograms and shared toggles: %d check(s) failed\n",
+            check_failures);
+}
+
+static void write_json(FILE* out, long long iterations)
+{
+    fprintf(out, "{\n  \"library_version\": \"%s\",\n", CHIP_GPIO_VERSION);
+    fprintf(out, "  \"backend\": \"fake-sysfs\",\n");
+    fprintf(out, "  \"iterations\": %lld,\n  \"results\": [\n", iterations);
+
+    for (int i = 0; i < num_results; i++)
+    {
+        bench_result_t* r = &results[i];
+        fprintf(out, "    {\"name\": \"%s\", \"iterations\": %lld, \"errors\": %lld, "
+                "\"ops_per_sec\": %.1f, \"mean_ns\": %.1f, \"p50_ns\": %lld, "
+                "\"p99_ns\": %lld, \"p999_ns\": %lld, \"max_ns\": %lld}%s\n",
+                r->name, r->iterations, r->errors, r->ops_per_sec, r->mean_ns,
+                r->p50_ns, r->p99_ns, r->p999_ns, r->max_ns,
+                i < num_results-1 ? "," : "");
+    }
+
+    fprintf(out, "  ],\n  \"library_counters\": {\n");
+
+    for (int op = 0; op < GPIO_STAT_NUM_OPS; op++)
+    {
+        gpio_op_stats_t* o = &lib_stats.op[op];
+        fprintf(out, "    \"%s\": {\"calls\": %llu, \"errors\": %llu, \"syscalls\": %llu, "
+                "\"time_ns\": %llu},\n", stat_op_names[op], (unsigned long long) o->count,
+                (unsigned long long) o->errors, (unsigned long long) o->syscalls,
+                (unsigned long long) o->time_ns);
+    }
+
+    fprintf(out, "    \"poll_passes\": %llu, \"events\": %llu, \"events_dropped\": %llu\n",
+            (unsigned long long) lib_stats.poll_passes,
+            (unsigned long long) lib_stats.events,
+            (unsigned long long) lib_stats.events_dropped);
+    fprintf(out, "  },\n  \"batch_syscalls\": {\n");
+
+    for (int b = GPIO_BATCH_FDS; b <= GPIO_BATCH_URING; b++)
+    {
+        fprintf(out, "    \"%s\": {\"read_batch\": %.2f, \"bus_write\": %.2f, "
+                "\"poll_pass\": %.2f}%s\n", batch_backend_names[b], batch_syscalls[b][0],
+                batch_syscalls[b][1], batch_syscalls[b][2],
+                b < GPIO_BATCH_URING ? "," : "");
+    }
+
+    fprintf(out, "  },\n  \"pio_checks\": {\"run\": %d, \"failed\": %d},\n", pio_checks,
+            pio_failures);
+    fprintf(out, "  \"other_checks\": {\"failed\": %d},\n", check_failures);
+    fprintf(out, "  \"polling\": {\n");
+
+    for (int mode = 0; mode < POLL_MODES; mode++)
+    {
+        fprintf(out, "    \"%s\": {", poll_mode_names[mode]);
+        for (int w = 0; w < POLL_WORKLOADS; w++)
+        {
+            poll_result_t* r = &poll_results[mode][w];
+            fprintf(out, "\"%s\": {\"cpu_s_per_hour\": %.1f, \"pulses\": %lld, "
+                    "\"missed\": %lld}%s", poll_workload_names[w], r->cpu_s_per_hour,
+                    r->pulses, r->missed, w < POLL_WORKLOADS-1 ? ", " : "");
+        }
+        fprintf(out, "}%s\n", mode < POLL_MODES-1 ? "," : "");
+    }
+
+    fprintf(out, "  },\n  \"threads\": {\n");
+
+    for (int op = 0; op < THREAD_OPS; op++)
+    {
+        fprintf(out, "    \"%s\": {", thread_op_names[op]);
+        for (int c = 0; c < num_thread_counts; c++)
+        {
+            thread_result_t* r = &thread_results[op][c];
+            fprintf(out, "\"%d\": {\"ops_per_sec\": %.1f, \"scaling\": %.2f, "
+                    "\"errors\": %lld}%s", thread_counts[c], r->ops_per_sec,
+                    r->ops_per_sec / thread_results[op][0].ops_per_sec, r->errors,
+                    c < num_thread_counts-1 ? ", " : "");
+        }
+        fprintf(out, "}%s\n", op < THREAD_OPS-1 ? "," : "");
+    }
+
+    fprintf(out, "  }\n}\n");
+}
+
+int main(int argc, char** argv)
+{
+    long long n = DEFAULT_ITERATIONS;
+    char* json_path = NULL;
+    FILE* json = NULL;
+    int opt = 0;
+
+    int max_threads = 0; //the number of CPUs online
+
+    while ((opt = getopt(argc, argv, "n:j:t:")) != -1)
+    {
+        if (opt == 'n') { n = atoll(optarg); }
+        else if (opt == 'j') { json_path = optarg; }
+        else if (opt == 't') { max_threads = atoi(optarg); }
+        else
+        {
+            fprintf(stderr, "Usage: %s [-n iterations] [-j results.json] [-t threads]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    if (n < 1) { n = DEFAULT_ITERATIONS; }
+    set_thread_counts(max_threads);
+
+    if (make_fake_sysfs() < GPIO_OK) { remove_fake_sysfs(); return 1; }
+
+    set_gpio_sysfs_root(fake_root);
+    if (initialize_gpio_interface() < GPIO_OK)
+    {
+        fprintf(stderr, "Could not initialize against the fake sysfs tree\n");
+        remove_fake_sysfs();
+        return 1;
+    }
+
+    xio_out = get_gpio_num("XIO-P7");
+    xio_in = get_gpio_num("XIO-P1");
+    xio_cb = get_gpio_num("XIO-P3");
+
+    silence_stderr();
+
+    setup_gpio_pin(xio_out, GPIO_DIR_OUT);
+    setup_gpio_pin(xio_in, GPIO_DIR_IN);
+    setup_gpio_pin(xio_cb, GPIO_DIR_IN);
+
+    bench_op("get_gpio_num", op_get_gpio_num, n);
+    bench_op("is_gpio_pin_open", op_is_gpio_pin_open, n);
+    bench_open_close(n);
+    bench_setup_pins(n < 1000 ? n : 1000);
+    bench_op("set_gpio_dir", op_set_gpio_dir, n);
+    bench_op("get_gpio_dir", op_get_gpio_dir, n);
+    bench_op("set_gpio_val", op_set_gpio_val, n);
+    bench_op("read_gpio_val", op_read_gpio_val, n);
+    bench_op("read_gpio_val_n", op_read_gpio_val_n, n);
+    bench_op("toggle_gpio_val", op_toggle_gpio_val, n);
+    bench_op("set_gpio_val_unchanged", op_set_gpio_val_same, n); //skipped (shadowed)
+    bench_op("read_gpio_val_output", op_read_gpio_val_out, n);
+    set_gpio_shadow_mode(GPIO_SHADOW_VERIFY); //every toggle reads the hardware
+    bench_op("toggle_gpio_val_verify", op_toggle_gpio_val, n);
+    set_gpio_shadow_mode(GPIO_SHADOW_ON);
+
+    bench_bus = create_gpio_bus_n(bus_names, 8);
+    setup_gpio_bus(bench_bus, GPIO_DIR_OUT);
+    bench_op("bus_write_8bit", op_bus_write, n);
+    bench_op("bus_read_8bit", op_bus_read, n);
+    destroy_gpio_bus(bench_bus);
+
+    bench_chain = create_shift_register(get_gpio_num("CSID0"), get_gpio_num("CSID1"),
+                                        get_gpio_num("CSID2"), 2, SHIFT_OUT);
+    setup_shift_register(bench_chain);
+    bench_op("shift_register_16bit", op_shift_register_write, n);
+    destroy_shift_register(bench_chain);
+
+    bench_batch(n);
+    bench_threads(n);
+    bench_pio(n);
+    bench_callback_latency(n < 1000 ? n : 1000); //each one waits on the poller
+    bench_wait(n < 1000 ? n : 1000);
+    bench_callback_hogged(0, n < 200 ? n : 200); //each one waits out the hog's callback
+    bench_callback_hogged(2, n < 200 ? n : 200);
+    bench_callback_fanout(0, n < 1000 ? n : 1000);
+    bench_callback_fanout(1, n < 1000 ? n : 1000);
+    bench_callback_managers(n < 1000 ? n : 1000);
+
+    //these take as long as their workloads, whatever n is
+    for (int mode = 0; mode < POLL_MODES; mode++)
+    {
+        for (int w = 0; w < POLL_WORKLOADS; w++) { bench_polling(mode, w); }
+    }
+    get_gpio_stats(&lib_stats);
+
+    terminate_gpio_interface();
+    restore_stderr(pio_failures || check_failures);
+    remove_fake_sysfs();
+
+    print_results(stdout);
+
+    if (json_path != NULL)
+    {
+        json = strcmp(json_path, "-") == 0 ? stdout : fopen(json_path, "w");
+        if (json == NULL) { perror(json_path); return 1; }
+        write_json(json, n);
+        if (json != stdout) { fclose(json); }
+    }
+
+    return pio_failures || check_failures ? 1 : 0;
+}
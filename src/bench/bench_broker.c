@@ -0,0 +1,376 @@
+/*
+ * Copyright (c) 2017, Bryan Haley
+ * This code is dual licensed (GPLv2 and Simplified BSD). Use the license that works
+ * best for you. Check LICENSE.GPL and LICENSE.BSD for more details.
+ *
+ * bench_broker.c
+ * Runs a broker (chip_gpio_broker.h) and two client processes against a fake sysfs
+ * tree. Checks that pins are shared and released properly, that only owners may write,
+ * that clients can't write the shared snapshot, and that subscribed changes arrive; then times reads, writes and event delivery
+ * through the broker. Exits with 1 if a check fails.
+ *
+ * Usage: bench_gpio_broker [-n iterations]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "chip_gpio.h"
+#include "chip_gpio_error.h"
+#include "chip_gpio_broker.h"
+
+#define FAKE_XIO_BASE 1013 //what the CHIP's 4.4 kernel uses
+#define FAKE_R8_PINS 192 //ports A to F
+#define DEFAULT_ITERATIONS 10000
+#define EVENT_ITERATIONS 100 //each one waits for a poll pass of the broker
+#define TIMEOUT_MS 1000
+#define NS_PER_SEC 1000000000LL
+
+static char fake_root[] = "/tmp/chipgpio_bench_broker.XXXXXX";
+static char socket_path[256];
+static int failures;
+
+static inline long long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec*NS_PER_SEC + ts.tv_nsec;
+}
+
+static int write_fake_file(char* path, char* contents)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) { perror(path); return GPIO_ERR; }
+    if (write(fd, contents, strlen(contents)) < 0) { perror(path); }
+    close(fd);
+    return GPIO_OK;
+}
+
+//Change a fake value file in place; truncating it could let the broker read it empty
+static void set_fake_value(char* path, int val)
+{
+    int fd = open(path, O_WRONLY);
+    char c = '0' + val;
+    if (fd < 0 || pwrite(fd, &c, 1, 0) < 0) { perror(path); }
+    close(fd);
+}
+
+static int make_fake_pin(int kern)
+{
+    char path[256];
+
+    snprintf(path, sizeof(path), "%s%s%d", fake_root, GPIO_SYSFS_PATH, kern);
+    if (mkdir(path, 0755) < 0) { perror(path); return GPIO_ERR; }
+
+    snprintf(path, sizeof(path), "%s%s%d/value", fake_root, GPIO_SYSFS_PATH, kern);
+    if (write_fake_file(path, "0\n") < 0) { return GPIO_ERR; }
+
+    snprintf(path, sizeof(path), "%s%s%d/direction", fake_root, GPIO_SYSFS_PATH, kern);
+    return write_fake_file(path, "in\n");
+}
+
+//Build just enough of /sys/class/gpio for the library to initialize and run
+static int make_fake_sysfs()
+{
+    char path[256];
+    char base[16];
+
+    if (mkdtemp(fake_root) == NULL) { perror("mkdtemp"); return GPIO_ERR; }
+
+    snprintf(path, sizeof(path), "%s/sys", fake_root);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/sys/class", fake_root);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/sys/class/gpio", fake_root);
+    mkdir(path, 0755);
+
+    snprintf(path, sizeof(path), "%s%s", fake_root, GPIO_EXPORT_PATH);
+    write_fake_file(path, "");
+    snprintf(path, sizeof(path), "%s%s", fake_root, GPIO_UNEXPORT_PATH);
+    write_fake_file(path, "");
+
+    snprintf(path, sizeof(path), "%s%s%d", fake_root, GPIOCHIP_SYSFS_PATH, FAKE_XIO_BASE);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s%s%d/base", fake_root, GPIOCHIP_SYSFS_PATH,
+             FAKE_XIO_BASE);
+    snprintf(base, sizeof(base), "%d\n", FAKE_XIO_BASE);
+    write_fake_file(path, base);
+    snprintf(path, sizeof(path), "%s%s%d/label", fake_root, GPIOCHIP_SYSFS_PATH,
+             FAKE_XIO_BASE);
+    write_fake_file(path, "pcf8574a\n");
+
+    for (int i = 0; i < FAKE_R8_PINS; i++)
+    { if (make_fake_pin(i) < 0) { return GPIO_ERR; } }
+
+    for (int i = 0; i < NUM_XIO_PINS; i++)
+    { if (make_fake_pin(FAKE_XIO_BASE+i) < 0) { return GPIO_ERR; } }
+
+    return GPIO_OK;
+}
+
+static int remove_entry(const char* path, const struct stat* sb, int flag, struct FTW* ftw)
+{
+    return remove(path);
+}
+
+static void check(int ok, char* what)
+{
+    printf("%-56s %s\n", what, ok ? "ok" : "FAILED");
+    if (!ok) { failures++; }
+}
+
+//Whether this client's mapping of the broker's snapshot is read-only and can't be made
+//writable. Its memfd shows up in /proc/self/maps by name.
+static int is_snapshot_read_only()
+{
+    FILE* maps = fopen("/proc/self/maps", "r");
+    char line[512];
+    char perms[8];
+    unsigned long start = 0;
+    unsigned long end = 0;
+    int found = 0;
+    int read_only = 1;
+
+    if (maps == NULL) { perror("/proc/self/maps"); return 0; }
+
+    while (fgets(line, sizeof(line), maps) != NULL)
+    {
+        if (strstr(line, "memfd:chipgpio_broker ") == NULL ||
+            sscanf(line, "%lx-%lx %7s", &start, &end, perms) != 3) { continue; }
+
+        found = 1;
+        if (perms[1] == 'w' ||
+            mprotect((void*) start, end-start, PROT_READ | PROT_WRITE) == GPIO_OK)
+        { read_only = 0; }
+    }
+    fclose(maps);
+
+    return found && read_only;
+}
+
+static int compare_ll(const void* a, const void* b)
+{
+    long long x = *(const long long*) a;
+    long long y = *(const long long*) b;
+    return (x > y) - (x < y);
+}
+
+static void print_latency(char* name, long long* samples, long long n)
+{
+    qsort(samples, n, sizeof(long long), compare_ll);
+    printf("%-24s %10lld %10lld %10lld %10lld\n", name, n, samples[(long long) (0.5*(n-1))],
+           samples[(long long) (0.99*(n-1))], samples[n-1]);
+}
+
+static void stop_broker(int sig)
+{
+    stop_gpio_broker();
+}
+
+static void run_broker()
+{
+    int devnull = open("/dev/null", O_WRONLY);
+
+    //pins in the fake tree look already open, which the library warns about
+    dup2(devnull, STDERR_FILENO);
+    set_gpio_sysfs_root(fake_root);
+    unsetenv(GPIO_BROKER_ENV);
+
+    if (initialize_gpio_interface() < GPIO_OK) { _exit(1); }
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGTERM, stop_broker);
+    run_gpio_broker(socket_path);
+    terminate_gpio_interface();
+    _exit(0);
+}
+
+//Second client: opens the pin, says so, then holds it until told to exit
+static void run_second_client(int pin, int ready_fd, int done_fd)
+{
+    char c = 0;
+
+    //the connection inherited from the parent is the parent's; make one of our own
+    disconnect_gpio_broker();
+    if (connect_gpio_broker(socket_path) < GPIO_OK ||
+        setup_gpio_pin(pin, GPIO_DIR_OUT) < GPIO_OK)
+    { _exit(1); }
+
+    if (write(ready_fd, "r", 1) < 0 || read(done_fd, &c, 1) < 0) { _exit(1); }
+    _exit(0);
+}
+
+//Connect, retrying while the broker starts up
+static int connect_when_ready()
+{
+    long long deadline = now_ns() + TIMEOUT_MS*1000000LL;
+
+    while (access(socket_path, F_OK) < GPIO_OK && now_ns() < deadline)
+    { usleep(1000); }
+
+    return connect_gpio_broker(socket_path);
+}
+
+//Wait for an event on pin, up to TIMEOUT_MS. Returns its value, or GPIO_ERR.
+static int wait_for_event(int pin)
+{
+    struct pollfd pfd = { get_gpio_broker_event_fd(), POLLIN, 0 };
+    gpio_broker_event_t events[8];
+    long long deadline = now_ns() + TIMEOUT_MS*1000000LL;
+    int n = 0;
+
+    while (now_ns() < deadline)
+    {
+        poll(&pfd, 1, TIMEOUT_MS);
+        n = read_gpio_broker_events(events, 8);
+        for (int i = 0; i < n; i++)
+        { if (events[i].pin == pin) { return events[i].new_val; } }
+    }
+
+    return GPIO_ERR;
+}
+
+static void run_checks(long long n, int shared_pin, int event_pin, int event_kern)
+{
+    gpio_error_t err;
+    char path[256];
+    long long* samples = (long long*) malloc(n*sizeof(long long));
+    long long start = 0;
+    long long deadline = 0;
+    long long i = 0;
+    int ready[2];
+    int done[2];
+    pid_t second = 0;
+    struct stat st;
+    char c = 0;
+
+    if (pipe(ready) < 0 || pipe(done) < 0) { perror("pipe"); failures++; return; }
+
+    second = fork();
+    if (second == 0) { run_second_client(shared_pin, ready[1], done[0]); }
+    if (read(ready[0], &c, 1) != 1) { check(0, "second client opened the pin"); }
+
+    check(stat(socket_path, &st) == GPIO_OK &&
+          (st.st_mode & 0777) == GPIO_BROKER_SOCKET_MODE, "socket has the broker's mode");
+    check(is_snapshot_read_only(), "clients can't write the snapshot");
+
+    //this process hasn't opened the pin, so it may only read it
+    check(read_gpio_val(shared_pin) == 0, "non-owner can read a shared pin");
+    check(set_gpio_val(shared_pin, 1) == GPIO_ERR &&
+          get_gpio_last_error(&err) == GPIO_E_NOT_OWNER, "non-owner can't write it");
+
+    check(open_gpio_pin(shared_pin) == GPIO_OK && is_gpio_pin_open(shared_pin),
+          "a second owner can open it");
+    check(set_gpio_val(shared_pin, 1) == 1 && read_gpio_val(shared_pin) == 1,
+          "owner writes are seen by reads");
+    check(close_gpio_pin(shared_pin) == GPIO_OK && !is_gpio_pin_open(shared_pin) &&
+          read_gpio_val(shared_pin) == 1, "pin stays open for the other owner");
+
+    //the second client exits without closing; the broker releases its pin
+    if (write(done[1], "d", 1) < 0) { perror("write"); }
+    waitpid(second, NULL, 0);
+    deadline = now_ns() + TIMEOUT_MS*1000000LL;
+    while (read_gpio_val(shared_pin) != GPIO_ERR && now_ns() < deadline) { usleep(1000); }
+    check(read_gpio_val(shared_pin) == GPIO_ERR, "pins of exited clients are released");
+
+    //changes to a subscribed pin are pushed
+    check(setup_gpio_pin(event_pin, GPIO_DIR_IN) >= GPIO_OK &&
+          subscribe_gpio_broker(event_pin) == GPIO_OK, "subscribe to an input");
+    snprintf(path, sizeof(path), "%s%s%d/value", fake_root, GPIO_SYSFS_PATH, event_kern);
+    set_fake_value(path, 1);
+    check(wait_for_event(event_pin) == 1 && read_gpio_val(event_pin) == 1,
+          "subscribed changes arrive");
+
+    check(setup_gpio_pin(shared_pin, GPIO_DIR_OUT) >= GPIO_OK, "owner can set up a pin");
+
+    printf("\n%-24s %10s %10s %10s %10s\n", "operation", "iterations", "p50 ns", "p99 ns",
+           "max ns");
+
+    for (long long i = 0; i < n; i++)
+    {
+        start = now_ns();
+        read_gpio_val(shared_pin);
+        samples[i] = now_ns() - start;
+    }
+    print_latency("broker_read", samples, n);
+
+    for (long long i = 0; i < n; i++)
+    {
+        start = now_ns();
+        set_gpio_val(shared_pin, i & 1);
+        samples[i] = now_ns() - start;
+    }
+    print_latency("broker_write", samples, n);
+
+    for (i = 0; i < EVENT_ITERATIONS && i < n; i++)
+    {
+        set_fake_value(path, i & 1);
+        start = now_ns();
+        if (wait_for_event(event_pin) != (i & 1))
+        { check(0, "every change arrives"); break; }
+        samples[i] = now_ns() - start;
+    }
+    if (i > 0) { print_latency("broker_event", samples, i); }
+
+    free(samples);
+}
+
+int main(int argc, char** argv)
+{
+    long long n = DEFAULT_ITERATIONS;
+    pid_t broker = 0;
+    int shared_pin = GPIO_ERR;
+    int event_pin = GPIO_ERR;
+    int event_kern = GPIO_ERR;
+    int opt = 0;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1)
+    {
+        if (opt == 'n') { n = atoll(optarg); }
+        else
+        {
+            fprintf(stderr, "Usage: %s [-n iterations]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (n < 1) { n = DEFAULT_ITERATIONS; }
+
+    if (make_fake_sysfs() < GPIO_OK) { return 1; }
+    snprintf(socket_path, sizeof(socket_path), "%s/broker.sock", fake_root);
+
+    //look up the pins (and where the broker will find the input's value) directly
+    set_gpio_sysfs_root(fake_root);
+    if (initialize_gpio_interface() < GPIO_OK) { return 1; }
+    shared_pin = get_gpio_num("LCD-D4");
+    event_pin = get_gpio_num("LCD-D5");
+    event_kern = get_gpio_kern_num(event_pin);
+    terminate_gpio_interface();
+
+    broker = fork();
+    if (broker == 0) { run_broker(); }
+
+    if (connect_when_ready() < GPIO_OK) { failures++; }
+    else
+    {
+        run_checks(n, shared_pin, event_pin, event_kern);
+        disconnect_gpio_broker();
+    }
+
+    kill(broker, SIGTERM);
+    waitpid(broker, NULL, 0);
+    nftw(fake_root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+
+    printf("\n%d check(s) failed\n", failures);
+
+    return failures ? 1 : 0;
+}
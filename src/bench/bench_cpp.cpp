@@ -0,0 +1,232 @@
+/*
+ * Copyright (c) 2017, Bryan Haley
+ * This code is dual licensed (GPLv2 and Simplified BSD). Use the license that works
+ * best for you. Check LICENSE.GPL and LICENSE.BSD for more details.
+ *
+ * bench_cpp.cpp
+ * Compares the C++ layer (chip_gpio.hpp) with the C interface it wraps: the same reads
+ * and writes through read_gpio_val/set_gpio_val, chipgpio::Pin and chipgpio::StaticPin,
+ * and a word written through a gpio_bus_t and a chipgpio::PinGroup. Like bench_gpio, it
+ * runs against a fake sysfs tree, so the numbers are the library's own overhead.
+ *
+ * Usage: bench_gpio_cpp [-n iterations] [-j results.json]
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <ftw.h>
+#include <sys/stat.h>
+#include "chip_gpio.hpp"
+
+extern "C"
+{
+#include "chip_gpio_bus.h"
+}
+
+#define FAKE_XIO_BASE 1013 //what the CHIP's 4.4 kernel uses
+#define FAKE_R8_PINS 192 //ports A to F
+#define DEFAULT_ITERATIONS 10000
+
+using namespace chipgpio;
+
+struct bench_result_t
+{
+    std::string name;
+    long long iterations;
+    long long errors;
+    double ops_per_sec;
+    double mean_ns;
+    long long p50_ns;
+    long long p99_ns;
+    long long max_ns;
+};
+
+static std::vector<bench_result_t> results;
+static char fake_root[] = "/tmp/chipgpio_bench_cpp.XXXXXX";
+
+static inline long long now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        Clock::now().time_since_epoch()).count();
+}
+
+static void write_fake_file(const std::string& path, const char* contents)
+{
+    FILE* f = fopen(path.c_str(), "w");
+    if (f == NULL) { perror(path.c_str()); return; }
+    fputs(contents, f);
+    fclose(f);
+}
+
+static void make_fake_pin(int kern)
+{
+    std::string dir = std::string(fake_root) + GPIO_SYSFS_PATH + std::to_string(kern);
+    mkdir(dir.c_str(), 0755);
+    write_fake_file(dir + "/value", "0\n");
+    write_fake_file(dir + "/direction", "in\n");
+}
+
+//Just enough of /sys/class/gpio for the library to initialize and run
+static int make_fake_sysfs()
+{
+    std::string root;
+    std::string chip;
+
+    if (mkdtemp(fake_root) == NULL) { perror("mkdtemp"); return GPIO_ERR; }
+
+    root = fake_root;
+    mkdir((root + "/sys").c_str(), 0755);
+    mkdir((root + "/sys/class").c_str(), 0755);
+    mkdir((root + GPIO_CLASS_PATH).c_str(), 0755);
+    write_fake_file(root + GPIO_EXPORT_PATH, "");
+    write_fake_file(root + GPIO_UNEXPORT_PATH, "");
+
+    chip = root + GPIOCHIP_SYSFS_PATH + std::to_string(FAKE_XIO_BASE);
+    mkdir(chip.c_str(), 0755);
+    write_fake_file(chip + "/base", (std::to_string(FAKE_XIO_BASE) + "\n").c_str());
+    write_fake_file(chip + "/label", "pcf8574a\n");
+
+    for (int i = 0; i < FAKE_R8_PINS; i++) { make_fake_pin(i); }
+    for (int i = 0; i < NUM_XIO_PINS; i++) { make_fake_pin(FAKE_XIO_BASE+i); }
+
+    return GPIO_OK;
+}
+
+static int remove_entry(const char* path, const struct stat* sb, int flag, struct FTW* ftw)
+{
+    return remove(path);
+}
+
+//Time op once per iteration. op returns false (or throws) on failure.
+template <typename Op>
+static void bench_op(const char* name, long long n, Op op)
+{
+    std::vector<long long> samples(n);
+    bench_result_t r { name, n, 0, 0.0, 0.0, 0, 0, 0 };
+    long long total = 0;
+    long long start = 0;
+
+    for (long long i = 0; i < n; i++)
+    {
+        start = now_ns();
+        try { if (!op(i)) { r.errors++; } }
+        catch (const Error&) { r.errors++; }
+        samples[i] = now_ns() - start;
+    }
+
+    std::sort(samples.begin(), samples.end());
+    for (long long s : samples) { total += s; }
+
+    r.mean_ns = (double) total/n;
+    r.ops_per_sec = total ? (double) n*1e9/total : 0.0;
+    r.p50_ns = samples[(long long) (0.50*(n-1) + 0.5)];
+    r.p99_ns = samples[(long long) (0.99*(n-1) + 0.5)];
+    r.max_ns = samples[n-1];
+    results.push_back(r);
+}
+
+static void run(long long n)
+{
+    Interface gpio(fake_root);
+    int c_pin = get_gpio_num((char*) "LCD-D4");
+    const char* bus_names[8] = { "LCD-D10", "LCD-D11", "LCD-D12", "LCD-D13", "LCD-D14",
+                                 "LCD-D15", "LCD-D18", "LCD-D19" };
+    gpio_bus_t* bus = create_gpio_bus_n((char**) bus_names, 8);
+
+    setup_gpio_pin(c_pin, GPIO_DIR_OUT);
+    setup_gpio_bus(bus, GPIO_DIR_OUT);
+
+    Pin pin("LCD-D5", Direction::Out);
+    StaticPin<pins::LCD_D6> static_pin(Direction::Out);
+    PinGroup group({ "LCD-D20", "LCD-D21", "LCD-D22", "LCD-D23", "LCD-CLK", "LCD-DE",
+                     "CSID0", "CSID1" }, Direction::Out);
+
+    bench_op("c_set_gpio_val", n, [&](long long i)
+             { return set_gpio_val(c_pin, i & 1) >= GPIO_OK; });
+    bench_op("cpp_pin_write", n, [&](long long i) { pin.write(i & 1); return true; });
+    bench_op("cpp_static_pin_write", n, [&](long long i)
+             { static_pin.write(i & 1); return true; });
+
+    bench_op("c_read_gpio_val", n, [&](long long i)
+             { return read_gpio_val(c_pin) >= GPIO_OK; });
+    bench_op("cpp_pin_read", n, [&](long long i) { return pin.read() || true; });
+    bench_op("cpp_static_pin_read", n, [&](long long i)
+             { return static_pin.read() || true; });
+
+    bench_op("c_bus_write_8bit", n, [&](long long i)
+             { return bus_write(bus, i & 1 ? 0x55 : 0xAA) >= GPIO_OK; });
+    bench_op("cpp_group_write_8bit", n, [&](long long i)
+             { group.write(i & 1 ? 0x55 : 0xAA); return true; });
+
+    destroy_gpio_bus(bus);
+    //the C++ handles close their own pins as they go out of scope; the rest are
+    //closed by terminate_gpio_interface
+}
+
+int main(int argc, char** argv)
+{
+    long long n = DEFAULT_ITERATIONS;
+    const char* json_path = NULL;
+    FILE* json = NULL;
+    FILE* saved_stderr = NULL;
+    int opt = 0;
+
+    while ((opt = getopt(argc, argv, "n:j:")) != -1)
+    {
+        if (opt == 'n') { n = atoll(optarg); }
+        else if (opt == 'j') { json_path = optarg; }
+        else
+        {
+            fprintf(stderr, "Usage: %s [-n iterations] [-j results.json]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (n < 1) { n = DEFAULT_ITERATIONS; }
+
+    if (make_fake_sysfs() < GPIO_OK) { return 1; }
+
+    //pins in the fake tree look already open, which the library warns about
+    saved_stderr = fdopen(dup(STDERR_FILENO), "w");
+    freopen("/dev/null", "w", stderr);
+
+    try { run(n); }
+    catch (const Error& e) { fprintf(saved_stderr, "%s\n", e.what()); }
+
+    nftw(fake_root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+
+    printf("%-24s %10s %8s %12s %10s %10s %10s\n", "operation", "iterations", "errors",
+           "ops/sec", "p50 ns", "p99 ns", "max ns");
+    for (const bench_result_t& r : results)
+    {
+        printf("%-24s %10lld %8lld %12.0f %10lld %10lld %10lld\n", r.name.c_str(),
+               r.iterations, r.errors, r.ops_per_sec, r.p50_ns, r.p99_ns, r.max_ns);
+    }
+
+    if (json_path != NULL)
+    {
+        json = strcmp(json_path, "-") == 0 ? stdout : fopen(json_path, "w");
+        if (json == NULL) { perror(json_path); return 1; }
+
+        fprintf(json, "{\n  \"library_version\": \"%s\",\n", CHIP_GPIO_VERSION);
+        fprintf(json, "  \"backend\": \"fake-sysfs\",\n");
+        fprintf(json, "  \"iterations\": %lld,\n  \"results\": [\n", n);
+        for (size_t i = 0; i < results.size(); i++)
+        {
+            const bench_result_t& r = results[i];
+            fprintf(json, "    {\"name\": \"%s\", \"iterations\": %lld, \"errors\": %lld, "
+                    "\"ops_per_sec\": %.1f, \"mean_ns\": %.1f, \"p50_ns\": %lld, "
+                    "\"p99_ns\": %lld, \"max_ns\": %lld}%s\n", r.name.c_str(),
+                    r.iterations, r.errors, r.ops_per_sec, r.mean_ns, r.p50_ns, r.p99_ns,
+                    r.max_ns, i < results.size()-1 ? "," : "");
+        }
+        fprintf(json, "  ]\n}\n");
+        if (json != stdout) { fclose(json); }
+    }
+
+    return results.empty() ? 1 : 0;
+}
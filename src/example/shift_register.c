@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2017, Bryan Haley
+ * This code is dual licensed (GPLv2 and Simplified BSD). Use the license that works
+ * best for you. Check LICENSE.GPL and LICENSE.BSD for more details.
+ *
+ * shift_register.c
+ * An example program utilizing libchipgpio to count in binary across a chain of
+ * 74HC595 shift registers, then report how many full-chain updates per second were
+ * achieved. By default, SER should be connected to XIO-P0, SRCLK to XIO-P1 and RCLK to
+ * XIO-P2. Pass the number of chained registers as the first argument (default 1).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "chip_gpio.h"
+#include "chip_gpio_shift_register.h"
+
+#define NUM_UPDATES 1000
+
+int main (int argc, char **argv)
+{
+    shift_register_t* chain = NULL;
+    uint8_t buf[MAX_SHIFT_BYTES] = { 0 };
+    int num_bytes = 1;
+    struct timespec start, end;
+    double elapsed = 0.0;
+
+    if (argc > 1) { num_bytes = atoi(argv[1]); }
+
+    //You must call initialize_gpio_interface before use. Sub-zero values are errors.
+    if (initialize_gpio_interface() < GPIO_OK)
+    { fprintf(stderr, "GPIO Error. Shutting down.\n"); return GPIO_ERR; }
+
+    chain = create_shift_register(get_gpio_num("XIO-P0"), get_gpio_num("XIO-P1"),
+                                  get_gpio_num("XIO-P2"), num_bytes, SHIFT_OUT);
+    if (chain == NULL || setup_shift_register(chain) < GPIO_OK)
+    {
+        fprintf(stderr, "GPIO Error. Shutting down.\n");
+        terminate_gpio_interface();
+        return GPIO_ERR;
+    }
+
+    //Count up in binary; every update is a different buffer so every one is shifted
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 1; i <= NUM_UPDATES; i++)
+    {
+        memcpy(buf, &i, sizeof(int) < (size_t) num_bytes ? sizeof(int) : num_bytes);
+        if (shift_register_write(chain, buf) < GPIO_OK)
+        { fprintf(stderr, "Could not write to the chain\n"); break; }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec)/1e9;
+    printf("%d full-chain updates (%d bytes) in %.3f s: %.1f updates/s\n",
+           NUM_UPDATES, num_bytes, elapsed, NUM_UPDATES/elapsed);
+
+    //Writing the same buffer again is free; nothing is shifted
+    shift_register_write(chain, buf);
+
+    destroy_shift_register(chain);
+    terminate_gpio_interface(); //this function also calls autoclose_gpio_pins
+
+    return 0;
+}
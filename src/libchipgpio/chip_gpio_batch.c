@@ -0,0 +1,692 @@
+/*
+ * Copyright (c) 2017, Bryan Haley
+ * This code is dual licensed (GPLv2 and Simplified BSD). Use the license that works
+ * best for you. Check LICENSE.GPL and LICENSE.BSD for more details.
+ *
+ * chip_gpio_batch.c
+ * Implementation of batched pin reads and writes (chip_gpio_batch.h).
+ *  Note: io_uring is used through its system calls directly, so there's no liburing to
+ *  depend on. Batches of different threads share the ring, so only one submits at a time;
+ *  with plain fds they don't wait on each other at all. Value fds are kept in the pin
+ *  cache: writes lock their pins (see lock_pin_cache), while reads only count themselves
+ *  as readers of the fds, which keeps them open. Like read_gpio_val, a read that overlaps
+ *  a write to the same pin returns either value.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "chip_gpio.h"
+#include "chip_gpio_utils.h"
+#include "chip_gpio_stats.h"
+#include "chip_gpio_shift_register.h"
+#include "chip_gpio_batch.h"
+#include "chip_gpio_pio.h"
+
+#ifndef TRUE
+    #define TRUE 1
+#endif
+#ifndef FALSE
+    #define FALSE 0
+#endif
+
+#define NO_FD INT_MIN //result of an entry whose value file couldn't be opened
+#define PIN_CHANGED (INT_MIN+1) //no fd, as the pin was being changed (read it as usual)
+
+typedef struct
+{
+    int fd;
+    int fixed; //bool; value fds are registered with the ring, and used by index (pin)
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sq_ring;
+    size_t sq_ring_len;
+    void* cq_ring; //the same mapping as sq_ring on kernels with IORING_FEAT_SINGLE_MMAP
+    size_t cq_ring_len;
+    size_t sqes_len;
+} gpio_uring_t;
+
+//Locks are taken in the order pin, fd_lock, ring_lock
+static pthread_mutex_t fd_lock = PTHREAD_MUTEX_INITIALIZER; //opening/closing value fds
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static int requested = GPIO_BATCH_FDS; //io_uring is used once it's asked for
+static int uring_unavailable = FALSE; //bool; setting it up failed, don't keep trying
+static gpio_uring_t ring = { .fd = GPIO_ERR };
+
+static inline int sys_io_uring_setup(unsigned entries, struct io_uring_params* p)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                                     unsigned flags)
+{
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL,
+                         0);
+}
+
+static inline int sys_io_uring_register(int fd, unsigned opcode, void* arg, unsigned n)
+{
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, n);
+}
+
+static void free_uring()
+{
+    if (ring.sqes != NULL) { munmap(ring.sqes, ring.sqes_len); }
+    if (ring.cq_ring != NULL && ring.cq_ring != ring.sq_ring)
+    { munmap(ring.cq_ring, ring.cq_ring_len); }
+    if (ring.sq_ring != NULL) { munmap(ring.sq_ring, ring.sq_ring_len); }
+    if (ring.fd >= GPIO_OK) { close(ring.fd); }
+
+    memset(&ring, 0, sizeof(ring));
+    ring.fd = GPIO_ERR;
+}
+
+// Set up the ring and register a (sparse) table of value fds, one slot per pin. Called
+// with ring_lock held; fds opened while the table is built update their slots after.
+static int setup_uring()
+{
+    struct io_uring_params p;
+    int* table = NULL;
+
+    memset(&p, 0, sizeof(p));
+    ring.fd = sys_io_uring_setup(GPIO_URING_ENTRIES, &p);
+    if (ring.fd < GPIO_OK) { return GPIO_ERR; } //ENOSYS, or disabled by a sysctl/seccomp
+
+    //IORING_OP_READ/WRITE came with the same kernel (5.6) as this feature
+    if (!(p.features & IORING_FEAT_RW_CUR_POS)) { free_uring(); return GPIO_ERR; }
+
+    ring.sq_ring_len = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    ring.cq_ring_len = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring.cq_ring_len > ring.sq_ring_len) { ring.sq_ring_len = ring.cq_ring_len; }
+        ring.cq_ring_len = ring.sq_ring_len;
+    }
+
+    ring.sq_ring = mmap(NULL, ring.sq_ring_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    if (ring.sq_ring == MAP_FAILED)
+    { ring.sq_ring = NULL; free_uring(); return GPIO_ERR; }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) { ring.cq_ring = ring.sq_ring; }
+    else
+    {
+        ring.cq_ring = mmap(NULL, ring.cq_ring_len, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+        if (ring.cq_ring == MAP_FAILED)
+        { ring.cq_ring = NULL; free_uring(); return GPIO_ERR; }
+    }
+
+    ring.sqes_len = p.sq_entries*sizeof(struct io_uring_sqe);
+    ring.sqes = mmap(NULL, ring.sqes_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED) { ring.sqes = NULL; free_uring(); return GPIO_ERR; }
+
+    ring.sq_head = (unsigned*) ((char*) ring.sq_ring + p.sq_off.head);
+    ring.sq_tail = (unsigned*) ((char*) ring.sq_ring + p.sq_off.tail);
+    ring.sq_mask = (unsigned*) ((char*) ring.sq_ring + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned*) ((char*) ring.sq_ring + p.sq_off.array);
+    ring.cq_head = (unsigned*) ((char*) ring.cq_ring + p.cq_off.head);
+    ring.cq_tail = (unsigned*) ((char*) ring.cq_ring + p.cq_off.tail);
+    ring.cq_mask = (unsigned*) ((char*) ring.cq_ring + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe*) ((char*) ring.cq_ring + p.cq_off.cqes);
+
+    //fixed files save the kernel an fd lookup per entry; without them the ring still
+    //works with plain fds
+    table = (int*) malloc((NUM_PINS+FIRST_PIN)*sizeof(int));
+    ring.fixed = FALSE;
+    if (table == NULL) { return GPIO_OK; }
+
+    for (int i = 0; i < NUM_PINS+FIRST_PIN; i++)
+    {
+        table[i] = pin_cache != NULL ? __atomic_load_n(&pin_cache[i].value_fd,
+                                                       __ATOMIC_ACQUIRE) : GPIO_ERR;
+    }
+
+    ring.fixed = sys_io_uring_register(ring.fd, IORING_REGISTER_FILES, table,
+                                       NUM_PINS+FIRST_PIN) >= GPIO_OK;
+    free(table);
+
+    return GPIO_OK;
+}
+
+//Point a pin's slot in the registered table at fd (GPIO_ERR to empty it). Called with
+//fd_lock held.
+static void update_fixed_file(int pin, int fd)
+{
+    struct io_uring_files_update update;
+
+    pthread_mutex_lock(&ring_lock);
+
+    if (ring.fd < GPIO_OK || !ring.fixed) { pthread_mutex_unlock(&ring_lock); return; }
+
+    memset(&update, 0, sizeof(update));
+    update.offset = pin;
+    update.fds = (unsigned long) &fd;
+
+    //if the slot can't be updated, the ring can't be trusted to use the right file
+    if (sys_io_uring_register(ring.fd, IORING_REGISTER_FILES_UPDATE, &update, 1) < 1)
+    {
+        sys_io_uring_register(ring.fd, IORING_UNREGISTER_FILES, NULL, 0);
+        ring.fixed = FALSE;
+    }
+
+    pthread_mutex_unlock(&ring_lock);
+}
+
+// Set up io_uring if it was asked for and isn't yet (again, after the pin map changed).
+// Called with ring_lock held.
+static void choose_backend()
+{
+    if (requested == GPIO_BATCH_FDS || ring.fd >= GPIO_OK) { return; }
+    if (uring_unavailable) { return; }
+    if (setup_uring() < GPIO_OK)
+    { __atomic_store_n(&uring_unavailable, TRUE, __ATOMIC_RELAXED); }
+}
+
+// Take ring_lock if batches go through io_uring. Batches that use plain fds don't touch
+// the lock at all.
+static int lock_uring()
+{
+    if (__atomic_load_n(&requested, __ATOMIC_RELAXED) == GPIO_BATCH_FDS ||
+        __atomic_load_n(&uring_unavailable, __ATOMIC_RELAXED))
+    { return FALSE; }
+
+    pthread_mutex_lock(&ring_lock);
+    choose_backend();
+    if (ring.fd >= GPIO_OK) { return TRUE; }
+
+    pthread_mutex_unlock(&ring_lock);
+    return FALSE;
+}
+
+// The value fd of a pin, opened on first use. locked says whether the caller holds the
+// pin's lock; if it doesn't and the pin is changed before its fd is stored, nothing is
+// opened (the path may be the old one) and PIN_CHANGED is returned.
+static int get_value_fd(int pin, int locked)
+{
+    pin_cache_t* c = &pin_cache[pin];
+    int fd = __atomic_load_n(&c->value_fd, __ATOMIC_SEQ_CST); //pairs with the exchange
+    unsigned seq = read_pin_cache_begin(c);
+
+    if (fd >= GPIO_OK) { return fd; }
+
+    pthread_mutex_lock(&fd_lock);
+
+    fd = c->value_fd;
+    if (fd < GPIO_OK && !locked && read_pin_cache_changed(c, seq)) { fd = PIN_CHANGED; }
+    else if (fd < GPIO_OK)
+    {
+        fd = open(get_pin_value_path(c), O_RDWR | O_CLOEXEC);
+        if (fd < GPIO_OK) { report_gpio_error(GPIO_E_OPEN, pin, get_pin_kern(c), errno); }
+        else
+        {
+            __atomic_store_n(&c->value_fd, fd, __ATOMIC_RELEASE);
+            update_fixed_file(pin, fd);
+        }
+    }
+
+    pthread_mutex_unlock(&fd_lock);
+
+    return fd;
+}
+
+// Closed (or reopened) pins may get a new value file; forget the old one. Called with
+// the pin's lock held, so no batch is writing it. Reads that already have the fd are
+// waited for, so it isn't closed (and its number reused) under them.
+void release_gpio_batch_fd(int pin)
+{
+    pin_cache_t* c = NULL;
+    int fd = GPIO_ERR;
+
+    if (pin_cache == NULL || !does_pin_exist(pin)) { return; }
+    c = &pin_cache[pin];
+
+    //an fd being opened (see get_value_fd) is either stored by now, or won't be
+    pthread_mutex_lock(&fd_lock);
+    fd = __atomic_exchange_n(&c->value_fd, GPIO_ERR, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&fd_lock);
+    if (fd < GPIO_OK) { return; }
+
+    //a read counted after the exchange sees no fd (see do_chunk), and the pin being
+    //locked keeps it from opening another; the ones before may still use the ring's slot
+    while (__atomic_load_n(&c->fd_readers, __ATOMIC_SEQ_CST) > 0) { sched_yield(); }
+
+    pthread_mutex_lock(&fd_lock);
+    update_fixed_file(pin, GPIO_ERR);
+    pthread_mutex_unlock(&fd_lock);
+    close(fd);
+}
+
+//Close every value fd and the ring. No other thread may be using the pins.
+void free_gpio_batch()
+{
+    pthread_mutex_lock(&fd_lock);
+    for (int i = 0; pin_cache != NULL && i < NUM_PINS+FIRST_PIN; i++)
+    {
+        if (pin_cache[i].value_fd >= GPIO_OK) { close(pin_cache[i].value_fd); }
+        pin_cache[i].value_fd = GPIO_ERR;
+    }
+    pthread_mutex_unlock(&fd_lock);
+
+    //the registered table is sized for this pin map; choose_backend makes a new one
+    pthread_mutex_lock(&ring_lock);
+    free_uring();
+    pthread_mutex_unlock(&ring_lock);
+}
+
+int set_gpio_batch_backend(int backend)
+{
+    int rc = GPIO_OK;
+
+    if (backend < GPIO_BATCH_AUTO || backend > GPIO_BATCH_URING)
+    {
+        fprintf(stderr, "Unknown batch backend %d\n", backend);
+        return GPIO_ERR;
+    }
+
+    pthread_mutex_lock(&ring_lock);
+
+    free_uring();
+    __atomic_store_n(&requested, backend, __ATOMIC_RELAXED);
+    __atomic_store_n(&uring_unavailable, FALSE, __ATOMIC_RELAXED);
+    choose_backend();
+    rc = ring.fd >= GPIO_OK ? GPIO_BATCH_URING : GPIO_BATCH_FDS;
+
+    pthread_mutex_unlock(&ring_lock);
+
+    if (backend == GPIO_BATCH_URING && rc != GPIO_BATCH_URING)
+    {
+        fprintf(stderr, "io_uring is not available; batches will use plain fds\n");
+        return GPIO_ERR;
+    }
+
+    return rc;
+}
+
+int get_gpio_batch_backend()
+{
+    int rc = GPIO_ERR;
+
+    pthread_mutex_lock(&ring_lock);
+    choose_backend();
+    rc = ring.fd >= GPIO_OK ? GPIO_BATCH_URING : GPIO_BATCH_FDS;
+    pthread_mutex_unlock(&ring_lock);
+
+    return rc;
+}
+
+//Count each pin of a batch as an equal share of its time; the first syscalls pins are
+//counted as having made one syscall each
+static void record_batch(int* pins, int* rcs, int n, int op, long long start,
+                         int syscalls)
+{
+    long long share = (get_time_ns()-start)/n;
+
+    for (int i = 0; i < n; i++)
+    { record_gpio_op_ns(pins[i], op, share, i < syscalls, rcs[i]); }
+}
+
+// Queue n reads or writes (of one character each) and wait for all of them. res[i] is
+// the result of entry i: bytes transferred, or -errno (-ECANCELED if the kernel didn't
+// take the entry).
+static int submit_uring(int* pins, int* fds, char* bufs, int* res, int n, int write)
+{
+    unsigned tail = *ring.sq_tail;
+    unsigned mask = *ring.sq_mask;
+    unsigned head = 0;
+    int submitted = 0;
+    int done = 0;
+    int err = 0;
+    int rc = 0;
+
+    for (int i = 0; i < n; i++)
+    {
+        unsigned idx = (tail+i) & mask;
+        struct io_uring_sqe* sqe = &ring.sqes[idx];
+
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe->fd = ring.fixed ? pins[i] : fds[i];
+        sqe->flags = ring.fixed ? IOSQE_FIXED_FILE : 0;
+        sqe->addr = (unsigned long) &bufs[i];
+        sqe->len = 1;
+        sqe->off = 0; //sysfs attributes are only regenerated when read from the start
+        sqe->user_data = i;
+        ring.sq_array[idx] = idx;
+    }
+
+    __atomic_store_n(ring.sq_tail, tail+n, __ATOMIC_RELEASE);
+
+    do { rc = sys_io_uring_enter(ring.fd, n, n, IORING_ENTER_GETEVENTS); }
+    while (rc < GPIO_OK && errno == EINTR);
+    if (rc < GPIO_OK) { err = errno; }
+
+    //entries the kernel didn't take point at the caller's buffers, so they're taken
+    //back off the ring (nothing else reads it; there's no SQ polling thread)
+    submitted = (int) (__atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) - tail);
+    if (submitted < n)
+    { __atomic_store_n(ring.sq_tail, tail+submitted, __ATOMIC_RELEASE); }
+
+    for (int i = 0; i < n; i++) { res[i] = -(err ? err : ECANCELED); }
+
+    //the kernel doesn't wait after a short submit, but what it took still uses bufs
+    head = *ring.cq_head;
+    while (done < submitted)
+    {
+        struct io_uring_cqe* cqe = NULL;
+
+        if (head == __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE))
+        {
+            __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE); //so it can wait
+            sys_io_uring_enter(ring.fd, 0, submitted-done, IORING_ENTER_GETEVENTS);
+            continue;
+        }
+
+        cqe = &ring.cqes[head & *ring.cq_mask];
+        if (cqe->user_data < (unsigned) n) { res[cqe->user_data] = cqe->res; }
+        head++;
+        done++;
+    }
+
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+    return submitted == n ? GPIO_OK : GPIO_ERR;
+}
+
+// Transfer one character per pin through the current backend, using the fds found by
+// the caller. Returns the number of syscalls made; res[i] is as in submit_uring.
+static int transfer(int* pins, int* fds, char* bufs, int* res, int n, int write)
+{
+    int syscalls = 0;
+
+    for (int i = 0; i < n; i++)
+    { res[i] = fds[i] == PIN_CHANGED ? PIN_CHANGED : (fds[i] < GPIO_OK ? NO_FD : 0); }
+
+    if (lock_uring())
+    {
+        int ok[GPIO_URING_ENTRIES];
+        char ok_bufs[GPIO_URING_ENTRIES];
+        int ok_fds[GPIO_URING_ENTRIES];
+        int ok_res[GPIO_URING_ENTRIES];
+        int map[GPIO_URING_ENTRIES];
+        int m = 0;
+
+        //pins whose fd couldn't be opened are left out (and already reported)
+        for (int i = 0; i < n; i++)
+        {
+            if (fds[i] < GPIO_OK) { continue; }
+            ok[m] = pins[i];
+            ok_fds[m] = fds[i];
+            ok_bufs[m] = bufs[i];
+            ok_res[m] = -EIO; //until submit_uring has a result for it
+            map[m++] = i;
+        }
+
+        if (m > 0) { submit_uring(ok, ok_fds, ok_bufs, ok_res, m, write); }
+        pthread_mutex_unlock(&ring_lock);
+
+        for (int j = 0; j < m; j++)
+        {
+            res[map[j]] = ok_res[j];
+            bufs[map[j]] = ok_bufs[j];
+        }
+
+        return m > 0;
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        if (fds[i] < GPIO_OK) { continue; }
+        res[i] = write ? pwrite(fds[i], &bufs[i], 1, 0) : pread(fds[i], &bufs[i], 1, 0);
+        if (res[i] < 0) { res[i] = -errno; }
+        syscalls++;
+    }
+
+    return syscalls;
+}
+
+//Lock (or unlock) the pins of a chunk being written, each once and in order, so two
+//batches writing the same pins can't each hold one the other wants
+static void lock_chunk_pins(int* pins, int n, int lock)
+{
+    int sorted[GPIO_URING_ENTRIES];
+
+    for (int i = 0; i < n; i++)
+    {
+        int j = i;
+        for (; j > 0 && sorted[j-1] > pins[i]; j--) { sorted[j] = sorted[j-1]; }
+        sorted[j] = pins[i];
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        if (i > 0 && sorted[i] == sorted[i-1]) { continue; }
+        if (lock) { lock_pin_cache(&pin_cache[sorted[i]]); }
+        else { unlock_pin_cache(&pin_cache[sorted[i]]); }
+    }
+}
+
+// Read or write one chunk of at most GPIO_URING_ENTRIES pins that sysfs can be used
+// for, which have all been resolved. Pins whose fd couldn't be had because they were
+// being changed are read by read_gpio_val.
+static int do_chunk(int* pins, int* vals, int n, int write)
+{
+    char bufs[GPIO_URING_ENTRIES];
+    int res[GPIO_URING_ENTRIES];
+    int fds[GPIO_URING_ENTRIES];
+    long long start = get_time_ns();
+    int rc = GPIO_OK;
+    int syscalls = 0;
+
+    if (write) { lock_chunk_pins(pins, n, TRUE); }
+
+    for (int i = 0; i < n; i++)
+    {
+        bufs[i] = write ? vals[i] + '0' : '\0';
+
+        //counted before the fd is looked at, so it can't be closed while it's read
+        if (!write)
+        { __atomic_fetch_add(&pin_cache[pins[i]].fd_readers, 1, __ATOMIC_SEQ_CST); }
+        fds[i] = get_value_fd(pins[i], write);
+    }
+
+    syscalls = transfer(pins, fds, bufs, res, n, write);
+
+    for (int i = 0; !write && i < n; i++)
+    { __atomic_fetch_sub(&pin_cache[pins[i]].fd_readers, 1, __ATOMIC_RELEASE); }
+
+    for (int i = 0; i < n; i++)
+    {
+        int kern = get_cached_kern_num(pins[i]);
+
+        if (res[i] == PIN_CHANGED) { continue; } //read below
+
+        if (res[i] == NO_FD) { rc = vals[i] = GPIO_ERR; } //reported by get_value_fd
+        else if (res[i] < 0)
+        {
+            rc = vals[i] = report_gpio_error(write ? GPIO_E_WRITE : GPIO_E_READ, pins[i],
+                                             kern, -res[i]);
+        }
+        else if (!write && bufs[i] != '0' && bufs[i] != '1')
+        { rc = vals[i] = report_gpio_error(GPIO_E_BAD_DATA, pins[i], kern, 0); }
+        else if (!write) { vals[i] = bufs[i] - '0'; }
+
+        if (write) { set_gpio_shadow(&pin_cache[pins[i]], vals[i]); }
+    }
+
+    if (write) { lock_chunk_pins(pins, n, FALSE); }
+
+    for (int i = 0; !write && i < n; i++)
+    {
+        if (res[i] != PIN_CHANGED) { continue; }
+        if ((vals[i] = read_gpio_val(pins[i])) < GPIO_OK) { rc = GPIO_ERR; }
+    }
+
+    record_batch(pins, vals, n, write ? GPIO_STAT_WRITE : GPIO_STAT_READ, start,
+                 syscalls);
+
+    return rc;
+}
+
+// Read or write a chunk of at most GPIO_URING_ENTRIES pins that are on the PIO registers
+// (regs[i] and bits[i] are pin i's data register and bit), touching each port's data
+// register once: a read loads it, and a write sets and clears the chunk's bits of the
+// port in one store.
+static int do_pio_chunk(int* pins, volatile uint32_t** regs, uint32_t* bits, int* vals,
+                        int n, int write)
+{
+    volatile uint32_t* ports[GPIO_PIO_PORTS];
+    uint32_t data[GPIO_PIO_PORTS];
+    uint32_t set[GPIO_PIO_PORTS];
+    uint32_t clear[GPIO_PIO_PORTS];
+    long long start = get_time_ns();
+    int num_ports = 0;
+    int p = 0;
+
+    if (write) { lock_chunk_pins(pins, n, TRUE); }
+
+    for (int i = 0; i < n; i++)
+    {
+        for (p = 0; p < num_ports && ports[p] != regs[i]; p++);
+
+        if (p == num_ports)
+        {
+            ports[p] = regs[i];
+            data[p] = write ? 0 : __atomic_load_n(regs[i], __ATOMIC_ACQUIRE);
+            set[p] = clear[p] = 0;
+            num_ports++;
+        }
+
+        if (!write) { vals[i] = (data[p] & bits[i]) != 0; }
+        else if (vals[i]) { set[p] |= bits[i]; }
+        else { clear[p] |= bits[i]; }
+    }
+
+    for (p = 0; write && p < num_ports; p++)
+    { write_pio_data(ports[p], set[p], clear[p]); }
+
+    if (write)
+    {
+        for (int i = 0; i < n; i++) { set_gpio_shadow(&pin_cache[pins[i]], vals[i]); }
+        lock_chunk_pins(pins, n, FALSE);
+    }
+
+    record_batch(pins, vals, n, write ? GPIO_STAT_WRITE : GPIO_STAT_READ, start, 0);
+
+    return GPIO_OK;
+}
+
+// Split a batch into chunks of pins that go through sysfs, and chunks of pins that go
+// through the PIO registers. Virtual pins, and every pin
+// in broker client mode, go the usual way first (as a shift register may well do a
+// batch of its own).
+static int do_batch(int* pins, int* vals, int n, int write)
+{
+    int chunk_pins[GPIO_URING_ENTRIES];
+    int chunk_vals[GPIO_URING_ENTRIES];
+    int chunk_idx[GPIO_URING_ENTRIES];
+    int pio_pins[GPIO_URING_ENTRIES];
+    int pio_vals[GPIO_URING_ENTRIES];
+    int pio_idx[GPIO_URING_ENTRIES];
+    volatile uint32_t* pio_regs[GPIO_URING_ENTRIES];
+    uint32_t pio_bits[GPIO_URING_ENTRIES];
+    volatile uint32_t* reg = NULL;
+    uint32_t bit = 0;
+    int m = 0;
+    int p = 0;
+    int rc = GPIO_OK;
+
+    if (pins == NULL || vals == NULL || n < 0) { return GPIO_ERR; }
+
+    for (int i = 0; i < n; i++)
+    {
+        int val = GPIO_OK;
+
+        if (pins[i] >= VIRTUAL_PIN_BASE || gpio_broker_fd >= GPIO_OK)
+        { val = write ? set_gpio_val(pins[i], vals[i]) : read_gpio_val(pins[i]); }
+        else if (check_if_pin_exists(pins[i]) < GPIO_OK ||
+                 (write && is_valid_value(vals[i], pins[i]) < GPIO_OK))
+        { val = GPIO_ERR; }
+        else if (get_pin_cache(pins[i]) == NULL) { val = GPIO_ERR; } //resolve it
+        else { continue; }
+
+        if (val < GPIO_OK) { rc = GPIO_ERR; }
+        if (!write) { vals[i] = val; }
+    }
+
+    for (int i = 0; i <= n; i++)
+    {
+        //flush when the chunk is full or the batch is done
+        if (m == GPIO_URING_ENTRIES || (i == n && m > 0))
+        {
+            if (do_chunk(chunk_pins, chunk_vals, m, write) < GPIO_OK) { rc = GPIO_ERR; }
+            for (int j = 0; !write && j < m; j++) { vals[chunk_idx[j]] = chunk_vals[j]; }
+            m = 0;
+        }
+
+        if (p == GPIO_URING_ENTRIES || (i == n && p > 0))
+        {
+            do_pio_chunk(pio_pins, pio_regs, pio_bits, pio_vals, p, write);
+            for (int j = 0; !write && j < p; j++) { vals[pio_idx[j]] = pio_vals[j]; }
+            p = 0;
+        }
+
+        if (i == n) { break; }
+
+        //skip what was done (or rejected) above
+        if (pins[i] >= VIRTUAL_PIN_BASE || gpio_broker_fd >= GPIO_OK ||
+            pins[i] < FIRST_PIN || pins[i] >= NUM_PINS+FIRST_PIN || pin_cache == NULL ||
+            get_cached_kern_num(pins[i]) < GPIO_OK ||
+            (write && vals[i] != GPIO_PIN_LOW && vals[i] != GPIO_PIN_HIGH))
+        { continue; }
+
+        //outputs that already have the value are left alone (see set_gpio_shadow_mode)
+        if (write && gpio_shadow_mode == GPIO_SHADOW_ON &&
+            get_gpio_shadow(&pin_cache[pins[i]]) == vals[i])
+        { continue; }
+
+        if ((reg = get_pio_data_reg(pins[i], &pin_cache[pins[i]], write, &bit)) != NULL)
+        {
+            pio_pins[p] = pins[i];
+            pio_vals[p] = write ? vals[i] : GPIO_ERR;
+            pio_regs[p] = reg;
+            pio_bits[p] = bit;
+            pio_idx[p++] = i;
+            continue;
+        }
+
+        chunk_pins[m] = pins[i];
+        chunk_vals[m] = write ? vals[i] : GPIO_ERR;
+        chunk_idx[m++] = i;
+    }
+
+    return rc;
+}
+
+int read_gpio_vals(int* pins, int* vals, int n)
+{
+    return do_batch(pins, vals, n, FALSE);
+}
+
+int set_gpio_vals(int* pins, int* vals, int n)
+{
+    return do_batch(pins, vals, n, TRUE);
+}
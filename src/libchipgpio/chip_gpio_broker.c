@@ -0,0 +1,1013 @@
+/*
+ * Copyright (c) 2017, Bryan Haley
+ * This code is dual licensed (GPLv2 and Simplified BSD). Use the license that works
+ * best for you. Check LICENSE.GPL and LICENSE.BSD for more details.
+ *
+ * chip_gpio_broker.c
+ * Implementation of the broker (run_gpio_broker, used by gpio_brokerd) and of client
+ * mode, which the rw and oc functions switch to while connected.
+ *
+ * The broker keeps one shared memory region (a memfd, handed to each client over the
+ * socket along with an eventfd of its own):
+ *   broker_shm_t                header and the snapshot's sequence number
+ *   atomic_schar[num_pins]      value of each pin, -1 if no client has it open
+ *   atomic_schar[num_pins]      direction of each pin, -1 if no client has it open
+ *   atomic_ullong[num_pins]     clients (bit per slot) that have each pin open
+ *   broker_ring_t[MAX_BROKER_CLIENTS]
+ * The broker is the only writer of the snapshot (under broker_lock). Clients get a
+ * read-only fd of the region, which is sealed against new writable mappings where the
+ * kernel allows, so no client can change values, owners or another client's ring.
+ *
+ * Each ring has the broker as its only producer and its client as the only consumer. The
+ * consumer's tail lives in a memfd of its own (broker_tail_t), the only memory a client
+ * may write; a client moving its tail anywhere only loses or repeats its own events.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "chip_gpio.h"
+#include "chip_gpio_utils.h"
+#include "chip_gpio_callback_manager.h"
+#include "chip_gpio_broker.h"
+
+#ifndef TRUE
+    #define TRUE 1
+#endif
+#ifndef FALSE
+    #define FALSE 0
+#endif
+
+#define BROKER_MAGIC "CGPB"
+#define BROKER_VERSION 2
+#define BROKER_UNKNOWN -1 //value/direction of a pin nobody has open
+#define BROKER_SOCKET_SUFFIX ".new" //the socket's name until it's listening
+#define BROKER_SNAPSHOT_SPINS 100 //snapshot reads retried before yielding to the broker
+#define BROKER_SNAPSHOT_TIMEOUT_MS 100 //a broker that died mid-update leaves seq odd
+#define BROKER_HELLO_FDS 3 //the region (read-only), the client's eventfd and its tail
+
+#ifndef F_SEAL_FUTURE_WRITE
+    #define F_SEAL_FUTURE_WRITE 0x0010 //Linux 5.1; older kernels refuse it
+#endif
+
+//requests sent over the socket
+#define BROKER_HELLO 0 //arg: NUM_PINS+FIRST_PIN; reply carries the memfd and eventfd
+#define BROKER_OPEN 1
+#define BROKER_CLOSE 2
+#define BROKER_SET_DIR 3
+#define BROKER_WRITE 4
+#define BROKER_SUBSCRIBE 5
+#define BROKER_UNSUBSCRIBE 6
+
+typedef struct
+{
+    int op;
+    int pin;
+    int arg;
+} broker_request_t;
+
+typedef struct
+{
+    int rc;
+    int code; //GPIO_E_* if rc is GPIO_ERR
+    int sys_errno;
+} broker_reply_t;
+
+typedef struct
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t num_pins; //entries in each per-pin array (NUM_PINS+FIRST_PIN)
+    uint32_t values_offset;
+    uint32_t dirs_offset;
+    uint32_t owners_offset;
+    uint32_t rings_offset;
+    atomic_uint seq; //odd while the broker is updating the snapshot
+} broker_shm_t;
+
+typedef struct
+{
+    atomic_uint head __attribute__((aligned(CACHE_LINE_SIZE))); //advanced by the broker
+    atomic_ullong dropped;
+    gpio_broker_event_t events[BROKER_RING_SIZE];
+} __attribute__((aligned(CACHE_LINE_SIZE))) broker_ring_t;
+
+//a client's side of its ring, in a memfd shared with that client only
+typedef struct
+{
+    atomic_uint tail; //advanced by the client
+} broker_tail_t;
+
+typedef struct
+{
+    int sock; //GPIO_ERR if the slot is free
+    int event_fd;
+    int tail_fd;
+    broker_tail_t* tail; //mapping of tail_fd, or NULL
+    int hello; //bool; set once the client said hello
+} broker_client_t;
+
+int gpio_broker_fd = GPIO_ERR; //socket to the broker; GPIO_ERR unless in client mode
+
+static broker_shm_t* shm = NULL; //the broker's, or the client's mapping of it
+static size_t shm_size = 0;
+static atomic_schar* shm_values = NULL;
+static atomic_schar* shm_dirs = NULL;
+static atomic_ullong* shm_owners = NULL;
+static broker_ring_t* shm_rings = NULL;
+
+//client side
+static int client_slot = GPIO_ERR;
+static int client_event_fd = GPIO_ERR;
+static broker_tail_t* client_tail = NULL;
+static pthread_mutex_t request_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//broker side
+static volatile sig_atomic_t broker_stop = FALSE; //set by stop_gpio_broker at any time
+static int wake_pipe[2] = { GPIO_ERR, GPIO_ERR };
+static int shm_fd = GPIO_ERR;
+static int shm_ro_fd = GPIO_ERR; //what clients get
+static broker_client_t clients[MAX_BROKER_CLIENTS];
+static uint64_t* subscribers = NULL; //clients (bit per slot) subscribed to each pin
+static pthread_mutex_t broker_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline size_t align_up(size_t n)
+{
+    return (n + CACHE_LINE_SIZE-1) & ~((size_t) CACHE_LINE_SIZE-1);
+}
+
+//Point the shm_* pointers into a mapping
+static void set_shm_pointers()
+{
+    shm_values = (atomic_schar*) ((char*) shm+shm->values_offset);
+    shm_dirs = (atomic_schar*) ((char*) shm+shm->dirs_offset);
+    shm_owners = (atomic_ullong*) ((char*) shm+shm->owners_offset);
+    shm_rings = (broker_ring_t*) ((char*) shm+shm->rings_offset);
+}
+
+/*
+ * Broker side
+ */
+
+// Update a pin in the snapshot. Called with broker_lock held, so the broker's threads
+// don't both write at once; clients only ever read.
+static void publish_pin(int pin, int val, int dir)
+{
+    unsigned int seq = atomic_load_explicit(&shm->seq, memory_order_relaxed);
+
+    atomic_store_explicit(&shm->seq, seq+1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    atomic_store_explicit(&shm_values[pin], val, memory_order_relaxed);
+    atomic_store_explicit(&shm_dirs[pin], dir, memory_order_relaxed);
+
+    atomic_store_explicit(&shm->seq, seq+2, memory_order_release);
+}
+
+//Push an event to every client subscribed to the pin. Called with broker_lock held.
+static void push_event(int pin, int val, long long now)
+{
+    uint64_t subs = subscribers[pin];
+    gpio_broker_event_t event = { pin, val, now };
+    uint64_t one = 1;
+
+    while (subs)
+    {
+        int slot = __builtin_ctzll(subs);
+        broker_ring_t* ring = &shm_rings[slot];
+        unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        unsigned int tail = atomic_load_explicit(&clients[slot].tail->tail,
+                                                 memory_order_acquire);
+
+        subs &= subs-1;
+
+        if (head - tail >= BROKER_RING_SIZE)
+        {
+            atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+            continue;
+        }
+
+        ring->events[head & (BROKER_RING_SIZE-1)] = event;
+        atomic_store_explicit(&ring->head, head+1, memory_order_release);
+
+        //wake the client up; it doesn't matter if this fails (the count is huge)
+        if (write(clients[slot].event_fd, &one, sizeof(one)) < GPIO_OK) {}
+    }
+}
+
+//Called on the callback manager's thread for every pin some client has open
+static int broker_pin_changed(pin_change_t change, void* arg)
+{
+    (void) arg;
+    pthread_mutex_lock(&broker_lock);
+    publish_pin(change.pin, change.new_val,
+                atomic_load_explicit(&shm_dirs[change.pin], memory_order_relaxed));
+    push_event(change.pin, change.new_val, get_time_ns());
+    pthread_mutex_unlock(&broker_lock);
+
+    return GPIO_OK;
+}
+
+static inline uint64_t get_owners(int pin)
+{
+    return atomic_load_explicit(&shm_owners[pin], memory_order_relaxed);
+}
+
+static inline void set_owners(int pin, uint64_t owners)
+{
+    atomic_store_explicit(&shm_owners[pin], owners, memory_order_relaxed);
+}
+
+static int broker_open(int slot, int pin)
+{
+    int val = GPIO_ERR;
+    int dir = GPIO_ERR;
+
+    if (check_if_pin_exists(pin) < GPIO_OK) { return GPIO_ERR; }
+
+    //the first client to open a pin exports it; the rest share it
+    if (get_owners(pin) == 0)
+    {
+        if (open_gpio_pin(pin) < GPIO_OK) { return GPIO_ERR; }
+
+        val = read_gpio_val(pin);
+        dir = get_gpio_dir(pin);
+
+        pthread_mutex_lock(&broker_lock);
+        publish_pin(pin, val < GPIO_OK ? BROKER_UNKNOWN : val,
+                    dir < GPIO_OK ? BROKER_UNKNOWN : dir);
+        pthread_mutex_unlock(&broker_lock);
+
+        //the callback manager keeps the snapshot up to date from here on
+        register_callback_func(pin, broker_pin_changed, NULL);
+    }
+
+    set_owners(pin, get_owners(pin) | (1ULL << slot));
+
+    return GPIO_OK;
+}
+
+static int broker_close(int slot, int pin)
+{
+    if (check_if_pin_exists(pin) < GPIO_OK) { return GPIO_ERR; }
+
+    if (!(get_owners(pin) & (1ULL << slot)))
+    { return report_gpio_error(GPIO_E_NOT_OWNER, pin, GPIO_ERR, 0); }
+
+    set_owners(pin, get_owners(pin) & ~(1ULL << slot));
+
+    pthread_mutex_lock(&broker_lock);
+    subscribers[pin] &= ~(1ULL << slot);
+    pthread_mutex_unlock(&broker_lock);
+
+    //the last client to close a pin unexports it
+    if (get_owners(pin) == 0)
+    {
+        remove_callback_func(pin);
+
+        pthread_mutex_lock(&broker_lock);
+        publish_pin(pin, BROKER_UNKNOWN, BROKER_UNKNOWN);
+        pthread_mutex_unlock(&broker_lock);
+
+        return close_gpio_pin(pin);
+    }
+
+    return GPIO_OK;
+}
+
+static int check_owner(int slot, int pin)
+{
+    if (check_if_pin_exists(pin) < GPIO_OK) { return GPIO_ERR; }
+
+    if (!(get_owners(pin) & (1ULL << slot)))
+    { return report_gpio_error(GPIO_E_NOT_OWNER, pin, GPIO_ERR, 0); }
+
+    return GPIO_OK;
+}
+
+static int broker_set_dir(int slot, int pin, int out)
+{
+    int rc = GPIO_ERR;
+
+    if (check_owner(slot, pin) < GPIO_OK) { return GPIO_ERR; }
+
+    rc = set_gpio_dir(pin, out);
+    if (rc < GPIO_OK) { return GPIO_ERR; }
+
+    pthread_mutex_lock(&broker_lock);
+    publish_pin(pin, atomic_load_explicit(&shm_values[pin], memory_order_relaxed), out);
+    pthread_mutex_unlock(&broker_lock);
+
+    return rc;
+}
+
+static int broker_write(int slot, int pin, int val)
+{
+    int rc = GPIO_ERR;
+
+    if (check_owner(slot, pin) < GPIO_OK) { return GPIO_ERR; }
+
+    rc = set_gpio_val(pin, val);
+    if (rc < GPIO_OK) { return GPIO_ERR; }
+
+    //readers see the new value right away rather than on the next poll
+    pthread_mutex_lock(&broker_lock);
+    publish_pin(pin, val, atomic_load_explicit(&shm_dirs[pin], memory_order_relaxed));
+    pthread_mutex_unlock(&broker_lock);
+
+    return rc;
+}
+
+static int broker_subscribe(int slot, int pin, int subscribe)
+{
+    if (check_owner(slot, pin) < GPIO_OK) { return GPIO_ERR; }
+
+    pthread_mutex_lock(&broker_lock);
+    if (subscribe) { subscribers[pin] |= 1ULL << slot; }
+    else { subscribers[pin] &= ~(1ULL << slot); }
+    pthread_mutex_unlock(&broker_lock);
+
+    return GPIO_OK;
+}
+
+//Send a reply, with fds attached if num_fds isn't 0
+static int send_reply(int sock, int rc, int* fds, int num_fds)
+{
+    gpio_error_t err;
+    broker_reply_t reply = { rc, GPIO_E_NONE, 0 };
+    struct iovec iov = { &reply, sizeof(reply) };
+    struct msghdr msg;
+    char control[CMSG_SPACE(BROKER_HELLO_FDS*sizeof(int))];
+    struct cmsghdr* cmsg = NULL;
+
+    if (rc < GPIO_OK)
+    {
+        get_gpio_last_error(&err);
+        reply.code = err.code;
+        reply.sys_errno = err.sys_errno;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (num_fds)
+    {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(num_fds*sizeof(int));
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(num_fds*sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, num_fds*sizeof(int));
+    }
+
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) < GPIO_OK ? GPIO_ERR : GPIO_OK;
+}
+
+//Release everything a client had and free its slot
+static void drop_client(int slot)
+{
+    for (int i = FIRST_PIN; i < NUM_PINS+FIRST_PIN; i++)
+    { if (get_owners(i) & (1ULL << slot)) { broker_close(slot, i); } }
+
+    pthread_mutex_lock(&broker_lock);
+    close(clients[slot].sock);
+    if (clients[slot].event_fd >= GPIO_OK) { close(clients[slot].event_fd); }
+    if (clients[slot].tail_fd >= GPIO_OK) { close(clients[slot].tail_fd); }
+    if (clients[slot].tail != NULL) { munmap(clients[slot].tail, sizeof(broker_tail_t)); }
+    clients[slot].sock = GPIO_ERR;
+    clients[slot].event_fd = GPIO_ERR;
+    clients[slot].tail_fd = GPIO_ERR;
+    clients[slot].tail = NULL;
+    clients[slot].hello = FALSE;
+    pthread_mutex_unlock(&broker_lock);
+}
+
+//Make a client's tail memfd and map it. Returns the fd, or GPIO_ERR.
+static int create_client_tail(broker_tail_t** tail)
+{
+    int fd = memfd_create("chipgpio_broker_tail", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    void* map = MAP_FAILED;
+
+    //sealed to its size, so the client can't make the broker's mapping fault
+    if (fd >= GPIO_OK && ftruncate(fd, sizeof(broker_tail_t)) >= GPIO_OK &&
+        fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) >= GPIO_OK)
+    {
+        map = mmap(NULL, sizeof(broker_tail_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                   0);
+    }
+
+    if (map == MAP_FAILED)
+    {
+        fprintf(stderr, "Could not create a broker client's ring tail: %s\n",
+                strerror(errno));
+        if (fd >= GPIO_OK) { close(fd); }
+        return GPIO_ERR;
+    }
+
+    *tail = (broker_tail_t*) map;
+    atomic_store(&(*tail)->tail, 0);
+
+    return fd;
+}
+
+static void accept_client(int listen_fd)
+{
+    int sock = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    int slot = GPIO_ERR;
+
+    if (sock < GPIO_OK) { return; }
+
+    for (int i = 0; i < MAX_BROKER_CLIENTS && slot < GPIO_OK; i++)
+    { if (clients[i].sock < GPIO_OK) { slot = i; } }
+
+    if (slot < GPIO_OK)
+    {
+        fprintf(stderr, "Broker is full; refusing a client\n");
+        close(sock);
+        return;
+    }
+
+    pthread_mutex_lock(&broker_lock);
+    clients[slot].sock = sock;
+    clients[slot].event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    clients[slot].tail_fd = create_client_tail(&clients[slot].tail);
+    clients[slot].hello = FALSE;
+    atomic_store(&shm_rings[slot].head, 0);
+    atomic_store(&shm_rings[slot].dropped, 0);
+    pthread_mutex_unlock(&broker_lock);
+
+    if (clients[slot].event_fd < GPIO_OK || clients[slot].tail_fd < GPIO_OK)
+    {
+        fprintf(stderr, "Broker could not set up a client; refusing it\n");
+        drop_client(slot);
+    }
+}
+
+//Handle one request. Returns GPIO_ERR if the client should be dropped.
+static int handle_request(int slot)
+{
+    broker_request_t req;
+    ssize_t len = recv(clients[slot].sock, &req, sizeof(req), 0);
+    int fds[BROKER_HELLO_FDS] = { shm_ro_fd, clients[slot].event_fd,
+                                  clients[slot].tail_fd };
+    int rc = GPIO_ERR;
+
+    if (len != sizeof(req)) { return GPIO_ERR; } //hung up, or not a client
+
+    if (req.op == BROKER_HELLO)
+    {
+        //both sides must have loaded the same pin map
+        if (req.arg != NUM_PINS+FIRST_PIN) { return GPIO_ERR; }
+        clients[slot].hello = TRUE;
+        return send_reply(clients[slot].sock, slot, fds, BROKER_HELLO_FDS);
+    }
+
+    if (!clients[slot].hello) { return GPIO_ERR; }
+
+    clear_gpio_last_error();
+
+    switch (req.op)
+    {
+        case BROKER_OPEN: rc = broker_open(slot, req.pin); break;
+        case BROKER_CLOSE: rc = broker_close(slot, req.pin); break;
+        case BROKER_SET_DIR: rc = broker_set_dir(slot, req.pin, req.arg); break;
+        case BROKER_WRITE: rc = broker_write(slot, req.pin, req.arg); break;
+        case BROKER_SUBSCRIBE: rc = broker_subscribe(slot, req.pin, TRUE); break;
+        case BROKER_UNSUBSCRIBE: rc = broker_subscribe(slot, req.pin, FALSE); break;
+        default: return GPIO_ERR;
+    }
+
+    return send_reply(clients[slot].sock, rc, NULL, 0);
+}
+
+static void destroy_shm()
+{
+    if (shm != NULL) { munmap(shm, shm_size); }
+    if (shm_fd >= GPIO_OK) { close(shm_fd); }
+    if (shm_ro_fd >= GPIO_OK) { close(shm_ro_fd); }
+    shm = NULL;
+    shm_fd = GPIO_ERR;
+    shm_ro_fd = GPIO_ERR;
+}
+
+//Create the shared memory region for the current pin map
+static int create_shm()
+{
+    uint32_t num_pins = NUM_PINS+FIRST_PIN;
+    char ro_path[64];
+    broker_shm_t h;
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, BROKER_MAGIC, sizeof(h.magic));
+    h.version = BROKER_VERSION;
+    h.num_pins = num_pins;
+    h.values_offset = align_up(sizeof(broker_shm_t));
+    h.dirs_offset = align_up(h.values_offset+num_pins);
+    h.owners_offset = align_up(h.dirs_offset+num_pins);
+    h.rings_offset = align_up(h.owners_offset+num_pins*sizeof(atomic_ullong));
+    shm_size = h.rings_offset+MAX_BROKER_CLIENTS*sizeof(broker_ring_t);
+
+    shm_fd = memfd_create("chipgpio_broker", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (shm_fd < GPIO_OK || ftruncate(shm_fd, shm_size) < GPIO_OK)
+    {
+        fprintf(stderr, "Could not create the broker's shared memory: %s\n",
+                strerror(errno));
+        destroy_shm();
+        return GPIO_ERR;
+    }
+
+    shm = mmap(NULL, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    if (shm == MAP_FAILED)
+    {
+        fprintf(stderr, "Could not map the broker's shared memory: %s\n",
+                strerror(errno));
+        shm = NULL;
+        destroy_shm();
+        return GPIO_ERR;
+    }
+
+    //clients get the region through a read-only fd, so they can only map it to read.
+    //Reopening it through /proc could give them a writable one, which the seals stop
+    //(where the kernel has F_SEAL_FUTURE_WRITE), along with any change of its size.
+    snprintf(ro_path, sizeof(ro_path), "/proc/self/fd/%d", shm_fd);
+    shm_ro_fd = open(ro_path, O_RDONLY | O_CLOEXEC);
+    if (shm_ro_fd < GPIO_OK ||
+        fcntl(shm_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) < GPIO_OK)
+    {
+        fprintf(stderr, "Could not make the broker's shared memory read-only for its "
+                "clients: %s\n", strerror(errno));
+        destroy_shm();
+        return GPIO_ERR;
+    }
+    (void) fcntl(shm_fd, F_ADD_SEALS, F_SEAL_FUTURE_WRITE);
+
+    memcpy(shm, &h, sizeof(h));
+    set_shm_pointers();
+
+    for (uint32_t i = 0; i < num_pins; i++)
+    {
+        atomic_init(&shm_values[i], BROKER_UNKNOWN);
+        atomic_init(&shm_dirs[i], BROKER_UNKNOWN);
+    }
+
+    return GPIO_OK;
+}
+
+// The socket is bound under a temporary name and renamed once it's listening, so
+// clients never find a socket_path that refuses connections.
+static int listen_on(char* socket_path)
+{
+    struct sockaddr_un addr;
+    int fd = GPIO_ERR;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    if (strlen(socket_path)+sizeof(BROKER_SOCKET_SUFFIX) > sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Socket path %s is too long\n", socket_path);
+        return GPIO_ERR;
+    }
+
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s" BROKER_SOCKET_SUFFIX,
+             socket_path);
+    unlink(addr.sun_path); //left behind by a broker that didn't exit cleanly
+
+    //connecting needs write permission on the socket, which bind gives by the umask
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < GPIO_OK || bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < GPIO_OK ||
+        chmod(addr.sun_path, GPIO_BROKER_SOCKET_MODE) < GPIO_OK ||
+        listen(fd, MAX_BROKER_CLIENTS) < GPIO_OK ||
+        rename(addr.sun_path, socket_path) < GPIO_OK)
+    {
+        fprintf(stderr, "Could not listen on %s: %s\n", socket_path, strerror(errno));
+        if (fd >= GPIO_OK) { close(fd); }
+        unlink(addr.sun_path);
+        return GPIO_ERR;
+    }
+
+    return fd;
+}
+
+int run_gpio_broker(char* socket_path)
+{
+    struct pollfd fds[MAX_BROKER_CLIENTS+2];
+    int slots[MAX_BROKER_CLIENTS+2];
+    int listen_fd = GPIO_ERR;
+    int rc = GPIO_ERR;
+    int n = 0;
+
+    if (socket_path == NULL) { socket_path = GPIO_BROKER_DEFAULT_SOCKET; }
+
+    for (int i = 0; i < MAX_BROKER_CLIENTS; i++)
+    {
+        clients[i].sock = GPIO_ERR;
+        clients[i].event_fd = GPIO_ERR;
+        clients[i].tail_fd = GPIO_ERR;
+        clients[i].tail = NULL;
+    }
+
+    if (create_shm() < GPIO_OK) { goto done; }
+
+    subscribers = (uint64_t*) calloc(NUM_PINS+FIRST_PIN, sizeof(uint64_t));
+    if (subscribers == NULL)
+    {
+        fprintf(stderr, "Could not allocate the broker's subscriber masks\n");
+        goto done;
+    }
+
+    if (pipe2(wake_pipe, O_CLOEXEC | O_NONBLOCK) < GPIO_OK)
+    {
+        fprintf(stderr, "Could not create the broker's wake pipe: %s\n", strerror(errno));
+        wake_pipe[0] = wake_pipe[1] = GPIO_ERR;
+        goto done;
+    }
+
+    if ((listen_fd = listen_on(socket_path)) < GPIO_OK) { goto done; }
+
+    if (setup_callback_manager() < GPIO_OK)
+    {
+        fprintf(stderr, "Broker could not start the callback manager\n");
+        goto done;
+    }
+
+    rc = GPIO_OK;
+
+    //a stop that came in while starting up is only seen here
+    while (!broker_stop)
+    {
+        n = 0;
+        fds[n].fd = wake_pipe[0];
+        fds[n++].events = POLLIN;
+        fds[n].fd = listen_fd;
+        fds[n++].events = POLLIN;
+
+        for (int i = 0; i < MAX_BROKER_CLIENTS; i++)
+        {
+            if (clients[i].sock < GPIO_OK) { continue; }
+            slots[n] = i;
+            fds[n].fd = clients[i].sock;
+            fds[n++].events = POLLIN;
+        }
+
+        if (poll(fds, n, -1) < GPIO_OK)
+        {
+            if (errno == EINTR) { continue; }
+            fprintf(stderr, "Broker could not poll: %s\n", strerror(errno));
+            break;
+        }
+
+        if (fds[0].revents) { break; } //stop_gpio_broker
+
+        for (int i = 2; i < n; i++)
+        {
+            if (fds[i].revents && handle_request(slots[i]) < GPIO_OK)
+            { drop_client(slots[i]); }
+        }
+
+        if (fds[1].revents & POLLIN) { accept_client(listen_fd); }
+    }
+
+    for (int i = 0; i < MAX_BROKER_CLIENTS; i++)
+    { if (clients[i].sock >= GPIO_OK) { drop_client(i); } }
+
+    terminate_callback_manager();
+
+done:
+    if (listen_fd >= GPIO_OK)
+    {
+        close(listen_fd);
+        unlink(socket_path);
+    }
+    if (wake_pipe[0] >= GPIO_OK) { close(wake_pipe[0]); }
+    if (wake_pipe[1] >= GPIO_OK) { close(wake_pipe[1]); }
+    wake_pipe[0] = wake_pipe[1] = GPIO_ERR;
+    destroy_shm();
+    free(subscribers);
+    subscribers = NULL;
+    broker_stop = FALSE;
+
+    return rc;
+}
+
+int stop_gpio_broker()
+{
+    int fd = wake_pipe[1];
+
+    //seen by run_gpio_broker even if it's still starting up
+    broker_stop = TRUE;
+    if (fd >= GPIO_OK && write(fd, "", 1) < GPIO_OK) { return GPIO_ERR; }
+
+    return GPIO_OK;
+}
+
+/*
+ * Client side
+ */
+
+//Send a request and wait for the reply. Failures are reported as if they were local.
+static int broker_request(int op, int pin, int arg)
+{
+    broker_request_t req = { op, pin, arg };
+    broker_reply_t reply;
+    int err = 0;
+
+    pthread_mutex_lock(&request_lock);
+
+    if (send(gpio_broker_fd, &req, sizeof(req), MSG_NOSIGNAL) != sizeof(req) ||
+        recv(gpio_broker_fd, &reply, sizeof(reply), 0) != sizeof(reply))
+    {
+        err = errno;
+        pthread_mutex_unlock(&request_lock);
+        return report_gpio_error(GPIO_E_BROKER, pin, GPIO_ERR, err);
+    }
+
+    pthread_mutex_unlock(&request_lock);
+
+    //some failures are only printed by the broker, without a code
+    if (reply.rc < GPIO_OK)
+    {
+        return report_gpio_error(reply.code == GPIO_E_NONE ? GPIO_E_BROKER : reply.code,
+                                 pin, GPIO_ERR, reply.sys_errno);
+    }
+
+    return reply.rc;
+}
+
+//Say hello and receive the memfd, eventfd and tail memfd. Returns the slot.
+static int broker_hello(int* fds)
+{
+    broker_request_t req = { BROKER_HELLO, 0, NUM_PINS+FIRST_PIN };
+    broker_reply_t reply;
+    struct iovec iov = { &reply, sizeof(reply) };
+    struct msghdr msg;
+    char control[CMSG_SPACE(BROKER_HELLO_FDS*sizeof(int))];
+    struct cmsghdr* cmsg = NULL;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if (send(gpio_broker_fd, &req, sizeof(req), MSG_NOSIGNAL) != sizeof(req) ||
+        recvmsg(gpio_broker_fd, &msg, MSG_CMSG_CLOEXEC) != (ssize_t) sizeof(reply) ||
+        reply.rc < GPIO_OK)
+    { return GPIO_ERR; }
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(BROKER_HELLO_FDS*sizeof(int)))
+    { return GPIO_ERR; }
+
+    memcpy(fds, CMSG_DATA(cmsg), BROKER_HELLO_FDS*sizeof(int));
+
+    return reply.rc;
+}
+
+int connect_gpio_broker(char* socket_path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    int fds[BROKER_HELLO_FDS] = { GPIO_ERR, GPIO_ERR, GPIO_ERR };
+    void* tail = MAP_FAILED;
+
+    if (gpio_broker_fd >= GPIO_OK) { return GPIO_OK; }
+    if (socket_path == NULL) { socket_path = GPIO_BROKER_DEFAULT_SOCKET; }
+
+    //pins are still looked up by name here, so the pin map is needed; sysfs isn't
+    if (initialize_gpio_pin_names() < GPIO_OK) { return GPIO_ERR; }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socket_path);
+
+    gpio_broker_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (gpio_broker_fd < GPIO_OK ||
+        connect(gpio_broker_fd, (struct sockaddr*) &addr, sizeof(addr)) < GPIO_OK)
+    {
+        fprintf(stderr, "Could not connect to the GPIO broker at %s: %s\n", socket_path,
+                strerror(errno));
+        goto fail;
+    }
+
+    client_slot = broker_hello(fds);
+    if (client_slot < GPIO_OK)
+    {
+        fprintf(stderr, "The GPIO broker at %s refused the connection (is it using the "
+                "same pin map?)\n", socket_path);
+        goto fail;
+    }
+
+    client_event_fd = fds[1];
+    fds[1] = GPIO_ERR;
+
+    //the snapshot and rings are the broker's to write; only the tail is ours
+    if (fstat(fds[0], &st) < GPIO_OK ||
+        (shm = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fds[0], 0)) == MAP_FAILED ||
+        (tail = mmap(NULL, sizeof(broker_tail_t), PROT_READ | PROT_WRITE, MAP_SHARED,
+                     fds[2], 0)) == MAP_FAILED)
+    {
+        if (shm == MAP_FAILED) { shm = NULL; }
+        else { shm_size = st.st_size; }
+        fprintf(stderr, "Could not map the GPIO broker's memory: %s\n", strerror(errno));
+        goto fail;
+    }
+
+    //the mappings stay valid
+    close(fds[0]);
+    close(fds[2]);
+    fds[0] = fds[2] = GPIO_ERR;
+    shm_size = st.st_size;
+    client_tail = (broker_tail_t*) tail;
+
+    if (memcmp(shm->magic, BROKER_MAGIC, sizeof(shm->magic)) != GPIO_OK ||
+        shm->version != BROKER_VERSION ||
+        shm->num_pins != (uint32_t) (NUM_PINS+FIRST_PIN))
+    {
+        fprintf(stderr, "The GPIO broker at %s is a different version\n", socket_path);
+        goto fail;
+    }
+
+    set_shm_pointers();
+
+    return GPIO_OK;
+
+fail:
+    for (int i = 0; i < BROKER_HELLO_FDS; i++)
+    { if (fds[i] >= GPIO_OK) { close(fds[i]); } }
+    disconnect_gpio_broker();
+    return GPIO_ERR;
+}
+
+int disconnect_gpio_broker()
+{
+    //the broker releases our pins when the socket closes
+    if (gpio_broker_fd >= GPIO_OK) { close(gpio_broker_fd); }
+    if (client_event_fd >= GPIO_OK) { close(client_event_fd); }
+    if (shm != NULL) { munmap(shm, shm_size); }
+    if (client_tail != NULL) { munmap(client_tail, sizeof(broker_tail_t)); }
+
+    gpio_broker_fd = GPIO_ERR;
+    client_event_fd = GPIO_ERR;
+    client_slot = GPIO_ERR;
+    shm = NULL;
+    client_tail = NULL;
+
+    return GPIO_OK;
+}
+
+int is_gpio_broker_connected()
+{
+    return gpio_broker_fd >= GPIO_OK;
+}
+
+int broker_open_gpio_pin(int pin)
+{
+    if (check_if_pin_exists(pin) < GPIO_OK) { return GPIO_ERR; }
+    return broker_request(BROKER_OPEN, pin, 0);
+}
+
+int broker_close_gpio_pin(int pin)
+{
+    if (check_if_pin_exists(pin) < GPIO_OK) { return GPIO_ERR; }
+    return broker_request(BROKER_CLOSE, pin, 0);
+}
+
+int broker_is_gpio_pin_open(int pin)
+{
+    return (atomic_load_explicit(&shm_owners[pin], memory_order_relaxed) >> client_slot)
+           & 1;
+}
+
+int broker_set_gpio_dir(int pin, int out)
+{
+    if (check_if_pin_exists(pin) < GPIO_OK) { return GPIO_ERR; }
+    return broker_request(BROKER_SET_DIR, pin, out ? GPIO_DIR_OUT : GPIO_DIR_IN);
+}
+
+int broker_set_gpio_val(int pin, int val)
+{
+    if (check_if_pin_exists(pin) < GPIO_OK || is_valid_value(val, pin) < GPIO_OK)
+    { return GPIO_ERR; }
+    return broker_request(BROKER_WRITE, pin, val);
+}
+
+// Read a pin's value or direction from the snapshot. It's as fresh as the broker's last
+// poll of the pin (or the last write through the broker).
+static int read_snapshot(atomic_schar* array, int pin)
+{
+    unsigned int seq = 0;
+    int val = BROKER_UNKNOWN;
+    int tries = 0;
+    long long deadline = 0;
+
+    if (check_if_pin_exists(pin) < GPIO_OK) { return GPIO_ERR; }
+
+    do
+    {
+        //an update is a few stores; if it takes this long, the broker is gone
+        if (++tries > BROKER_SNAPSHOT_SPINS)
+        {
+            if (!deadline)
+            { deadline = get_time_ns() + BROKER_SNAPSHOT_TIMEOUT_MS*1000000LL; }
+            else if (get_time_ns() > deadline)
+            { return report_gpio_error(GPIO_E_BROKER, pin, GPIO_ERR, EAGAIN); }
+            sched_yield();
+        }
+
+        seq = atomic_load_explicit(&shm->seq, memory_order_acquire);
+        val = atomic_load_explicit(&array[pin], memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || seq != atomic_load_explicit(&shm->seq, memory_order_relaxed));
+
+    //nobody has the pin open, so there's no value file to read either
+    if (val == BROKER_UNKNOWN)
+    { return report_gpio_error(GPIO_E_OPEN, pin, GPIO_ERR, ENOENT); }
+
+    return val;
+}
+
+int broker_read_gpio_val(int pin)
+{
+    return read_snapshot(shm_values, pin);
+}
+
+int broker_get_gpio_dir(int pin)
+{
+    return read_snapshot(shm_dirs, pin);
+}
+
+int subscribe_gpio_broker(int pin)
+{
+    if (!is_gpio_broker_connected())
+    { return report_gpio_error(GPIO_E_BROKER, pin, GPIO_ERR, 0); }
+    return broker_request(BROKER_SUBSCRIBE, pin, 0);
+}
+
+int subscribe_gpio_broker_n(char* name)
+{
+    int pin = get_pin_from_name(name);
+    if (pin < GPIO_OK) { return GPIO_ERR; }
+    return subscribe_gpio_broker(pin);
+}
+
+int unsubscribe_gpio_broker(int pin)
+{
+    if (!is_gpio_broker_connected())
+    { return report_gpio_error(GPIO_E_BROKER, pin, GPIO_ERR, 0); }
+    return broker_request(BROKER_UNSUBSCRIBE, pin, 0);
+}
+
+int read_gpio_broker_events(gpio_broker_event_t* events, int max)
+{
+    broker_ring_t* ring = NULL;
+    unsigned int head = 0;
+    unsigned int tail = 0;
+    uint64_t count = 0;
+    int n = 0;
+
+    if (!is_gpio_broker_connected() || events == NULL) { return GPIO_ERR; }
+
+    //clear the eventfd first, so an event pushed while draining wakes us up again
+    if (read(client_event_fd, &count, sizeof(count)) < GPIO_OK) {}
+
+    ring = &shm_rings[client_slot];
+    tail = atomic_load_explicit(&client_tail->tail, memory_order_relaxed);
+    head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    for (; n < max && tail+n != head; n++)
+    { events[n] = ring->events[(tail+n) & (BROKER_RING_SIZE-1)]; }
+
+    atomic_store_explicit(&client_tail->tail, tail+n, memory_order_release);
+
+    return n;
+}
+
+int get_gpio_broker_event_fd()
+{
+    return client_event_fd;
+}
+
+uint64_t get_gpio_broker_dropped()
+{
+    if (!is_gpio_broker_connected()) { return 0; }
+    return atomic_load_explicit(&shm_rings[client_slot].dropped, memory_order_relaxed);
+}
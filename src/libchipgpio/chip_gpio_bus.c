@@ -0,0 +1,278 @@
+/*
+ * Copyright (c) 2017, Bryan Haley
+ * This code is dual licensed (GPLv2 and Simplified BSD). Use the license that works
+ * best for you. Check LICENSE.GPL and LICENSE.BSD for more details.
+ *
+ * chip_gpio_bus.c
+ * Implementation of parallel buses built from groups of GPIO pins.
+ *  Note: sysfs has no way to set several lines at once, so every pin is still its own
+ *  write (though they're submitted together where io_uring is available). To keep that
+ *  to a minimum, the last word written is kept in a shadow and only the bits that
+ *  changed are written.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "chip_gpio.h"
+#include "chip_gpio_utils.h"
+#include "chip_gpio_bus.h"
+#include "chip_gpio_batch.h"
+
+#ifndef TRUE
+    #define TRUE 1
+#endif
+
+#ifndef FALSE
+    #define FALSE 0
+#endif
+
+static inline int is_valid_bus(gpio_bus_t* bus)
+{
+    if (bus == NULL)
+    {
+        fprintf(stderr, "Tried to use a bus that does not exist\n");
+        return GPIO_ERR;
+    }
+
+    return GPIO_OK;
+}
+
+//Create a bus from an ordered list of pins; pins[0] is bit 0
+gpio_bus_t* create_gpio_bus(int* pins, int width)
+{
+    gpio_bus_t* bus = NULL;
+
+    if (pins == NULL || width < 1 || width > MAX_BUS_WIDTH)
+    {
+        fprintf(stderr, "Could not create a bus %d pins wide (1 to %d are allowed)\n",
+                width, MAX_BUS_WIDTH);
+        return NULL;
+    }
+
+    for (int i = 0; i < width; i++)
+    {
+        if (check_if_pin_exists(pins[i]) < GPIO_OK) { return NULL; }
+
+        for (int j = 0; j < i; j++)
+        {
+            if (pins[i] == pins[j])
+            {
+                fprintf(stderr, "Pin %d appears on the bus more than once\n", pins[i]);
+                return NULL;
+            }
+        }
+    }
+
+    bus = (gpio_bus_t*) calloc(1, sizeof(gpio_bus_t));
+    if (bus == NULL) { return NULL; }
+
+    bus->width = width;
+    for (int i = 0; i < width; i++) { bus->pins[i] = pins[i]; }
+
+    //precompute the mask so words can be scattered/gathered without checking widths
+    bus->mask = width == MAX_BUS_WIDTH ? UINT32_MAX : ((uint32_t) 1 << width)-1;
+    bus->shadow = 0;
+    bus->shadow_valid = FALSE;
+    bus->dir = GPIO_ERR;
+    bus->strobe_pin = BUS_NO_STROBE;
+    bus->strobe_active = GPIO_PIN_HIGH;
+    bus->strobe_width_us = 0;
+
+    return bus;
+}
+
+//Convenience function; converts pin names to numerical values and passes them to above
+gpio_bus_t* create_gpio_bus_n(char** names, int width)
+{
+    int pins[MAX_BUS_WIDTH];
+
+    if (names == NULL || width < 1 || width > MAX_BUS_WIDTH)
+    { return create_gpio_bus(NULL, width); }
+
+    for (int i = 0; i < width; i++)
+    {
+        pins[i] = get_gpio_pin_num_from_name(names[i]);
+        if (pins[i] < GPIO_OK)
+        {
+            fprintf(stderr, "Could not create bus; no pin named %s\n", names[i]);
+            return NULL;
+        }
+    }
+
+    return create_gpio_bus(pins, width);
+}
+
+//Open every pin on the bus and set their direction
+int setup_gpio_bus(gpio_bus_t* bus, int out)
+{
+    if (is_valid_bus(bus) < GPIO_OK) { return GPIO_ERR; }
+
+    for (int i = 0; i < bus->width; i++)
+    {
+        if (open_gpio_pin(bus->pins[i]) < GPIO_OK) { return GPIO_ERR; }
+    }
+
+    if (bus->strobe_pin != BUS_NO_STROBE &&
+        setup_gpio_pin(bus->strobe_pin, GPIO_DIR_OUT) < GPIO_OK)
+    { return GPIO_ERR; }
+
+    if (bus->strobe_pin != BUS_NO_STROBE &&
+        set_gpio_val(bus->strobe_pin, !bus->strobe_active) < GPIO_OK)
+    { return GPIO_ERR; }
+
+    return set_gpio_bus_dir(bus, out);
+}
+
+//Change the direction of every data pin (e.g. to read a busy flag back from an LCD)
+int set_gpio_bus_dir(gpio_bus_t* bus, int out)
+{
+    if (is_valid_bus(bus) < GPIO_OK) { return GPIO_ERR; }
+
+    for (int i = 0; i < bus->width; i++)
+    {
+        if (set_gpio_dir(bus->pins[i], out) < GPIO_OK) { return GPIO_ERR; }
+    }
+
+    //whatever the pins were driven to before is unknown once they've been inputs
+    bus->dir = out;
+    bus->shadow_valid = FALSE;
+
+    return out;
+}
+
+int set_gpio_bus_strobe(gpio_bus_t* bus, int pin, int active_level, int width_us)
+{
+    if (is_valid_bus(bus) < GPIO_OK) { return GPIO_ERR; }
+    if (check_if_pin_exists(pin) < GPIO_OK) { return GPIO_ERR; }
+    if (is_valid_value(active_level, pin) < GPIO_OK) { return GPIO_ERR; }
+
+    for (int i = 0; i < bus->width; i++)
+    {
+        if (bus->pins[i] == pin)
+        {
+            fprintf(stderr, "Pin %d is already a data pin on this bus\n", pin);
+            return GPIO_ERR;
+        }
+    }
+
+    bus->strobe_pin = pin;
+    bus->strobe_active = active_level;
+    bus->strobe_width_us = width_us > 0 ? width_us : 0;
+
+    return GPIO_OK;
+}
+
+//Scatter a word across the bus, writing only the pins whose bit has changed (as one
+//batch, see chip_gpio_batch.h)
+int bus_write(gpio_bus_t* bus, uint32_t word)
+{
+    int pins[MAX_BUS_WIDTH];
+    int vals[MAX_BUS_WIDTH];
+    uint32_t changed = 0;
+    int bit = 0;
+    int n = 0;
+
+    if (is_valid_bus(bus) < GPIO_OK) { return GPIO_ERR; }
+
+    word &= bus->mask;
+    changed = bus->shadow_valid ? (word ^ bus->shadow) : bus->mask;
+
+    while (changed)
+    {
+        bit = __builtin_ctz(changed);
+        changed &= changed-1; //clear the lowest set bit
+
+        pins[n] = bus->pins[bit];
+        vals[n++] = (word >> bit) & 1;
+    }
+
+    if (n > 0 && set_gpio_vals(pins, vals, n) < GPIO_OK)
+    {
+        //part of the word may have made it out; don't trust the shadow anymore
+        bus->shadow_valid = FALSE;
+        return GPIO_ERR;
+    }
+
+    bus->shadow = word;
+    bus->shadow_valid = TRUE;
+
+    return GPIO_OK;
+}
+
+//Gather a word from the bus
+int64_t bus_read(gpio_bus_t* bus)
+{
+    int vals[MAX_BUS_WIDTH];
+    uint32_t word = 0;
+
+    if (is_valid_bus(bus) < GPIO_OK) { return GPIO_ERR; }
+
+    if (read_gpio_vals(bus->pins, vals, bus->width) < GPIO_OK) { return GPIO_ERR; }
+
+    for (int i = 0; i < bus->width; i++) { word |= (uint32_t) vals[i] << i; }
+
+    return word;
+}
+
+//Pulse the strobe pin to its active level and back
+int bus_strobe(gpio_bus_t* bus)
+{
+    if (is_valid_bus(bus) < GPIO_OK) { return GPIO_ERR; }
+
+    if (bus->strobe_pin == BUS_NO_STROBE)
+    {
+        fprintf(stderr, "Bus has no strobe pin; call set_gpio_bus_strobe first\n");
+        return GPIO_ERR;
+    }
+
+    if (set_gpio_val(bus->strobe_pin, bus->strobe_active) < GPIO_OK)
+    { return GPIO_ERR; }
+
+    if (bus->strobe_width_us > 0) { usleep(bus->strobe_width_us); }
+
+    if (set_gpio_val(bus->strobe_pin, !bus->strobe_active) < GPIO_OK)
+    { return GPIO_ERR; }
+
+    return GPIO_OK;
+}
+
+int bus_write_strobe(gpio_bus_t* bus, uint32_t word)
+{
+    if (bus_write(bus, word) < GPIO_OK) { return GPIO_ERR; }
+    return bus_strobe(bus);
+}
+
+//The bus is sampled while the strobe is still active, as parallel ADCs only drive their
+//outputs while RD is asserted
+int64_t bus_strobe_read(gpio_bus_t* bus)
+{
+    int64_t word = GPIO_ERR;
+
+    if (is_valid_bus(bus) < GPIO_OK) { return GPIO_ERR; }
+
+    if (bus->strobe_pin == BUS_NO_STROBE)
+    {
+        fprintf(stderr, "Bus has no strobe pin; call set_gpio_bus_strobe first\n");
+        return GPIO_ERR;
+    }
+
+    if (set_gpio_val(bus->strobe_pin, bus->strobe_active) < GPIO_OK)
+    { return GPIO_ERR; }
+
+    if (bus->strobe_width_us > 0) { usleep(bus->strobe_width_us); }
+
+    word = bus_read(bus);
+
+    if (set_gpio_val(bus->strobe_pin, !bus->strobe_active) < GPIO_OK)
+    { return GPIO_ERR; }
+
+    return word;
+}
+
+int destroy_gpio_bus(gpio_bus_t* bus)
+{
+    if (is_valid_bus(bus) < GPIO_OK) { return GPIO_ERR; }
+    free(bus);
+    return GPIO_OK;
+}
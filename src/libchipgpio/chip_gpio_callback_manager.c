@@ -7,16 +7,25 @@
  * Implementation of functions for registering and managing callback functions.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <time.h>
 #include "chip_gpio.h"
 #include "chip_gpio_utils.h"
 #include "chip_gpio_callback_manager.h"
+#include "chip_gpio_probes.h"
+#include "chip_gpio_batch.h"
 
 #define NO_FUNC NULL
-#define NEVER_READ -1
+#define BITS_PER_WORD 64
+#define PIN_WORD(pin) ((pin) / BITS_PER_WORD)
+#define PIN_BIT(pin) (1ULL << ((pin) % BITS_PER_WORD))
 
 #ifndef TRUE
     #define TRUE 1
@@ -33,72 +42,396 @@ typedef struct
     void* arg;
 } callback_func_t;
 
-//struct to hold data used to interpret pin value changes
+// Per-pin state, kept as bitsets (one bit per pin) so that a pass only visits the pins
+// somebody is listening to, and works out changes and flips a word of pins at a time
 typedef struct
 {
-    int  value;
-    char flip; //bool indicating if the callback func for this pin a flip function
-    char flipped_value; //opposite of the inital value
-    char is_flipped; //bool indicating if the value flipped but has now returned
-} pin_callback_t;
-
-pthread_t manager_thread; //pins are polled on a separate thread
-callback_func_t* callback_func; //array of callback functions
-pin_callback_t* pin_val; //array of pin callback data
-int manager_thread_finished; //bool used to indicate when the thread has closed
-int delay; //optional polling delay
-int stop_polling; //bool used to tell the polling thread to wrap it up
-int first_start; //bool used to tell if start_callback_manager has been called yet
-int paused; //bool indicating if the thread was paused externally
-void* poll_values(void* arg); //function invoked on manager_thread
-
-//Allocate memory for arrays, initialize structs, set booleans used for thread control
-int initialize_callback_manager()
+    int num_words;
+    uint64_t* registered; //has a callback function
+    uint64_t* measured; //has a measurement channel
+    uint64_t* batched; //is one of the batch callback's pins
+    uint64_t* flip; //its callback function is a flip function
+    uint64_t* known; //value holds a value that was read (or forced)
+    uint64_t* value; //last value read
+    uint64_t* flipped_value; //value a flip function's pin flips to (opposite of initial)
+    uint64_t* is_flipped; //the value flipped, so returning calls the flip function
+    uint64_t* group[NUM_PIN_GROUPS]; //pins in each pin group, worked out once
+} pin_bits_t;
+
+//the batch callback and the changes gathered for it; used only by the polling thread
+//while it runs
+typedef struct
+{
+    void* func;
+    void* arg;
+    int mode; //CALLBACK_BATCH_*
+    long long interval_ns; //least time to gather changes for
+    long long last_ns; //when the last batch was delivered
+    int num_events;
+    pin_event_t events[CALLBACK_BATCH_SIZE];
+    short* slot; //each pin's index in events (CALLBACK_BATCH_LATEST), -1 if none
+} batch_t;
+
+//measurement channel data; written only by the polling thread
+typedef struct
+{
+    long long gate_ns; //window frequency is measured over (0 = disabled)
+    long long gate_start_ns;
+    uint64_t gate_start_edges;
+    long long last_rise_ns;
+    atomic_int reset_requested; //bool set by reset_gpio_measurement for the poller
+    atomic_uint seq; //sequence lock guarding measurement; odd while being written
+    pin_measurement_t measurement;
+} pin_measure_t;
+
+//log-bucketed histogram; written only by the polling thread, zeroed by any thread
+typedef struct
+{
+    atomic_ullong count;
+    atomic_ullong min_ns;
+    atomic_ullong max_ns;
+    atomic_ullong sum_ns;
+    atomic_ullong buckets[HIST_NUM_BUCKETS];
+} histogram_t;
+
+//Everything one callback manager needs; the functions without _m use default_manager
+struct gpio_cb_manager
+{
+    pthread_t thread; //pins are polled on a separate thread
+    int num_pins; //NUM_PINS+FIRST_PIN when it was initialized; what its arrays hold
+    callback_func_t* callback_func; //array of callback functions
+    pin_bits_t bits;
+    long long* last_read_ns; //when the polling thread last read each pin (0 = not yet)
+    pin_measure_t* measures; //array of measurement channels
+    batch_t batch;
+    callback_pool_t* pool; //its callback workers, created the first time they're needed
+    int thread_finished; //bool used to indicate when the thread has closed
+    int delay; //optional polling delay
+    int cpu; //CPU the polling thread is pinned to, or GPIO_ERR for any
+    int adaptive_min_us; //adaptive polling's fast interval
+    int adaptive_max_us; //adaptive polling's slow interval (0 = fixed delay instead)
+    int adaptive_quiet_us; //how long pins must be quiet before backing off
+    int poll_interval_us; //current adaptive interval
+    long long last_activity_ns; //when a pass last saw a change
+    int pass_active; //bool set when a change (or encoder step) is seen in a pass
+    pthread_mutex_t sleep_lock;
+    pthread_cond_t sleep_cond; //signalled to cut the wait between passes short
+    int stop_polling; //bool used to tell the polling thread to wrap it up
+    int first_start; //bool used to tell if start_callback_manager has been called yet
+    int paused; //bool indicating if the thread was paused externally
+    histogram_t histograms[NUM_PIN_GROUPS][CALLBACK_NUM_HISTS];
+};
+
+static gpio_cb_manager_t default_manager =
+{
+    .cpu = GPIO_ERR,
+    .sleep_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void* poll_values(void* arg); //function invoked on a manager's thread
+static void update_measurement(gpio_cb_manager_t* manager, int pin, int new_val,
+                               int changed, long long now);
+static void update_measurement_error(gpio_cb_manager_t* m, int pin);
+static void record_histogram(gpio_cb_manager_t* m, int group, int hist, long long ns);
+
+//thread_finished and stop_polling are shared with the manager's thread
+static inline int get_manager_flag(int* flag)
+{ return __atomic_load_n(flag, __ATOMIC_ACQUIRE); }
+
+static inline void set_manager_flag(int* flag, int val)
+{ __atomic_store_n(flag, val, __ATOMIC_RELEASE); }
+
+//Pins on another gpiochip (the i2c expander, on the CHIP) are slow to read
+static inline int get_pin_group(int pin)
+{
+    if (p_ident[pin].chip_label) { return PIN_GROUP_XIO; }
+
+    return PIN_GROUP_R8;
+}
+
+static inline int get_bit(const uint64_t* set, int pin)
+{
+    return (set[PIN_WORD(pin)] & PIN_BIT(pin)) != 0;
+}
+
+static inline void set_bit(uint64_t* set, int pin, int on)
+{
+    if (on) { set[PIN_WORD(pin)] |= PIN_BIT(pin); }
+    else { set[PIN_WORD(pin)] &= ~PIN_BIT(pin); }
+}
+
+//Allocate every bitset in one block
+static int alloc_pin_bits(pin_bits_t* bits, int num_pins)
+{
+    uint64_t* block = NULL;
+    int words = (num_pins+BITS_PER_WORD-1) / BITS_PER_WORD;
+    int num_sets = 8+NUM_PIN_GROUPS;
+
+    block = (uint64_t*) calloc(words*num_sets, sizeof(uint64_t));
+    if (block == NULL) { return GPIO_ERR; }
+
+    bits->num_words = words;
+    bits->registered = block;
+    bits->measured = block + words;
+    bits->batched = block + 2*words;
+    bits->flip = block + 3*words;
+    bits->known = block + 4*words;
+    bits->value = block + 5*words;
+    bits->flipped_value = block + 6*words;
+    bits->is_flipped = block + 7*words;
+    for (int g = 0; g < NUM_PIN_GROUPS; g++) { bits->group[g] = block + (8+g)*words; }
+
+    return GPIO_OK;
+}
+
+// Call a callback function, recording how long after detection it was invoked and how
+// long it took. Runs on the polling thread, or on a worker (chip_gpio_callback_pool.c).
+void invoke_callback(gpio_cb_manager_t* m, int pin, int new_val, void* func, void* arg,
+                     long long detected_ns)
+{
+    int (*user_func)(pin_change_t, void*) = func;
+    pin_change_t change = { pin, new_val };
+    long long start = get_time_ns();
+    long long latency = start-detected_ns;
+
+    record_histogram(m, get_pin_group(pin), CALLBACK_HIST_DISPATCH, latency);
+    if (GPIO_PROBE_ENABLED(dispatch))
+    { GPIO_PROBE4(dispatch, pin, get_cached_kern_num(pin), new_val, latency); }
+
+    user_func(change, arg);
+    record_callback_run(m->pool, pin, get_time_ns()-start);
+}
+
+//Hand a change to the workers, or run its callback right here if there are none
+static inline void dispatch_callback(gpio_cb_manager_t* m, pin_change_t change,
+                                     long long detected_ns)
+{
+    int pin = change.pin;
+    callback_func_t* c = &m->callback_func[pin];
+
+    if (queue_callback(m->pool, pin, change.new_val, c->func, c->arg, detected_ns) <
+        GPIO_OK)
+    { invoke_callback(m, pin, change.new_val, c->func, c->arg, detected_ns); }
+}
+
+//The wait between passes is timed on CLOCK_MONOTONIC, so clock changes don't stretch it
+static void init_poll_sleep(gpio_cb_manager_t* m)
+{
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&m->sleep_cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+static void unlock_poll_sleep(void* arg)
+{
+    gpio_cb_manager_t* m = arg;
+    pthread_mutex_unlock(&m->sleep_lock);
+}
+
+// Sleep between passes. Pausing the manager wakes the polling thread, so a long adaptive
+// interval doesn't hold up registering callbacks.
+static void wait_between_passes(gpio_cb_manager_t* m, int us)
+{
+    struct timespec until;
+
+    clock_gettime(CLOCK_MONOTONIC, &until);
+    until.tv_sec += us / 1000000;
+    until.tv_nsec += (long) (us % 1000000)*NS_PER_US;
+    if (until.tv_nsec >= NS_PER_SEC)
+    {
+        until.tv_sec++;
+        until.tv_nsec -= NS_PER_SEC;
+    }
+
+    pthread_mutex_lock(&m->sleep_lock);
+    pthread_cleanup_push(unlock_poll_sleep, m); //a forced pause cancels the thread
+    while (!get_manager_flag(&m->stop_polling) &&
+           pthread_cond_timedwait(&m->sleep_cond, &m->sleep_lock, &until) != ETIMEDOUT);
+    pthread_cleanup_pop(TRUE);
+}
+
+// Adaptive polling: drop to the fast interval on any change, then double the interval
+// on every pass once the pins have been quiet for a while, up to the slow one
+static int next_poll_interval(gpio_cb_manager_t* m, long long now)
+{
+    if (m->pass_active)
+    {
+        m->pass_active = FALSE;
+        m->last_activity_ns = now;
+        m->poll_interval_us = m->adaptive_min_us;
+    }
+
+    else if (now - m->last_activity_ns >= m->adaptive_quiet_us*NS_PER_US &&
+             m->poll_interval_us < m->adaptive_max_us)
+    {
+        m->poll_interval_us = m->poll_interval_us > m->adaptive_max_us/2 ?
+                              m->adaptive_max_us :
+                              m->poll_interval_us > 0 ? 2*m->poll_interval_us : 1;
+    }
+
+    return m->poll_interval_us;
+}
+
+// Allocate memory for arrays, initialize structs, set booleans used for thread control.
+// The arrays are sized for the pin map loaded now; pins a later, larger map adds are
+// turned away (see check_manager_pin) until the manager is initialized again.
+static int init_manager(gpio_cb_manager_t* m)
 {
-    callback_func = (callback_func_t*) 
-                        malloc((NUM_PINS+FIRST_PIN)*sizeof(callback_func_t));
-    pin_val = (pin_callback_t*) malloc((NUM_PINS+FIRST_PIN)*sizeof(pin_callback_t));
+    m->num_pins = 0; //until everything is allocated
+    m->callback_func = (callback_func_t*)
+                           malloc((NUM_PINS+FIRST_PIN)*sizeof(callback_func_t));
+    m->last_read_ns = (long long*) calloc(NUM_PINS+FIRST_PIN, sizeof(long long));
+    m->measures = (pin_measure_t*) malloc((NUM_PINS+FIRST_PIN)*sizeof(pin_measure_t));
+    init_poll_sleep(m);
+    m->batch.slot = (short*) malloc((NUM_PINS+FIRST_PIN)*sizeof(short));
+    m->batch.func = NO_FUNC;
+    m->batch.num_events = 0;
+    if (m->callback_func == NULL || m->last_read_ns == NULL || m->measures == NULL ||
+        m->batch.slot == NULL || alloc_pin_bits(&m->bits, NUM_PINS+FIRST_PIN) < GPIO_OK)
+    { return GPIO_ERR; }
 
-    for (int i = FIRST_PIN; i < NUM_PINS+FIRST_PIN; i++)
+    m->num_pins = NUM_PINS+FIRST_PIN;
+    for (int i = FIRST_PIN; i < m->num_pins; i++)
     {
-        pin_val[i].value = NEVER_READ;
-        pin_val[i].flip = FALSE;
-        pin_val[i].flipped_value = NEVER_READ;
-        pin_val[i].is_flipped = TRUE;
-        callback_func[i].func = NO_FUNC;
+        set_bit(m->bits.is_flipped, i, TRUE);
+        set_bit(m->bits.group[get_pin_group(i)], i, TRUE);
+        atomic_init(&m->measures[i].reset_requested, FALSE);
+        atomic_init(&m->measures[i].seq, 0);
+        m->callback_func[i].func = NO_FUNC;
+        m->batch.slot[i] = -1;
     }
 
-    manager_thread_finished = TRUE;
-    stop_polling = FALSE;
-    first_start = FALSE;
-    paused = FALSE;
+    set_manager_flag(&m->thread_finished, TRUE);
+    set_manager_flag(&m->stop_polling, FALSE);
+    m->first_start = FALSE;
+    m->paused = FALSE;
+
+    if (get_callback_pool(m) == NULL) { return GPIO_ERR; }
+
+    return init_callback_pool(m->pool, m->num_pins);
+}
+
+//A pin that exists and fits the manager's arrays
+static int check_manager_pin(gpio_cb_manager_t* m, int pin)
+{
+    if (check_if_pin_exists(pin) < GPIO_OK) { return GPIO_ERR; }
+
+    if (pin >= m->num_pins) { return report_gpio_error(GPIO_E_NO_PIN, pin, GPIO_ERR, 0); }
 
     return GPIO_OK;
 }
 
+int initialize_callback_manager()
+{
+    return init_manager(&default_manager);
+}
+
 //Convenience method; same as above, shorter name
 int init_callback_manager()
 {
     return initialize_callback_manager();
 }
 
+// A manager of its own, initialized and ready to start. Its polling thread, workers,
+// callbacks and histograms are separate from every other manager's.
+gpio_cb_manager_t* create_callback_manager()
+{
+    gpio_cb_manager_t* m = (gpio_cb_manager_t*) calloc(1, sizeof(gpio_cb_manager_t));
+
+    if (m == NULL) { return NULL; }
+
+    m->cpu = GPIO_ERR;
+    pthread_mutex_init(&m->sleep_lock, NULL);
+    if (init_manager(m) < GPIO_OK)
+    {
+        fprintf(stderr, "Could not create a callback manager\n");
+        free_callback_manager(m);
+        return NULL;
+    }
+
+    return m;
+}
+
+//Terminate a manager made by create_callback_manager and free it
+int free_callback_manager(gpio_cb_manager_t* m)
+{
+    if (m == NULL || m == &default_manager)
+    {
+        fprintf(stderr, "Only managers made by create_callback_manager can be freed\n");
+        return GPIO_ERR;
+    }
+
+    terminate_callback_manager_m(m);
+    detach_encoders(m);
+    destroy_callback_pool(m->pool);
+    pthread_mutex_destroy(&m->sleep_lock);
+    free(m);
+
+    return GPIO_OK;
+}
+
+gpio_cb_manager_t* get_default_callback_manager()
+{
+    return &default_manager;
+}
+
+//The manager's worker pool, created the first time it's asked for
+callback_pool_t* get_callback_pool(gpio_cb_manager_t* m)
+{
+    if (m->pool == NULL) { m->pool = create_callback_pool(m); }
+    return m->pool;
+}
+
+//Pin the polling thread to a CPU, or let it run on any (GPIO_ERR)
+static void apply_manager_cpu(gpio_cb_manager_t* m)
+{
+    cpu_set_t set;
+
+    if (m->cpu < 0) { return; }
+
+    CPU_ZERO(&set);
+    CPU_SET(m->cpu, &set);
+    if (pthread_setaffinity_np(m->thread, sizeof(set), &set) != 0)
+    { fprintf(stderr, "Could not pin the callback manager to CPU %d\n", m->cpu); }
+}
+
 //create the thread that pins will be polled on
-int start_callback_manager()
+int start_callback_manager_m(gpio_cb_manager_t* m)
 {
-    // If this function is called, any thread assigned to manager_thread SHOULD
+    // If this function is called, any thread assigned to the manager SHOULD
     // have already been destroyed, but let's just make sure.
     // (We should be fine even if pthread_cancel fails, so long as we make sure
-    //  manager_thread is not NULL; if it -is- NULL, we'll accidentally close the thread
+    //  the thread is not NULL; if it -is- NULL, we'll accidentally close the thread
     //  that called this func; that's what this if statement prevents.)
-    if (!manager_thread) { pthread_cancel(manager_thread); }
-    
-    pthread_create(&manager_thread, NULL, &poll_values, NULL);
+    //  A finished thread still has to be joined to free its resources.
+    if (m->thread)
+    {
+        if (!get_manager_flag(&m->thread_finished)) { pthread_cancel(m->thread); }
+        pthread_join(m->thread, NULL);
+        m->thread = 0;
+    }
 
-    first_start = TRUE;
+    //workers first, so the first changes found have somewhere to go
+    if (start_callback_pool(m->pool) < GPIO_OK) { return GPIO_ERR; }
+
+    //set here rather than on the new thread, so a pause right after this waits for it
+    set_manager_flag(&m->thread_finished, FALSE);
+    pthread_create(&m->thread, NULL, &poll_values, m);
+    apply_manager_cpu(m);
+
+    m->first_start = TRUE;
 
     return GPIO_OK;
 }
 
+int start_callback_manager()
+{
+    return start_callback_manager_m(&default_manager);
+}
+
 //Convenience function; calls init and start together
 int setup_callback_manager()
 {
@@ -107,101 +440,306 @@ int setup_callback_manager()
     return start_callback_manager();
 }
 
-//Read values from pins with registered callback functions, and call their functions
-void* poll_values(void* arg)
+int set_callback_manager_cpu(gpio_cb_manager_t* m, int cpu)
+{
+    if (m == NULL || cpu < GPIO_ERR || cpu >= CPU_SETSIZE)
+    {
+        fprintf(stderr, "Could not pin the callback manager to CPU %d\n", cpu);
+        return GPIO_ERR;
+    }
+
+    m->cpu = cpu;
+    if (m->thread && !get_manager_flag(&m->thread_finished)) { apply_manager_cpu(m); }
+
+    return GPIO_OK;
+}
+
+//A pin couldn't be read (or read something other than 0 or 1)
+static void handle_read_error(gpio_cb_manager_t* m, int pin)
 {
-    manager_thread_finished = FALSE;
-    pin_change_t change = { GPIO_ERR, NEVER_READ };
+    //whatever happened since the last read is lost
+    record_gpio_event(pin, TRUE);
+    m->last_read_ns[pin] = 0;
+    if (get_bit(m->bits.measured, pin)) { update_measurement_error(m, pin); }
+
+    //the batch callback stops hearing about it too
+    set_bit(m->bits.batched, pin, FALSE);
 
-    while (!stop_polling)
+    if (get_bit(m->bits.registered, pin))
     {
-        for (int i = FIRST_PIN; i < NUM_PINS+FIRST_PIN; i++) //search through all pins
+        //(Did the program close the pin before removing its callback?)
+        report_gpio_error(GPIO_E_CALLBACK_REMOVED, pin, GPIO_ERR, 0);
+
+        //Theoritically we should never get a value other than 0 or 1 from
+        //a digital IO pin, so if we do, be safe and remove the callback. This is the
+        //polling thread, which can't pause itself (nor wait for a worker that may be
+        //waiting to pause it), so the callback is dropped in place.
+        m->callback_func[pin].func = NO_FUNC;
+        m->callback_func[pin].arg = NULL;
+        set_bit(m->bits.registered, pin, FALSE);
+        set_bit(m->bits.flip, pin, FALSE);
+        set_bit(m->bits.is_flipped, pin, FALSE);
+        discard_callbacks(m->pool, pin, FALSE);
+    }
+
+    //with nothing else listening, the pin no longer has a last value
+    if (!get_bit(m->bits.measured, pin) && !get_bit(m->bits.registered, pin))
+    { set_bit(m->bits.known, pin, FALSE); }
+}
+
+//A pin's value changed since the previous read (and its new value has been stored)
+static void record_change(gpio_cb_manager_t* m, int pin, int group, long long now)
+{
+    long long last = m->last_read_ns[pin];
+
+    record_gpio_event(pin, FALSE);
+
+    //the change happened at some point since the previous read
+    if (last) { record_histogram(m, group, CALLBACK_HIST_DETECT, now - last); }
+
+    if (GPIO_PROBE_ENABLED(change))
+    {
+        GPIO_PROBE4(change, pin, get_cached_kern_num(pin),
+                    (int) (m->bits.value[pin/BITS_PER_WORD] >> (pin % BITS_PER_WORD)) & 1,
+                    last ? now - last : 0);
+    }
+}
+
+//Hand the gathered changes to the batch callback
+static void deliver_batch(batch_t* batch, long long now)
+{
+    int (*user_func)(const pin_event_t*, int, void*) = batch->func;
+
+    if (batch->num_events == 0) { return; }
+
+    if (user_func != NO_FUNC) { user_func(batch->events, batch->num_events, batch->arg); }
+
+    for (int i = 0; i < batch->num_events; i++)
+    { batch->slot[batch->events[i].pin] = -1; }
+    batch->num_events = 0;
+    batch->last_ns = now;
+}
+
+static void add_batch_event(batch_t* batch, int pin, int new_val, long long now)
+{
+    pin_event_t* e = NULL;
+
+    //coalescing: overwrite the change the pin already has in the batch
+    if (batch->mode == CALLBACK_BATCH_LATEST && batch->slot[pin] >= 0)
+    {
+        e = &batch->events[batch->slot[pin]];
+        e->new_val = new_val;
+        e->time_ns = now;
+        return;
+    }
+
+    if (batch->num_events == CALLBACK_BATCH_SIZE) { deliver_batch(batch, now); }
+
+    batch->slot[pin] = (short) batch->num_events;
+    e = &batch->events[batch->num_events++];
+    e->pin = pin;
+    e->new_val = new_val;
+    e->time_ns = now;
+}
+
+// Work out what changed in one word of pins that were just read (ok: read fine,
+// new_val: what they read) and act on it
+static void process_word(gpio_cb_manager_t* m, int w, int group, uint64_t ok,
+                         uint64_t new_val, long long now)
+{
+    pin_bits_t* bits = &m->bits;
+    uint64_t changed = (new_val ^ bits->value[w]) & ok;
+    uint64_t flip_changed = changed & bits->registered[w] & bits->flip[w];
+    uint64_t not_flipped = new_val ^ bits->flipped_value[w]; //set where new != flipped
+    uint64_t dispatch = 0;
+    uint64_t x = 0;
+
+    if (changed) { m->pass_active = TRUE; }
+
+    //plain callbacks on every change; flip functions when their pin flipped and came back
+    dispatch = (changed & bits->registered[w] & ~bits->flip[w]) |
+               (flip_changed & not_flipped & bits->is_flipped[w]);
+
+    //measurement channels are updated on every read, not just on changes, so frequency
+    //gates close on time
+    for (x = bits->measured[w] & ok; x; x &= x-1)
+    {
+        int bit = __builtin_ctzll(x);
+        update_measurement(m, w*BITS_PER_WORD + bit, (new_val >> bit) & 1,
+                           (changed >> bit) & 1, now);
+    }
+
+    //store the new values, and mark pins that are now flipping
+    bits->is_flipped[w] |= flip_changed & ~not_flipped;
+    bits->value[w] = (bits->value[w] & ~ok) | (new_val & ok);
+
+    for (x = changed; x; x &= x-1)
+    { record_change(m, w*BITS_PER_WORD + __builtin_ctzll(x), group, now); }
+
+    for (x = ok; x; x &= x-1)
+    { m->last_read_ns[w*BITS_PER_WORD + __builtin_ctzll(x)] = now; }
+
+    for (x = dispatch; x; x &= x-1)
+    {
+        int bit = __builtin_ctzll(x);
+        pin_change_t change = { w*BITS_PER_WORD + bit, (int) ((new_val >> bit) & 1) };
+        dispatch_callback(m, change, now);
+    }
+
+    for (x = changed & bits->batched[w]; x; x &= x-1)
+    {
+        int bit = __builtin_ctzll(x);
+        add_batch_event(&m->batch, w*BITS_PER_WORD + bit, (new_val >> bit) & 1, now);
+    }
+}
+
+// Read values from pins with registered callback functions, measurement channels or
+// the batch callback, and call their functions. Each group's pins are read as one batch
+// (chip_gpio_batch.h); only the set bits of the registered, measured and batched bitsets
+// are visited.
+static void* poll_values(void* arg)
+{
+    gpio_cb_manager_t* m = arg;
+    pin_bits_t* bits = &m->bits;
+    int words = bits->num_words;
+    long long now = 0;
+    long long read_start = 0;
+    long long pass_start = 0;
+    //one block, so a forced pause (which cancels the thread) has one thing to free
+    uint64_t* ok = (uint64_t*) malloc(2*words*sizeof(uint64_t) +
+                                      2*m->num_pins*sizeof(int));
+    uint64_t* new_val = ok + words;
+    int* pins = (int*) (new_val + words);
+    int* vals = pins + m->num_pins;
+    int n = 0;
+
+    pthread_cleanup_push(free, ok);
+    set_manager_flag(&m->thread_finished, FALSE);
+
+    while (!get_manager_flag(&m->stop_polling))
+    {
+        pass_start = get_time_ns();
+
+        for (int group = 0; group < NUM_PIN_GROUPS; group++)
         {
-            if (callback_func[i].func != NO_FUNC) //if the pin has a callback func
+            //gather the pins somebody is listening to, lowest first
+            n = 0;
+            for (int w = 0; w < words; w++)
             {
-                change.pin = i;
-                change.new_val = read_gpio_val(i); //read in the pin's current value
-                
-                //assign function pointer user_func to the registered callback function
-                int (*user_func)(pin_change_t, void*) = callback_func[i].func;
-                
-                //check for errors
-                if (change.new_val < GPIO_PIN_LOW || change.new_val > GPIO_PIN_HIGH)
-                {
-                    fprintf(stderr, 
-                        "Warning: read an impossible value from pin %d. Removing its callback function automatically. (Did you close pin %d before removing its callback function?)\n",
-                            i);
-                        
-                    //Theoritically we should never get a value other than 0 or 1 from a
-                    //digital IO pin, so if we do, be safe and remove the callback function
-                    remove_callback_func(i);
-                }
+                uint64_t x = bits->registered[w] | bits->measured[w] | bits->batched[w];
+
+                for (x &= bits->group[group][w]; x; x &= x-1)
+                { pins[n++] = w*BITS_PER_WORD + __builtin_ctzll(x); }
+                ok[w] = 0;
+                new_val[w] = 0;
+            }
+
+            if (n == 0) { continue; }
 
-                //if there are no errors and the value has changed
-                else if (pin_val[i].value != change.new_val)
+            read_start = get_time_ns();
+            read_gpio_vals(pins, vals, n); //read in the pins' current values
+            now = get_time_ns();
+            record_histogram(m, group, CALLBACK_HIST_POLL_PASS, now - read_start);
+
+            //back into bits; failed pins are left out of ok
+            for (int k = 0; k < n; k++)
+            {
+                if (vals[k] < GPIO_PIN_LOW || vals[k] > GPIO_PIN_HIGH)
                 {
-                    pin_val[i].value = change.new_val; //store the new value
-                    
-                    //if it isn't a flip function, we're done, just call user_func
-                    if (!pin_val[i].flip)
-                    { user_func(change, callback_func[i].arg); }
-
-                    //if it is a flip function and the values flipped to and back, call
-                    else if (pin_val[i].value != pin_val[i].flipped_value &&
-                             pin_val[i].is_flipped)
-                    { user_func(change, callback_func[i].arg); }
-                    
-                    //if the pin is currently flipping, set the bool to indicate this
-                    else if (pin_val[i].value == pin_val[i].flipped_value)
-                    { pin_val[i].is_flipped = TRUE; }
+                    handle_read_error(m, pins[k]);
+                    continue;
                 }
+
+                ok[PIN_WORD(pins[k])] |= PIN_BIT(pins[k]);
+                if (vals[k]) { new_val[PIN_WORD(pins[k])] |= PIN_BIT(pins[k]); }
+            }
+
+            for (int w = 0; w < words; w++)
+            {
+                if (ok[w]) { process_word(m, w, group, ok[w], new_val[w], now); }
             }
         } // done polling pins
 
-        if (delay > 0) //optional delay
-        { usleep(delay); }
+        //quadrature encoders are sampled on the same pass
+        if (poll_encoders(m) > 0) { m->pass_active = TRUE; }
+
+        now = get_time_ns();
+        if (m->batch.num_events && now - m->batch.last_ns >= m->batch.interval_ns)
+        { deliver_batch(&m->batch, now); }
+        record_gpio_poll_pass(pass_start);
+
+        if (m->adaptive_max_us > 0)
+        {
+            int interval = next_poll_interval(m, now);
+            if (interval > 0) { wait_between_passes(m, interval); }
+        }
+
+        else if (m->delay > 0) //optional delay
+        { wait_between_passes(m, m->delay); }
     } // finished polling values
 
+    deliver_batch(&m->batch, get_time_ns()); //nothing is held while paused
+
+    pthread_cleanup_pop(TRUE); //frees the buffers
+
     //indicate we are finished with this thread
-    manager_thread_finished = TRUE;
+    set_manager_flag(&m->thread_finished, TRUE);
 
     return NULL;
 }
 
 //register a function to be called any time a pin's value changes
-int register_callback_func(int pin, void* func, void* arg)
+int register_callback_func_m(gpio_cb_manager_t* m, int pin, void* func, void* arg)
 {
-    int was_paused = paused;
+    int was_paused = m->paused;
+    int val = GPIO_ERR;
     
-    if (check_if_pin_exists < GPIO_OK)
+    if (check_manager_pin(m, pin) < GPIO_OK)
     { return GPIO_ERR; }
     
     //if the polling thread has already started, we need to stop it before doing this
-    if (first_start && !was_paused) { pause_callback_manager(); }
+    if (m->first_start && !was_paused) { pause_callback_manager_m(m); }
 
     //set the callback func for the pin to function pointer passed to us
-    callback_func[pin].func = func;
-    callback_func[pin].arg = arg;
+    m->callback_func[pin].func = func;
+    m->callback_func[pin].arg = arg;
+    discard_callbacks(m->pool, pin, TRUE); //changes queued for the old function
 
     //set some initial values
-    pin_val[pin].value = read_gpio_val(pin);
-    pin_val[pin].flip = FALSE;
-    pin_val[pin].is_flipped = FALSE;
-    pin_val[pin].flipped_value = !pin_val[pin].value;
+    val = read_gpio_val(pin);
+    m->last_read_ns[pin] = get_time_ns();
+    set_bit(m->bits.flip, pin, FALSE);
+    set_bit(m->bits.is_flipped, pin, FALSE);
 
     //check for errors
-    if (pin_val[pin].value < GPIO_PIN_LOW || pin_val[pin].value > GPIO_PIN_HIGH)
+    if (val < GPIO_PIN_LOW || val > GPIO_PIN_HIGH)
     {
         fprintf(stderr, "Unable to register a callback for pin %d\n", pin);
-        callback_func[pin].func = NO_FUNC;
-        callback_func[pin].arg = NULL;
+        m->callback_func[pin].func = NO_FUNC;
+        m->callback_func[pin].arg = NULL;
+        set_bit(m->bits.registered, pin, FALSE);
+        if (!get_bit(m->bits.measured, pin) && !get_bit(m->bits.batched, pin))
+        { set_bit(m->bits.known, pin, FALSE); }
     }
 
-    if (first_start && !was_paused) { return unpause_callback_manager(); }
+    else
+    {
+        set_bit(m->bits.value, pin, val);
+        set_bit(m->bits.flipped_value, pin, !val);
+        set_bit(m->bits.known, pin, TRUE);
+        set_bit(m->bits.registered, pin, TRUE);
+    }
+
+    if (m->first_start && !was_paused) { return unpause_callback_manager_m(m); }
 
     return GPIO_OK;
 }
 
+int register_callback_func(int pin, void* func, void* arg)
+{
+    return register_callback_func_m(&default_manager, pin, func, arg);
+}
+
 //Convenience method; converts a string into a numerical pin and calls above
 int register_callback_func_n(char* name, void* func, void* arg)
 {
@@ -220,14 +758,29 @@ int register_callback_func_n(char* name, void* func, void* arg)
 // released, the value flips back to 1. The callback function would then be called.
 // This is effectively an on-release trigger, but might not always be used with buttons,
 // so a more generic name is used.
-int register_callback_flip_func(int pin, void* func, void* arg)
+int register_callback_flip_func_m(gpio_cb_manager_t* m, int pin, void* func, void* arg)
 {
-    //just register the callback function then set the flip flag to true
-    int rc = register_callback_func(pin, func, arg);
-    pin_val[pin].flip = TRUE;
+    int was_paused = m->paused;
+    int rc = GPIO_ERR;
+
+    //the polling thread rewrites whole words of the bitsets, so it's kept out while
+    //the callback is registered and the flip flag set
+    if (m->first_start && !was_paused) { pause_callback_manager_m(m); }
+
+    rc = register_callback_func_m(m, pin, func, arg);
+    if (rc >= GPIO_OK) { set_bit(m->bits.flip, pin, TRUE); }
+
+    if (m->first_start && !was_paused && unpause_callback_manager_m(m) < GPIO_OK)
+    { return GPIO_ERR; }
+
     return rc;
 }
 
+int register_callback_flip_func(int pin, void* func, void* arg)
+{
+    return register_callback_flip_func_m(&default_manager, pin, func, arg);
+}
+
 int register_callback_flip_func_n(char* name, void* func, void* arg)
 {
     int pin = get_gpio_num(name);
@@ -237,20 +790,33 @@ int register_callback_flip_func_n(char* name, void* func, void* arg)
 
 // Force the flipped_value of a pin
 // This probably shouldn't be called before start or unexpected behavior may occur
-int set_callback_flip_value(int pin, int val)
+int set_callback_flip_value_m(gpio_cb_manager_t* m, int pin, int val)
 {
-    if (check_if_pin_exists < GPIO_OK)
+    int was_paused = FALSE;
+
+    if (check_manager_pin(m, pin) < GPIO_OK)
     { return GPIO_ERR; }
 
     if (is_valid_value(val, pin) < GPIO_OK)
     { return GPIO_ERR; }
 
-    pin_val[pin].flipped_value = val;
-    pin_val[pin].value = !val;
+    was_paused = m->paused;
+    if (m->first_start && !was_paused) { pause_callback_manager_m(m); }
+
+    set_bit(m->bits.flipped_value, pin, val);
+    set_bit(m->bits.value, pin, !val);
+    set_bit(m->bits.known, pin, TRUE);
+
+    if (m->first_start && !was_paused) { return unpause_callback_manager_m(m); }
 
     return GPIO_OK;
 }
 
+int set_callback_flip_value(int pin, int val)
+{
+    return set_callback_flip_value_m(&default_manager, pin, val);
+}
+
 int set_callback_flip_value_n(char* name, int val)
 {
     int pin = get_gpio_num(name);
@@ -260,19 +826,28 @@ int set_callback_flip_value_n(char* name, int val)
 
 //"Deregister" a callback function, stopping the pin from being polled. The pin should
 // be closed by the programmer if it's done being used AFTER removing its callback func.
-int remove_callback_func(int pin)
+int remove_callback_func_m(gpio_cb_manager_t* m, int pin)
 {
-    if (check_if_pin_exists < GPIO_OK)
+    if (check_manager_pin(m, pin) < GPIO_OK)
     { return GPIO_ERR; }
 
-    pause_callback_manager();
+    pause_callback_manager_m(m);
 
-    callback_func[pin].func = NO_FUNC;
-    callback_func[pin].arg = NULL;
+    m->callback_func[pin].func = NO_FUNC;
+    m->callback_func[pin].arg = NULL;
+    set_bit(m->bits.registered, pin, FALSE);
+    discard_callbacks(m->pool, pin, TRUE);
 
-    pin_val[pin].value = NEVER_READ;
+    //a measurement channel or the batch callback on this pin still needs the last value
+    if (!get_bit(m->bits.measured, pin) && !get_bit(m->bits.batched, pin))
+    { set_bit(m->bits.known, pin, FALSE); }
 
-    return unpause_callback_manager();
+    return unpause_callback_manager_m(m);
+}
+
+int remove_callback_func(int pin)
+{
+    return remove_callback_func_m(&default_manager, pin);
 }
 
 int remove_callback_func_n(char* name)
@@ -286,34 +861,556 @@ int remove_callback_func_n(char* name)
     return remove_callback_func(pin);
 }
 
+//Stop gathering changes for the batch callback's pins
+static void clear_batch_pins(gpio_cb_manager_t* m)
+{
+    for (int w = 0; w < m->bits.num_words; w++)
+    {
+        //pins nothing else is listening to no longer have a last value
+        m->bits.known[w] &= ~(m->bits.batched[w] & ~m->bits.registered[w] &
+                              ~m->bits.measured[w]);
+        m->bits.batched[w] = 0;
+    }
+
+    for (int i = 0; i < m->batch.num_events; i++)
+    { m->batch.slot[m->batch.events[i].pin] = -1; }
+    m->batch.num_events = 0;
+}
+
+// Register the function every pass's changes on pins are handed to in one call. Pins
+// that can't be read are left out (and GPIO_ERR is returned); the others are still
+// registered.
+int register_callback_batch_func_m(gpio_cb_manager_t* m, int* pins, int n, void* func,
+                                   void* arg)
+{
+    int was_paused = m->paused;
+    int rc = GPIO_OK;
+    int val = GPIO_ERR;
+
+    if (pins == NULL || n < 0 || func == NO_FUNC) { return GPIO_ERR; }
+
+    for (int i = 0; i < n; i++)
+    {
+        if (check_manager_pin(m, pins[i]) < GPIO_OK) { return GPIO_ERR; }
+    }
+
+    //if the polling thread has already started, we need to stop it before doing this
+    if (m->first_start && !was_paused) { pause_callback_manager_m(m); }
+
+    clear_batch_pins(m);
+    m->batch.func = func;
+    m->batch.arg = arg;
+    m->batch.last_ns = get_time_ns();
+
+    for (int i = 0; i < n; i++)
+    {
+        int pin = pins[i];
+
+        //pins with a callback function or measurement channel already have a last value
+        if (!get_bit(m->bits.known, pin))
+        {
+            val = read_gpio_val(pin);
+            m->last_read_ns[pin] = get_time_ns();
+            if (val < GPIO_PIN_LOW || val > GPIO_PIN_HIGH)
+            {
+                fprintf(stderr, "Unable to register a batch callback for pin %d\n", pin);
+                rc = GPIO_ERR;
+                continue;
+            }
+
+            set_bit(m->bits.value, pin, val);
+            set_bit(m->bits.known, pin, TRUE);
+        }
+
+        set_bit(m->bits.batched, pin, TRUE);
+    }
+
+    if (m->first_start && !was_paused && unpause_callback_manager_m(m) < GPIO_OK)
+    { return GPIO_ERR; }
+
+    return rc;
+}
+
+int register_callback_batch_func(int* pins, int n, void* func, void* arg)
+{
+    return register_callback_batch_func_m(&default_manager, pins, n, func, arg);
+}
+
+int register_callback_batch_func_n(char** names, int n, void* func, void* arg)
+{
+    int* pins = NULL;
+    int rc = GPIO_ERR;
+
+    if (names == NULL || n < 0) { return GPIO_ERR; }
+
+    pins = (int*) malloc((n > 0 ? n : 1)*sizeof(int));
+    if (pins == NULL) { return GPIO_ERR; }
+
+    for (int i = 0; i < n; i++)
+    {
+        pins[i] = get_gpio_num(names[i]);
+        if (pins[i] < GPIO_OK)
+        {
+            fprintf(stderr, "Could not register batch callback func for pin %s\n",
+                    names[i]);
+            free(pins);
+            return GPIO_ERR;
+        }
+    }
+
+    rc = register_callback_batch_func(pins, n, func, arg);
+    free(pins);
+    return rc;
+}
+
+int remove_callback_batch_func_m(gpio_cb_manager_t* m)
+{
+    int was_paused = m->paused;
+
+    //pausing delivers what the batch callback has waiting
+    if (m->first_start && !was_paused) { pause_callback_manager_m(m); }
+
+    clear_batch_pins(m);
+    m->batch.func = NO_FUNC;
+    m->batch.arg = NULL;
+
+    if (m->first_start && !was_paused) { return unpause_callback_manager_m(m); }
+
+    return GPIO_OK;
+}
+
+int remove_callback_batch_func()
+{
+    return remove_callback_batch_func_m(&default_manager);
+}
+
+int set_callback_batch_mode_m(gpio_cb_manager_t* m, int mode, int interval_us)
+{
+    int was_paused = m->paused;
+
+    if ((mode != CALLBACK_BATCH_EVERY && mode != CALLBACK_BATCH_LATEST) ||
+        interval_us < 0)
+    {
+        fprintf(stderr, "Invalid batch callback mode %d (interval %d us)\n", mode,
+                interval_us);
+        return GPIO_ERR;
+    }
+
+    //changes gathered the old way are delivered first
+    if (m->first_start && !was_paused) { pause_callback_manager_m(m); }
+
+    m->batch.mode = mode;
+    m->batch.interval_ns = (long long) interval_us*NS_PER_US;
+
+    if (m->first_start && !was_paused) { return unpause_callback_manager_m(m); }
+
+    return GPIO_OK;
+}
+
+int set_callback_batch_mode(int mode, int interval_us)
+{
+    return set_callback_batch_mode_m(&default_manager, mode, interval_us);
+}
+
+//Record an edge and/or close a frequency gate for a measured pin. Only ever called on
+//the polling thread, which is the sole writer of the measurement snapshot.
+static void update_measurement(gpio_cb_manager_t* manager, int pin, int new_val,
+                               int changed, long long now)
+{
+    pin_measure_t* p = &manager->measures[pin];
+    pin_measurement_t* m = &p->measurement;
+    int reset = atomic_exchange_explicit(&p->reset_requested, FALSE,
+                                         memory_order_acquire);
+    int gate_closed = p->gate_ns > 0 && now - p->gate_start_ns >= p->gate_ns;
+
+    if (!changed && !reset && !gate_closed) { return; }
+
+    //begin write; readers retry while seq is odd
+    atomic_fetch_add_explicit(&p->seq, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    if (reset)
+    {
+        m->edges = 0;
+        m->rising_edges = 0;
+        m->errors = 0;
+        m->period_ns = 0;
+        m->high_ns = 0;
+        m->duty_cycle = 0.0;
+        m->frequency = 0.0;
+        m->last_edge_ns = 0;
+        p->last_rise_ns = 0;
+        p->gate_start_ns = now;
+        p->gate_start_edges = 0;
+        changed = FALSE; //the edge (if any) straddles the reset
+        gate_closed = FALSE;
+    }
+
+    if (changed)
+    {
+        m->edges++;
+        m->last_edge_ns = now;
+
+        if (new_val == GPIO_PIN_HIGH)
+        {
+            m->rising_edges++;
+            if (p->last_rise_ns)
+            {
+                m->period_ns = now - p->last_rise_ns;
+                m->duty_cycle = m->high_ns <= m->period_ns ?
+                                (double) m->high_ns / (double) m->period_ns : 0.0;
+            }
+            p->last_rise_ns = now;
+        }
+
+        else if (p->last_rise_ns)
+        { m->high_ns = now - p->last_rise_ns; }
+    }
+
+    if (gate_closed)
+    {
+        m->frequency = (double) (m->rising_edges - p->gate_start_edges)*NS_PER_SEC /
+                       (double) (now - p->gate_start_ns);
+        p->gate_start_ns = now;
+        p->gate_start_edges = m->rising_edges;
+    }
+
+    //end write
+    atomic_fetch_add_explicit(&p->seq, 1, memory_order_release);
+}
+
+static void update_measurement_error(gpio_cb_manager_t* m, int pin)
+{
+    pin_measure_t* p = &m->measures[pin];
+
+    atomic_fetch_add_explicit(&p->seq, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    p->measurement.errors++;
+    atomic_fetch_add_explicit(&p->seq, 1, memory_order_release);
+}
+
+//Start counting edges and timing pulses on a pin from the polling thread
+int enable_gpio_measurement_m(gpio_cb_manager_t* m, int pin, int gate_us)
+{
+    int was_paused = m->paused;
+    int rc = GPIO_OK;
+    int val = GPIO_ERR;
+
+    if (check_manager_pin(m, pin) < GPIO_OK)
+    { return GPIO_ERR; }
+
+    //if the polling thread has already started, we need to stop it before doing this
+    if (m->first_start && !was_paused) { pause_callback_manager_m(m); }
+
+    //pins with a callback function already have a last value
+    if (get_bit(m->bits.known, pin)) { val = get_bit(m->bits.value, pin); }
+    else
+    {
+        val = read_gpio_val(pin);
+        m->last_read_ns[pin] = get_time_ns();
+    }
+
+    if (val < GPIO_PIN_LOW || val > GPIO_PIN_HIGH)
+    {
+        fprintf(stderr, "Unable to enable measurement for pin %d\n", pin);
+        rc = GPIO_ERR;
+    }
+
+    else
+    {
+        pin_measure_t* p = &m->measures[pin];
+
+        set_bit(m->bits.value, pin, val);
+        set_bit(m->bits.known, pin, TRUE);
+        memset(&p->measurement, 0, sizeof(pin_measurement_t));
+        p->measurement.pin = pin;
+        p->gate_ns = gate_us > 0 ? gate_us*NS_PER_US : 0;
+        p->gate_start_ns = get_time_ns();
+        p->gate_start_edges = 0;
+        p->last_rise_ns = 0;
+        atomic_store(&p->reset_requested, FALSE);
+        set_bit(m->bits.measured, pin, TRUE);
+    }
+
+    if (m->first_start && !was_paused && unpause_callback_manager_m(m) < GPIO_OK)
+    { return GPIO_ERR; }
+
+    return rc;
+}
+
+int enable_gpio_measurement(int pin, int gate_us)
+{
+    return enable_gpio_measurement_m(&default_manager, pin, gate_us);
+}
+
+int enable_gpio_measurement_n(char* name, int gate_us)
+{
+    int pin = get_gpio_num(name);
+    if (pin < GPIO_OK) { return GPIO_ERR; }
+    return enable_gpio_measurement(pin, gate_us);
+}
+
+int disable_gpio_measurement_m(gpio_cb_manager_t* m, int pin)
+{
+    int was_paused = m->paused;
+
+    if (check_manager_pin(m, pin) < GPIO_OK)
+    { return GPIO_ERR; }
+
+    if (m->first_start && !was_paused) { pause_callback_manager_m(m); }
+
+    set_bit(m->bits.measured, pin, FALSE);
+    if (!get_bit(m->bits.registered, pin) && !get_bit(m->bits.batched, pin))
+    { set_bit(m->bits.known, pin, FALSE); }
+
+    if (m->first_start && !was_paused) { return unpause_callback_manager_m(m); }
+
+    return GPIO_OK;
+}
+
+int disable_gpio_measurement(int pin)
+{
+    return disable_gpio_measurement_m(&default_manager, pin);
+}
+
+int disable_gpio_measurement_n(char* name)
+{
+    int pin = get_gpio_num(name);
+    if (pin < GPIO_OK) { return GPIO_ERR; }
+    return disable_gpio_measurement(pin);
+}
+
+// Copy out a consistent snapshot of a pin's measurement channel. This never blocks the
+// polling thread; if the snapshot changes while being copied, the copy is retried.
+int get_gpio_measurement_m(gpio_cb_manager_t* m, int pin, pin_measurement_t* out)
+{
+    unsigned int start = 0;
+    pin_measure_t* p = NULL;
+
+    if (check_manager_pin(m, pin) < GPIO_OK || out == NULL)
+    { return GPIO_ERR; }
+
+    p = &m->measures[pin];
+    if (!get_bit(m->bits.measured, pin))
+    {
+        fprintf(stderr, "Pin %d has no measurement channel\n", pin);
+        return GPIO_ERR;
+    }
+
+    do
+    {
+        start = atomic_load_explicit(&p->seq, memory_order_acquire);
+        *out = p->measurement;
+        atomic_thread_fence(memory_order_acquire);
+    } while ((start & 1) || start != atomic_load_explicit(&p->seq, memory_order_relaxed));
+
+    return GPIO_OK;
+}
+
+int get_gpio_measurement(int pin, pin_measurement_t* out)
+{
+    return get_gpio_measurement_m(&default_manager, pin, out);
+}
+
+int get_gpio_measurement_n(char* name, pin_measurement_t* out)
+{
+    int pin = get_gpio_num(name);
+    if (pin < GPIO_OK) { return GPIO_ERR; }
+    return get_gpio_measurement(pin, out);
+}
+
+//Zero a pin's counters. The polling thread applies the reset on its next read.
+int reset_gpio_measurement_m(gpio_cb_manager_t* m, int pin)
+{
+    if (check_manager_pin(m, pin) < GPIO_OK)
+    { return GPIO_ERR; }
+
+    if (!get_bit(m->bits.measured, pin))
+    {
+        fprintf(stderr, "Pin %d has no measurement channel\n", pin);
+        return GPIO_ERR;
+    }
+
+    atomic_store_explicit(&m->measures[pin].reset_requested, TRUE, memory_order_release);
+
+    return GPIO_OK;
+}
+
+int reset_gpio_measurement(int pin)
+{
+    return reset_gpio_measurement_m(&default_manager, pin);
+}
+
+int reset_gpio_measurement_n(char* name)
+{
+    int pin = get_gpio_num(name);
+    if (pin < GPIO_OK) { return GPIO_ERR; }
+    return reset_gpio_measurement(pin);
+}
+
+//Map a value to its log bucket: exact below HIST_SUB_BUCKETS, then HIST_SUB_BUCKETS
+//buckets for every power of two
+static inline int get_histogram_bucket(unsigned long long ns)
+{
+    int exp = 0;
+
+    if (ns < HIST_SUB_BUCKETS) { return (int) ns; }
+
+    exp = 63 - __builtin_clzll(ns); //index of the highest set bit
+    if (exp > HIST_MAX_EXP) { return HIST_NUM_BUCKETS-1; }
+
+    return (exp-HIST_SUB_BITS+1)*HIST_SUB_BUCKETS +
+           (int) (ns >> (exp-HIST_SUB_BITS)) - HIST_SUB_BUCKETS;
+}
+
+//Dispatch latencies are also recorded by callback workers, so min/max are CAS loops
+static void record_histogram(gpio_cb_manager_t* m, int group, int hist, long long ns)
+{
+    histogram_t* h = &m->histograms[group][hist];
+    unsigned long long v = ns > 0 ? (unsigned long long) ns : 0;
+    unsigned long long cur = 0;
+
+    if (atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed) == 0)
+    { atomic_store_explicit(&h->min_ns, v, memory_order_relaxed); }
+
+    cur = atomic_load_explicit(&h->min_ns, memory_order_relaxed);
+    while (v < cur && !atomic_compare_exchange_weak_explicit(&h->min_ns, &cur, v,
+                                                             memory_order_relaxed,
+                                                             memory_order_relaxed));
+
+    cur = atomic_load_explicit(&h->max_ns, memory_order_relaxed);
+    while (v > cur && !atomic_compare_exchange_weak_explicit(&h->max_ns, &cur, v,
+                                                             memory_order_relaxed,
+                                                             memory_order_relaxed));
+
+    atomic_fetch_add_explicit(&h->sum_ns, v, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->buckets[get_histogram_bucket(v)], 1,
+                              memory_order_relaxed);
+}
+
+int get_callback_histogram_m(gpio_cb_manager_t* m, int group, int hist,
+                             latency_histogram_t* out)
+{
+    histogram_t* h = NULL;
+
+    if (group < 0 || group >= NUM_PIN_GROUPS || hist < 0 || hist >= CALLBACK_NUM_HISTS ||
+        out == NULL)
+    {
+        fprintf(stderr, "No callback histogram %d for pin group %d\n", hist, group);
+        return GPIO_ERR;
+    }
+
+    h = &m->histograms[group][hist];
+    out->count = atomic_load_explicit(&h->count, memory_order_relaxed);
+    out->min_ns = atomic_load_explicit(&h->min_ns, memory_order_relaxed);
+    out->max_ns = atomic_load_explicit(&h->max_ns, memory_order_relaxed);
+    out->sum_ns = atomic_load_explicit(&h->sum_ns, memory_order_relaxed);
+
+    for (int b = 0; b < HIST_NUM_BUCKETS; b++)
+    { out->buckets[b] = atomic_load_explicit(&h->buckets[b], memory_order_relaxed); }
+
+    return GPIO_OK;
+}
+
+int get_callback_histogram(int group, int hist, latency_histogram_t* out)
+{
+    return get_callback_histogram_m(&default_manager, group, hist, out);
+}
+
+//Values recorded while this runs may or may not survive the reset
+int reset_callback_histograms_m(gpio_cb_manager_t* m)
+{
+    for (int g = 0; g < NUM_PIN_GROUPS; g++)
+    {
+        for (int hist = 0; hist < CALLBACK_NUM_HISTS; hist++)
+        {
+            histogram_t* h = &m->histograms[g][hist];
+
+            atomic_store_explicit(&h->count, 0, memory_order_relaxed);
+            atomic_store_explicit(&h->min_ns, 0, memory_order_relaxed);
+            atomic_store_explicit(&h->max_ns, 0, memory_order_relaxed);
+            atomic_store_explicit(&h->sum_ns, 0, memory_order_relaxed);
+            for (int b = 0; b < HIST_NUM_BUCKETS; b++)
+            { atomic_store_explicit(&h->buckets[b], 0, memory_order_relaxed); }
+        }
+    }
+
+    return GPIO_OK;
+}
+
+int reset_callback_histograms()
+{
+    return reset_callback_histograms_m(&default_manager);
+}
+
+int64_t get_histogram_bucket_ns(int bucket)
+{
+    if (bucket < HIST_SUB_BUCKETS) { return bucket; }
+
+    return (int64_t) (HIST_SUB_BUCKETS + bucket%HIST_SUB_BUCKETS) <<
+           (bucket/HIST_SUB_BUCKETS - 1);
+}
+
+int64_t get_histogram_percentile(const latency_histogram_t* hist, double percentile)
+{
+    uint64_t target = 0;
+    uint64_t seen = 0;
+    int64_t upper = 0;
+
+    if (hist == NULL || hist->count == 0) { return 0; }
+
+    //the rank of the value we're looking for (at least the first one)
+    target = (uint64_t) (percentile*hist->count + 0.5);
+    if (target < 1) { target = 1; }
+    if (target > hist->count) { target = hist->count; }
+
+    for (int b = 0; b < HIST_NUM_BUCKETS; b++)
+    {
+        seen += hist->buckets[b];
+        if (seen < target) { continue; }
+
+        //report the top of the bucket, but never more than the largest value seen
+        upper = b < HIST_NUM_BUCKETS-1 ? get_histogram_bucket_ns(b+1)-1 :
+                                           (int64_t) hist->max_ns;
+        return upper < (int64_t) hist->max_ns ? upper : (int64_t) hist->max_ns;
+    }
+
+    return (int64_t) hist->max_ns;
+}
+
 //Destroy/stop the polling thread without deregistering all callback functions
-int pause_callback_manager()
+int pause_callback_manager_m(gpio_cb_manager_t* m)
 {
     time_t start = time(NULL);
     time_t now = time(NULL);
     int timeout_in_seconds = 5;
 
-    if (!manager_thread || manager_thread_finished)
+    if (!m->thread || get_manager_flag(&m->thread_finished))
     {
         fprintf(stderr, "Could not pause callback manager because it is not running. (Did you initialize and start callback manager first?)\n");
         return GPIO_ERR;
     }
 
-    stop_polling = TRUE; //tell manager_thread to finish up
-    while (!manager_thread_finished) //wait for manager thread to finish
+    //tell the thread to finish up, waking it if it's between passes
+    pthread_mutex_lock(&m->sleep_lock);
+    set_manager_flag(&m->stop_polling, TRUE);
+    pthread_cond_broadcast(&m->sleep_cond);
+    pthread_mutex_unlock(&m->sleep_lock);
+
+    while (!get_manager_flag(&m->thread_finished)) //wait for manager thread to finish
     {
         now = time(NULL);
         
         if (now-start > timeout_in_seconds) //prevent an infinite loop using a timeout
         {
             fprintf(stderr, "Warning: attempting to pause the callback manager failed. Forcing it in order to prevent an infinite loop.\n");
-            if (!manager_thread) 
+            if (m->thread) 
             {
-                pthread_cancel(manager_thread);
-                manager_thread_finished = TRUE;
+                pthread_cancel(m->thread);
+                set_manager_flag(&m->thread_finished, TRUE);
             }
             
-            else //manager_thread SHOULDN'T ever be null
+            else //the thread SHOULDN'T ever be null
             {
                 fprintf(stderr, "Could not force callback manager to pause; No valid handle for thread. (Are you being thread-safe?)\n");
             }
@@ -324,38 +1421,72 @@ int pause_callback_manager()
         usleep(10);
     }
     
-    paused = TRUE;
+    m->paused = TRUE;
 
     return GPIO_OK;
 }
 
+int pause_callback_manager()
+{
+    return pause_callback_manager_m(&default_manager);
+}
+
 //Recreate polling thread with previously registered callback funcs
-int unpause_callback_manager()
+int unpause_callback_manager_m(gpio_cb_manager_t* m)
 {
-    if (!manager_thread || !stop_polling)
+    if (!m->thread || !get_manager_flag(&m->stop_polling))
     {
         fprintf(stderr, "Could not unpause callback manager because it is not paused. (Did you initialize and start callback manager first?)\n");
         return GPIO_ERR;
     }
 
-    stop_polling = FALSE;
-    paused = FALSE;
+    set_manager_flag(&m->stop_polling, FALSE);
+    m->paused = FALSE;
 
-    return start_callback_manager();
+    return start_callback_manager_m(m);
+}
+
+int unpause_callback_manager()
+{
+    return unpause_callback_manager_m(&default_manager);
 }
 
 // Destroy polling thread and free memory used by callback func definitions.
 // Init would need to be called if the callback manager is to be used again.
-int terminate_callback_manager()
+int terminate_callback_manager_m(gpio_cb_manager_t* m)
 {
-    pause_callback_manager();
-    first_start = FALSE;
-    paused = FALSE;
-    free(callback_func);
-    free(pin_val);
+    if (m->thread && !get_manager_flag(&m->thread_finished))
+    { pause_callback_manager_m(m); }
+    if (m->thread)
+    {
+        pthread_join(m->thread, NULL);
+        m->thread = 0;
+    }
+    m->first_start = FALSE;
+    m->paused = FALSE;
+    set_manager_flag(&m->stop_polling, FALSE);
+    //what the workers have queued still runs
+    if (m->pool) { free_callback_pool(m->pool); }
+    free(m->callback_func);
+    free(m->last_read_ns);
+    free(m->measures);
+    free(m->batch.slot);
+    m->callback_func = NULL;
+    m->last_read_ns = NULL;
+    m->measures = NULL;
+    memset(&m->batch, 0, sizeof(m->batch));
+    pthread_cond_destroy(&m->sleep_cond);
+    free(m->bits.registered); //the start of the block every bitset is in
+    memset(&m->bits, 0, sizeof(m->bits));
+    m->num_pins = 0;
     return GPIO_OK;
 }
 
+int terminate_callback_manager()
+{
+    return terminate_callback_manager_m(&default_manager);
+}
+
 //Convenience method; shorter name, calls above
 int term_callback_manager()
 {
@@ -363,8 +1494,54 @@ int term_callback_manager()
 }
 
 //Set the optional delay if desired
-int set_callback_polling_delay(int new_delay)
+int set_callback_polling_delay_m(gpio_cb_manager_t* m, int new_delay)
 {
-    delay = new_delay;
+    m->delay = new_delay;
     return new_delay;
 }
+
+int set_callback_polling_delay(int new_delay)
+{
+    return set_callback_polling_delay_m(&default_manager, new_delay);
+}
+
+int set_callback_adaptive_polling_m(gpio_cb_manager_t* m, int min_us, int max_us,
+                                    int quiet_us)
+{
+    int was_paused = m->paused;
+
+    if (min_us < 0 || quiet_us < 0 || (max_us > 0 && max_us < min_us))
+    {
+        fprintf(stderr, "Invalid adaptive polling intervals (%d to %d us, quiet %d us)\n",
+                min_us, max_us, quiet_us);
+        return GPIO_ERR;
+    }
+
+    if (m->first_start && !was_paused) { pause_callback_manager_m(m); }
+
+    m->adaptive_min_us = min_us;
+    m->adaptive_max_us = max_us > 0 ? max_us : 0;
+    m->adaptive_quiet_us = quiet_us;
+    m->poll_interval_us = min_us; //start fast, as if something just happened
+    m->last_activity_ns = get_time_ns();
+    m->pass_active = FALSE;
+
+    if (m->first_start && !was_paused) { return unpause_callback_manager_m(m); }
+
+    return GPIO_OK;
+}
+
+int set_callback_adaptive_polling(int min_us, int max_us, int quiet_us)
+{
+    return set_callback_adaptive_polling_m(&default_manager, min_us, max_us, quiet_us);
+}
+
+int get_callback_polling_interval_m(gpio_cb_manager_t* m)
+{
+    return m->adaptive_max_us > 0 ? m->poll_interval_us : (m->delay > 0 ? m->delay : 0);
+}
+
+int get_callback_polling_interval()
+{
+    return get_callback_polling_interval_m(&default_manager);
+}
@@ -0,0 +1,491 @@
+/*
+ * Copyright (c) 2017, Bryan Haley
+ * This code is dual licensed (GPLv2 and Simplified BSD). Use the license that works
+ * best for you. Check LICENSE.GPL and LICENSE.BSD for more details.
+ *
+ * chip_gpio_callback_pool.c
+ * Implementation of the callback worker pool and callback accounting
+ * (set_callback_workers and get_callback_stats in chip_gpio_callback_manager.h).
+ *  Note: every pin has its own queue of changes, so its changes stay in order. A pin
+ *  with changes waiting is put on the ready list of its priority; a worker takes the
+ *  first pin off the highest priority list, runs a few of its changes and, if any are
+ *  left, puts it at the back of the list again. A pin is never on a list while a worker
+ *  has it, so no two workers run the same pin's callback at once, while any idle worker
+ *  can pick up any other pin.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "chip_gpio.h"
+#include "chip_gpio_utils.h"
+#include "chip_gpio_callback_manager.h"
+
+#ifndef TRUE
+    #define TRUE 1
+#endif
+#ifndef FALSE
+    #define FALSE 0
+#endif
+
+#define CALLBACK_RUN_BATCH 8 //changes a worker runs for one pin before taking the next
+
+typedef struct
+{
+    int new_val;
+    void* func; //taken when queued, so changes for a replaced function don't mix it up
+    void* arg;
+    long long detected_ns;
+} queued_change_t;
+
+typedef struct
+{
+    queued_change_t changes[CALLBACK_QUEUE_SIZE];
+    unsigned head; //next to run
+    unsigned tail; //next free; tail-head changes are waiting
+    char ready; //bool; on a ready list
+    char running; //bool; a worker has it
+    char priority; //CALLBACK_PRIORITY_*
+} pin_queue_t;
+
+typedef struct
+{
+    int* pins; //num_pins entries, used as a ring
+    unsigned head;
+    unsigned tail;
+} ready_list_t;
+
+//Only one thread runs a pin's callback at a time, so max doesn't need a CAS loop
+typedef struct
+{
+    atomic_ullong calls;
+    atomic_ullong total_ns;
+    atomic_ullong max_ns;
+    atomic_ullong dropped;
+} callback_time_t;
+
+//Each callback manager has a pool of its own (see get_callback_pool)
+struct callback_pool
+{
+    gpio_cb_manager_t* manager; //whose callbacks the workers run
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_cond_t idle; //signalled when a pin someone waits on stops running
+    int idle_waiters; //threads in discard_callbacks waiting on idle
+    pthread_t workers[MAX_CALLBACK_WORKERS];
+    int num_workers; //what was asked for
+    int num_running; //workers started
+    int stopping; //bool; workers exit once nothing is ready
+    int num_pins;
+    pin_queue_t* queues;
+    ready_list_t ready[CALLBACK_NUM_PRIORITIES];
+    callback_time_t* callback_time;
+};
+
+//The pool and pin whose callback a worker thread is running right now
+static __thread callback_pool_t* current_pool = NULL;
+static __thread int current_pin = GPIO_ERR;
+
+//Put a pin at the back of its priority's ready list. Called with the pool's lock held.
+static void make_ready(callback_pool_t* p, int pin)
+{
+    ready_list_t* r = &p->ready[(int) p->queues[pin].priority];
+
+    p->queues[pin].ready = TRUE;
+    r->pins[r->tail++ % p->num_pins] = pin;
+}
+
+//Take the first pin off the highest priority ready list. Called with the pool's lock
+//held.
+static int take_ready(callback_pool_t* p)
+{
+    for (int prio = 0; prio < CALLBACK_NUM_PRIORITIES; prio++)
+    {
+        ready_list_t* r = &p->ready[prio];
+        int pin = GPIO_ERR;
+
+        if (r->head == r->tail) { continue; }
+
+        pin = r->pins[r->head++ % p->num_pins];
+        p->queues[pin].ready = FALSE;
+        p->queues[pin].running = TRUE;
+        return pin;
+    }
+
+    return GPIO_ERR;
+}
+
+static void* run_worker(void* arg)
+{
+    callback_pool_t* p = arg;
+
+    pthread_mutex_lock(&p->lock);
+
+    while (TRUE)
+    {
+        int pin = take_ready(p);
+        pin_queue_t* q = NULL;
+
+        if (pin == GPIO_ERR)
+        {
+            if (p->stopping) { break; }
+            pthread_cond_wait(&p->cond, &p->lock);
+            continue;
+        }
+
+        q = &p->queues[pin];
+        for (int k = 0; k < CALLBACK_RUN_BATCH && q->head != q->tail; k++)
+        {
+            queued_change_t c = q->changes[q->head++ % CALLBACK_QUEUE_SIZE];
+
+            pthread_mutex_unlock(&p->lock);
+            current_pool = p;
+            current_pin = pin;
+            invoke_callback(p->manager, pin, c.new_val, c.func, c.arg, c.detected_ns);
+            current_pool = NULL;
+            current_pin = GPIO_ERR;
+            pthread_mutex_lock(&p->lock);
+        }
+
+        //let other pins of the same priority have a turn before the rest of this one's
+        q->running = FALSE;
+        if (q->head != q->tail) { make_ready(p, pin); }
+        if (p->idle_waiters) { pthread_cond_broadcast(&p->idle); }
+    }
+
+    pthread_mutex_unlock(&p->lock);
+
+    return NULL;
+}
+
+//Let the workers finish what's queued, then wait for them to exit
+static void stop_workers(callback_pool_t* p)
+{
+    pthread_mutex_lock(&p->lock);
+    p->stopping = TRUE;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+
+    for (int i = 0; i < p->num_running; i++) { pthread_join(p->workers[i], NULL); }
+
+    //changes queued after the last worker saw nothing ready are dropped (and counted)
+    pthread_mutex_lock(&p->lock);
+    for (int i = 0; p->queues != NULL && i < p->num_pins; i++)
+    {
+        atomic_fetch_add_explicit(&p->callback_time[i].dropped,
+                                  p->queues[i].tail - p->queues[i].head,
+                                  memory_order_relaxed);
+        p->queues[i].head = p->queues[i].tail;
+        p->queues[i].ready = FALSE;
+    }
+    for (int prio = 0; prio < CALLBACK_NUM_PRIORITIES; prio++)
+    { p->ready[prio].head = p->ready[prio].tail; }
+    __atomic_store_n(&p->num_running, 0, __ATOMIC_RELAXED);
+    p->stopping = FALSE;
+    pthread_mutex_unlock(&p->lock);
+}
+
+//Called by get_callback_pool the first time a manager's pool is needed; the pool's
+//queues are allocated by init_callback_pool
+callback_pool_t* create_callback_pool(gpio_cb_manager_t* manager)
+{
+    callback_pool_t* p = (callback_pool_t*) calloc(1, sizeof(callback_pool_t));
+
+    if (p == NULL) { return NULL; }
+
+    p->manager = manager;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    pthread_cond_init(&p->idle, NULL);
+
+    return p;
+}
+
+//Called by free_callback_manager
+void destroy_callback_pool(callback_pool_t* p)
+{
+    if (p == NULL) { return; }
+
+    free_callback_pool(p);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->cond);
+    pthread_cond_destroy(&p->idle);
+    free(p);
+}
+
+//Called by initialize_callback_manager, with the number of pins its arrays hold
+int init_callback_pool(callback_pool_t* p, int num_pins)
+{
+    free_callback_pool(p);
+
+    p->num_pins = num_pins;
+    p->queues = (pin_queue_t*) malloc(p->num_pins*sizeof(pin_queue_t));
+    p->callback_time = (callback_time_t*) malloc(p->num_pins*sizeof(callback_time_t));
+    if (p->queues == NULL || p->callback_time == NULL)
+    {
+        free_callback_pool(p);
+        return GPIO_ERR;
+    }
+
+    memset(p->queues, 0, p->num_pins*sizeof(pin_queue_t));
+    for (int i = 0; i < p->num_pins; i++)
+    { p->queues[i].priority = CALLBACK_PRIORITY_NORMAL; }
+
+    for (int prio = 0; prio < CALLBACK_NUM_PRIORITIES; prio++)
+    {
+        p->ready[prio].pins = (int*) malloc(p->num_pins*sizeof(int));
+        p->ready[prio].head = 0;
+        p->ready[prio].tail = 0;
+    }
+
+    reset_callback_stats_m(p->manager);
+
+    return GPIO_OK;
+}
+
+//Called by start_callback_manager (also when unpausing); workers keep running across
+//pauses
+int start_callback_pool(callback_pool_t* p)
+{
+    pthread_mutex_lock(&p->lock);
+
+    while (p->queues != NULL && p->num_running < p->num_workers)
+    {
+        if (pthread_create(&p->workers[p->num_running], NULL, &run_worker, p) != 0)
+        {
+            pthread_mutex_unlock(&p->lock);
+            fprintf(stderr, "Could not start callback worker %d\n", p->num_running);
+            return GPIO_ERR;
+        }
+        __atomic_store_n(&p->num_running, p->num_running+1, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_unlock(&p->lock);
+
+    return GPIO_OK;
+}
+
+//Called by terminate_callback_manager
+void free_callback_pool(callback_pool_t* p)
+{
+    stop_workers(p);
+
+    free(p->queues);
+    free(p->callback_time);
+    p->queues = NULL;
+    p->callback_time = NULL;
+
+    for (int prio = 0; prio < CALLBACK_NUM_PRIORITIES; prio++)
+    {
+        free(p->ready[prio].pins);
+        p->ready[prio].pins = NULL;
+    }
+}
+
+int queue_callback(callback_pool_t* p, int pin, int new_val, void* func, void* arg,
+                   long long detected_ns)
+{
+    pin_queue_t* q = NULL;
+
+    //no lock to take when the polling thread runs callbacks itself
+    if (__atomic_load_n(&p->num_running, __ATOMIC_RELAXED) == 0) { return GPIO_ERR; }
+
+    pthread_mutex_lock(&p->lock);
+
+    if (p->num_running == 0)
+    {
+        pthread_mutex_unlock(&p->lock);
+        return GPIO_ERR;
+    }
+
+    q = &p->queues[pin];
+    if (q->tail - q->head == CALLBACK_QUEUE_SIZE)
+    {
+        pthread_mutex_unlock(&p->lock);
+        atomic_fetch_add_explicit(&p->callback_time[pin].dropped, 1,
+                                  memory_order_relaxed);
+        return GPIO_OK;
+    }
+
+    q->changes[q->tail++ % CALLBACK_QUEUE_SIZE] =
+        (queued_change_t) { new_val, func, arg, detected_ns };
+
+    if (!q->ready && !q->running)
+    {
+        make_ready(p, pin);
+        pthread_cond_signal(&p->cond);
+    }
+
+    pthread_mutex_unlock(&p->lock);
+
+    return GPIO_OK;
+}
+
+// Forget the changes waiting for a pin whose callback was removed or replaced, and (if
+// wait is set) wait for one a worker is running right now to return, so the old function
+// and its argument can be freed afterwards. A callback removing its own pin's callback
+// doesn't wait for itself.
+void discard_callbacks(callback_pool_t* p, int pin, int wait)
+{
+    pin_queue_t* q = NULL;
+
+    pthread_mutex_lock(&p->lock);
+
+    if (p->queues != NULL && pin >= 0 && pin < p->num_pins)
+    {
+        q = &p->queues[pin];
+        q->head = q->tail;
+
+        if (wait && (current_pool != p || current_pin != pin))
+        {
+            p->idle_waiters++;
+            while (q->running) { pthread_cond_wait(&p->idle, &p->lock); }
+            p->idle_waiters--;
+        }
+    }
+
+    pthread_mutex_unlock(&p->lock);
+}
+
+void record_callback_run(callback_pool_t* p, int pin, long long ns)
+{
+    callback_time_t* t = &p->callback_time[pin];
+    unsigned long long v = ns > 0 ? (unsigned long long) ns : 0;
+
+    atomic_fetch_add_explicit(&t->calls, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&t->total_ns, v, memory_order_relaxed);
+    if (v > atomic_load_explicit(&t->max_ns, memory_order_relaxed))
+    { atomic_store_explicit(&t->max_ns, v, memory_order_relaxed); }
+}
+
+int set_callback_workers_m(gpio_cb_manager_t* m, int workers)
+{
+    callback_pool_t* p = get_callback_pool(m);
+    int running = 0;
+
+    if (p == NULL || workers < 0 || workers > MAX_CALLBACK_WORKERS)
+    {
+        fprintf(stderr, "Callback workers must be between 0 and %d\n",
+                MAX_CALLBACK_WORKERS);
+        return GPIO_ERR;
+    }
+
+    //the polling thread runs callbacks itself while there are no workers
+    pthread_mutex_lock(&p->lock);
+    p->num_workers = workers;
+    running = p->num_running;
+    pthread_mutex_unlock(&p->lock);
+
+    if (running > 0)
+    {
+        stop_workers(p);
+        return start_callback_pool(p);
+    }
+
+    return GPIO_OK;
+}
+
+int set_callback_workers(int workers)
+{
+    return set_callback_workers_m(get_default_callback_manager(), workers);
+}
+
+int get_callback_workers_m(gpio_cb_manager_t* m)
+{
+    callback_pool_t* p = get_callback_pool(m);
+    return p != NULL ? p->num_workers : 0;
+}
+
+int get_callback_workers()
+{
+    return get_callback_workers_m(get_default_callback_manager());
+}
+
+int set_callback_priority_m(gpio_cb_manager_t* m, int pin, int priority)
+{
+    callback_pool_t* p = get_callback_pool(m);
+
+    if (check_if_pin_exists(pin) < GPIO_OK) { return GPIO_ERR; }
+
+    if (priority < 0 || priority >= CALLBACK_NUM_PRIORITIES || p == NULL ||
+        p->queues == NULL || pin >= p->num_pins)
+    {
+        fprintf(stderr, "Could not set callback priority %d for pin %d\n", priority, pin);
+        return GPIO_ERR;
+    }
+
+    //a pin already on a ready list moves the next time it's queued
+    pthread_mutex_lock(&p->lock);
+    p->queues[pin].priority = (char) priority;
+    pthread_mutex_unlock(&p->lock);
+
+    return GPIO_OK;
+}
+
+int set_callback_priority(int pin, int priority)
+{
+    return set_callback_priority_m(get_default_callback_manager(), pin, priority);
+}
+
+int set_callback_priority_n(char* name, int priority)
+{
+    int pin = get_gpio_num(name);
+    if (pin < GPIO_OK) { return GPIO_ERR; }
+    return set_callback_priority(pin, priority);
+}
+
+int get_callback_stats_m(gpio_cb_manager_t* m, int pin, callback_stats_t* out)
+{
+    callback_pool_t* p = get_callback_pool(m);
+    callback_time_t* t = NULL;
+
+    if (check_if_pin_exists(pin) < GPIO_OK || out == NULL || p == NULL ||
+        p->callback_time == NULL || pin >= p->num_pins)
+    { return GPIO_ERR; }
+
+    t = &p->callback_time[pin];
+    out->pin = pin;
+    out->calls = atomic_load_explicit(&t->calls, memory_order_relaxed);
+    out->total_ns = atomic_load_explicit(&t->total_ns, memory_order_relaxed);
+    out->max_ns = atomic_load_explicit(&t->max_ns, memory_order_relaxed);
+    out->dropped = atomic_load_explicit(&t->dropped, memory_order_relaxed);
+
+    return GPIO_OK;
+}
+
+int get_callback_stats(int pin, callback_stats_t* out)
+{
+    return get_callback_stats_m(get_default_callback_manager(), pin, out);
+}
+
+int get_callback_stats_n(char* name, callback_stats_t* out)
+{
+    int pin = get_gpio_num(name);
+    if (pin < GPIO_OK) { return GPIO_ERR; }
+    return get_callback_stats(pin, out);
+}
+
+//Callbacks running while this runs may or may not be counted
+int reset_callback_stats_m(gpio_cb_manager_t* m)
+{
+    callback_pool_t* p = get_callback_pool(m);
+
+    if (p == NULL || p->callback_time == NULL) { return GPIO_ERR; }
+
+    for (int i = 0; i < p->num_pins; i++)
+    {
+        atomic_store_explicit(&p->callback_time[i].calls, 0, memory_order_relaxed);
+        atomic_store_explicit(&p->callback_time[i].total_ns, 0, memory_order_relaxed);
+        atomic_store_explicit(&p->callback_time[i].max_ns, 0, memory_order_relaxed);
+        atomic_store_explicit(&p->callback_time[i].dropped, 0, memory_order_relaxed);
+    }
+
+    return GPIO_OK;
+}
+
+int reset_callback_stats()
+{
+    return reset_callback_stats_m(get_default_callback_manager());
+}
@@ -0,0 +1,349 @@
+/*
+ * Copyright (c) 2017, Bryan Haley
+ * This code is dual licensed (GPLv2 and Simplified BSD). Use the license that works
+ * best for you. Check LICENSE.GPL and LICENSE.BSD for more details.
+ *
+ * chip_gpio_encoder.c
+ * Implementation of the quadrature encoder decoder. Encoders are sampled once per pass
+ * of their callback manager's polling thread (see poll_values), and counted with a
+ * lookup table rather than by dispatching user callbacks for every step.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include "chip_gpio.h"
+#include "chip_gpio_utils.h"
+#include "chip_gpio_callback_manager.h"
+#include "chip_gpio_encoder.h"
+
+#ifndef TRUE
+    #define TRUE 1
+#endif
+
+#ifndef FALSE
+    #define FALSE 0
+#endif
+
+#define QUAD_INVALID 2 //both pins changed between samples; direction is unknown
+
+// Quadrature (Gray code) state machine. A state is (A << 1) | B, and the table is
+// indexed by (previous state << 2) | current state. Going 00 -> 01 -> 11 -> 10 -> 00
+// counts up, the reverse counts down.
+static const signed char quad_table[16] =
+{
+     0, +1, -1, QUAD_INVALID,
+    -1,  0, QUAD_INVALID, +1,
+    +1, QUAD_INVALID,  0, -1,
+    QUAD_INVALID, -1, +1,  0
+};
+
+//struct holding the state of one encoder
+//  Fields marked atomic may be touched by both the user and the polling thread. The
+//  rest are only ever touched by the polling thread once the encoder is active.
+typedef struct
+{
+    atomic_int active; //bool indicating if this slot is in use
+    gpio_cb_manager_t* manager; //whose polling thread samples it
+    int pin_a;
+    int pin_b;
+    int state; //last sampled (A << 1) | B
+    atomic_llong position;
+    atomic_ullong errors;
+    atomic_uint rebase; //bumped by set_encoder_position so the poller can resync
+
+    //velocity estimation
+    atomic_int window_us;
+    _Atomic double velocity;
+    long long window_start_ns;
+    long long window_start_pos;
+
+    //notification threshold; threshold, func and arg change together, under notify_lock
+    atomic_flag notify_lock; //only held to copy the three in or out
+    long long threshold;
+    void* func;
+    void* arg;
+    long long last_notified;
+    unsigned int seen_rebase;
+} encoder_t;
+
+static encoder_t encoders[MAX_ENCODERS];
+
+static inline int is_valid_encoder(int encoder)
+{
+    if (encoder < 0 || encoder >= MAX_ENCODERS ||
+        !atomic_load_explicit(&encoders[encoder].active, memory_order_acquire))
+    {
+        fprintf(stderr, "Encoder %d does not exist\n", encoder);
+        return GPIO_ERR;
+    }
+
+    return GPIO_OK;
+}
+
+static inline void lock_encoder_notify(encoder_t* enc)
+{
+    while (atomic_flag_test_and_set_explicit(&enc->notify_lock, memory_order_acquire)) { }
+}
+
+static inline void unlock_encoder_notify(encoder_t* enc)
+{
+    atomic_flag_clear_explicit(&enc->notify_lock, memory_order_release);
+}
+
+//read both pins of an encoder and combine them into a state
+static inline int sample_encoder(encoder_t* enc)
+{
+    int a = read_gpio_val(enc->pin_a);
+    int b = read_gpio_val(enc->pin_b);
+
+    if (a < GPIO_PIN_LOW || a > GPIO_PIN_HIGH || b < GPIO_PIN_LOW || b > GPIO_PIN_HIGH)
+    { return GPIO_ERR; }
+
+    return (a << 1) | b;
+}
+
+//Start decoding a pair of pins as a quadrature encoder, sampled by manager
+int register_encoder_m(gpio_cb_manager_t* manager, int pin_a, int pin_b)
+{
+    int slot = GPIO_ERR;
+    int state = GPIO_ERR;
+    encoder_t* enc = NULL;
+
+    if (manager == NULL)
+    {
+        fprintf(stderr, "Could not register encoder; no callback manager given\n");
+        return GPIO_ERR;
+    }
+
+    if (check_if_pin_exists(pin_a) < GPIO_OK || check_if_pin_exists(pin_b) < GPIO_OK)
+    { return GPIO_ERR; }
+
+    if (pin_a == pin_b)
+    {
+        fprintf(stderr, "Encoder pins A and B must be different (got %d twice)\n", pin_a);
+        return GPIO_ERR;
+    }
+
+    for (int i = 0; i < MAX_ENCODERS; i++)
+    {
+        if (!atomic_load_explicit(&encoders[i].active, memory_order_acquire))
+        { slot = i; break; }
+    }
+
+    if (slot < GPIO_OK)
+    {
+        fprintf(stderr, "Could not register encoder; all %d slots are in use\n",
+                MAX_ENCODERS);
+        return GPIO_ERR;
+    }
+
+    enc = &encoders[slot];
+    enc->manager = manager;
+    enc->pin_a = pin_a;
+    enc->pin_b = pin_b;
+
+    state = sample_encoder(enc);
+    if (state < GPIO_OK)
+    {
+        fprintf(stderr, "Unable to register an encoder on pins %d and %d\n", pin_a, pin_b);
+        return GPIO_ERR;
+    }
+
+    //set some initial values
+    enc->state = state;
+    atomic_store(&enc->position, 0);
+    atomic_store(&enc->errors, 0);
+    atomic_store(&enc->window_us, 0);
+    atomic_store(&enc->velocity, 0.0);
+    lock_encoder_notify(enc);
+    enc->threshold = 0;
+    enc->func = NULL;
+    enc->arg = NULL;
+    unlock_encoder_notify(enc);
+    enc->window_start_ns = get_time_ns();
+    enc->window_start_pos = 0;
+    enc->last_notified = 0;
+    enc->seen_rebase = atomic_load(&enc->rebase);
+
+    //publish the encoder to the polling thread only once it is fully set up
+    atomic_store_explicit(&enc->active, TRUE, memory_order_release);
+
+    return slot;
+}
+
+int register_encoder(int pin_a, int pin_b)
+{
+    return register_encoder_m(get_default_callback_manager(), pin_a, pin_b);
+}
+
+//Convenience method; converts strings into numerical pins and calls above
+int register_encoder_n(char* pin_a_name, char* pin_b_name)
+{
+    int pin_a = get_gpio_pin_num_from_name(pin_a_name);
+    int pin_b = get_gpio_pin_num_from_name(pin_b_name);
+    if (pin_a < GPIO_OK || pin_b < GPIO_OK)
+    {
+        fprintf(stderr, "Could not register encoder for pins %s and %s\n",
+                pin_a_name, pin_b_name);
+        return GPIO_ERR;
+    }
+    return register_encoder(pin_a, pin_b);
+}
+
+//Stop decoding an encoder. Its pins should be closed by the programmer afterwards.
+int remove_encoder(int encoder)
+{
+    if (is_valid_encoder(encoder) < GPIO_OK) { return GPIO_ERR; }
+    atomic_store_explicit(&encoders[encoder].active, FALSE, memory_order_release);
+    return GPIO_OK;
+}
+
+//Remove the encoders sampled by a manager that's about to be freed
+void detach_encoders(gpio_cb_manager_t* m)
+{
+    for (int i = 0; i < MAX_ENCODERS; i++)
+    {
+        if (atomic_load_explicit(&encoders[i].active, memory_order_acquire) &&
+            encoders[i].manager == m)
+        { atomic_store_explicit(&encoders[i].active, FALSE, memory_order_release); }
+    }
+}
+
+int64_t get_encoder_position(int encoder)
+{
+    if (encoder < 0 || encoder >= MAX_ENCODERS) { return 0; }
+    return atomic_load_explicit(&encoders[encoder].position, memory_order_relaxed);
+}
+
+int set_encoder_position(int encoder, int64_t position)
+{
+    if (is_valid_encoder(encoder) < GPIO_OK) { return GPIO_ERR; }
+    atomic_store(&encoders[encoder].position, position);
+    atomic_fetch_add(&encoders[encoder].rebase, 1);
+    return GPIO_OK;
+}
+
+int set_encoder_velocity_window(int encoder, int window_us)
+{
+    if (is_valid_encoder(encoder) < GPIO_OK) { return GPIO_ERR; }
+    if (window_us < 0) { window_us = 0; }
+    atomic_store(&encoders[encoder].window_us, window_us);
+    if (!window_us) { atomic_store(&encoders[encoder].velocity, 0.0); }
+    return GPIO_OK;
+}
+
+double get_encoder_velocity(int encoder)
+{
+    if (encoder < 0 || encoder >= MAX_ENCODERS) { return 0.0; }
+    return atomic_load_explicit(&encoders[encoder].velocity, memory_order_relaxed);
+}
+
+int set_encoder_threshold(int encoder, int64_t threshold, void* func, void* arg)
+{
+    encoder_t* enc = NULL;
+
+    if (is_valid_encoder(encoder) < GPIO_OK) { return GPIO_ERR; }
+    enc = &encoders[encoder];
+
+    //the poller copies all three at once, so it never pairs a func with another's arg
+    lock_encoder_notify(enc);
+    enc->threshold = func != NULL && threshold > 0 ? threshold : 0;
+    enc->func = func;
+    enc->arg = arg;
+    unlock_encoder_notify(enc);
+
+    return GPIO_OK;
+}
+
+uint64_t get_encoder_errors(int encoder)
+{
+    if (encoder < 0 || encoder >= MAX_ENCODERS) { return 0; }
+    return atomic_load_explicit(&encoders[encoder].errors, memory_order_relaxed);
+}
+
+//Sample every active encoder of a manager once. Invoked by poll_values on every pass.
+int poll_encoders(gpio_cb_manager_t* m)
+{
+    int moved = 0;
+    long long now = 0; //only fetched if an encoder needs it
+    long long pos = 0;
+    long long threshold = 0;
+    void* func = NULL;
+    void* arg = NULL;
+    int window_us = 0;
+    int state = GPIO_ERR;
+    int step = 0;
+    unsigned int rebase = 0;
+    encoder_t* enc = NULL;
+
+    for (int i = 0; i < MAX_ENCODERS; i++)
+    {
+        enc = &encoders[i];
+        if (!atomic_load_explicit(&enc->active, memory_order_acquire) ||
+            enc->manager != m)
+        { continue; }
+
+        state = sample_encoder(enc);
+        if (state < GPIO_OK)
+        {
+            atomic_fetch_add_explicit(&enc->errors, 1, memory_order_relaxed);
+            continue;
+        }
+
+        step = quad_table[(enc->state << 2) | state];
+        enc->state = state;
+
+        if (step == QUAD_INVALID)
+        { atomic_fetch_add_explicit(&enc->errors, 1, memory_order_relaxed); }
+        else if (step)
+        {
+            atomic_fetch_add_explicit(&enc->position, step, memory_order_relaxed);
+            moved++;
+        }
+
+        pos = atomic_load_explicit(&enc->position, memory_order_relaxed);
+
+        //if the user moved the position, don't count the jump as motion
+        rebase = atomic_load_explicit(&enc->rebase, memory_order_relaxed);
+        if (rebase != enc->seen_rebase)
+        {
+            enc->seen_rebase = rebase;
+            enc->window_start_pos = pos;
+            enc->last_notified = pos;
+        }
+
+        //optional velocity estimation
+        window_us = atomic_load_explicit(&enc->window_us, memory_order_relaxed);
+        if (window_us > 0)
+        {
+            if (!now) { now = get_time_ns(); }
+            if (now - enc->window_start_ns >= window_us*NS_PER_US)
+            {
+                atomic_store_explicit(&enc->velocity,
+                    (double) (pos - enc->window_start_pos)*NS_PER_SEC /
+                    (double) (now - enc->window_start_ns), memory_order_relaxed);
+                enc->window_start_ns = now;
+                enc->window_start_pos = pos;
+            }
+        }
+
+        //optional notification once the position has moved far enough
+        //(func is called without the lock, so it may set a new threshold itself)
+        lock_encoder_notify(enc);
+        threshold = enc->threshold;
+        func = enc->func;
+        arg = enc->arg;
+        unlock_encoder_notify(enc);
+
+        if (threshold > 0 && llabs(pos - enc->last_notified) >= threshold)
+        {
+            int (*user_func)(encoder_change_t, void*) = func;
+            encoder_change_t change = { i, pos, pos - enc->last_notified };
+            enc->last_notified = pos;
+            user_func(change, arg);
+        }
+    }
+
+    return moved;
+}
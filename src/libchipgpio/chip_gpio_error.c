@@ -0,0 +1,270 @@
+/*
+ * Copyright (c) 2017, Bryan Haley
+ * This code is dual licensed (GPLv2 and Simplified BSD). Use the license that works
+ * best for you. Check LICENSE.GPL and LICENSE.BSD for more details.
+ *
+ * chip_gpio_error.c
+ * Implementation of the error channel: per-thread and per-pin error slots, and the
+ * rate limited, deduplicating log. Reporting takes no library-wide lock: a pin's slot
+ * has its own (held for a few stores), the rate limit is a single compare-and-swap, and
+ * the log function is read under a sequence count.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "chip_gpio.h"
+#include "chip_gpio_utils.h"
+#include "chip_gpio_pin_map.h"
+#include "chip_gpio_error.h"
+
+#define MAX_LOG_MESSAGE 256
+
+#ifndef TRUE
+    #define TRUE 1
+#endif
+#ifndef FALSE
+    #define FALSE 0
+#endif
+
+//per-pin error slot; pin 0 collects errors on pins that don't exist
+typedef struct
+{
+    gpio_error_t last;
+    int logged_code; //code of the last error that was logged for this pin
+    long long logged_ns; //when it was logged
+    uint64_t suppressed; //errors held back since then
+    atomic_flag lock; //only held to copy the fields above in or out
+} pin_error_t;
+
+static __thread gpio_error_t last_error; //zeroed, i.e. GPIO_E_NONE, on every thread
+static pin_error_t pin_errors[MAX_PIN_MAP_PINS+FIRST_PIN]; //any pin map fits
+
+static int default_log(gpio_error_t err, char* message, void* arg);
+//func and arg change together, so readers check log_seq (odd while they're changing)
+static pthread_mutex_t log_func_lock = PTHREAD_MUTEX_INITIALIZER; //serializes setters
+static atomic_uint log_seq;
+static void* _Atomic log_func = default_log;
+static void* _Atomic log_arg = NULL;
+static atomic_int log_rate = GPIO_LOG_DEFAULT_RATE;
+static atomic_llong log_dedup_ns = GPIO_LOG_DEFAULT_DEDUP_MS*1000000LL;
+//the rate limit: when the next message is due if messages were evenly spaced. Up to
+//log_rate messages may go out ahead of it (a burst), one every 1/log_rate s after that.
+static atomic_llong log_due_ns;
+
+static const char* error_strings[GPIO_NUM_ERRORS] =
+{
+    "No error",
+    "Tried to access non-existent pin",
+    "Could not identify kernel-assigned identifier for pin",
+    "Invalid value for pin",
+    "Could not open a sysfs file for pin",
+    "Could not read from pin",
+    "Could not write to pin",
+    "Could not close a sysfs file for pin",
+    "Invalid data read from pin",
+    "Read an impossible value; removed the callback function for pin",
+    "Could not reach the GPIO broker for pin",
+    "Pin was not opened by this process",
+    "Output does not hold the value last written to pin"
+};
+
+const char* gpio_strerror(int code)
+{
+    if (code < 0 || code >= GPIO_NUM_ERRORS) { return "Unknown error"; }
+    return error_strings[code];
+}
+
+static int default_log(gpio_error_t err, char* message, void* arg)
+{
+    (void) err;
+    (void) arg;
+    fprintf(stderr, "%s\n", message);
+    return GPIO_OK;
+}
+
+static inline void lock_pin_error(pin_error_t* slot)
+{
+    while (atomic_flag_test_and_set_explicit(&slot->lock, memory_order_acquire)) { }
+}
+
+static inline void unlock_pin_error(pin_error_t* slot)
+{
+    atomic_flag_clear_explicit(&slot->lock, memory_order_release);
+}
+
+//TRUE if a message may be logged at now under the rate limit
+static int take_log_slot(long long now)
+{
+    int rate = atomic_load_explicit(&log_rate, memory_order_relaxed);
+    long long interval = 0;
+    long long due = 0;
+    long long next = 0;
+
+    if (rate <= 0) { return TRUE; }
+
+    interval = NS_PER_SEC/rate;
+    due = atomic_load_explicit(&log_due_ns, memory_order_relaxed);
+    do
+    {
+        next = (due > now ? due : now) + interval;
+        if (next - now > NS_PER_SEC) { return FALSE; } //the burst is used up
+    } while (!atomic_compare_exchange_weak_explicit(&log_due_ns, &due, next,
+                                                    memory_order_relaxed,
+                                                    memory_order_relaxed));
+
+    return TRUE;
+}
+
+//The log function and its argument, as set together by set_gpio_log_func
+static void* get_log_func(void** arg)
+{
+    unsigned seq = 0;
+    void* func = NULL;
+
+    do
+    {
+        seq = atomic_load_explicit(&log_seq, memory_order_acquire);
+        func = atomic_load_explicit(&log_func, memory_order_relaxed);
+        *arg = atomic_load_explicit(&log_arg, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || atomic_load_explicit(&log_seq, memory_order_relaxed) != seq);
+
+    return func;
+}
+
+// Nothing is formatted unless the error is going to be logged, so an error that is
+// rate limited or a repeat costs a timestamp and a few stores under the pin's lock.
+int report_gpio_error(int code, int pin, int pin_kern, int sys_errno)
+{
+    long long now = get_time_ns();
+    pin_error_t* slot = does_pin_exist(pin) ? &pin_errors[pin] : &pin_errors[0];
+    gpio_error_t err = { code, pin, pin_kern, sys_errno, now, 0 };
+    long long dedup_ns = atomic_load_explicit(&log_dedup_ns, memory_order_relaxed);
+    int (*func)(gpio_error_t, char*, void*) = NULL;
+    void* arg = NULL;
+    int log = atomic_load_explicit(&log_func, memory_order_relaxed) != NULL;
+    uint64_t suppressed = 0;
+    char message[MAX_LOG_MESSAGE];
+    int len = 0;
+
+    lock_pin_error(slot);
+
+    err.count = slot->last.count+1;
+    slot->last = err;
+
+    if (log)
+    {
+        //repeats of the error last logged for this pin are held back for a while
+        if (dedup_ns > 0 && slot->logged_ns && code == slot->logged_code &&
+            now - slot->logged_ns < dedup_ns)
+        { slot->suppressed++; log = FALSE; }
+
+        else if (!take_log_slot(now)) { slot->suppressed++; log = FALSE; }
+
+        else
+        {
+            suppressed = slot->suppressed;
+            slot->suppressed = 0;
+            slot->logged_code = code;
+            slot->logged_ns = now;
+        }
+    }
+
+    unlock_pin_error(slot);
+
+    if (log) { func = get_log_func(&arg); }
+
+    last_error = err;
+
+    if (func != NULL)
+    {
+        len = snprintf(message, sizeof(message), "%s %d (%d)", gpio_strerror(code), pin,
+                       pin_kern);
+        if (sys_errno && len < MAX_LOG_MESSAGE)
+        {
+            len += snprintf(message+len, sizeof(message)-len, ": %s",
+                            strerror(sys_errno));
+        }
+        if (suppressed && len < MAX_LOG_MESSAGE)
+        {
+            snprintf(message+len, sizeof(message)-len, " (%llu similar errors suppressed)",
+                     (unsigned long long) suppressed);
+        }
+
+        func(err, message, arg);
+    }
+
+    errno = sys_errno; //strerror and the log function may have changed it
+    return GPIO_ERR;
+}
+
+int get_gpio_last_error(gpio_error_t* out)
+{
+    if (out == NULL) { return GPIO_ERR; }
+
+    *out = last_error;
+    return out->code;
+}
+
+int clear_gpio_last_error()
+{
+    memset(&last_error, 0, sizeof(gpio_error_t));
+    return GPIO_OK;
+}
+
+int get_gpio_pin_error(int pin, gpio_error_t* out)
+{
+    if (!does_pin_exist(pin) || out == NULL) { return GPIO_ERR; }
+
+    lock_pin_error(&pin_errors[pin]);
+    *out = pin_errors[pin].last;
+    unlock_pin_error(&pin_errors[pin]);
+
+    return out->code;
+}
+
+int get_gpio_pin_error_n(char* name, gpio_error_t* out)
+{
+    int pin = get_pin_from_name(name);
+    if (pin < GPIO_OK) { return GPIO_ERR; }
+    return get_gpio_pin_error(pin, out);
+}
+
+int clear_gpio_pin_error(int pin)
+{
+    if (!does_pin_exist(pin)) { return GPIO_ERR; }
+
+    lock_pin_error(&pin_errors[pin]);
+    memset(&pin_errors[pin].last, 0, sizeof(gpio_error_t));
+    pin_errors[pin].logged_code = GPIO_E_NONE;
+    pin_errors[pin].logged_ns = 0;
+    pin_errors[pin].suppressed = 0;
+    unlock_pin_error(&pin_errors[pin]);
+
+    return GPIO_OK;
+}
+
+int set_gpio_log_func(void* func, void* arg)
+{
+    pthread_mutex_lock(&log_func_lock);
+    atomic_fetch_add_explicit(&log_seq, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&log_func, func, memory_order_relaxed);
+    atomic_store_explicit(&log_arg, arg, memory_order_relaxed);
+    atomic_fetch_add_explicit(&log_seq, 1, memory_order_release);
+    pthread_mutex_unlock(&log_func_lock);
+
+    return GPIO_OK;
+}
+
+int set_gpio_log_limits(int max_per_sec, int dedup_ms)
+{
+    atomic_store(&log_rate, max_per_sec > 0 ? max_per_sec : 0);
+    atomic_store(&log_due_ns, 0); //a full burst is available again
+    atomic_store(&log_dedup_ns, dedup_ms > 0 ? dedup_ms*1000000LL : 0);
+
+    return GPIO_OK;
+}
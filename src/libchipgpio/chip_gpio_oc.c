@@ -14,10 +14,17 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <math.h>
+#include <dirent.h>
 #include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/inotify.h>
 #include "chip_gpio.h"
 #include "chip_gpio_utils.h"
+#include "chip_gpio_stats.h"
+#include "chip_gpio_probes.h"
+#include "chip_gpio_broker.h"
+#include "chip_gpio_pio.h"
 
 #ifndef TRUE
     #define TRUE 1
@@ -26,115 +33,224 @@
     #define FALSE 0
 #endif
 
-//find base number for xio pins and open files allowing opening and closing of gpio pins
-int initialize_gpio_interface()
+char gpio_sysfs_root[PATH_MAX]; //empty by default, i.e. the real /sys
+pin_cache_t* pin_cache = NULL;
+int xiopin_base = GPIO_ERR;
+//Store fds for the gpio export and unexport files here
+//  At one point, it was planned to store file descriptors for GPIO value files in this
+//  array for performance considerations; however I have since changed this.
+static int pin_fd[GPIO_CLOSE_FD+1] = { GPIO_ERR, GPIO_ERR };
+
+//Paths replaced by set_pin_cache_kern; other threads may still be using them
+typedef struct retired_path
+{
+    struct retired_path* next;
+    char* path;
+} retired_path_t;
+
+static retired_path_t* retired_paths = NULL;
+
+static void retire_path(char* path)
+{
+    retired_path_t* r = NULL;
+
+    if (path == NULL) { return; }
+
+    //if there's no memory for the list, leaking the path is safer than freeing it
+    r = (retired_path_t*) malloc(sizeof(retired_path_t));
+    if (r == NULL) { return; }
+
+    //pins are resolved under their own locks, so other pins may be pushing too
+    r->path = path;
+    r->next = __atomic_load_n(&retired_paths, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&retired_paths, &r->next, r, 0, __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED));
+}
+
+//Point a pin at its (new) kernel number. Called with the pin's lock held.
+static void set_pin_cache_kern(pin_cache_t* c, int pin_kern)
+{
+    //another thread may be using the paths, so only replace them if they changed
+    if (c->kern == pin_kern) { return; }
+
+    retire_path(c->value_path);
+    retire_path(c->direction_path);
+    __atomic_store_n(&c->value_path, get_gpio_path(pin_kern, "/value"), __ATOMIC_RELEASE);
+    __atomic_store_n(&c->direction_path, get_gpio_path(pin_kern, "/direction"),
+                     __ATOMIC_RELEASE);
+    c->kern_str_len = snprintf(c->kern_str, sizeof(c->kern_str), "%d", pin_kern);
+    __atomic_store_n(&c->kern, pin_kern, __ATOMIC_RELEASE);
+}
+
+// Find a pin's kernel number and build its paths. Pins are resolved again when they're
+// opened, so a kernel number function set after initialize_gpio_interface is used.
+int resolve_pin_cache(int pin)
+{
+    pin_cache_t* c = &pin_cache[pin];
+    int pin_kern = get_kern_num(pin);
+
+    if (pin_kern < GPIO_OK) { return GPIO_ERR; }
+
+    lock_pin_cache(c);
+    set_pin_cache_kern(c, pin_kern);
+    unlock_pin_cache(c);
+
+    return GPIO_OK;
+}
+
+//Forget every resolved pin. No other thread may be using the pins.
+static void free_pin_cache()
+{
+    free_gpio_batch(); //its fds are kept in the cache
+    if (pin_cache == NULL) { return; }
+
+    for (int i = 0; i < NUM_PINS+FIRST_PIN; i++)
+    {
+        free(pin_cache[i].value_path);
+        free(pin_cache[i].direction_path);
+    }
+
+    while (retired_paths != NULL)
+    {
+        retired_path_t* next = retired_paths->next;
+        free(retired_paths->path);
+        free(retired_paths);
+        retired_paths = next;
+    }
+
+    free(pin_cache);
+    pin_cache = NULL;
+}
+
+//Point the library at a different sysfs tree (e.g. a fake one for benchmarking).
+//Must be called before initialize_gpio_interface.
+int set_gpio_sysfs_root(char* root)
 {
+    if (root == NULL) { root = ""; }
+
+    if (strlen(root) >= PATH_MAX)
+    {
+        fprintf(stderr, "sysfs root %s is too long\n", root);
+        return GPIO_ERR;
+    }
+
+    snprintf(gpio_sysfs_root, PATH_MAX, "%s", root);
+
+    return GPIO_OK;
+}
+
+// Find the base number of the gpiochip with the given label. Only the gpiochip
+// directories that exist are looked at, so this doesn't depend on the kernel.
+static int find_gpiochip_base(char* label)
+{
+    char* class_path = get_sysfs_path(GPIO_CLASS_PATH);
+    DIR* dir = opendir(class_path);
+    struct dirent* entry = NULL;
     char* path = NULL;
-    int no_err = GPIO_ERR;
+    char buf[PATH_MAX];
     int fd = GPIO_ERR;
-    char* base_num_str = NULL;
-    char* label_path = NULL;
-    int label_fd = GPIO_ERR;
-    char* correct_label = NULL;
-    char* label = NULL;
+    int len = GPIO_ERR;
+    int base = GPIO_ERR;
+
+    free(class_path);
+    if (dir == NULL) { return GPIO_ERR; }
+
+    while (base < GPIO_OK && (entry = readdir(dir)) != NULL)
+    {
+        if (strncmp(entry->d_name, "gpiochip", strlen("gpiochip")) != GPIO_OK)
+        { continue; }
+
+        //read the label; it ends with a linefeed
+        path = get_gpiochip_path(atoi(entry->d_name+strlen("gpiochip")), "/label");
+        fd = open(path, O_RDONLY);
+        len = fd < GPIO_OK ? GPIO_ERR : read(fd, buf, sizeof(buf)-1);
+        if (fd >= GPIO_OK) { close(fd); }
+        free(path);
+
+        if (len < GPIO_OK) { continue; }
+        buf[len] = '\0';
+        buf[strcspn(buf, "\n")] = '\0';
+        if (strcmp(buf, label) != GPIO_OK) { continue; }
+
+        //it's the right chip, so get its base number
+        path = get_gpiochip_path(atoi(entry->d_name+strlen("gpiochip")), "/base");
+        fd = open(path, O_RDONLY);
+        len = fd < GPIO_OK ? GPIO_ERR : read(fd, buf, BASE_NUM_MAX_DIGITS);
+        if (fd >= GPIO_OK) { close(fd); }
+
+        if (len > 0)
+        {
+            buf[len] = '\0';
+            base = atoi(buf);
+        }
+        else
+        {
+            fprintf(stderr, "Could not get base number from %s: %s\n", path,
+                    strerror(errno));
+        }
+
+        free(path);
+    }
+
+    closedir(dir);
+
+    return base;
+}
+
+//load the pin map, find the base numbers of the gpiochips it uses (e.g. the xio pins)
+//and open files allowing opening and closing of gpio pins
+int initialize_gpio_interface()
+{
+    char* export_path = NULL;
+    char* unexport_path = NULL;
+
+    //programs sharing the pins through gpio_brokerd don't touch sysfs at all
+    if (getenv(GPIO_BROKER_ENV) != NULL)
+    { return connect_gpio_broker(getenv(GPIO_BROKER_ENV)); }
 	
     //Initialize pin identities
+    free_pin_cache(); //it's sized for the previous pin map
     if (initialize_gpio_pin_names() < 0)
     { fprintf(stderr, "Warning: could not initialize pin label names\n"); return GPIO_ERR; }
 
-    //Find the base XIO pin number in a way that does not depend on the kernel
+    //Find the base number of every gpiochip the pin map refers to. Pins usually share
+    //one chip, so only look it up again when the label changes.
     xiopin_base = GPIO_ERR;
 
-    for (int i = 0; i < ((int) pow(10,BASE_NUM_MAX_DIGITS)-1); i++)
+    for (int i = FIRST_PIN; i < NUM_PINS+FIRST_PIN; i++)
     {
-        path = get_gpiochip_path(i, "/base");
-        
-        if (access(path, F_OK) >= 0) //if file exists
-        {
-            //simple error checking
-            no_err = TRUE;
+        char* label = p_ident[i].chip_label;
+        if (label == NULL) { continue; }
 
-            //get a file descriptor for the base file
-            fd = open(path, O_RDONLY);
-            if (fd < GPIO_OK)
-            {
-                fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno)); 
-                no_err = FALSE;
-            }
-            
-            //create a buffer for the base number
-            //char base_num_str[BASE_NUM_MAX_DIGITS+1] = {'\0'};
-	    base_num_str = (char*) calloc(BASE_NUM_MAX_DIGITS, sizeof(int));
-            
-            //read the base number from the file
-            if (read(fd, base_num_str, BASE_NUM_MAX_DIGITS) < GPIO_OK)
-            {
-                fprintf(stderr, "Could not get XIO base number from %s: %s\n", path,
-                        strerror(errno));
-                no_err = FALSE;
-            }
-            
-            //get a file descriptor for the label file
-            label_path = get_gpiochip_path(i, "/label");
-            label_fd = open(label_path, O_RDONLY);
-            if (label_fd < GPIO_OK)
-            {
-                fprintf(stderr, "Could not open %s: %s\n", label_path, strerror(errno));
-                no_err = FALSE;
-            }
-           
-            //create a buffer for the label
-            correct_label = XIO_CHIP_LABEL; //this is the label for the xio gpio chip
-            //char label[sizeof(correct_label)];
-            label = (char*) calloc(strlen(correct_label)+1, sizeof(char));
-            
-            label[strlen(correct_label)] = '\0'; //make sure label is null terminated
-
-            //read the label from the file
-            //note: watch out for possible endoffile or linefeed after label giving a
-            //      false negative
-            if (read(label_fd, label, strlen(correct_label)) < GPIO_OK)
-            {
-                fprintf(stderr, "Could not read label from %s: %s", label_path,
-                        strerror(errno));
-                no_err = FALSE;
-            }
+        if (i > FIRST_PIN && p_ident[i-1].chip_label &&
+            strcmp(p_ident[i-1].chip_label, label) == GPIO_OK)
+        { p_ident[i].chip_base = p_ident[i-1].chip_base; }
+        else
+        { p_ident[i].chip_base = find_gpiochip_base(label); }
 
-            //if the label is correct and we didn't get any errors, set the base number and
-            //get the number of xio pins
-            if (strncmp(label, correct_label, strlen(correct_label)) == GPIO_OK && no_err)
-            {
-                xiopin_base = atoi(base_num_str);
-
-                //since we have our base number, we can break the loop now
-                close(fd); //doesn't really matter if this fails, it won't be used again
-                free(path);
-                free(base_num_str);
-                free(label);
-                path = NULL; //make sure we don't free this twice somehow
-                break;
-            }
+        //Error checking
+        if (p_ident[i].chip_base < GPIO_OK)
+        {
+            fprintf(stderr, "Failed to obtain base number of gpiochip %s\n", label);
+            return GPIO_ERR;
         }
-        
-        free(path);
-    }
 
-    //Error checking
-    if (xiopin_base < GPIO_OK)
-    {
-        fprintf(stderr, "Failed to obtain XIO pin base number\n");
-        return GPIO_ERR;
+        if (strcmp(label, XIO_CHIP_LABEL) == GPIO_OK)
+        { xiopin_base = p_ident[i].chip_base; }
     }
-    
-    if (NUM_XIO_U14_PINS < GPIO_OK)
+
+    //pins are resolved as they're used (see resolve_pin_cache); for convenience, 0 is
+    //not used
+    pin_cache = (pin_cache_t*) aligned_alloc(CACHE_LINE_SIZE,
+                                             (NUM_PINS+FIRST_PIN)*sizeof(pin_cache_t));
+    memset(pin_cache, 0, (NUM_PINS+FIRST_PIN)*sizeof(pin_cache_t));
+    for (int i = 0; i < NUM_PINS+FIRST_PIN; i++)
     {
-        fprintf(stderr, "Failed to obtain number of XIO pins\n");
-        return GPIO_ERR;
+        pin_cache[i].kern = GPIO_ERR;
+        pin_cache[i].shadow = GPIO_ERR;
+        pin_cache[i].value_fd = GPIO_ERR;
     }
 
-    //for convenience, 0 is not used
-    is_pin_open = (unsigned char*) calloc(NUM_PINS+FIRST_PIN, sizeof(char));
-
     //GPIO_CLOSE_FD should always be the last file descriptor in the array
     for (int i = 0; i <= GPIO_CLOSE_FD; i++)
     {
@@ -143,8 +259,12 @@ int initialize_gpio_interface()
     }
 
     //Open the export and unexport files (these allow pins to be opened/closed)
-    pin_fd[GPIO_OPEN_FD] = open("/sys/class/gpio/export", O_WRONLY);
-    pin_fd[GPIO_CLOSE_FD] = open("/sys/class/gpio/unexport", O_WRONLY);
+    export_path = get_sysfs_path(GPIO_EXPORT_PATH);
+    unexport_path = get_sysfs_path(GPIO_UNEXPORT_PATH);
+    pin_fd[GPIO_OPEN_FD] = open(export_path, O_WRONLY);
+    pin_fd[GPIO_CLOSE_FD] = open(unexport_path, O_WRONLY);
+    free(export_path);
+    free(unexport_path);
 
     //check for errors
     if (pin_fd[GPIO_OPEN_FD] < GPIO_OK)
@@ -159,7 +279,8 @@ int initialize_gpio_interface()
         return GPIO_ERR;
     }
 
-    return xiopin_base;
+    //a pin map without XIO pins is fine; there's just no base number to return
+    return xiopin_base < GPIO_OK ? GPIO_OK : xiopin_base;
 }
 
 //Convenience function
@@ -171,51 +292,57 @@ int init_gpio_inf()
 //open a GPIO pin by writing its chip-assigned number to the export file
 int open_gpio_pin(int pin)
 {
-    char* pin_str = NULL;
+    pin_cache_t* c = NULL;
+    long long start = get_time_ns();
     int pin_kern = GPIO_ERR;
-    char* path = NULL;
+    int rc = GPIO_OK;
+
+    GPIO_PROBE1(open_entry, pin);
+
+    if (gpio_broker_fd >= GPIO_OK)
+    { return record_gpio_op(pin, GPIO_STAT_OPEN, start, 2, broker_open_gpio_pin(pin)); }
 	
-    //get kernel-recognized pin number
-    pin_str = get_kern_num_str(pin);
+    //get kernel-recognized pin number, picking up any change to how it's found
+    if (check_if_pin_exists(pin) < GPIO_OK || pin_cache == NULL ||
+        (pin_kern = get_kern_num(pin)) < GPIO_OK)
+    { return record_gpio_op(pin, GPIO_STAT_OPEN, start, 0, GPIO_ERR); }
+
+    c = &pin_cache[pin];
+    lock_pin_cache(c);
+    set_pin_cache_kern(c, pin_kern);
+    release_gpio_batch_fd(pin); //the path may have changed
+    set_gpio_shadow(c, GPIO_ERR);
     
     //error-checking: see if the pin was already open before this was called
-    pin_kern = get_kern_num(pin);
-    path = get_gpio_path(pin_kern, "/value");
-    
-    if (access(path, F_OK) >= GPIO_OK) //if file exists
+    if (access(c->value_path, F_OK) >= GPIO_OK) //if file exists
     {
         fprintf(stderr,
             "Warning: pin %d (%s) may already be open. This will likely cause issues.\n",
-            pin, pin_str);
+            pin, c->kern_str);
     }
 
-    if (is_gpio_pin_open(pin))
+    if (is_pin_cache_open(c))
     {
-        free(pin_str);
-        return GPIO_OK;
+        unlock_pin_cache(c);
+        return record_gpio_op(pin, GPIO_STAT_OPEN, start, 1, GPIO_OK);
     }
 
-    free(path);
     //finished error checking
 
     //write to the export file to open to the gpio, check for error
-    if (write(pin_fd[GPIO_OPEN_FD], pin_str, strlen(pin_str)) < GPIO_OK)
+    if (write(pin_fd[GPIO_OPEN_FD], c->kern_str, c->kern_str_len) < GPIO_OK)
     {
         fprintf(stderr,
             "Could not open pin %d (%s). Did you call gpio_init(), and are you root?: ",
-            pin, pin_str);
+            pin, c->kern_str);
         perror("");
-        free(pin_str);
-        return GPIO_ERR;
+        rc = GPIO_ERR;
     }
+    else { set_pin_cache_open(c, TRUE); } //keep track of open pins for autoclose method
 
-    //keep track of open pins for autoclose method
-    is_pin_open[pin] = TRUE;
-
-    //free mem used by get_kern_num_str
-    free(pin_str);
+    unlock_pin_cache(c);
 
-    return GPIO_OK;
+    return record_gpio_op(pin, GPIO_STAT_OPEN, start, 2, rc);
 }
 
 //Convenience function; converts pin's name to numerical value and passes it to above func
@@ -239,6 +366,309 @@ int setup_gpio_pin_n(char* name, int out)
     return set_gpio_dir_n(name, out);
 }
 
+//A pin's nodes exist and we may use them (udev may still be changing their owner)
+static int gpio_nodes_ready(pin_cache_t* c)
+{
+    return access(c->direction_path, W_OK) >= GPIO_OK &&
+           access(c->value_path, R_OK | W_OK) >= GPIO_OK;
+}
+
+// Wait for the nodes of the n pins in caches to become usable. New gpioN directories
+// show up as events on the class directory, and changes of owner or mode as events on
+// the pins' own directories. sysfs doesn't always send them, so everything is checked
+// again every GPIO_SETUP_RECHECK_MS as well.
+static int wait_for_gpio_nodes(pin_cache_t** caches, int n)
+{
+    long long deadline = get_time_ns() + GPIO_SETUP_TIMEOUT_MS*1000000LL;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    unsigned char* watched = NULL;
+    char* path = NULL;
+    int pending = 0;
+    int ifd = GPIO_ERR;
+
+    for (int i = 0; i < n; i++) { if (!gpio_nodes_ready(caches[i])) { pending++; } }
+    if (pending == 0) { return GPIO_OK; }
+
+    watched = (unsigned char*) calloc(n, sizeof(unsigned char));
+    ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (ifd >= GPIO_OK)
+    {
+        path = get_sysfs_path(GPIO_CLASS_PATH);
+        inotify_add_watch(ifd, path, IN_CREATE | IN_ATTRIB);
+        free(path);
+    }
+
+    while (TRUE)
+    {
+        long long now = get_time_ns();
+        int timeout_ms = GPIO_SETUP_RECHECK_MS;
+
+        pending = 0;
+        for (int i = 0; i < n; i++)
+        {
+            if (gpio_nodes_ready(caches[i])) { continue; }
+            pending++;
+
+            //watch the pin's directory once it exists
+            if (ifd >= GPIO_OK && watched != NULL && !watched[i])
+            {
+                path = get_gpio_path(caches[i]->kern, "");
+                watched[i] = inotify_add_watch(ifd, path, IN_ATTRIB | IN_CREATE) >= 0;
+                free(path);
+            }
+        }
+
+        if (pending == 0 || now >= deadline) { break; }
+
+        if (deadline - now < timeout_ms*1000000LL)
+        { timeout_ms = (int) ((deadline - now) / 1000000LL) + 1; }
+
+        if (ifd >= GPIO_OK)
+        {
+            struct pollfd pfd = { ifd, POLLIN, 0 };
+            if (poll(&pfd, 1, timeout_ms) > 0)
+            { while (read(ifd, buf, sizeof(buf)) > 0); } //just a reason to look again
+        }
+        else { usleep(timeout_ms*1000); }
+    }
+
+    if (ifd >= GPIO_OK) { close(ifd); }
+    free(watched);
+
+    return pending == 0 ? GPIO_OK : GPIO_ERR;
+}
+
+//Write a pin's direction; outputs are given their first value along with it
+static int write_gpio_direction(int pin, pin_cache_t* c, int dir, int val)
+{
+    long long start = get_time_ns();
+    const char* str = dir == GPIO_DIR_IN ? "in" : (val ? "high" : "low");
+    int fd = GPIO_ERR;
+    int rc = dir;
+
+    GPIO_PROBE2(set_dir_entry, pin, dir);
+
+    lock_pin_cache(c);
+    fd = open(c->direction_path, O_WRONLY);
+
+    if (fd < GPIO_OK)
+    {
+        report_gpio_error(GPIO_E_OPEN, pin, c->kern, errno);
+        unlock_pin_cache(c);
+        return record_gpio_op(pin, GPIO_STAT_SET_DIR, start, 1, GPIO_ERR);
+    }
+
+    if (write(fd, str, strlen(str)) < GPIO_OK)
+    {
+        rc = report_gpio_error(GPIO_E_WRITE, pin, c->kern, errno);
+        set_gpio_shadow(c, GPIO_ERR);
+    }
+    else { set_gpio_shadow(c, dir == GPIO_DIR_OUT ? val : GPIO_ERR); }
+
+    if (close(fd) < GPIO_OK) { report_gpio_error(GPIO_E_CLOSE, pin, c->kern, errno); }
+    unlock_pin_cache(c);
+
+    return record_gpio_op(pin, GPIO_STAT_SET_DIR, start, 3, rc);
+}
+
+//Drop a pin's value fd and shadow. Called with the pin's lock held.
+static void forget_gpio_pin(int pin, pin_cache_t* c)
+{
+    release_gpio_batch_fd(pin);
+    set_gpio_shadow(c, GPIO_ERR);
+}
+
+//Unexport a pin and forget what we knew about it
+static int unexport_gpio_pin(int pin, pin_cache_t* c)
+{
+    long long start = get_time_ns();
+
+    GPIO_PROBE1(close_entry, pin);
+
+    lock_pin_cache(c);
+
+    if (write(pin_fd[GPIO_CLOSE_FD], c->kern_str, c->kern_str_len) < GPIO_OK)
+    {
+        fprintf(stderr, "Could not close pin %d (%s) (Was it open?)\n", pin, c->kern_str);
+        unlock_pin_cache(c);
+        return record_gpio_op(pin, GPIO_STAT_CLOSE, start, 1, GPIO_ERR);
+    }
+
+    //keep track of open pins for autoclose method
+    set_pin_cache_open(c, FALSE);
+    forget_gpio_pin(pin, c);
+    unlock_pin_cache(c);
+
+    return record_gpio_op(pin, GPIO_STAT_CLOSE, start, 1, GPIO_OK);
+}
+
+//Through the broker, pins are set up one at a time (it does the sysfs work)
+static int setup_gpio_pins_brokered(const pin_cfg_t* cfgs, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        if (setup_gpio_pin(cfgs[i].pin, cfgs[i].dir) >= GPIO_OK &&
+            (cfgs[i].dir == GPIO_DIR_IN ||
+             set_gpio_val(cfgs[i].pin, cfgs[i].val) >= GPIO_OK))
+        { continue; }
+
+        for (int j = 0; j <= i; j++) { close_gpio_pin(cfgs[j].pin); }
+        return GPIO_ERR;
+    }
+
+    return GPIO_OK;
+}
+
+int setup_gpio_pins(const pin_cfg_t* cfgs, int n)
+{
+    pin_cache_t** caches = NULL;
+    unsigned char* exported = NULL;
+    pin_cfg_t* before = NULL; //what pins that were already open were set to
+    int rc = GPIO_OK;
+    int set = 0; //directions written
+    int i = 0;
+
+    if (cfgs == NULL || n < 0) { return GPIO_ERR; }
+
+    if (gpio_broker_fd >= GPIO_OK) { return setup_gpio_pins_brokered(cfgs, n); }
+
+    //check everything first, so a bad entry doesn't leave anything half done
+    for (i = 0; i < n; i++)
+    {
+        if (check_if_pin_exists(cfgs[i].pin) < GPIO_OK || pin_cache == NULL ||
+            resolve_pin_cache(cfgs[i].pin) < GPIO_OK ||
+            (cfgs[i].dir != GPIO_DIR_IN && cfgs[i].dir != GPIO_DIR_OUT) ||
+            (cfgs[i].dir == GPIO_DIR_OUT && is_valid_value(cfgs[i].val, cfgs[i].pin) <
+                                            GPIO_OK))
+        {
+            fprintf(stderr, "Could not set up pin %d\n", cfgs[i].pin);
+            return GPIO_ERR;
+        }
+    }
+
+    caches = (pin_cache_t**) malloc((n > 0 ? n : 1)*sizeof(pin_cache_t*));
+    exported = (unsigned char*) calloc(n > 0 ? n : 1, sizeof(unsigned char));
+    before = (pin_cfg_t*) malloc((n > 0 ? n : 1)*sizeof(pin_cfg_t));
+    if (caches == NULL || exported == NULL || before == NULL)
+    {
+        free(caches);
+        free(exported);
+        free(before);
+        return GPIO_ERR;
+    }
+
+    //export every pin that isn't open yet
+    for (i = 0; i < n && rc >= GPIO_OK; i++)
+    {
+        int pin = cfgs[i].pin;
+        long long start = get_time_ns();
+
+        caches[i] = &pin_cache[pin];
+        lock_pin_cache(caches[i]);
+        if (is_pin_cache_open(caches[i])) { unlock_pin_cache(caches[i]); continue; }
+
+        GPIO_PROBE1(open_entry, pin);
+        release_gpio_batch_fd(pin); //the path may have changed
+        set_gpio_shadow(caches[i], GPIO_ERR);
+
+        if (write(pin_fd[GPIO_OPEN_FD], caches[i]->kern_str, caches[i]->kern_str_len) <
+            GPIO_OK)
+        {
+            fprintf(stderr, "Could not open pin %d (%s): ", pin, caches[i]->kern_str);
+            perror("");
+            unlock_pin_cache(caches[i]);
+            rc = record_gpio_op(pin, GPIO_STAT_OPEN, start, 1, GPIO_ERR);
+            break;
+        }
+
+        set_pin_cache_open(caches[i], TRUE);
+        unlock_pin_cache(caches[i]);
+        exported[i] = TRUE;
+        record_gpio_op(pin, GPIO_STAT_OPEN, start, 1, GPIO_OK);
+    }
+
+    //one wait for every node, then every direction
+    if (rc >= GPIO_OK && wait_for_gpio_nodes(caches, n) < GPIO_OK)
+    {
+        fprintf(stderr, "Timed out waiting for the sysfs nodes of pins being set up\n");
+        rc = GPIO_ERR;
+    }
+
+    //remember how the pins that were already open were set, to put them back
+    for (i = 0; i < n && rc >= GPIO_OK; i++)
+    {
+        if (exported[i]) { continue; }
+
+        before[i].dir = get_gpio_dir(cfgs[i].pin);
+        before[i].val = before[i].dir == GPIO_DIR_OUT ? read_gpio_val(cfgs[i].pin) : 0;
+        if (before[i].dir < GPIO_OK || before[i].val < GPIO_OK)
+        {
+            fprintf(stderr, "Could not read how open pin %d is set up\n", cfgs[i].pin);
+            rc = GPIO_ERR;
+        }
+    }
+
+    for (set = 0; set < n && rc >= GPIO_OK; set++)
+    {
+        rc = write_gpio_direction(cfgs[set].pin, caches[set], cfgs[set].dir,
+                                  cfgs[set].val);
+    }
+
+    //roll back: close what this exported, and put back the pins that were open (the
+    //one that failed included, as a failed write may have changed it)
+    if (rc < GPIO_OK)
+    {
+        for (i = 0; i < set; i++)
+        {
+            if (exported[i]) { continue; }
+            write_gpio_direction(cfgs[i].pin, caches[i], before[i].dir, before[i].val);
+        }
+        for (i = 0; i < n; i++)
+        { if (exported[i]) { unexport_gpio_pin(cfgs[i].pin, caches[i]); } }
+    }
+
+    free(caches);
+    free(exported);
+    free(before);
+
+    return rc < GPIO_OK ? GPIO_ERR : GPIO_OK;
+}
+
+int close_gpio_pins(const int* pins, int n)
+{
+    int rc = GPIO_OK;
+
+    if (pins == NULL || n < 0) { return GPIO_ERR; }
+
+    if (gpio_broker_fd >= GPIO_OK)
+    {
+        for (int i = 0; i < n; i++)
+        { if (close_gpio_pin(pins[i]) < GPIO_OK) { rc = GPIO_ERR; } }
+        return rc;
+    }
+
+    //stop using every pin before any of them goes away, then unexport them. The
+    //unexport file takes one pin per write, so those can't be merged.
+    for (int i = 0; i < n; i++)
+    {
+        pin_cache_t* c = get_pin_cache(pins[i]);
+        if (c == NULL) { continue; }
+
+        lock_pin_cache(c);
+        forget_gpio_pin(pins[i], c);
+        unlock_pin_cache(c);
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        pin_cache_t* c = get_pin_cache(pins[i]);
+
+        if (c == NULL || unexport_gpio_pin(pins[i], c) < GPIO_OK) { rc = GPIO_ERR; }
+    }
+
+    return rc;
+}
+
 //Convenience function
 int is_gpio_pin_open(int pin)
 {
@@ -248,7 +678,9 @@ int is_gpio_pin_open(int pin)
         return GPIO_ERR;
     }
 
-    return is_pin_open[pin];
+    if (gpio_broker_fd >= GPIO_OK) { return broker_is_gpio_pin_open(pin); }
+
+    return pin_cache == NULL ? FALSE : is_pin_cache_open(&pin_cache[pin]);
 }
 
 //Convenience function
@@ -266,33 +698,42 @@ int get_gpio_xio_base()
     return xiopin_base;
 }
 
+int get_gpio_kern_num(int pin)
+{
+    pin_cache_t* c = get_pin_cache(pin);
+    if (c == NULL) { return GPIO_ERR; }
+    return get_pin_kern(c);
+}
+
+const char* get_gpio_value_path(int pin)
+{
+    pin_cache_t* c = get_pin_cache(pin);
+    if (c == NULL) { return NULL; }
+    return get_pin_value_path(c);
+}
+
 //Close a GPIO pin by writing its chip-assigned number to the unexport file
 int close_gpio_pin(int pin)
 {
-    char* pin_str = NULL;
+    pin_cache_t* c = NULL;
+    long long start = get_time_ns();
+
+    if (gpio_broker_fd >= GPIO_OK)
+    {
+        GPIO_PROBE1(close_entry, pin);
+        return record_gpio_op(pin, GPIO_STAT_CLOSE, start, 2, broker_close_gpio_pin(pin));
+    }
+
+    c = get_pin_cache(pin);
+    if (c == NULL) { return record_gpio_op(pin, GPIO_STAT_CLOSE, start, 0, GPIO_ERR); }
 	
-    if (!is_pin_open[pin])
+    if (!is_pin_cache_open(c))
     {
         fprintf(stderr,
             "Warning: attempting to close a pin (%d) not managed by this program.\n", pin);
     }
-    
-    pin_str = get_kern_num_str(pin);
-        
-    if (write(pin_fd[GPIO_CLOSE_FD], pin_str, strlen(pin_str)) < GPIO_OK)
-    {
-        fprintf(stderr, "Could not close pin %d (%s) (Was it open?)\n", pin, pin_str);
-        free(pin_str);
-        return GPIO_ERR;
-    }
-
-    //free memory used by get_kern_num_str
-    free(pin_str);
 
-    //keep track of open pins for autoclose method
-    is_pin_open[pin] = FALSE;
-
-    return GPIO_OK;
+    return unexport_gpio_pin(pin, c);
 }
 
 //Convenience function
@@ -320,8 +761,16 @@ int get_gpio_num(char* name)
 //This will close only pins that were opened by the program that evoked it
 int autoclose_gpio_pins()
 {
+    int* pins = (int*) malloc((NUM_PINS+FIRST_PIN)*sizeof(int));
+    int n = 0;
+
+    if (pins == NULL) { return GPIO_ERR; }
+
     for (int i = FIRST_PIN; i < NUM_PINS+FIRST_PIN; i++)
-    { if (is_gpio_pin_open(i)) { close_gpio_pin(i); } }
+    { if (is_gpio_pin_open(i)) { pins[n++] = i; } }
+
+    close_gpio_pins(pins, n);
+    free(pins);
     
     return GPIO_OK;
 }
@@ -331,6 +780,9 @@ int terminate_gpio_interface()
 {
     int err = GPIO_OK;
 
+    //the broker closes the pins of clients that go away
+    if (gpio_broker_fd >= GPIO_OK) { return disconnect_gpio_broker(); }
+
     autoclose_gpio_pins();
 
     if (close(pin_fd[GPIO_OPEN_FD]) < GPIO_OK)
@@ -347,7 +799,8 @@ int terminate_gpio_interface()
         err = GPIO_ERR;
     }
 
-    free(is_pin_open);
+    disable_gpio_pio();
+    free_pin_cache();
 
     return err;
 }
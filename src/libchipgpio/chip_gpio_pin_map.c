@@ -0,0 +1,611 @@
+/*
+ * Copyright (c) 2017, Bryan Haley
+ * This code is dual licensed (GPLv2 and Simplified BSD). Use the license that works
+ * best for you. Check LICENSE.GPL and LICENSE.BSD for more details.
+ *
+ * chip_gpio_pin_map.c
+ * Implementation of the pin map: the built-in map of the CHIP, the INI parser, and the
+ * compiled (mmapable) binary index.
+ *
+ * Binary index layout (native byte order; CHIP and x86 are both little endian):
+ *   pin_map_header_t
+ *   pin_map_entry_t[num_pins]   indexed by pin number, pin 0 included
+ *   uint32_t[hash_size]         open addressed FNV-1a hash of names -> pin (0 = empty)
+ *   char[strings_size]          NUL terminated strings; offset 0 is ""
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "chip_gpio.h"
+#include "chip_gpio_utils.h"
+#include "chip_gpio_pin_map.h"
+
+#ifndef TRUE
+    #define TRUE 1
+#endif
+#ifndef FALSE
+    #define FALSE 0
+#endif
+
+#define PIN_MAP_MAGIC "CGPM"
+#define PIN_MAP_VERSION 1
+#define MAX_PIN_MAP_LINE 256
+#define NO_STRING 0
+
+typedef struct
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t num_pins; //entries, pin 0 included
+    uint32_t hash_size; //power of two
+    uint32_t pins_offset;
+    uint32_t hash_offset;
+    uint32_t strings_offset;
+    uint32_t strings_size;
+} pin_map_header_t;
+
+typedef struct
+{
+    uint32_t name; //offsets into the string table
+    uint32_t chip_label;
+    int32_t mult; //R8 port letter, or GPIO_UNUSED
+    int32_t off;
+    int32_t kern; //fixed kernel number, or GPIO_ERR
+} pin_map_entry_t;
+
+//a map being built from text, before it is loaded or written out
+typedef struct
+{
+    pin_map_entry_t* pins;
+    uint32_t num_pins;
+    char* strings;
+    uint32_t strings_size;
+    uint32_t strings_cap;
+} pin_map_builder_t;
+
+char* PIN_UNUSED;
+char* XIO_CHIP_LABEL;
+int gpio_num_pins = 0; //nothing exists until initialize_gpio_interface loads a map
+pin_identifier_t* p_ident = NULL;
+
+static char* requested_path = NULL; //set by load_gpio_pin_map
+static void* mapped = NULL; //mmapped binary index, if that's what was loaded
+static size_t mapped_size = 0;
+static char* strings = NULL; //owned string table for text maps
+static uint32_t* name_hash = NULL; //points into mapped, or owned
+static uint32_t hash_size = 0;
+
+static inline uint32_t hash_name(const char* name)
+{
+    uint32_t h = 2166136261u; //FNV-1a
+
+    while (*name) { h = (h ^ (unsigned char) *name++)*16777619u; }
+
+    return h;
+}
+
+//Smallest power of two at least twice the number of pins, so probes stay short
+static uint32_t get_hash_size(uint32_t num_pins)
+{
+    uint32_t size = 16;
+    while (size < num_pins*2) { size <<= 1; }
+    return size;
+}
+
+// Insert every named pin into hash (size slots, zeroed). names[i] is NULL for pins that
+// aren't used. A name may only be used once.
+static int fill_name_hash(uint32_t* hash, uint32_t size, char** names, uint32_t num_pins)
+{
+    uint32_t h = 0;
+
+    for (uint32_t i = FIRST_PIN; i < num_pins; i++)
+    {
+        if (names[i] == NULL) { continue; }
+
+        h = hash_name(names[i]) & (size-1);
+        while (hash[h])
+        {
+            if (strcmp(names[hash[h]], names[i]) == GPIO_OK)
+            {
+                fprintf(stderr, "Pin name %s is used more than once\n", names[i]);
+                return GPIO_ERR;
+            }
+            h = (h+1) & (size-1);
+        }
+        hash[h] = i;
+    }
+
+    return GPIO_OK;
+}
+
+//Find a pin by its exact name. Used by get_pin_from_name.
+int find_gpio_pin(char* name)
+{
+    uint32_t h = 0;
+    uint32_t pin = 0;
+
+    if (name_hash == NULL || name == NULL) { return GPIO_ERR; }
+
+    //every slot is looked at at most once, even in a table with no empty slot
+    h = hash_name(name) & (hash_size-1);
+    for (uint32_t i = 0; i < hash_size && (pin = name_hash[h]) != 0; i++)
+    {
+        if (strcmp(p_ident[pin].name, name) == GPIO_OK) { return pin; }
+        h = (h+1) & (hash_size-1);
+    }
+
+    return GPIO_ERR;
+}
+
+//Allocate p_ident for num_pins pins and mark them all unused
+static int allocate_pins(int num_pins)
+{
+    gpio_num_pins = num_pins;
+    p_ident = (pin_identifier_t*) calloc(NUM_PINS+FIRST_PIN, sizeof(pin_identifier_t));
+    if (p_ident == NULL) { gpio_num_pins = 0; return GPIO_ERR; }
+
+    for (int i = 0; i < NUM_PINS+FIRST_PIN; i++)
+    {
+	//Unused pins will all have this info
+        p_ident[i].name = PIN_UNUSED;
+        p_ident[i].mult =  GPIO_UNUSED;
+        p_ident[i].off  = GPIO_ERR;
+        p_ident[i].func = NULL;
+        p_ident[i].arg = NULL;
+        p_ident[i].hard_coded_kern_pin = GPIO_ERR;
+        p_ident[i].chip_label = NULL;
+        p_ident[i].chip_base = GPIO_ERR;
+    }
+
+    return GPIO_OK;
+}
+
+//The CHIP, as it was defined in chip_gpio_pin_defs.h before pin maps existed
+static int load_builtin_pin_map()
+{
+    if (allocate_pins(BUILTIN_NUM_PINS) < GPIO_OK) { return GPIO_ERR; }
+
+    // Here, we define the name (by which users of this library should access
+    // the pins by) and other identifying information (see CHIP_GPIO_BUILTIN_PINS).
+    // XIO pins only need the name and their line on the expander chip.
+    #define SET_BUILTIN_PIN(pin, pin_name, port, offset) \
+        p_ident[GPIO_##pin].name = pin_name; \
+        p_ident[GPIO_##pin].mult = port; p_ident[GPIO_##pin].off = offset; \
+        if (port == GPIO_UNUSED) { p_ident[GPIO_##pin].chip_label = XIO_CHIP_LABEL; }
+
+    CHIP_GPIO_BUILTIN_PINS(SET_BUILTIN_PIN)
+
+    #undef SET_BUILTIN_PIN
+
+    return GPIO_OK;
+}
+
+//Copy a pin's entry (in a compiled or freshly parsed map) into p_ident
+static void set_pin_from_entry(int pin, pin_map_entry_t* e, char* strs)
+{
+    if (e->name == NO_STRING) { return; }
+
+    p_ident[pin].name = strs+e->name;
+    p_ident[pin].mult = e->mult;
+    p_ident[pin].off = e->off;
+    p_ident[pin].hard_coded_kern_pin = e->kern;
+    p_ident[pin].chip_label = e->chip_label == NO_STRING ? NULL : strs+e->chip_label;
+}
+
+//Append a string to the builder's string table and return its offset (NO_STRING if
+//there's no memory for it)
+static uint32_t add_string(pin_map_builder_t* b, char* str)
+{
+    uint32_t len = strlen(str)+1;
+    uint32_t offset = b->strings_size;
+    char* strings = NULL;
+
+    if (b->strings_size+len > b->strings_cap)
+    {
+        strings = (char*) realloc(b->strings, (b->strings_size+len)*2);
+        if (strings == NULL) { return NO_STRING; }
+        b->strings = strings;
+        b->strings_cap = (b->strings_size+len)*2;
+    }
+
+    memcpy(b->strings+offset, str, len);
+    b->strings_size += len;
+
+    return offset;
+}
+
+static char* trim(char* str)
+{
+    char* end = NULL;
+
+    while (isspace((unsigned char) *str)) { str++; }
+    end = str+strlen(str);
+    while (end > str && isspace((unsigned char) end[-1])) { *--end = '\0'; }
+
+    return str;
+}
+
+// Parse "name = number, source" into the builder. source is P<port><n> (an R8 pin),
+// chip:<label>:<n> (line n of the gpiochip with that label) or kern:<n>.
+static int parse_pin_line(pin_map_builder_t* b, char* line)
+{
+    char* eq = strchr(line, '=');
+    char* comma = NULL;
+    char* name = NULL;
+    char* source = NULL;
+    char* label = NULL;
+    char* end = NULL;
+    long pin = 0;
+    pin_map_entry_t e = { NO_STRING, NO_STRING, GPIO_UNUSED, GPIO_ERR, GPIO_ERR };
+
+    if (eq == NULL || (comma = strchr(eq, ',')) == NULL) { return GPIO_ERR; }
+    *eq = '\0';
+    *comma = '\0';
+    name = trim(line);
+    source = trim(comma+1);
+
+    pin = strtol(trim(eq+1), &end, 10);
+    if (*end != '\0' || pin < FIRST_PIN || pin > MAX_PIN_MAP_PINS || *name == '\0')
+    { return GPIO_ERR; }
+
+    if (source[0] == 'P' && source[1] >= 'A' && source[1] <= 'Z' && isdigit(source[2]))
+    {
+        e.mult = source[1];
+        e.off = strtol(source+2, &end, 10);
+    }
+
+    else if (strncmp(source, "chip:", 5) == GPIO_OK &&
+             (end = strrchr(source, ':')) != source+4)
+    {
+        label = source+5;
+        *end = '\0';
+        e.off = strtol(end+1, &end, 10);
+    }
+
+    else if (strncmp(source, "kern:", 5) == GPIO_OK)
+    { e.kern = strtol(source+5, &end, 10); }
+
+    else { return GPIO_ERR; }
+
+    if (*end != '\0' || (e.mult != GPIO_UNUSED && e.off < 0) || (label && e.off < 0))
+    { return GPIO_ERR; }
+
+    //grow the pin table to fit
+    if (pin >= b->num_pins)
+    {
+        pin_map_entry_t* pins = NULL;
+
+        pins = (pin_map_entry_t*) realloc(b->pins, (pin+1)*sizeof(pin_map_entry_t));
+        if (pins == NULL) { return GPIO_ERR; }
+        b->pins = pins;
+        memset(b->pins+b->num_pins, 0, (pin+1-b->num_pins)*sizeof(pin_map_entry_t));
+        b->num_pins = pin+1;
+    }
+
+    if (b->pins[pin].name != NO_STRING)
+    {
+        fprintf(stderr, "Pin %ld is defined twice\n", pin);
+        return GPIO_ERR;
+    }
+
+    e.name = add_string(b, name);
+    if (label) { e.chip_label = add_string(b, label); }
+    if (e.name == NO_STRING || (label && e.chip_label == NO_STRING)) { return GPIO_ERR; }
+    b->pins[pin] = e;
+
+    return GPIO_OK;
+}
+
+static void free_builder(pin_map_builder_t* b)
+{
+    free(b->pins);
+    free(b->strings);
+    memset(b, 0, sizeof(pin_map_builder_t));
+}
+
+//Parse a text pin map. Every line outside [pins] is ignored.
+static int parse_pin_map(char* path, pin_map_builder_t* b)
+{
+    FILE* f = fopen(path, "r");
+    char buf[MAX_PIN_MAP_LINE];
+    char* line = NULL;
+    int line_num = 0;
+    int in_pins = FALSE;
+
+    memset(b, 0, sizeof(pin_map_builder_t));
+
+    if (f == NULL)
+    {
+        fprintf(stderr, "Could not open pin map %s: %s\n", path, strerror(errno));
+        return GPIO_ERR;
+    }
+
+    add_string(b, ""); //offset 0 (NO_STRING)
+    b->num_pins = FIRST_PIN; //pin 0 is never used
+
+    b->pins = (pin_map_entry_t*) calloc(FIRST_PIN, sizeof(pin_map_entry_t));
+    if (b->strings == NULL || b->pins == NULL)
+    {
+        fclose(f);
+        free_builder(b);
+        return GPIO_ERR;
+    }
+
+    while (fgets(buf, sizeof(buf), f) != NULL)
+    {
+        line_num++;
+        buf[strcspn(buf, ";#\n")] = '\0'; //strip comments
+        line = trim(buf);
+
+        if (*line == '\0') { continue; }
+
+        if (*line == '[')
+        {
+            in_pins = strcmp(line, "[pins]") == GPIO_OK;
+            continue;
+        }
+
+        if (in_pins && parse_pin_line(b, line) < GPIO_OK)
+        {
+            fprintf(stderr, "Invalid pin definition on line %d of %s\n", line_num, path);
+            fclose(f);
+            free_builder(b);
+            return GPIO_ERR;
+        }
+    }
+
+    fclose(f);
+
+    if (b->num_pins <= FIRST_PIN)
+    {
+        fprintf(stderr, "Pin map %s defines no pins\n", path);
+        free_builder(b);
+        return GPIO_ERR;
+    }
+
+    return GPIO_OK;
+}
+
+static int load_text_pin_map(char* path)
+{
+    pin_map_builder_t b;
+
+    if (parse_pin_map(path, &b) < GPIO_OK) { return GPIO_ERR; }
+
+    if (allocate_pins(b.num_pins-FIRST_PIN) < GPIO_OK)
+    { free_builder(&b); return GPIO_ERR; }
+
+    for (uint32_t i = FIRST_PIN; i < b.num_pins; i++)
+    { set_pin_from_entry(i, &b.pins[i], b.strings); }
+
+    //p_ident points into the string table, so keep it
+    strings = b.strings;
+    b.strings = NULL;
+    free_builder(&b);
+
+    return GPIO_OK;
+}
+
+//mmap a compiled index. Names are used straight out of the mapping.
+static int load_binary_pin_map(char* path, int fd)
+{
+    struct stat st;
+    pin_map_header_t* h = NULL;
+    pin_map_entry_t* pins = NULL;
+    char* strs = NULL;
+    uint32_t empty = 0;
+
+    if (fstat(fd, &st) < GPIO_OK || st.st_size < (off_t) sizeof(pin_map_header_t))
+    { goto invalid; }
+
+    mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped == MAP_FAILED) { mapped = NULL; goto invalid; }
+    mapped_size = st.st_size;
+    h = (pin_map_header_t*) mapped;
+
+    //everything must be inside the file before any of it is trusted
+    if (h->version != PIN_MAP_VERSION || h->num_pins <= FIRST_PIN ||
+        h->num_pins > MAX_PIN_MAP_PINS+FIRST_PIN || h->hash_size == 0 ||
+        (h->hash_size & (h->hash_size-1)) || h->pins_offset % 4 || h->hash_offset % 4 ||
+        h->pins_offset+(uint64_t) h->num_pins*sizeof(pin_map_entry_t) > mapped_size ||
+        h->hash_offset+(uint64_t) h->hash_size*sizeof(uint32_t) > mapped_size ||
+        h->strings_offset+(uint64_t) h->strings_size > mapped_size ||
+        h->strings_size == 0)
+    { goto invalid; }
+
+    pins = (pin_map_entry_t*) ((char*) mapped+h->pins_offset);
+    strs = (char*) mapped+h->strings_offset;
+    name_hash = (uint32_t*) ((char*) mapped+h->hash_offset);
+    hash_size = h->hash_size;
+
+    if (strs[h->strings_size-1] != '\0') { goto invalid; }
+
+    for (uint32_t i = 0; i < h->num_pins; i++)
+    {
+        if (pins[i].name >= h->strings_size || pins[i].chip_label >= h->strings_size)
+        { goto invalid; }
+    }
+
+    //a lookup stops at an empty slot, so there has to be one
+    for (uint32_t i = 0; i < hash_size; i++)
+    {
+        if (name_hash[i] >= h->num_pins) { goto invalid; }
+        if (name_hash[i] == 0) { empty++; }
+    }
+    if (!empty) { goto invalid; }
+
+    if (allocate_pins(h->num_pins-FIRST_PIN) < GPIO_OK) { goto invalid; }
+
+    for (uint32_t i = FIRST_PIN; i < h->num_pins; i++)
+    { set_pin_from_entry(i, &pins[i], strs); }
+
+    return GPIO_OK;
+
+invalid:
+    fprintf(stderr, "Pin map %s is not a valid compiled pin map\n", path);
+    name_hash = NULL;
+    hash_size = 0;
+    return GPIO_ERR;
+}
+
+//Hash the names in p_ident, for maps that weren't compiled
+static int build_name_hash()
+{
+    char** names = (char**) calloc(NUM_PINS+FIRST_PIN, sizeof(char*));
+
+    hash_size = get_hash_size(NUM_PINS+FIRST_PIN);
+    name_hash = (uint32_t*) calloc(hash_size, sizeof(uint32_t));
+    if (names == NULL || name_hash == NULL)
+    {
+        free(names);
+        return GPIO_ERR;
+    }
+
+    for (int i = FIRST_PIN; i < NUM_PINS+FIRST_PIN; i++)
+    { if (p_ident[i].name != PIN_UNUSED) { names[i] = p_ident[i].name; } }
+
+    if (fill_name_hash(name_hash, hash_size, names, NUM_PINS+FIRST_PIN) < GPIO_OK)
+    {
+        free(names);
+        return GPIO_ERR;
+    }
+
+    free(names);
+    return GPIO_OK;
+}
+
+//Forget the loaded map
+static void unload_pin_map()
+{
+    if (mapped == NULL) { free(name_hash); }
+    else { munmap(mapped, mapped_size); }
+
+    free(p_ident);
+    free(strings);
+    p_ident = NULL;
+    gpio_num_pins = 0;
+    mapped = NULL;
+    mapped_size = 0;
+    strings = NULL;
+    name_hash = NULL;
+    hash_size = 0;
+}
+
+//This is called in initialize_gpio_interface() before anything else
+int initialize_gpio_pin_names()
+{
+    char* path = requested_path ? requested_path : getenv(PIN_MAP_ENV);
+    char magic[sizeof(PIN_MAP_MAGIC)-1];
+    int fd = GPIO_ERR;
+    int rc = GPIO_ERR;
+
+    PIN_UNUSED = "DO NOT USE";
+    // this is the i2c chip handling the XIO pins
+    XIO_CHIP_LABEL = "pcf8574a"; // Currently, the CHIP uses this label to identify
+                                 // the correct directory containing the xio base
+                                 // number, so we just need to know this beforehand.
+
+    unload_pin_map();
+
+    if (path == NULL || *path == '\0') { rc = load_builtin_pin_map(); }
+
+    //compiled maps start with PIN_MAP_MAGIC; anything else is parsed as text
+    else if ((fd = open(path, O_RDONLY)) < GPIO_OK)
+    { fprintf(stderr, "Could not open pin map %s: %s\n", path, strerror(errno)); }
+
+    else if (read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+             memcmp(magic, PIN_MAP_MAGIC, sizeof(magic)) == GPIO_OK)
+    { rc = load_binary_pin_map(path, fd); }
+
+    else { rc = load_text_pin_map(path); }
+
+    if (fd >= GPIO_OK) { close(fd); }
+
+    if (rc < GPIO_OK) { unload_pin_map(); return GPIO_ERR; }
+
+    //compiled maps carry their own hash table
+    if (name_hash == NULL && (rc = build_name_hash()) < GPIO_OK) { unload_pin_map(); }
+
+    return rc;
+}
+
+int load_gpio_pin_map(char* path)
+{
+    free(requested_path);
+    requested_path = path ? strdup(path) : NULL;
+    return GPIO_OK;
+}
+
+int compile_gpio_pin_map(char* ini_path, char* bin_path)
+{
+    pin_map_builder_t b;
+    pin_map_header_t h;
+    uint32_t* hash = NULL;
+    char** names = NULL;
+    FILE* f = NULL;
+    int rc = GPIO_OK;
+
+    if (parse_pin_map(ini_path, &b) < GPIO_OK) { return GPIO_ERR; }
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, PIN_MAP_MAGIC, sizeof(h.magic));
+    h.version = PIN_MAP_VERSION;
+    h.num_pins = b.num_pins;
+    h.hash_size = get_hash_size(b.num_pins);
+    h.pins_offset = sizeof(pin_map_header_t);
+    h.hash_offset = h.pins_offset+b.num_pins*sizeof(pin_map_entry_t);
+    h.strings_offset = h.hash_offset+h.hash_size*sizeof(uint32_t);
+    h.strings_size = b.strings_size;
+
+    hash = (uint32_t*) calloc(h.hash_size, sizeof(uint32_t));
+    names = (char**) calloc(b.num_pins, sizeof(char*));
+    if (hash == NULL || names == NULL)
+    {
+        free(hash);
+        free(names);
+        free_builder(&b);
+        return GPIO_ERR;
+    }
+
+    for (uint32_t i = FIRST_PIN; i < b.num_pins; i++)
+    { if (b.pins[i].name != NO_STRING) { names[i] = b.strings+b.pins[i].name; } }
+
+    rc = fill_name_hash(hash, h.hash_size, names, b.num_pins);
+    free(names);
+
+    if (rc == GPIO_OK && (f = fopen(bin_path, "wb")) == NULL)
+    {
+        fprintf(stderr, "Could not create %s: %s\n", bin_path, strerror(errno));
+        rc = GPIO_ERR;
+    }
+
+    if (rc == GPIO_OK &&
+        (fwrite(&h, sizeof(h), 1, f) != 1 ||
+         fwrite(b.pins, sizeof(pin_map_entry_t), b.num_pins, f) != b.num_pins ||
+         fwrite(hash, sizeof(uint32_t), h.hash_size, f) != h.hash_size ||
+         fwrite(b.strings, 1, b.strings_size, f) != b.strings_size))
+    {
+        fprintf(stderr, "Could not write %s: %s\n", bin_path, strerror(errno));
+        rc = GPIO_ERR;
+    }
+
+    if (f != NULL && fclose(f) != 0) { rc = GPIO_ERR; }
+
+    free(hash);
+    free_builder(&b);
+
+    return rc;
+}
+
+int get_gpio_num_pins()
+{
+    return NUM_PINS;
+}
@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) 2017, Bryan Haley
+ * This code is dual licensed (GPLv2 and Simplified BSD). Use the license that works
+ * best for you. Check LICENSE.GPL and LICENSE.BSD for more details.
+ *
+ * chip_gpio_pio.c
+ * Implementation of the PIO register backend (chip_gpio_pio.h). The rw and batch
+ * functions ask get_pio_data_reg whether a pin goes through the registers, and do the
+ * loads themselves; stores go through write_pio_data, under the port's lock.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "chip_gpio.h"
+#include "chip_gpio_utils.h"
+#include "chip_gpio_shift_register.h"
+#include "chip_gpio_pio.h"
+
+#ifndef TRUE
+    #define TRUE 1
+#endif
+#ifndef FALSE
+    #define FALSE 0
+#endif
+
+#define PIO_PINS_PER_CFG 8
+#define PIO_CFG_BITS 4
+#define PIO_CFG_MASK 0xF
+
+volatile uint32_t* gpio_pio_regs = NULL; //the start of the PIO block, once mapped
+static void* pio_map = NULL; //the whole mapping, which starts on a page boundary
+static size_t pio_map_len = 0;
+static unsigned char port_locks[GPIO_PIO_PORTS]; //held around writes of a data register
+
+//The register at byte offset reg of port's registers
+static inline volatile uint32_t* get_pio_reg(volatile uint32_t* regs, int port, int reg)
+{
+    return regs + (port*GPIO_PIO_PORT_SIZE + reg)/sizeof(uint32_t);
+}
+
+volatile uint32_t* get_pio_data_reg(int pin, pin_cache_t* c, int write, uint32_t* bit)
+{
+    volatile uint32_t* regs = __atomic_load_n(&gpio_pio_regs, __ATOMIC_ACQUIRE);
+    int port = GPIO_ERR;
+    int off = GPIO_ERR;
+    uint32_t cfg = 0;
+
+    if (regs == NULL || p_ident[pin].mult == GPIO_UNUSED) { return NULL; }
+
+    port = p_ident[pin].mult - 'A';
+    off = p_ident[pin].off;
+
+    //a kernel number function (or a fixed number) can put a pin somewhere else
+    if (port < 0 || port >= GPIO_PIO_PORTS || off < 0 || off >= 32 ||
+        get_pin_kern(c) != decode_r8_pin(p_ident[pin].mult, off))
+    { return NULL; }
+
+    //pins muxed to something else (the LCD, say) are left to the kernel, and so are
+    //writes to pins that aren't outputs, which sysfs reports as errors
+    cfg = *get_pio_reg(regs, port, GPIO_PIO_CFG + off/PIO_PINS_PER_CFG*sizeof(uint32_t));
+    cfg = (cfg >> (off%PIO_PINS_PER_CFG)*PIO_CFG_BITS) & PIO_CFG_MASK;
+    if (cfg != GPIO_PIO_CFG_OUT && (write || cfg != GPIO_PIO_CFG_IN)) { return NULL; }
+
+    *bit = 1u << off;
+    return get_pio_reg(regs, port, GPIO_PIO_DAT);
+}
+
+void write_pio_data(volatile uint32_t* reg, uint32_t set, uint32_t clear)
+{
+    //the data registers are GPIO_PIO_PORT_SIZE bytes apart, at GPIO_PIO_DAT of each port
+    size_t port = ((volatile char*) reg - (volatile char*) gpio_pio_regs - GPIO_PIO_DAT) /
+                  GPIO_PIO_PORT_SIZE;
+    unsigned char* lock = &port_locks[port];
+
+    //held for a load and a store, so spinning is cheap unless the holder was preempted
+    for (int spins = 0; __atomic_test_and_set(lock, __ATOMIC_ACQUIRE); spins++)
+    { if (spins >= PIN_LOCK_SPINS) { sched_yield(); } }
+
+    __atomic_store_n(reg, (__atomic_load_n(reg, __ATOMIC_RELAXED) & ~clear) | set,
+                     __ATOMIC_RELAXED);
+    __atomic_clear(lock, __ATOMIC_RELEASE);
+}
+
+int enable_gpio_pio(char* path)
+{
+    char* file = path == NULL ? GPIO_PIO_DEV : path;
+    long page = sysconf(_SC_PAGESIZE);
+    struct stat st;
+    off_t offset = 0;
+    size_t start = 0; //of the PIO block, in the mapping
+    void* map = NULL;
+    volatile uint32_t* none = NULL;
+    int fd = GPIO_ERR;
+
+    //other threads may be holding registers of the current mapping
+    if (is_gpio_pio_enabled())
+    {
+        fprintf(stderr, "The PIO registers are already mapped; disable_gpio_pio first\n");
+        return GPIO_ERR;
+    }
+
+    fd = open(file, O_RDWR | O_SYNC | (path == NULL ? 0 : O_CREAT), 0644);
+    if (fd < GPIO_OK || fstat(fd, &st) < GPIO_OK)
+    {
+        fprintf(stderr, "Could not open %s for the PIO registers (are you root?): %s\n",
+                file, strerror(errno));
+        if (fd >= GPIO_OK) { close(fd); }
+        return GPIO_ERR;
+    }
+
+    //the hardware is mapped from the page holding the block; an image from its start
+    if (S_ISCHR(st.st_mode))
+    {
+        offset = GPIO_PIO_BASE & ~(page-1);
+        start = GPIO_PIO_BASE - offset;
+    }
+    else if (st.st_size < GPIO_PIO_SIZE && ftruncate(fd, GPIO_PIO_SIZE) < GPIO_OK)
+    {
+        fprintf(stderr, "Could not size the PIO register image %s: %s\n", file,
+                strerror(errno));
+        close(fd);
+        return GPIO_ERR;
+    }
+
+    map = mmap(NULL, start+GPIO_PIO_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+    close(fd); //the mapping keeps what it needs
+
+    if (map == MAP_FAILED)
+    {
+        fprintf(stderr, "Could not map the PIO registers from %s: %s\n", file,
+                strerror(errno));
+        return GPIO_ERR;
+    }
+
+    //another thread may have mapped them meanwhile
+    if (!__atomic_compare_exchange_n(&gpio_pio_regs, &none,
+                                     (volatile uint32_t*) ((char*) map + start), 0,
+                                     __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    {
+        fprintf(stderr, "The PIO registers are already mapped; disable_gpio_pio first\n");
+        munmap(map, start+GPIO_PIO_SIZE);
+        return GPIO_ERR;
+    }
+
+    pio_map = map;
+    pio_map_len = start+GPIO_PIO_SIZE;
+
+    return GPIO_OK;
+}
+
+int disable_gpio_pio()
+{
+    if (pio_map == NULL) { return GPIO_OK; }
+
+    __atomic_store_n(&gpio_pio_regs, NULL, __ATOMIC_RELEASE);
+    munmap(pio_map, pio_map_len);
+    pio_map = NULL;
+    pio_map_len = 0;
+
+    return GPIO_OK;
+}
+
+int is_gpio_pio_enabled()
+{
+    return __atomic_load_n(&gpio_pio_regs, __ATOMIC_ACQUIRE) != NULL;
+}
+
+int is_gpio_pio_pin(int pin)
+{
+    uint32_t bit = 0;
+    pin_cache_t* c = NULL;
+
+    if (pin >= VIRTUAL_PIN_BASE || gpio_broker_fd >= GPIO_OK || !is_gpio_pio_enabled())
+    { return FALSE; }
+
+    c = get_pin_cache(pin);
+    return c != NULL && get_pio_data_reg(pin, c, FALSE, &bit) != NULL;
+}
+
+int is_gpio_pio_pin_n(char* pin_name)
+{
+    int pin = get_pin_from_name(pin_name);
+    if (pin < GPIO_OK) { return FALSE; }
+    return is_gpio_pio_pin(pin);
+}
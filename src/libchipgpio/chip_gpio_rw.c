@@ -18,104 +18,99 @@
 #include <errno.h>
 #include "chip_gpio.h"
 #include "chip_gpio_utils.h"
-
-//Set the value of a GPIO pin in the output direction to 1 or 0 (on/off) by writing
-//'1' or '0' to its value file.
-//  Note: those are the characters '1' and '0' (a.k.a. 0x30 and 0x31), not literal values
-//  1 and 0.
-int set_gpio_val(int pin, int val)
+#include "chip_gpio_shift_register.h"
+#include "chip_gpio_stats.h"
+#include "chip_gpio_probes.h"
+#include "chip_gpio_error.h"
+
+#ifndef TRUE
+    #define TRUE 1
+#endif
+#ifndef FALSE
+    #define FALSE 0
+#endif
+
+int gpio_shadow_mode = GPIO_SHADOW_ON;
+
+// Write val to a pin: through its port's data register if the PIO registers are mapped
+// and the pin is configured as an output there (see chip_gpio_pio.h), or else to its
+// value file. Called with the pin's lock held.
+static int write_pin_value(int pin, pin_cache_t* c, int val, long long start)
 {
-    int pin_kern = GPIO_ERR;
-    char* path = NULL;
+    int pin_kern = c->kern;
+    uint32_t bit = 0;
+    volatile uint32_t* reg = get_pio_data_reg(pin, c, TRUE, &bit);
     int fd = GPIO_ERR;
-	
-    pin_kern = get_kern_num(pin);
-    
-    //Digital pins can only be on or off
-    if (is_valid_value(val, pin) < GPIO_OK)
-    { return GPIO_ERR; }
-    
-    //Open the value file in the pin directory and write the requested value
-    path = get_gpio_path(pin_kern, "/value");
-    fd = open(path, O_RDWR);
-    
-    //free memory used by get_gpio_path
-    free(path);
-    path = NULL;
 
+    if (reg != NULL)
+    {
+        write_pio_data(reg, val ? bit : 0, val ? 0 : bit);
+        set_gpio_shadow(c, val);
+        return record_gpio_op(pin, GPIO_STAT_WRITE, start, 0, val);
+    }
+
+    fd = open(c->value_path, O_RDWR);
     if (fd < GPIO_OK)
     {
-        fprintf(stderr, "Could not open pin %d (%d) for writing: %s\n", 
-                pin, pin_kern, strerror(errno));
+        report_gpio_error(GPIO_E_OPEN, pin, pin_kern, errno);
         close(fd);
-        return GPIO_ERR;
+        return record_gpio_op(pin, GPIO_STAT_WRITE, start, 1, GPIO_ERR);
     }
 
     char val_ch = val + '0';
 
     if (write(fd, &val_ch, sizeof(char)) < GPIO_OK)
     {
-        fprintf(stderr,
-                "Could not write value %d to pin %d (%d): %s\n", 
-                val, pin, pin_kern, strerror(errno));
+        report_gpio_error(GPIO_E_WRITE, pin, pin_kern, errno);
         close(fd);
-        return GPIO_ERR;
+        set_gpio_shadow(c, GPIO_ERR); //who knows what it holds now
+        return record_gpio_op(pin, GPIO_STAT_WRITE, start, 3, GPIO_ERR);
     }
 
+    set_gpio_shadow(c, val);
+
     if (close(fd) < GPIO_OK)
     {
-        fprintf(stderr, "Could not close pin %d (%d) for writing: %s\n", 
-                pin, pin_kern, strerror(errno));
+        report_gpio_error(GPIO_E_CLOSE, pin, pin_kern, errno);
         //return GPIO_ERR; //try to continue anyway
     }
 
-    return val;
+    return record_gpio_op(pin, GPIO_STAT_WRITE, start, 3, val);
 }
 
-//Convenience function; takes a pin's name as a string and passes it long to above as int
-int set_gpio_val_n(char* name, int val)
-{
-    int pin = get_pin_from_name(name);
-    if (pin < GPIO_OK) { return GPIO_ERR; }
-    return set_gpio_val(pin, val);
-}
-
-//Return the value (1 aka HIGH or 0 aka LOW) of a GPIO pin in the input direction by
-//reading its value file.
-int read_gpio_val(int pin)
+// Read a pin, from its port's data register or its value file. Nothing is locked; the
+// paths stay valid (see pin_cache_t).
+static int read_pin_value(int pin, pin_cache_t* c, long long start)
 {
     char val = GPIO_ERR;
-   
-    //open the value file in the pin directory and read the requested value
-    int pin_kern = get_kern_num(pin);
-    char* path = get_gpio_path(pin_kern, "/value");
-    int fd = open(path, O_RDWR);
-    
-    //free memory used by get_gpio_path
-    free(path);
-    path = NULL;
+    int pin_kern = get_pin_kern(c);
+    uint32_t bit = 0;
+    volatile uint32_t* reg = get_pio_data_reg(pin, c, FALSE, &bit);
+    int fd = GPIO_ERR;
+
+    if (reg != NULL)
+    { return record_gpio_op(pin, GPIO_STAT_READ, start, 0, read_pio_data(reg, bit)); }
 
+    fd = open(get_pin_value_path(c), O_RDWR);
     if (fd < GPIO_OK)
     {
-        fprintf(stderr, "Could not open pin %d (%d) for reading: %s\n", 
-                pin, pin_kern, strerror(errno));
+        report_gpio_error(GPIO_E_OPEN, pin, pin_kern, errno);
         close(fd);
-        return GPIO_ERR;
+        return record_gpio_op(pin, GPIO_STAT_READ, start, 1, GPIO_ERR);
     }
 
     if (read(fd, &val, 1) < GPIO_OK)
     {
-        fprintf(stderr, "Could not read from pin %d (%d): %s\n", 
-                pin, pin_kern, strerror(errno));
+        report_gpio_error(GPIO_E_READ, pin, pin_kern, errno);
         close(fd);
-        return GPIO_ERR;
+        return record_gpio_op(pin, GPIO_STAT_READ, start, 3, GPIO_ERR);
     }
 
     if (val != '0' && val != '1')
     {
-        fprintf(stderr, "Invalid value read from pin %d (%d)\n", pin, pin_kern);
+        report_gpio_error(GPIO_E_BAD_DATA, pin, pin_kern, 0);
         close(fd);
-        return GPIO_ERR;
+        return record_gpio_op(pin, GPIO_STAT_READ, start, 3, GPIO_ERR);
     }
     
     val -= '0'; //An ASCII character is given (either '0' or '1'), so subtract it by
@@ -123,11 +118,106 @@ int read_gpio_val(int pin)
 
     if (close(fd) < GPIO_OK)
     {
-        fprintf(stderr, "Could not close pin %d (%d) for reading: %s\n", 
-                pin, pin_kern, strerror(errno));
+        report_gpio_error(GPIO_E_CLOSE, pin, pin_kern, errno);
         //return GPIO_ERR; try to continue anyway
     }
 
+    return record_gpio_op(pin, GPIO_STAT_READ, start, 3, val);
+}
+
+//Set the value of a GPIO pin in the output direction to 1 or 0 (on/off) by writing
+//'1' or '0' to its value file.
+//  Note: those are the characters '1' and '0' (a.k.a. 0x30 and 0x31), not literal values
+//  1 and 0.
+int set_gpio_val(int pin, int val)
+{
+    long long start = get_time_ns();
+    pin_cache_t* c = NULL;
+    int mode = gpio_shadow_mode;
+    int rc = GPIO_ERR;
+
+    //pins exposed by a shift register chain are handled by its driver
+    if (pin >= VIRTUAL_PIN_BASE) { return set_virtual_gpio_val(pin, val); }
+
+    GPIO_PROBE2(write_entry, pin, val);
+
+    if (gpio_broker_fd >= GPIO_OK)
+    {
+        return record_gpio_op(pin, GPIO_STAT_WRITE, start, 2,
+                              broker_set_gpio_val(pin, val));
+    }
+	
+    c = get_pin_cache(pin);
+    
+    //Digital pins can only be on or off (get_pin_cache has already reported bad pins)
+    if (c == NULL || is_valid_value(val, pin) < GPIO_OK)
+    { return record_gpio_op(pin, GPIO_STAT_WRITE, start, 0, GPIO_ERR); }
+
+    //the output already has this value
+    if (mode == GPIO_SHADOW_ON && get_gpio_shadow(c) == val)
+    { return record_gpio_op(pin, GPIO_STAT_WRITE, start, 0, val); }
+
+    //the write and its shadow go together, so writes to the pin from other threads
+    //can't leave the shadow holding the value that lost
+    lock_pin_cache(c);
+
+    if (mode == GPIO_SHADOW_ON && get_gpio_shadow(c) == val)
+    { rc = record_gpio_op(pin, GPIO_STAT_WRITE, start, 0, val); }
+    else { rc = write_pin_value(pin, c, val, start); }
+
+    unlock_pin_cache(c);
+
+    return rc;
+}
+
+//Convenience function; takes a pin's name as a string and passes it long to above as int
+int set_gpio_val_n(char* name, int val)
+{
+    int pin = get_pin_from_name(name);
+    if (pin < GPIO_OK) { return GPIO_ERR; }
+    return set_gpio_val(pin, val);
+}
+
+//Return the value (1 aka HIGH or 0 aka LOW) of a GPIO pin in the input direction by
+//reading its value file.
+//  Reads don't lock the pin; a read that overlaps a write to the same pin returns either
+//  value.
+int read_gpio_val(int pin)
+{
+    long long start = get_time_ns();
+    unsigned seq = 0;
+    int shadow = GPIO_ERR;
+    int val = GPIO_ERR;
+
+    if (pin >= VIRTUAL_PIN_BASE) { return read_virtual_gpio_val(pin); }
+
+    GPIO_PROBE1(read_entry, pin);
+
+    //a load from the broker's shared snapshot; no syscalls
+    if (gpio_broker_fd >= GPIO_OK)
+    { return record_gpio_op(pin, GPIO_STAT_READ, start, 0, broker_read_gpio_val(pin)); }
+   
+    pin_cache_t* c = get_pin_cache(pin);
+    if (c == NULL)
+    { return record_gpio_op(pin, GPIO_STAT_READ, start, 0, GPIO_ERR); }
+
+    //an output we wrote to holds what we wrote
+    seq = read_pin_cache_begin(c);
+    shadow = get_gpio_shadow(c);
+    if (shadow >= GPIO_OK && gpio_shadow_mode == GPIO_SHADOW_ON)
+    { return record_gpio_op(pin, GPIO_STAT_READ, start, 0, shadow); }
+
+    //read the pin's PIO data register, or open the value file in its directory
+    val = read_pin_value(pin, c, start);
+
+    //the hardware wins, but say that it didn't hold what we wrote (unless another
+    //thread wrote something else in the meantime)
+    if (gpio_shadow_mode == GPIO_SHADOW_VERIFY && shadow >= GPIO_OK && val >= GPIO_OK &&
+        val != shadow && !read_pin_cache_changed(c, seq) &&
+        __atomic_compare_exchange_n(&c->shadow, &shadow, val, 0, __ATOMIC_RELAXED,
+                                    __ATOMIC_RELAXED))
+    { report_gpio_error(GPIO_E_SHADOW_MISMATCH, pin, get_pin_kern(c), 0); }
+
     return val;
 }
 
@@ -139,12 +229,50 @@ int read_gpio_val_n(char* name)
     return read_gpio_val(pin);
 }
 
-//Call read and send the opposite value to write
+//Call read and send the opposite value to write. For an output we've written to, the
+//read comes from its shadow, so this is a single write.
+//  The pin is locked from the read to the write, so toggles from several threads don't
+//  cancel each other out.
 int toggle_gpio_val(int pin)
 {
-    int val = read_gpio_val(pin);
-    if (is_valid_value(val, pin) < GPIO_ERR) { return GPIO_ERR; }
-    return set_gpio_val(pin, !val);
+    long long start = get_time_ns();
+    pin_cache_t* c = NULL;
+    int shadow = GPIO_ERR;
+    int val = GPIO_ERR;
+
+    //virtual pins and brokered pins are locked by their driver or the broker, if at all
+    if (pin >= VIRTUAL_PIN_BASE || gpio_broker_fd >= GPIO_OK)
+    {
+        val = read_gpio_val(pin);
+        if (is_valid_value(val, pin) < GPIO_OK) { return GPIO_ERR; }
+        return set_gpio_val(pin, !val);
+    }
+
+    GPIO_PROBE1(read_entry, pin);
+
+    c = get_pin_cache(pin);
+    if (c == NULL) { return record_gpio_op(pin, GPIO_STAT_READ, start, 0, GPIO_ERR); }
+
+    lock_pin_cache(c);
+
+    shadow = get_gpio_shadow(c);
+    if (shadow >= GPIO_OK && gpio_shadow_mode == GPIO_SHADOW_ON)
+    { val = record_gpio_op(pin, GPIO_STAT_READ, start, 0, shadow); }
+    else { val = read_pin_value(pin, c, start); }
+
+    if (gpio_shadow_mode == GPIO_SHADOW_VERIFY && shadow >= GPIO_OK && val >= GPIO_OK &&
+        val != shadow)
+    { report_gpio_error(GPIO_E_SHADOW_MISMATCH, pin, c->kern, 0); }
+
+    if (val >= GPIO_OK)
+    {
+        GPIO_PROBE2(write_entry, pin, !val);
+        val = write_pin_value(pin, c, !val, get_time_ns());
+    }
+
+    unlock_pin_cache(c);
+
+    return val < GPIO_OK ? GPIO_ERR : val;
 }
 
 //Convenience function
@@ -158,22 +286,37 @@ int toggle_gpio_val_n(char* name)
 //set a GPIO pin's direction (input/output) by writing "in" or "out" to its direction file
 int set_gpio_dir(int pin, int out)
 {
+    long long start = get_time_ns();
+
+    GPIO_PROBE2(set_dir_entry, pin, out);
+
+    if (gpio_broker_fd >= GPIO_OK)
+    {
+        return record_gpio_op(pin, GPIO_STAT_SET_DIR, start, 2,
+                              broker_set_gpio_dir(pin, out));
+    }
+
     //open the direction file in the pin directory to write the direction
-    int pin_kern = get_kern_num(pin);
-    char* path = get_gpio_path(pin_kern, "/direction");
-    int fd = open(path, O_WRONLY);
-    
-    //free the mem used by get_gpio_path
-    free(path);
-    path = NULL;
+    pin_cache_t* c = get_pin_cache(pin);
+    if (c == NULL)
+    { return record_gpio_op(pin, GPIO_STAT_SET_DIR, start, 0, GPIO_ERR); }
+
+    //a write to the pin mustn't set the shadow between here and the new direction
+    lock_pin_cache(c);
+
+    int pin_kern = c->kern;
+    int fd = open(c->direction_path, O_WRONLY);
+
+    //the kernel may well change the value along with the direction
+    set_gpio_shadow(c, GPIO_ERR);
 
     //err check
     if (fd < GPIO_OK)
     {
-        fprintf(stderr, "Could not open pin %d (%d)'s direction: %s\n", 
-                pin, pin_kern, strerror(errno));
+        report_gpio_error(GPIO_E_OPEN, pin, pin_kern, errno);
         close(fd);
-        return GPIO_ERR;
+        unlock_pin_cache(c);
+        return record_gpio_op(pin, GPIO_STAT_SET_DIR, start, 1, GPIO_ERR);
     }
 
     //GPIO_DIR_OUT = 1
@@ -183,29 +326,32 @@ int set_gpio_dir(int pin, int out)
     {
         if (write(fd, "out", strlen("out")) < GPIO_OK)
         {
-            fprintf(stderr, "Failed to set %s to %s: %s\n", path, "out", strerror(errno));
+            report_gpio_error(GPIO_E_WRITE, pin, pin_kern, errno);
             close(fd);
-            return GPIO_ERR;
+            unlock_pin_cache(c);
+            return record_gpio_op(pin, GPIO_STAT_SET_DIR, start, 3, GPIO_ERR);
         }
     }
     else
     {
         if (write(fd, "in", sizeof("in")) < GPIO_OK)
         {
-            fprintf(stderr, "Failed to set %s to %s: %s\n", path, "in", strerror(errno));
+            report_gpio_error(GPIO_E_WRITE, pin, pin_kern, errno);
             close(fd);
-            return GPIO_ERR;
+            unlock_pin_cache(c);
+            return record_gpio_op(pin, GPIO_STAT_SET_DIR, start, 3, GPIO_ERR);
         }
     }
 
     if (close(fd) < GPIO_OK)
     {
-        fprintf(stderr, "Could not close pin %d (%d)'s direction: %s\n", 
-                pin, pin_kern, strerror(errno));
+        report_gpio_error(GPIO_E_CLOSE, pin, pin_kern, errno);
         //return GPIO_ERR; //try to continue anyway
     }
 
-    return out;
+    unlock_pin_cache(c);
+
+    return record_gpio_op(pin, GPIO_STAT_SET_DIR, start, 3, out);
 }
 
 //Convenience function
@@ -216,55 +362,77 @@ int set_gpio_dir_n(char* name, int out)
     return set_gpio_dir(pin, out);
 }
 
+int set_gpio_shadow_mode(int mode)
+{
+    if (mode != GPIO_SHADOW_OFF && mode != GPIO_SHADOW_ON && mode != GPIO_SHADOW_VERIFY)
+    {
+        fprintf(stderr, "Invalid output shadow mode %d\n", mode);
+        return GPIO_ERR;
+    }
+
+    //what was written while they were ignored (or distrusted) may be stale by now
+    if (mode != gpio_shadow_mode && pin_cache != NULL)
+    {
+        for (int i = 0; i < NUM_PINS+FIRST_PIN; i++)
+        { set_gpio_shadow(&pin_cache[i], GPIO_ERR); }
+    }
+
+    gpio_shadow_mode = mode;
+    return mode;
+}
+
+int get_gpio_shadow_mode()
+{
+    return gpio_shadow_mode;
+}
+
 int get_gpio_dir(int pin)
 {
-    int out = GPIO_ERR;
-    
-    //open the direction file in the pin directory to write the direction
-    int pin_kern = get_kern_num(pin);
-    char* path = get_gpio_path(pin_kern, "/direction");
-    int fd = open(path, O_WRONLY);
+    long long start = get_time_ns();
+    char dir_ch = '\0';
+
+    if (gpio_broker_fd >= GPIO_OK)
+    { return record_gpio_op(pin, GPIO_STAT_GET_DIR, start, 0, broker_get_gpio_dir(pin)); }
     
-    //free the mem used by get_gpio_path
-    free(path);
-    path = NULL;
+    //open the direction file in the pin directory to read the direction
+    pin_cache_t* c = get_pin_cache(pin);
+    if (c == NULL)
+    { return record_gpio_op(pin, GPIO_STAT_GET_DIR, start, 0, GPIO_ERR); }
+
+    int pin_kern = get_pin_kern(c);
+    int fd = open(get_pin_direction_path(c), O_RDONLY);
 
     //err check
     if (fd < GPIO_OK)
     {
-        fprintf(stderr, "Could not open pin %d (%d)'s direction: %s\n", 
-                pin, pin_kern, strerror(errno));
+        report_gpio_error(GPIO_E_OPEN, pin, pin_kern, errno);
         close(fd);
-        return GPIO_ERR;
+        return record_gpio_op(pin, GPIO_STAT_GET_DIR, start, 1, GPIO_ERR);
     }
 
-    //read the value from /direction
-    if (read(fd, &out, 1) < GPIO_OK)
+    //read the first character from /direction; it contains "in" or "out"
+    if (read(fd, &dir_ch, 1) < GPIO_OK)
     {
-        fprintf(stderr, "Could not read from pin %d (%d): %s\n", 
-                pin, pin_kern, strerror(errno));
+        report_gpio_error(GPIO_E_READ, pin, pin_kern, errno);
         close(fd);
-        return GPIO_ERR;
+        return record_gpio_op(pin, GPIO_STAT_GET_DIR, start, 3, GPIO_ERR);
     }
 
-    if (out != '0' && out != '1')
+    if (dir_ch != 'i' && dir_ch != 'o')
     {
-        fprintf(stderr, "Invalid direction read from pin %d (%d)\n", pin, pin_kern);
+        report_gpio_error(GPIO_E_BAD_DATA, pin, pin_kern, 0);
         close(fd);
-        return GPIO_ERR;
+        return record_gpio_op(pin, GPIO_STAT_GET_DIR, start, 3, GPIO_ERR);
     }
 
-    //Subtract by 0x30 to get numerical value
-    out -= '0';
-
     if (close(fd) < GPIO_OK)
     {
-        fprintf(stderr, "Could not close pin %d (%d)'s direction: %s\n", 
-                pin, pin_kern, strerror(errno));
-        return GPIO_ERR;
+        report_gpio_error(GPIO_E_CLOSE, pin, pin_kern, errno);
+        return record_gpio_op(pin, GPIO_STAT_GET_DIR, start, 3, GPIO_ERR);
     }
 
-    return out;
+    return record_gpio_op(pin, GPIO_STAT_GET_DIR, start, 3,
+                          dir_ch == 'o' ? GPIO_DIR_OUT : GPIO_DIR_IN);
 }
 
 int get_gpio_dir_n(char* name)
@@ -0,0 +1,463 @@
+/*
+ * Copyright (c) 2017, Bryan Haley
+ * This code is dual licensed (GPLv2 and Simplified BSD). Use the license that works
+ * best for you. Check LICENSE.GPL and LICENSE.BSD for more details.
+ *
+ * chip_gpio_shift_register.c
+ * Implementation of the shift register driver. Chains are pushed/pulled a whole buffer
+ * at a time; outputs are diffed against what the chain already holds and the data pin
+ * is only written when the next bit differs from the last one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "chip_gpio.h"
+#include "chip_gpio_utils.h"
+#include "chip_gpio_shift_register.h"
+
+#ifndef TRUE
+    #define TRUE 1
+#endif
+
+#ifndef FALSE
+    #define FALSE 0
+#endif
+
+#define BITS_PER_BYTE 8
+
+static shift_register_t* mapped_registers[MAX_SHIFT_REGISTERS]; //chains with virtual pins
+static int next_virtual_pin = VIRTUAL_PIN_BASE;
+//mapped_registers, next_virtual_pin and the chains' users
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t users_done = PTHREAD_COND_INITIALIZER;
+void* refresh_shift_register(void* arg); //function invoked on refresh_thread
+
+static inline int is_valid_shift_register(shift_register_t* sr)
+{
+    if (sr == NULL)
+    {
+        fprintf(stderr, "Tried to use a shift register that does not exist\n");
+        return GPIO_ERR;
+    }
+
+    return GPIO_OK;
+}
+
+//Pulse a clock or latch pin high then low
+static inline int pulse_pin(int pin)
+{
+    if (set_gpio_val(pin, GPIO_PIN_HIGH) < GPIO_OK) { return GPIO_ERR; }
+    return set_gpio_val(pin, GPIO_PIN_LOW);
+}
+
+//Shift buf out to a 595 chain. The caller must hold sr->lock.
+static int shift_out(shift_register_t* sr, const uint8_t* buf)
+{
+    int bit = 0;
+
+    //nothing to do if the chain already holds this buffer
+    if (sr->buffer_valid && memcmp(buf, sr->buffer, sr->num_bytes) == 0)
+    { return GPIO_OK; }
+
+    //the last register in the chain has to be shifted first, most significant bit first
+    for (int i = sr->num_bytes-1; i >= 0; i--)
+    {
+        for (int b = BITS_PER_BYTE-1; b >= 0; b--)
+        {
+            bit = (buf[i] >> b) & 1;
+
+            //only touch the data pin when the level actually has to change
+            if (bit != sr->data_level)
+            {
+                if (set_gpio_val(sr->data_pin, bit) < GPIO_OK)
+                {
+                    sr->data_level = GPIO_ERR;
+                    sr->buffer_valid = FALSE;
+                    return GPIO_ERR;
+                }
+                sr->data_level = bit;
+            }
+
+            if (pulse_pin(sr->clock_pin) < GPIO_OK)
+            {
+                sr->buffer_valid = FALSE;
+                return GPIO_ERR;
+            }
+        }
+    }
+
+    //move the shifted bits to the output pins all at once
+    if (pulse_pin(sr->latch_pin) < GPIO_OK)
+    {
+        sr->buffer_valid = FALSE;
+        return GPIO_ERR;
+    }
+
+    memcpy(sr->buffer, buf, sr->num_bytes);
+    sr->buffer_valid = TRUE;
+
+    return GPIO_OK;
+}
+
+//Load and shift a 165 chain into sr->buffer. The caller must hold sr->lock.
+static int shift_in(shift_register_t* sr)
+{
+    uint8_t buf[MAX_SHIFT_BYTES] = { 0 };
+    int bit = GPIO_ERR;
+
+    //SH/LD low captures the parallel inputs, high lets them be shifted out
+    if (set_gpio_val(sr->latch_pin, GPIO_PIN_LOW) < GPIO_OK) { return GPIO_ERR; }
+    if (set_gpio_val(sr->latch_pin, GPIO_PIN_HIGH) < GPIO_OK) { return GPIO_ERR; }
+
+    //the register closest to the CHIP comes out first, most significant bit first
+    for (int i = 0; i < sr->num_bytes; i++)
+    {
+        for (int b = BITS_PER_BYTE-1; b >= 0; b--)
+        {
+            bit = read_gpio_val(sr->data_pin);
+            if (bit < GPIO_OK) { return GPIO_ERR; }
+            buf[i] |= bit << b;
+
+            if (pulse_pin(sr->clock_pin) < GPIO_OK) { return GPIO_ERR; }
+        }
+    }
+
+    memcpy(sr->buffer, buf, sr->num_bytes);
+    sr->buffer_valid = TRUE;
+
+    return GPIO_OK;
+}
+
+shift_register_t* create_shift_register(int data_pin, int clock_pin, int latch_pin,
+                                        int num_bytes, int dir)
+{
+    shift_register_t* sr = NULL;
+
+    if (check_if_pin_exists(data_pin) < GPIO_OK ||
+        check_if_pin_exists(clock_pin) < GPIO_OK ||
+        check_if_pin_exists(latch_pin) < GPIO_OK)
+    { return NULL; }
+
+    if (num_bytes < 1 || num_bytes > MAX_SHIFT_BYTES)
+    {
+        fprintf(stderr, "Could not create a chain of %d shift registers (1 to %d are allowed)\n",
+                num_bytes, MAX_SHIFT_BYTES);
+        return NULL;
+    }
+
+    if (dir != SHIFT_OUT && dir != SHIFT_IN)
+    {
+        fprintf(stderr, "Invalid shift register direction: %d\n", dir);
+        return NULL;
+    }
+
+    sr = (shift_register_t*) calloc(1, sizeof(shift_register_t));
+    if (sr == NULL) { return NULL; }
+
+    sr->data_pin = data_pin;
+    sr->clock_pin = clock_pin;
+    sr->latch_pin = latch_pin;
+    sr->dir = dir;
+    sr->num_bytes = num_bytes;
+    sr->buffer_valid = FALSE;
+    sr->data_level = GPIO_ERR;
+    sr->refreshing = FALSE;
+    sr->users = 0;
+    sr->first_virtual_pin = GPIO_ERR;
+    pthread_mutex_init(&sr->lock, NULL);
+
+    return sr;
+}
+
+//Open the chain's pins, set their directions and drive them to their idle levels
+int setup_shift_register(shift_register_t* sr)
+{
+    if (is_valid_shift_register(sr) < GPIO_OK) { return GPIO_ERR; }
+
+    if (setup_gpio_pin(sr->data_pin, sr->dir == SHIFT_OUT ? GPIO_DIR_OUT : GPIO_DIR_IN)
+            < GPIO_OK ||
+        setup_gpio_pin(sr->clock_pin, GPIO_DIR_OUT) < GPIO_OK ||
+        setup_gpio_pin(sr->latch_pin, GPIO_DIR_OUT) < GPIO_OK)
+    { return GPIO_ERR; }
+
+    if (set_gpio_val(sr->clock_pin, GPIO_PIN_LOW) < GPIO_OK) { return GPIO_ERR; }
+
+    if (sr->dir == SHIFT_OUT)
+    {
+        if (set_gpio_val(sr->latch_pin, GPIO_PIN_LOW) < GPIO_OK) { return GPIO_ERR; }
+        if (set_gpio_val(sr->data_pin, GPIO_PIN_LOW) < GPIO_OK) { return GPIO_ERR; }
+        sr->data_level = GPIO_PIN_LOW;
+    }
+
+    //a 165 shifts while SH/LD is high
+    else if (set_gpio_val(sr->latch_pin, GPIO_PIN_HIGH) < GPIO_OK)
+    { return GPIO_ERR; }
+
+    return GPIO_OK;
+}
+
+int shift_register_write(shift_register_t* sr, const uint8_t* buf)
+{
+    int rc = GPIO_ERR;
+
+    if (is_valid_shift_register(sr) < GPIO_OK || buf == NULL) { return GPIO_ERR; }
+
+    if (sr->dir != SHIFT_OUT)
+    {
+        fprintf(stderr, "Cannot write to an input shift register chain\n");
+        return GPIO_ERR;
+    }
+
+    pthread_mutex_lock(&sr->lock);
+    memcpy(sr->pending, buf, sr->num_bytes); //keep virtual pins in sync
+    rc = shift_out(sr, buf);
+    pthread_mutex_unlock(&sr->lock);
+
+    return rc;
+}
+
+int shift_register_read(shift_register_t* sr, uint8_t* buf)
+{
+    int rc = GPIO_ERR;
+
+    if (is_valid_shift_register(sr) < GPIO_OK || buf == NULL) { return GPIO_ERR; }
+
+    pthread_mutex_lock(&sr->lock);
+
+    //an output chain can't be read back, but we know what we last shifted into it
+    if (sr->dir == SHIFT_OUT) { rc = sr->buffer_valid ? GPIO_OK : GPIO_ERR; }
+    else { rc = shift_in(sr); }
+
+    if (rc == GPIO_OK) { memcpy(buf, sr->buffer, sr->num_bytes); }
+
+    pthread_mutex_unlock(&sr->lock);
+
+    return rc;
+}
+
+//Give every bit of the chain a pin number of its own
+int map_shift_register_pins(shift_register_t* sr)
+{
+    int slot = GPIO_ERR;
+
+    if (is_valid_shift_register(sr) < GPIO_OK) { return GPIO_ERR; }
+
+    pthread_mutex_lock(&registry_lock);
+
+    if (sr->first_virtual_pin >= VIRTUAL_PIN_BASE)
+    {
+        pthread_mutex_unlock(&registry_lock);
+        return sr->first_virtual_pin;
+    }
+
+    for (int i = 0; i < MAX_SHIFT_REGISTERS; i++)
+    {
+        if (mapped_registers[i] == NULL) { slot = i; break; }
+    }
+
+    if (slot < GPIO_OK)
+    {
+        pthread_mutex_unlock(&registry_lock);
+        fprintf(stderr, "Could not map shift register pins; all %d slots are in use\n",
+                MAX_SHIFT_REGISTERS);
+        return GPIO_ERR;
+    }
+
+    //virtual pin numbers are never reused, so stale numbers can't alias a new chain
+    sr->first_virtual_pin = next_virtual_pin;
+    next_virtual_pin += sr->num_bytes*BITS_PER_BYTE;
+    mapped_registers[slot] = sr;
+
+    pthread_mutex_unlock(&registry_lock);
+
+    return sr->first_virtual_pin;
+}
+
+//Find the chain a virtual pin belongs to; it isn't freed until put_virtual_pin_register
+static shift_register_t* get_virtual_pin_register(int pin)
+{
+    shift_register_t* sr = NULL;
+
+    pthread_mutex_lock(&registry_lock);
+
+    for (int i = 0; i < MAX_SHIFT_REGISTERS; i++)
+    {
+        sr = mapped_registers[i];
+        if (sr != NULL && pin >= sr->first_virtual_pin &&
+            pin < sr->first_virtual_pin + sr->num_bytes*BITS_PER_BYTE)
+        {
+            sr->users++;
+            pthread_mutex_unlock(&registry_lock);
+            return sr;
+        }
+    }
+
+    pthread_mutex_unlock(&registry_lock);
+
+    fprintf(stderr, "Tried to access non-existant virtual pin %d\n", pin);
+    return NULL;
+}
+
+static void put_virtual_pin_register(shift_register_t* sr)
+{
+    pthread_mutex_lock(&registry_lock);
+    if (--sr->users == 0) { pthread_cond_broadcast(&users_done); }
+    pthread_mutex_unlock(&registry_lock);
+}
+
+//Invoked by set_gpio_val for pins at or above VIRTUAL_PIN_BASE
+int set_virtual_gpio_val(int pin, int val)
+{
+    shift_register_t* sr = get_virtual_pin_register(pin);
+    int bit = 0;
+    int rc = GPIO_OK;
+
+    if (sr == NULL) { return GPIO_ERR; }
+
+    if (is_valid_value(val, pin) < GPIO_OK)
+    {
+        put_virtual_pin_register(sr);
+        return GPIO_ERR;
+    }
+
+    if (sr->dir != SHIFT_OUT)
+    {
+        put_virtual_pin_register(sr);
+        fprintf(stderr, "Virtual pin %d is an input\n", pin);
+        return GPIO_ERR;
+    }
+
+    bit = pin - sr->first_virtual_pin;
+
+    pthread_mutex_lock(&sr->lock);
+
+    if (val) { sr->pending[bit/BITS_PER_BYTE] |= 1 << (bit%BITS_PER_BYTE); }
+    else { sr->pending[bit/BITS_PER_BYTE] &= ~(1 << (bit%BITS_PER_BYTE)); }
+
+    //without a refresh thread, the write goes out right away
+    if (!sr->refreshing) { rc = shift_out(sr, sr->pending); }
+
+    pthread_mutex_unlock(&sr->lock);
+    put_virtual_pin_register(sr);
+
+    return rc < GPIO_OK ? GPIO_ERR : val;
+}
+
+//Invoked by read_gpio_val for pins at or above VIRTUAL_PIN_BASE
+int read_virtual_gpio_val(int pin)
+{
+    shift_register_t* sr = get_virtual_pin_register(pin);
+    int bit = 0;
+    int val = GPIO_ERR;
+
+    if (sr == NULL) { return GPIO_ERR; }
+
+    bit = pin - sr->first_virtual_pin;
+
+    pthread_mutex_lock(&sr->lock);
+
+    //outputs report the value last requested
+    if (sr->dir == SHIFT_OUT)
+    { val = (sr->pending[bit/BITS_PER_BYTE] >> (bit%BITS_PER_BYTE)) & 1; }
+
+    //inputs are read right away unless a refresh thread keeps the buffer fresh
+    else if (sr->refreshing || shift_in(sr) == GPIO_OK)
+    { val = (sr->buffer[bit/BITS_PER_BYTE] >> (bit%BITS_PER_BYTE)) & 1; }
+
+    pthread_mutex_unlock(&sr->lock);
+    put_virtual_pin_register(sr);
+
+    return val;
+}
+
+//Keep the chain in sync with its virtual pins; runs on refresh_thread
+void* refresh_shift_register(void* arg)
+{
+    shift_register_t* sr = arg;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&sr->lock);
+        if (!sr->refreshing) { pthread_mutex_unlock(&sr->lock); break; }
+        if (sr->dir == SHIFT_OUT) { shift_out(sr, sr->pending); }
+        else { shift_in(sr); }
+        pthread_mutex_unlock(&sr->lock);
+
+        if (sr->refresh_us > 0) { usleep(sr->refresh_us); }
+    }
+
+    return NULL;
+}
+
+int start_shift_register_refresh(shift_register_t* sr, int interval_us)
+{
+    if (is_valid_shift_register(sr) < GPIO_OK) { return GPIO_ERR; }
+
+    //only one caller gets to start the thread
+    pthread_mutex_lock(&sr->lock);
+    if (sr->refreshing) { pthread_mutex_unlock(&sr->lock); return GPIO_OK; }
+    sr->refresh_us = interval_us;
+    sr->refreshing = TRUE;
+    pthread_mutex_unlock(&sr->lock);
+
+    if (pthread_create(&sr->refresh_thread, NULL, &refresh_shift_register, sr) != 0)
+    {
+        fprintf(stderr, "Could not start shift register refresh thread\n");
+        pthread_mutex_lock(&sr->lock);
+        sr->refreshing = FALSE;
+        pthread_mutex_unlock(&sr->lock);
+        return GPIO_ERR;
+    }
+
+    return GPIO_OK;
+}
+
+int stop_shift_register_refresh(shift_register_t* sr)
+{
+    int rc = GPIO_OK;
+
+    if (is_valid_shift_register(sr) < GPIO_OK) { return GPIO_ERR; }
+
+    //only one caller gets to join the thread
+    pthread_mutex_lock(&sr->lock);
+    if (!sr->refreshing) { pthread_mutex_unlock(&sr->lock); return GPIO_OK; }
+    sr->refreshing = FALSE;
+    pthread_mutex_unlock(&sr->lock);
+
+    pthread_join(sr->refresh_thread, NULL);
+
+    //flush anything written since the last refresh
+    if (sr->dir == SHIFT_OUT)
+    {
+        pthread_mutex_lock(&sr->lock);
+        rc = shift_out(sr, sr->pending);
+        pthread_mutex_unlock(&sr->lock);
+    }
+
+    return rc;
+}
+
+//Does not close the chain's pins
+int destroy_shift_register(shift_register_t* sr)
+{
+    if (is_valid_shift_register(sr) < GPIO_OK) { return GPIO_ERR; }
+
+    //no new virtual pin accesses can find it; wait for the ones in progress
+    pthread_mutex_lock(&registry_lock);
+    for (int i = 0; i < MAX_SHIFT_REGISTERS; i++)
+    {
+        if (mapped_registers[i] == sr) { mapped_registers[i] = NULL; }
+    }
+    while (sr->users > 0) { pthread_cond_wait(&users_done, &registry_lock); }
+    pthread_mutex_unlock(&registry_lock);
+
+    stop_shift_register_refresh(sr);
+
+    pthread_mutex_destroy(&sr->lock);
+    free(sr);
+
+    return GPIO_OK;
+}
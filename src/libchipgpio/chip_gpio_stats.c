@@ -0,0 +1,211 @@
+/*
+ * Copyright (c) 2017, Bryan Haley
+ * This code is dual licensed (GPLv2 and Simplified BSD). Use the license that works
+ * best for you. Check LICENSE.GPL and LICENSE.BSD for more details.
+ *
+ * chip_gpio_stats.c
+ * Implementation of the per-pin/per-operation counters. The rw, oc and callback manager
+ * code records into these through the hooks declared in chip_gpio_utils.h.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "chip_gpio.h"
+#include "chip_gpio_utils.h"
+#include "chip_gpio_pin_map.h"
+#include "chip_gpio_stats.h"
+#include "chip_gpio_probes.h"
+
+typedef struct
+{
+    atomic_ullong count;
+    atomic_ullong errors;
+    atomic_ullong syscalls;
+    atomic_ullong time_ns;
+} op_counter_t;
+
+//One per cache line, so threads using different pins don't share any
+typedef struct
+{
+    op_counter_t op[GPIO_STAT_NUM_OPS];
+    atomic_ullong events;
+    atomic_ullong events_dropped;
+} __attribute__((aligned(CACHE_LINE_SIZE))) pin_counter_t;
+
+// Pin 0 is never a real pin, so its slot collects operations on pins that don't exist
+// (which fail, but still cost time). Static storage starts zeroed, so the counters
+// work before initialize_gpio_interface is called.
+static pin_counter_t pin_counters[MAX_PIN_MAP_PINS+FIRST_PIN]; //any pin map fits
+static atomic_ullong poll_passes;
+static atomic_ullong poll_time_ns;
+
+GPIO_PROBE_LIST(DEFINE_GPIO_PROBE)
+
+static inline void add(atomic_ullong* counter, unsigned long long n)
+{
+    atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
+
+static inline uint64_t load(atomic_ullong* counter)
+{
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+static inline pin_counter_t* get_counter(int pin)
+{
+    return does_pin_exist(pin) ? &pin_counters[pin] : &pin_counters[0];
+}
+
+//Operations leave through record_gpio_op, so their exit probes fire here
+static inline void fire_exit_probe(int pin, int op, int rc, long long ns)
+{
+    switch (op)
+    {
+        case GPIO_STAT_READ:
+            if (GPIO_PROBE_ENABLED(read_exit))
+            { GPIO_PROBE4(read_exit, pin, get_cached_kern_num(pin), rc, ns); }
+            break;
+        case GPIO_STAT_WRITE:
+            if (GPIO_PROBE_ENABLED(write_exit))
+            { GPIO_PROBE4(write_exit, pin, get_cached_kern_num(pin), rc, ns); }
+            break;
+        case GPIO_STAT_SET_DIR:
+            if (GPIO_PROBE_ENABLED(set_dir_exit))
+            { GPIO_PROBE4(set_dir_exit, pin, get_cached_kern_num(pin), rc, ns); }
+            break;
+        case GPIO_STAT_OPEN:
+            if (GPIO_PROBE_ENABLED(open_exit))
+            { GPIO_PROBE4(open_exit, pin, get_cached_kern_num(pin), rc, ns); }
+            break;
+        case GPIO_STAT_CLOSE:
+            if (GPIO_PROBE_ENABLED(close_exit))
+            { GPIO_PROBE4(close_exit, pin, get_cached_kern_num(pin), rc, ns); }
+            break;
+    }
+}
+
+//Count one operation started at start_ns. Returns rc so it can wrap a return statement.
+int record_gpio_op(int pin, int op, long long start_ns, int syscalls, int rc)
+{
+    return record_gpio_op_ns(pin, op, get_time_ns()-start_ns, syscalls, rc);
+}
+
+//Count one operation that took ns
+int record_gpio_op_ns(int pin, int op, long long ns, int syscalls, int rc)
+{
+    op_counter_t* c = &get_counter(pin)->op[op];
+
+    add(&c->count, 1);
+    add(&c->syscalls, syscalls);
+    add(&c->time_ns, ns);
+    if (rc < GPIO_OK) { add(&c->errors, 1); }
+
+    fire_exit_probe(pin, op, rc, ns);
+
+    return rc;
+}
+
+void record_gpio_poll_pass(long long start_ns)
+{
+    long long ns = get_time_ns()-start_ns;
+    unsigned long long pass = atomic_fetch_add_explicit(&poll_passes, 1,
+                                                        memory_order_relaxed);
+
+    add(&poll_time_ns, ns);
+    GPIO_PROBE2(poll_pass, pass+1, ns);
+}
+
+void record_gpio_event(int pin, int dropped)
+{
+    pin_counter_t* c = get_counter(pin);
+
+    if (dropped) { add(&c->events_dropped, 1); }
+    else { add(&c->events, 1); }
+}
+
+static void copy_pin_counter(pin_counter_t* c, gpio_pin_stats_t* out)
+{
+    for (int op = 0; op < GPIO_STAT_NUM_OPS; op++)
+    {
+        out->op[op].count = load(&c->op[op].count);
+        out->op[op].errors = load(&c->op[op].errors);
+        out->op[op].syscalls = load(&c->op[op].syscalls);
+        out->op[op].time_ns = load(&c->op[op].time_ns);
+    }
+
+    out->events = load(&c->events);
+    out->events_dropped = load(&c->events_dropped);
+}
+
+//Sum every pin's counters into library-wide totals
+int get_gpio_stats(gpio_stats_t* out)
+{
+    gpio_pin_stats_t pin_stats;
+
+    if (out == NULL) { return GPIO_ERR; }
+
+    memset(out, 0, sizeof(gpio_stats_t));
+
+    for (int i = 0; i < NUM_PINS+FIRST_PIN; i++)
+    {
+        copy_pin_counter(&pin_counters[i], &pin_stats);
+
+        for (int op = 0; op < GPIO_STAT_NUM_OPS; op++)
+        {
+            out->op[op].count += pin_stats.op[op].count;
+            out->op[op].errors += pin_stats.op[op].errors;
+            out->op[op].syscalls += pin_stats.op[op].syscalls;
+            out->op[op].time_ns += pin_stats.op[op].time_ns;
+        }
+
+        out->events += pin_stats.events;
+        out->events_dropped += pin_stats.events_dropped;
+    }
+
+    out->poll_passes = load(&poll_passes);
+    out->poll_time_ns = load(&poll_time_ns);
+
+    return GPIO_OK;
+}
+
+int get_gpio_pin_stats(int pin, gpio_pin_stats_t* out)
+{
+    if (check_if_pin_exists(pin) < GPIO_OK || out == NULL)
+    { return GPIO_ERR; }
+
+    copy_pin_counter(&pin_counters[pin], out);
+    out->pin = pin;
+
+    return GPIO_OK;
+}
+
+int get_gpio_pin_stats_n(char* name, gpio_pin_stats_t* out)
+{
+    int pin = get_pin_from_name(name);
+    if (pin < GPIO_OK) { return GPIO_ERR; }
+    return get_gpio_pin_stats(pin, out);
+}
+
+int reset_gpio_stats()
+{
+    for (int i = 0; i < NUM_PINS+FIRST_PIN; i++)
+    {
+        for (int op = 0; op < GPIO_STAT_NUM_OPS; op++)
+        {
+            atomic_store_explicit(&pin_counters[i].op[op].count, 0, memory_order_relaxed);
+            atomic_store_explicit(&pin_counters[i].op[op].errors, 0, memory_order_relaxed);
+            atomic_store_explicit(&pin_counters[i].op[op].syscalls, 0,
+                                  memory_order_relaxed);
+            atomic_store_explicit(&pin_counters[i].op[op].time_ns, 0, memory_order_relaxed);
+        }
+
+        atomic_store_explicit(&pin_counters[i].events, 0, memory_order_relaxed);
+        atomic_store_explicit(&pin_counters[i].events_dropped, 0, memory_order_relaxed);
+    }
+
+    atomic_store_explicit(&poll_passes, 0, memory_order_relaxed);
+    atomic_store_explicit(&poll_time_ns, 0, memory_order_relaxed);
+
+    return GPIO_OK;
+}
@@ -0,0 +1,546 @@
+/*
+ * Copyright (c) 2017, Bryan Haley
+ * This code is dual licensed (GPLv2 and Simplified BSD). Use the license that works
+ * best for you. Check LICENSE.GPL and LICENSE.BSD for more details.
+ *
+ * chip_gpio_stepper.c
+ * Implementation of the stepper motion engine. A move is turned into a schedule of
+ * (time, axes) step events up front, so the emitting thread only has to sleep until
+ * each absolute deadline and pulse the STEP pins; nothing is calculated while stepping.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include "chip_gpio.h"
+#include "chip_gpio_utils.h"
+#include "chip_gpio_stepper.h"
+
+#ifndef TRUE
+    #define TRUE 1
+#endif
+
+#ifndef FALSE
+    #define FALSE 0
+#endif
+
+#define BISECTION_STEPS 48 //plenty to resolve an S-curve step time to well under 1 ns
+#define DEFAULT_MAX_SPEED 1000.0
+#define DEFAULT_ACCEL 4000.0
+#define DEFAULT_PULSE_WIDTH_US 2
+
+//struct describing how far along a move is at any point in time
+typedef struct
+{
+    int profile;
+    double dist; //steps travelled by the axis going furthest
+    double vpeak; //highest speed actually reached
+    double accel; //average acceleration
+    double ta; //time spent accelerating (and decelerating)
+    double da; //distance covered accelerating (and decelerating)
+    double total; //duration of the whole move
+} motion_profile_t;
+
+//one entry in a schedule; every axis in mask steps at t_ns after the move starts
+typedef struct
+{
+    long long t_ns;
+    uint32_t mask;
+} step_event_t;
+
+static int num_axes;
+static int step_pins[MAX_STEPPER_AXES];
+static int dir_pins[MAX_STEPPER_AXES];
+static int dir_sign[MAX_STEPPER_AXES]; //+1 or -1 for the current move
+
+static int profile_type = STEPPER_PROFILE_TRAPEZOID;
+static double max_speed = DEFAULT_MAX_SPEED;
+static double max_accel = DEFAULT_ACCEL;
+static int pulse_width_us = DEFAULT_PULSE_WIDTH_US;
+static int priority;
+
+static step_event_t* schedule; //events of the current/last move
+static size_t schedule_len;
+static pthread_t emit_thread; //schedules are emitted on a separate thread
+static int thread_started; //bool indicating if emit_thread needs to be joined
+
+//read without locks by the status functions
+static atomic_llong positions[MAX_STEPPER_AXES];
+static atomic_int running;
+static atomic_int abort_move;
+static atomic_ullong steps_done;
+static atomic_ullong steps_total;
+static atomic_int move_failed;
+static atomic_ullong late_events;
+static atomic_llong max_late_ns;
+static atomic_llong total_late_ns;
+
+void* emit_schedule(void* arg); //function invoked on emit_thread
+
+static inline int is_valid_axis(int axis)
+{
+    if (axis < 0 || axis >= num_axes)
+    {
+        fprintf(stderr, "Stepper axis %d does not exist\n", axis);
+        return GPIO_ERR;
+    }
+
+    return GPIO_OK;
+}
+
+// Fit the profile to a move; a short move may never reach max_speed (triangle profile).
+// The S-curve's acceleration peaks at 1.5 times its average halfway through the ramp, so
+// its ramp is made 1.5 times longer to keep that peak at max_accel.
+static void plan_profile(motion_profile_t* p, double dist)
+{
+    double stretch = profile_type == STEPPER_PROFILE_S_CURVE ? 1.5 : 1.0;
+
+    p->profile = profile_type;
+    p->dist = dist;
+    p->accel = max_accel;
+    p->vpeak = max_speed;
+    p->ta = stretch*p->vpeak/p->accel;
+    p->da = p->vpeak*p->ta/2; //same for both profiles, the S-curve ramp is symmetric
+
+    if (2*p->da > dist)
+    {
+        p->vpeak = sqrt(dist*p->accel/stretch);
+        p->ta = stretch*p->vpeak/p->accel;
+        p->da = dist/2;
+    }
+
+    p->total = 2*p->ta + (dist - 2*p->da)/p->vpeak;
+}
+
+//Distance covered t seconds into the acceleration phase
+static double accel_position(motion_profile_t* p, double t)
+{
+    double x = t/p->ta;
+
+    //constant acceleration
+    if (p->profile == STEPPER_PROFILE_TRAPEZOID) { return 0.5*p->accel*t*t; }
+
+    //speed follows a smoothstep (3x^2 - 2x^3), so acceleration starts and ends at 0
+    return p->vpeak*p->ta*(x*x*x - x*x*x*x/2);
+}
+
+//Time at which distance s is reached during the acceleration phase
+static double accel_time(motion_profile_t* p, double s)
+{
+    double lo = 0.0;
+    double hi = p->ta;
+    double mid = 0.0;
+
+    if (p->profile == STEPPER_PROFILE_TRAPEZOID) { return sqrt(2*s/p->accel); }
+
+    //the S-curve has no tidy inverse, but position is monotonic so bisect
+    for (int i = 0; i < BISECTION_STEPS; i++)
+    {
+        mid = (lo+hi)/2;
+        if (accel_position(p, mid) < s) { lo = mid; }
+        else { hi = mid; }
+    }
+
+    return (lo+hi)/2;
+}
+
+//Time at which distance s is reached during the whole move
+static double time_at(motion_profile_t* p, double s)
+{
+    if (s <= p->da) { return accel_time(p, s); }
+    if (s <= p->dist - p->da) { return p->ta + (s - p->da)/p->vpeak; }
+
+    //deceleration mirrors acceleration
+    return p->total - accel_time(p, p->dist - s);
+}
+
+static int compare_events(const void* a, const void* b)
+{
+    long long ta = ((const step_event_t*) a)->t_ns;
+    long long tb = ((const step_event_t*) b)->t_ns;
+    return (ta > tb) - (ta < tb);
+}
+
+//Turn a move into a time-ordered list of step events
+static int build_schedule(const int64_t* steps)
+{
+    motion_profile_t profile;
+    long long n = 0;
+    long long dist = 0;
+    size_t total = 0;
+    size_t len = 0;
+    step_event_t* events = NULL;
+
+    for (int a = 0; a < num_axes; a++)
+    {
+        n = llabs(steps[a]);
+        total += n;
+        if (n > dist) { dist = n; }
+    }
+
+    free(schedule);
+    schedule = NULL;
+    schedule_len = 0;
+
+    if (!total) { return GPIO_OK; }
+
+    events = (step_event_t*) malloc(total*sizeof(step_event_t));
+    if (events == NULL)
+    {
+        fprintf(stderr, "Could not allocate a schedule of %zu steps\n", total);
+        return GPIO_ERR;
+    }
+
+    plan_profile(&profile, dist);
+
+    //every axis covers the whole move; the k-th of its n steps happens when the
+    //furthest-travelling axis is (k-0.5)/n of the way there
+    for (int a = 0; a < num_axes; a++)
+    {
+        n = llabs(steps[a]);
+        for (long long k = 1; k <= n; k++)
+        {
+            events[len].t_ns = llround(time_at(&profile, (k-0.5)*dist/n)*NS_PER_SEC);
+            events[len].mask = (uint32_t) 1 << a;
+            len++;
+        }
+    }
+
+    qsort(events, len, sizeof(step_event_t), compare_events);
+
+    //axes stepping at the same instant share an event
+    total = len;
+    len = 0;
+    for (size_t i = 0; i < total; i++)
+    {
+        if (len && events[len-1].t_ns == events[i].t_ns)
+        { events[len-1].mask |= events[i].mask; }
+        else
+        { events[len++] = events[i]; }
+    }
+
+    schedule = events;
+    schedule_len = len;
+
+    return GPIO_OK;
+}
+
+static inline void sleep_until(long long deadline_ns)
+{
+    struct timespec ts;
+    ts.tv_sec = deadline_ns/NS_PER_SEC;
+    ts.tv_nsec = deadline_ns%NS_PER_SEC;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) { }
+}
+
+//Pulse STEP pins on schedule; runs on emit_thread
+void* emit_schedule(void* arg)
+{
+    long long start = get_time_ns();
+    long long deadline = 0;
+    long long late = 0;
+    uint32_t mask = 0;
+    uint32_t stepped = 0;
+    int a = 0;
+    int failed = FALSE;
+
+    (void) arg;
+
+    for (size_t i = 0; i < schedule_len; i++)
+    {
+        if (atomic_load_explicit(&abort_move, memory_order_relaxed)) { break; }
+
+        deadline = start + schedule[i].t_ns;
+        sleep_until(deadline);
+
+        //keep track of how far off the ideal profile we are
+        late = get_time_ns() - deadline;
+        atomic_fetch_add_explicit(&late_events, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&total_late_ns, late, memory_order_relaxed);
+        if (late > atomic_load_explicit(&max_late_ns, memory_order_relaxed))
+        { atomic_store_explicit(&max_late_ns, late, memory_order_relaxed); }
+
+        //only axes whose STEP pin went high have taken a step
+        stepped = 0;
+        for (mask = schedule[i].mask; mask; mask &= mask-1)
+        {
+            a = __builtin_ctz(mask);
+            if (set_gpio_val(step_pins[a], GPIO_PIN_HIGH) < GPIO_OK) { failed = TRUE; }
+            else { stepped |= (uint32_t) 1 << a; }
+        }
+
+        if (pulse_width_us > 0) { sleep_until(get_time_ns() + pulse_width_us*NS_PER_US); }
+
+        for (mask = stepped; mask; mask &= mask-1)
+        {
+            a = __builtin_ctz(mask);
+            if (set_gpio_val(step_pins[a], GPIO_PIN_LOW) < GPIO_OK) { failed = TRUE; }
+            atomic_fetch_add_explicit(&positions[a], dir_sign[a], memory_order_relaxed);
+            atomic_fetch_add_explicit(&steps_done, 1, memory_order_relaxed);
+        }
+
+        //the error itself was reported by set_gpio_val; don't carry on without a pin
+        if (failed)
+        {
+            atomic_store_explicit(&move_failed, TRUE, memory_order_relaxed);
+            break;
+        }
+    }
+
+    atomic_store_explicit(&running, FALSE, memory_order_release);
+
+    return NULL;
+}
+
+int add_stepper_axis(int step_pin, int dir_pin)
+{
+    if (num_axes >= MAX_STEPPER_AXES)
+    {
+        fprintf(stderr, "Could not add stepper axis; all %d axes are in use\n",
+                MAX_STEPPER_AXES);
+        return GPIO_ERR;
+    }
+
+    if (atomic_load(&running))
+    {
+        fprintf(stderr, "Cannot add a stepper axis while a move is running\n");
+        return GPIO_ERR;
+    }
+
+    if (setup_gpio_pin(step_pin, GPIO_DIR_OUT) < GPIO_OK ||
+        setup_gpio_pin(dir_pin, GPIO_DIR_OUT) < GPIO_OK)
+    { return GPIO_ERR; }
+
+    if (set_gpio_val(step_pin, GPIO_PIN_LOW) < GPIO_OK) { return GPIO_ERR; }
+
+    step_pins[num_axes] = step_pin;
+    dir_pins[num_axes] = dir_pin;
+    dir_sign[num_axes] = 1;
+    atomic_store(&positions[num_axes], 0);
+
+    return num_axes++;
+}
+
+//Convenience function; converts pin names to numerical values and passes them to above
+int add_stepper_axis_n(char* step_pin_name, char* dir_pin_name)
+{
+    int step_pin = get_gpio_pin_num_from_name(step_pin_name);
+    int dir_pin = get_gpio_pin_num_from_name(dir_pin_name);
+    if (step_pin < GPIO_OK || dir_pin < GPIO_OK) { return GPIO_ERR; }
+    return add_stepper_axis(step_pin, dir_pin);
+}
+
+int set_stepper_profile(int profile, double speed, double accel)
+{
+    if (profile != STEPPER_PROFILE_TRAPEZOID && profile != STEPPER_PROFILE_S_CURVE)
+    {
+        fprintf(stderr, "Invalid stepper profile: %d\n", profile);
+        return GPIO_ERR;
+    }
+
+    if (speed <= 0 || accel <= 0)
+    {
+        fprintf(stderr, "Stepper speed and acceleration must be above 0\n");
+        return GPIO_ERR;
+    }
+
+    //takes effect on the next move
+    profile_type = profile;
+    max_speed = speed;
+    max_accel = accel;
+
+    return GPIO_OK;
+}
+
+int set_stepper_pulse_width(int new_pulse_width_us)
+{
+    pulse_width_us = new_pulse_width_us > 0 ? new_pulse_width_us : 0;
+    return pulse_width_us;
+}
+
+int set_stepper_priority(int rt_priority)
+{
+    if (rt_priority < 0 || rt_priority > sched_get_priority_max(SCHED_FIFO))
+    {
+        fprintf(stderr, "Invalid real-time priority: %d\n", rt_priority);
+        return GPIO_ERR;
+    }
+
+    priority = rt_priority;
+    return GPIO_OK;
+}
+
+//create the thread the schedule is emitted on, real-time if requested
+static int start_emit_thread()
+{
+    pthread_attr_t attr;
+    struct sched_param param;
+
+    if (priority > 0)
+    {
+        pthread_attr_init(&attr);
+        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+        param.sched_priority = priority;
+        pthread_attr_setschedparam(&attr, &param);
+
+        if (pthread_create(&emit_thread, &attr, &emit_schedule, NULL) == 0)
+        {
+            pthread_attr_destroy(&attr);
+            return GPIO_OK;
+        }
+
+        pthread_attr_destroy(&attr);
+        fprintf(stderr, "Warning: could not use real-time priority for stepper moves (are you root?)\n");
+    }
+
+    if (pthread_create(&emit_thread, NULL, &emit_schedule, NULL) != 0)
+    {
+        fprintf(stderr, "Could not start stepper thread\n");
+        return GPIO_ERR;
+    }
+
+    return GPIO_OK;
+}
+
+int move_steppers(const int64_t* steps)
+{
+    uint64_t total = 0;
+
+    if (steps == NULL) { return GPIO_ERR; }
+
+    if (atomic_load(&running))
+    {
+        fprintf(stderr, "Cannot start a move while another is running\n");
+        return GPIO_ERR;
+    }
+
+    //the last move finished on its own but its thread still needs cleaning up
+    wait_for_steppers();
+
+    //the whole schedule is built up front, so its size has to be bounded
+    for (int a = 0; a < num_axes; a++)
+    {
+        if (steps[a] > MAX_STEPPER_MOVE_STEPS || steps[a] < -MAX_STEPPER_MOVE_STEPS)
+        { total = MAX_STEPPER_MOVE_STEPS+1; break; }
+        total += llabs(steps[a]);
+    }
+
+    if (total > MAX_STEPPER_MOVE_STEPS)
+    {
+        fprintf(stderr, "Cannot schedule a move of more than %d steps\n",
+                MAX_STEPPER_MOVE_STEPS);
+        return GPIO_ERR;
+    }
+
+    //set directions before any step goes out
+    for (int a = 0; a < num_axes; a++)
+    {
+        if (!steps[a]) { continue; }
+        dir_sign[a] = steps[a] > 0 ? 1 : -1;
+        if (set_gpio_val(dir_pins[a], steps[a] > 0) < GPIO_OK) { return GPIO_ERR; }
+    }
+
+    if (build_schedule(steps) < GPIO_OK) { return GPIO_ERR; }
+
+    atomic_store(&steps_done, 0);
+    atomic_store(&steps_total, total);
+    atomic_store(&late_events, 0);
+    atomic_store(&max_late_ns, 0);
+    atomic_store(&total_late_ns, 0);
+    atomic_store(&abort_move, FALSE);
+    atomic_store(&move_failed, FALSE);
+
+    if (!schedule_len) { return GPIO_OK; }
+
+    atomic_store_explicit(&running, TRUE, memory_order_release);
+    if (start_emit_thread() < GPIO_OK)
+    {
+        atomic_store(&running, FALSE);
+        return GPIO_ERR;
+    }
+    thread_started = TRUE;
+
+    return GPIO_OK;
+}
+
+//Convenience function for moving a single axis
+int move_stepper(int axis, int64_t steps)
+{
+    int64_t all_steps[MAX_STEPPER_AXES] = { 0 };
+
+    if (is_valid_axis(axis) < GPIO_OK) { return GPIO_ERR; }
+
+    all_steps[axis] = steps;
+    return move_steppers(all_steps);
+}
+
+//Block until the current move has finished
+int wait_for_steppers()
+{
+    if (thread_started)
+    {
+        pthread_join(emit_thread, NULL);
+        thread_started = FALSE;
+    }
+
+    return atomic_load(&move_failed) ? GPIO_ERR : GPIO_OK;
+}
+
+//Abandon the current move; the position reflects the steps actually taken
+int stop_steppers()
+{
+    atomic_store(&abort_move, TRUE);
+    return wait_for_steppers();
+}
+
+int get_stepper_status(stepper_status_t* out)
+{
+    if (out == NULL) { return GPIO_ERR; }
+
+    out->running = atomic_load_explicit(&running, memory_order_acquire);
+    out->num_axes = num_axes;
+    for (int a = 0; a < MAX_STEPPER_AXES; a++)
+    { out->position[a] = atomic_load_explicit(&positions[a], memory_order_relaxed); }
+    out->steps_done = atomic_load_explicit(&steps_done, memory_order_relaxed);
+    out->steps_total = atomic_load_explicit(&steps_total, memory_order_relaxed);
+    out->failed = atomic_load_explicit(&move_failed, memory_order_relaxed);
+
+    return GPIO_OK;
+}
+
+int64_t get_stepper_position(int axis)
+{
+    if (axis < 0 || axis >= MAX_STEPPER_AXES) { return 0; }
+    return atomic_load_explicit(&positions[axis], memory_order_relaxed);
+}
+
+int get_stepper_timing(stepper_timing_t* out)
+{
+    if (out == NULL) { return GPIO_ERR; }
+
+    out->events = atomic_load_explicit(&late_events, memory_order_relaxed);
+    out->max_late_ns = atomic_load_explicit(&max_late_ns, memory_order_relaxed);
+    out->mean_late_ns = out->events ?
+        atomic_load_explicit(&total_late_ns, memory_order_relaxed)/(int64_t) out->events :
+        0;
+
+    return GPIO_OK;
+}
+
+int terminate_steppers()
+{
+    stop_steppers();
+
+    free(schedule);
+    schedule = NULL;
+    schedule_len = 0;
+    num_axes = 0;
+
+    return GPIO_OK;
+}
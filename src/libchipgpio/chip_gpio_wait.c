@@ -0,0 +1,513 @@
+/*
+ * Copyright (c) 2017, Bryan Haley
+ * This code is dual licensed (GPLv2 and Simplified BSD). Use the license that works
+ * best for you. Check LICENSE.GPL and LICENSE.BSD for more details.
+ *
+ * chip_gpio_wait.c
+ * Implementation of waiting for edges (chip_gpio_wait.h).
+ *  Note: a waiter is an epoll instance holding the value fds of its interrupt capable
+ *  pins, plus (created as needed) one inotify fd for the pins of a fake tree and one
+ *  timerfd for the pins that have to be read every so often. Its fd is the epoll fd,
+ *  so it can itself be polled by an event loop.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/timerfd.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+#include "chip_gpio.h"
+#include "chip_gpio_utils.h"
+#include "chip_gpio_stats.h"
+#include "chip_gpio_shift_register.h"
+#include "chip_gpio_wait.h"
+
+#ifndef TRUE
+    #define TRUE 1
+#endif
+#ifndef FALSE
+    #define FALSE 0
+#endif
+
+#define WAIT_IRQ 0 //poll() on the value file, after setting the edge file
+#define WAIT_INOTIFY 1 //the value file isn't in sysfs; watch it for writes
+#define WAIT_SAMPLE 2 //read every GPIO_WAIT_SAMPLE_NS
+
+//epoll data of the waiter's own fds; value fds use their pin number
+#define EPOLL_INOTIFY -1
+#define EPOLL_TIMER -2
+
+typedef struct
+{
+    int pin;
+    int edges;
+    int mode; //WAIT_*, or GPIO_ERR until set up
+    int fd; //value fd (WAIT_IRQ and WAIT_INOTIFY), or GPIO_ERR
+    int wd; //inotify watch (WAIT_INOTIFY), or GPIO_ERR
+    int last_val;
+    int pending; //bool; written to (WAIT_INOTIFY) but not read yet
+} gpio_wait_t;
+
+struct gpio_waiter
+{
+    int epoll_fd;
+    int inotify_fd; //GPIO_ERR until a WAIT_INOTIFY pin is added
+    int timer_fd; //GPIO_ERR until a WAIT_SAMPLE pin is added
+    int num_sampled;
+    int num_waits;
+    gpio_wait_t waits[MAX_GPIO_WAITS];
+};
+
+static gpio_wait_t* find_wait(gpio_waiter_t* waiter, int pin)
+{
+    for (int i = 0; i < waiter->num_waits; i++)
+    {
+        if (waiter->waits[i].pin == pin) { return &waiter->waits[i]; }
+    }
+
+    return NULL;
+}
+
+static int epoll_add(gpio_waiter_t* waiter, int fd, unsigned events, int data)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = data;
+
+    return epoll_ctl(waiter->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+//Start or stop the sampling timer; it only runs while there are pins to sample
+static void arm_timer(gpio_waiter_t* waiter)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    if (waiter->num_sampled > 0)
+    {
+        its.it_interval.tv_nsec = GPIO_WAIT_SAMPLE_NS;
+        its.it_value.tv_nsec = GPIO_WAIT_SAMPLE_NS;
+    }
+
+    timerfd_settime(waiter->timer_fd, 0, &its, NULL);
+}
+
+//Read the value of a waited on pin. Returns GPIO_ERR if it couldn't be read.
+static int read_wait_val(gpio_wait_t* w)
+{
+    long long start = 0;
+    char buf[2];
+    ssize_t len = 0;
+
+    if (w->mode == WAIT_SAMPLE) { return read_gpio_val(w->pin); }
+
+    //reading (from the start) is also what rearms poll() on a sysfs value file
+    start = get_time_ns();
+    len = pread(w->fd, buf, sizeof(buf), 0);
+    if (len < 1)
+    {
+        return record_gpio_op(w->pin, GPIO_STAT_READ, start, 1,
+                              report_gpio_error(len < 0 ? GPIO_E_READ : GPIO_E_BAD_DATA,
+                                                w->pin, get_cached_kern_num(w->pin),
+                                                len < 0 ? errno : 0));
+    }
+
+    if (buf[0] != '0' && buf[0] != '1')
+    {
+        return record_gpio_op(w->pin, GPIO_STAT_READ, start, 1,
+                              report_gpio_error(GPIO_E_BAD_DATA, w->pin,
+                                                get_cached_kern_num(w->pin), 0));
+    }
+
+    return record_gpio_op(w->pin, GPIO_STAT_READ, start, 1, buf[0] - '0');
+}
+
+//Ask sysfs to raise poll() events on both edges of a pin (its edge file is next to its
+//value file). Returns GPIO_ERR if the pin can't do it.
+static int set_edge_file(char* value_path)
+{
+    size_t len = strlen(value_path);
+    char edge_path[PATH_MAX];
+    int fd = GPIO_ERR;
+    int rc = GPIO_ERR;
+
+    if (len >= sizeof(edge_path)) { return GPIO_ERR; }
+
+    //value_path ends in "/value"
+    memcpy(edge_path, value_path, len+1);
+    strcpy(edge_path + len - strlen("value"), "edge");
+
+    fd = open(edge_path, O_WRONLY | O_CLOEXEC);
+    if (fd < GPIO_OK) { return GPIO_ERR; }
+
+    if (write(fd, "both", 4) == 4) { rc = GPIO_OK; }
+    close(fd);
+
+    return rc;
+}
+
+//Work out how to wait on a pin and set it up
+static int setup_wait(gpio_waiter_t* waiter, gpio_wait_t* w)
+{
+    pin_cache_t* c = NULL;
+    struct statfs fs;
+    int mode = WAIT_SAMPLE;
+
+    w->fd = GPIO_ERR;
+    w->wd = GPIO_ERR;
+    w->mode = GPIO_ERR;
+    w->pending = FALSE;
+
+    if (w->pin < VIRTUAL_PIN_BASE && gpio_broker_fd < GPIO_OK)
+    {
+        c = get_pin_cache(w->pin);
+        if (c == NULL) { return GPIO_ERR; }
+
+        w->fd = open(get_pin_value_path(c), O_RDONLY | O_CLOEXEC);
+        if (w->fd < GPIO_OK)
+        { return report_gpio_error(GPIO_E_OPEN, w->pin, c->kern, errno); }
+
+        if (fstatfs(w->fd, &fs) == 0 && fs.f_type != SYSFS_MAGIC) { mode = WAIT_INOTIFY; }
+        else if (set_edge_file(get_pin_value_path(c)) == GPIO_OK) { mode = WAIT_IRQ; }
+    }
+
+    if (mode == WAIT_IRQ)
+    {
+        if (epoll_add(waiter, w->fd, EPOLLPRI | EPOLLERR, w->pin) < GPIO_OK)
+        { return GPIO_ERR; }
+    }
+    else if (mode == WAIT_INOTIFY)
+    {
+        if (waiter->inotify_fd < GPIO_OK)
+        {
+            waiter->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            if (waiter->inotify_fd < GPIO_OK) { return GPIO_ERR; }
+            if (epoll_add(waiter, waiter->inotify_fd, EPOLLIN, EPOLL_INOTIFY) < GPIO_OK)
+            { return GPIO_ERR; }
+        }
+
+        w->wd = inotify_add_watch(waiter->inotify_fd, get_pin_value_path(c), IN_MODIFY);
+        if (w->wd < GPIO_OK) { return GPIO_ERR; }
+    }
+    else
+    {
+        if (w->fd >= GPIO_OK) { close(w->fd); }
+        w->fd = GPIO_ERR;
+
+        if (waiter->timer_fd < GPIO_OK)
+        {
+            waiter->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+                                              TFD_NONBLOCK | TFD_CLOEXEC);
+            if (waiter->timer_fd < GPIO_OK) { return GPIO_ERR; }
+            if (epoll_add(waiter, waiter->timer_fd, EPOLLIN, EPOLL_TIMER) < GPIO_OK)
+            { return GPIO_ERR; }
+        }
+
+        waiter->num_sampled++;
+        if (waiter->num_sampled == 1) { arm_timer(waiter); }
+    }
+
+    w->mode = mode;
+
+    //watching starts before this read, so no edge after it is missed
+    w->last_val = read_wait_val(w);
+
+    return w->last_val < GPIO_OK ? GPIO_ERR : GPIO_OK;
+}
+
+static void teardown_wait(gpio_waiter_t* waiter, gpio_wait_t* w)
+{
+    if (w->wd >= GPIO_OK) { inotify_rm_watch(waiter->inotify_fd, w->wd); }
+    if (w->fd >= GPIO_OK) { close(w->fd); } //also takes it out of the epoll set
+
+    if (w->mode == WAIT_SAMPLE)
+    {
+        waiter->num_sampled--;
+        if (waiter->num_sampled == 0) { arm_timer(waiter); }
+    }
+
+    w->fd = GPIO_ERR;
+    w->wd = GPIO_ERR;
+    w->mode = GPIO_ERR;
+}
+
+gpio_waiter_t* create_gpio_waiter()
+{
+    gpio_waiter_t* waiter = (gpio_waiter_t*) malloc(sizeof(gpio_waiter_t));
+
+    if (waiter == NULL) { return NULL; }
+
+    memset(waiter, 0, sizeof(gpio_waiter_t));
+    waiter->inotify_fd = GPIO_ERR;
+    waiter->timer_fd = GPIO_ERR;
+    waiter->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (waiter->epoll_fd < GPIO_OK)
+    {
+        free(waiter);
+        return NULL;
+    }
+
+    return waiter;
+}
+
+int free_gpio_waiter(gpio_waiter_t* waiter)
+{
+    if (waiter == NULL) { return GPIO_ERR; }
+
+    for (int i = 0; i < waiter->num_waits; i++)
+    { teardown_wait(waiter, &waiter->waits[i]); }
+
+    if (waiter->inotify_fd >= GPIO_OK) { close(waiter->inotify_fd); }
+    if (waiter->timer_fd >= GPIO_OK) { close(waiter->timer_fd); }
+    close(waiter->epoll_fd);
+    free(waiter);
+
+    return GPIO_OK;
+}
+
+int add_gpio_wait(gpio_waiter_t* waiter, int pin, int edges)
+{
+    gpio_wait_t* w = NULL;
+
+    if (waiter == NULL || edges & ~GPIO_EDGE_BOTH || !edges) { return GPIO_ERR; }
+
+    if (pin < VIRTUAL_PIN_BASE && check_if_pin_exists(pin) < GPIO_OK) { return GPIO_ERR; }
+
+    //already waited on; just change which edges count
+    w = find_wait(waiter, pin);
+    if (w != NULL)
+    {
+        w->edges = edges;
+        return GPIO_OK;
+    }
+
+    if (waiter->num_waits == MAX_GPIO_WAITS)
+    {
+        fprintf(stderr, "A waiter can't wait on more than %d pins\n", MAX_GPIO_WAITS);
+        return GPIO_ERR;
+    }
+
+    w = &waiter->waits[waiter->num_waits];
+    w->pin = pin;
+    w->edges = edges;
+
+    if (setup_wait(waiter, w) < GPIO_OK)
+    {
+        teardown_wait(waiter, w);
+        return GPIO_ERR;
+    }
+
+    waiter->num_waits++;
+
+    return GPIO_OK;
+}
+
+int add_gpio_wait_n(gpio_waiter_t* waiter, char* name, int edges)
+{
+    int pin = get_pin_from_name(name);
+    if (pin < GPIO_OK) { return GPIO_ERR; }
+    return add_gpio_wait(waiter, pin, edges);
+}
+
+int remove_gpio_wait(gpio_waiter_t* waiter, int pin)
+{
+    gpio_wait_t* w = NULL;
+
+    if (waiter == NULL) { return GPIO_ERR; }
+
+    w = find_wait(waiter, pin);
+    if (w == NULL) { return GPIO_ERR; }
+
+    teardown_wait(waiter, w);
+    *w = waiter->waits[--waiter->num_waits];
+
+    return GPIO_OK;
+}
+
+int remove_gpio_wait_n(gpio_waiter_t* waiter, char* name)
+{
+    int pin = get_pin_from_name(name);
+    if (pin < GPIO_OK) { return GPIO_ERR; }
+    return remove_gpio_wait(waiter, pin);
+}
+
+int get_gpio_waiter_fd(gpio_waiter_t* waiter)
+{
+    if (waiter == NULL) { return GPIO_ERR; }
+    return waiter->epoll_fd;
+}
+
+// Read a pin that may have changed, and add an edge to out if it's one that counts.
+// Returns FALSE, leaving the pin unread, if out is full.
+static int check_wait(gpio_wait_t* w, gpio_edge_t* out, int max, int* n)
+{
+    int val = GPIO_ERR;
+    int edge = GPIO_EDGE_FALLING;
+
+    if (*n >= max) { return FALSE; }
+
+    //failed reads are skipped (and recorded); the next good one is compared instead
+    val = read_wait_val(w);
+    if (val < GPIO_OK || val == w->last_val) { return TRUE; }
+    if (val) { edge = GPIO_EDGE_RISING; }
+
+    if (w->edges & edge)
+    {
+        out[*n].pin = w->pin;
+        out[*n].new_val = val;
+        out[*n].time_ns = get_time_ns();
+        (*n)++;
+    }
+
+    w->last_val = val;
+
+    return TRUE;
+}
+
+int read_gpio_waiter_edges(gpio_waiter_t* waiter, gpio_edge_t* edges, int max)
+{
+    struct epoll_event evs[MAX_GPIO_WAITS+2];
+    char buf[sizeof(struct inotify_event)*MAX_GPIO_WAITS]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    uint64_t ticks = 0;
+    int num_evs = 0;
+    int n = 0;
+
+    if (waiter == NULL || edges == NULL || max < 0) { return GPIO_ERR; }
+
+    num_evs = epoll_wait(waiter->epoll_fd, evs, MAX_GPIO_WAITS+2, 0);
+
+    for (int i = 0; i < num_evs; i++)
+    {
+        gpio_wait_t* w = NULL;
+        ssize_t len = 0;
+
+        if (evs[i].data.fd == EPOLL_INOTIFY)
+        {
+            //several writes to one file may be one event; the pin is read once anyway
+            while ((len = read(waiter->inotify_fd, buf, sizeof(buf))) > 0)
+            {
+                for (char* p = buf; p < buf+len;
+                     p += sizeof(struct inotify_event) + ((struct inotify_event*) p)->len)
+                {
+                    int wd = ((struct inotify_event*) p)->wd;
+
+                    for (int j = 0; j < waiter->num_waits; j++)
+                    {
+                        if (waiter->waits[j].wd == wd)
+                        { waiter->waits[j].pending = TRUE; }
+                    }
+                }
+            }
+        }
+        else if (evs[i].data.fd == EPOLL_TIMER)
+        {
+            if (read(waiter->timer_fd, &ticks, sizeof(ticks)) < 0) { continue; }
+
+            for (int j = 0; j < waiter->num_waits; j++)
+            {
+                if (waiter->waits[j].mode == WAIT_SAMPLE)
+                { check_wait(&waiter->waits[j], edges, max, &n); }
+            }
+        }
+        else
+        {
+            w = find_wait(waiter, evs[i].data.fd);
+            if (w != NULL) { check_wait(w, edges, max, &n); }
+        }
+    }
+
+    for (int j = 0; j < waiter->num_waits; j++)
+    {
+        gpio_wait_t* w = &waiter->waits[j];
+        if (w->pending && check_wait(w, edges, max, &n)) { w->pending = FALSE; }
+    }
+
+    return n;
+}
+
+int wait_gpio_waiter(gpio_waiter_t* waiter, int64_t timeout_ns, gpio_edge_t* edges,
+                     int max)
+{
+    struct pollfd pfd;
+    struct timespec ts;
+    long long deadline = get_time_ns() + timeout_ns;
+    long long left = timeout_ns;
+    int n = 0;
+
+    if (waiter == NULL || edges == NULL || max < 1) { return GPIO_ERR; }
+
+    pfd.fd = waiter->epoll_fd;
+    pfd.events = POLLIN;
+
+    //wake-ups that turn out not to be a wanted edge (the other edge, or a sampled pin
+    //that didn't change) go back to sleep for whatever time is left
+    while ((n = read_gpio_waiter_edges(waiter, edges, max)) == 0)
+    {
+        if (timeout_ns != GPIO_WAIT_FOREVER)
+        {
+            left = deadline - get_time_ns();
+            if (left <= 0) { break; }
+            ts.tv_sec = left / NS_PER_SEC;
+            ts.tv_nsec = left % NS_PER_SEC;
+        }
+
+        if (ppoll(&pfd, 1, timeout_ns == GPIO_WAIT_FOREVER ? NULL : &ts, NULL) < 0 &&
+            errno != EINTR)
+        { return GPIO_ERR; }
+    }
+
+    return n;
+}
+
+int wait_for_any_gpio_edge(int* pins, int* edges, int n, int64_t timeout_ns,
+                           gpio_edge_t* edge)
+{
+    gpio_waiter_t* waiter = NULL;
+    gpio_edge_t found;
+    int rc = GPIO_OK;
+
+    if (pins == NULL || edges == NULL || n < 1) { return GPIO_ERR; }
+
+    waiter = create_gpio_waiter();
+    if (waiter == NULL) { return GPIO_ERR; }
+
+    for (int i = 0; i < n; i++)
+    {
+        if (add_gpio_wait(waiter, pins[i], edges[i]) < GPIO_OK)
+        {
+            free_gpio_waiter(waiter);
+            return GPIO_ERR;
+        }
+    }
+
+    rc = wait_gpio_waiter(waiter, timeout_ns, &found, 1);
+    if (rc > 0 && edge != NULL) { *edge = found; }
+
+    free_gpio_waiter(waiter);
+
+    return rc;
+}
+
+int wait_for_gpio_edge(int pin, int edges, int64_t timeout_ns, gpio_edge_t* edge)
+{
+    return wait_for_any_gpio_edge(&pin, &edges, 1, timeout_ns, edge);
+}
+
+int wait_for_gpio_edge_n(char* name, int edges, int64_t timeout_ns, gpio_edge_t* edge)
+{
+    int pin = get_pin_from_name(name);
+    if (pin < GPIO_OK) { return GPIO_ERR; }
+    return wait_for_gpio_edge(pin, edges, timeout_ns, edge);
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2017, Bryan Haley
+ * This code is dual licensed (GPLv2 and Simplified BSD). Use the license that works
+ * best for you. Check LICENSE.GPL and LICENSE.BSD for more details.
+ *
+ * gpio_brokerd.c
+ * Shares the GPIO pins between processes (see chip_gpio_broker.h). Runs until it gets
+ * SIGINT or SIGTERM; pins still open then are closed.
+ * Usage: gpio_brokerd [-s socket] [-m pin map] [-r sysfs root]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+#include "chip_gpio.h"
+#include "chip_gpio_pin_map.h"
+#include "chip_gpio_broker.h"
+
+static void handle_signal(int sig)
+{
+    stop_gpio_broker();
+}
+
+int main (int argc, char **argv)
+{
+    char* socket_path = GPIO_BROKER_DEFAULT_SOCKET;
+    struct sigaction sa;
+    int opt = 0;
+    int rc = 0;
+
+    while ((opt = getopt(argc, argv, "s:m:r:")) != -1)
+    {
+        if (opt == 's') { socket_path = optarg; }
+        else if (opt == 'm') { if (load_gpio_pin_map(optarg) < GPIO_OK) { return 1; } }
+        else if (opt == 'r') { if (set_gpio_sysfs_root(optarg) < GPIO_OK) { return 1; } }
+        else
+        {
+            fprintf(stderr, "Usage: %s [-s socket] [-m pin map] [-r sysfs root]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    //the broker itself must use sysfs, not connect to another broker
+    unsetenv(GPIO_BROKER_ENV);
+    if (initialize_gpio_interface() < GPIO_OK) { return 1; }
+
+    sa.sa_handler = handle_signal;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (run_gpio_broker(socket_path) < GPIO_OK) { rc = 1; }
+
+    terminate_gpio_interface();
+
+    return rc;
+}
@@ -0,0 +1,27 @@
+/*
+ * Copyright (c) 2017, Bryan Haley
+ * This code is dual licensed (GPLv2 and Simplified BSD). Use the license that works
+ * best for you. Check LICENSE.GPL and LICENSE.BSD for more details.
+ *
+ * gpio_pinmap.c
+ * Compiles a text pin map (see chip_gpio_pin_map.h) into the binary index that
+ * load_gpio_pin_map can mmap.
+ * Usage: gpio_pinmap <map.ini> <map.bin>
+ */
+
+#include <stdio.h>
+#include "chip_gpio.h"
+#include "chip_gpio_pin_map.h"
+
+int main (int argc, char **argv)
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "Usage: %s <map.ini> <map.bin>\n", argv[0]);
+        return 1;
+    }
+
+    if (compile_gpio_pin_map(argv[1], argv[2]) < GPIO_OK) { return 1; }
+
+    return 0;
+}